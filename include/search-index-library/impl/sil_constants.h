@@ -5,6 +5,8 @@
 #ifndef _SIL_SEARCH_CONSTANTS_H_
 #define _SIL_SEARCH_CONSTANTS_H_
 
+#include <inttypes.h>
+
 #define SMALL_GROUP_MASK 0x3FF        // mask to extract the id from the lower 10 bits
 #define SMALL_GROUP_SHIFT 6           // id shift to allow for value and position below
 #define SMALL_GROUP_FLAGS 0x3F        // lower 6 bit mask
@@ -27,4 +29,81 @@
 #define GROUP_4BYTE_LENGTH 0xFF
 #define GROUP_2BYTE_LENGTH 0xFE
 
+// search image flags (stored as the fifth field of the first line of _stats.txt)
+#define SIL_IMAGE_VALUE_SUMMARIES 0x1  // second level groups start with the min and max value
+#define SIL_IMAGE_GROUP_COUNTS 0x2     // followed by the number of ids in the group
+#define SIL_IMAGE_CONTENT_BLOCKS 0x4   // _content is LZ4 compressed blocks indexed by _content_blocks
+#define SIL_IMAGE_FORMAT_V2 0x8        // 64 bit global offsets and two byte top level group ids
+#define SIL_IMAGE_KNOWN_FLAGS 0xF      // images with other flags are from a newer format
+
+/* Postings are grouped by bits 18 and up of the id, then by bits 10-17, then by the low 10
+   bits.  Before SIL_IMAGE_FORMAT_V2 the top level group id was one byte, so ids were
+   limited to 26 bits. */
+#define TOP_GROUP_MASK 0xFFFC0000      // bits 18-31
+#define GROUP_MASK 0xFFFFFC00          // bits 10-31
+#define SECOND_GROUP_MASK 0x3FC00      // bits 10-17
+
+// the global header of images written before SIL_IMAGE_FORMAT_V2
+typedef struct {
+    uint32_t document_length;
+    uint32_t num_embeddings;
+    uint64_t content_offset : 36;
+    uint64_t embeddings_offset : 28;
+} sil_global_header_v1_t;
+
+/* _content_blocks is a sil_content_blocks_header_t followed by the offset of each block in
+   _content and the length of _content (num_blocks+1 uint64_t).  content_offset in the
+   global header is the offset in the uncompressed content, block i holding the bytes from
+   i*block_size. */
+typedef struct {
+    uint32_t block_size;
+    uint32_t num_blocks;
+} sil_content_blocks_header_t;
+
+#define SIL_DEFAULT_CONTENT_BLOCK_SIZE (64*1024)
+
+#define SIL_MAX_COLUMNS 16
+#define SIL_COLUMN_NAME_SIZE 32   // including the terminating zero
+
+/* _columns is a sil_columns_header_t and a sil_column_header_t for each column.  The
+   values of a column (num_documents values of width bytes, in the order of the ids) start
+   offset bytes into the file, on a 64 byte boundary. */
+typedef struct {
+    uint32_t num_columns;
+    uint32_t num_documents;
+} sil_columns_header_t;
+
+typedef struct {
+    char name[SIL_COLUMN_NAME_SIZE];
+    uint32_t type;
+    uint32_t width;
+    uint64_t offset;
+} sil_column_header_t;
+
+/* A builder with checkpoints (sil_search_builder_options_checkpoints) keeps its progress
+   in _manifest, a sil_checkpoint_t followed by last_term_length bytes of the last term
+   written.  Sorted runs are _checkpoint_N_gbl and _checkpoint_N_data (records with a
+   four byte length in front of them) and _checkpoint_N_ranks. */
+#define SIL_CHECKPOINT_MAGIC 0x4B504343
+
+typedef enum {
+    SIL_CHECKPOINT_RUNS = 0,     // documents are being added, num_runs runs are complete
+    SIL_CHECKPOINT_GLOBALS = 1,  // every document is in the runs, the global files are next
+    SIL_CHECKPOINT_TERMS = 2,    // terms_written terms are in _term_idx and _term_data
+    SIL_CHECKPOINT_ENCODED = 3   // every term is written, _stats.txt and reordering are next
+} sil_checkpoint_phase_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t phase;
+    uint32_t num_runs;
+    uint32_t max_id;
+    uint64_t total_documents;
+    uint64_t total_terms;        // terms in the documents (for bm25)
+    uint32_t terms_written;
+    uint32_t last_term_length;   // including the terminating zero
+    uint64_t idx_bytes;          // the length of _term_idx and _term_data as of terms_written
+    uint64_t data_bytes;
+} sil_checkpoint_t;
+
 #endif
@@ -30,6 +30,60 @@ int32_t decode_signed(uint32_t encoded) {
 }
 */
 
+#define SIL_DELETED_PAGE_BITS 16
+
+// the deleted documents of 65536 ids
+typedef struct {
+    uint64_t bits[1 << (SIL_DELETED_PAGE_BITS - 6)];
+    uint16_t group_deleted[1 << (SIL_DELETED_PAGE_BITS - 10)];  // per group of 1024 ids
+} sil_deleted_page_t;
+
+/* the documents deleted from an image (sil_search_image_delete).  A page is only allocated
+   once a document in it is deleted, so sparse ids do not cost a bit each. */
+typedef struct {
+    sil_deleted_page_t **pages;   // per 65536 ids, NULL if none of them is deleted
+    uint16_t *group_documents;    // documents in each group of 1024 ids
+    uint32_t num_deleted;
+} sil_deleted_t;
+
+/* Deletes may happen while cursors are reading, so the pages, bitmap and counts are read
+   and updated atomically. */
+static inline const sil_deleted_page_t *sil_deleted_page(const sil_deleted_t *d, uint32_t id) {
+    return __atomic_load_n(d->pages + (id >> SIL_DELETED_PAGE_BITS), __ATOMIC_ACQUIRE);
+}
+
+static inline bool sil_deleted_id(const sil_deleted_t *d, uint32_t id) {
+    const sil_deleted_page_t *page = sil_deleted_page(d, id);
+    return page && ((__atomic_load_n(page->bits + ((id >> 6) & ((1 << (SIL_DELETED_PAGE_BITS - 6)) - 1)),
+                                     __ATOMIC_RELAXED) >> (id & 63)) & 1);
+}
+
+// deleted documents in the group of 1024 ids holding gid
+static inline uint32_t sil_deleted_group(const sil_deleted_t *d, uint32_t gid) {
+    const sil_deleted_page_t *page = sil_deleted_page(d, gid);
+    if(!page)
+        return 0;
+    return __atomic_load_n(page->group_deleted + ((gid >> 10) & ((1 << (SIL_DELETED_PAGE_BITS - 10)) - 1)),
+                           __ATOMIC_RELAXED);
+}
+
+// true if the group of 1024 ids holding gid has any deleted documents
+static inline bool sil_deleted_group_some(const sil_deleted_t *d, uint32_t gid) {
+    return sil_deleted_group(d, gid) > 0;
+}
+
+// true if every document in the group of 1024 ids holding gid is deleted
+static inline bool sil_deleted_group_all(const sil_deleted_t *d, uint32_t gid) {
+    return sil_deleted_group(d, gid) >= d->group_documents[gid >> 10];
+}
+
+// a value which replaces the one stored for a posting (sil_search_image_update_value)
+typedef struct {
+    uint32_t term;  // index of the term in the image's terms
+    uint32_t id;
+    uint32_t value;
+} sil_value_update_t;
+
 typedef struct {
     sil_term_t pub;
 
@@ -39,6 +93,7 @@ typedef struct {
                           // by using two bits from 2 byte header
     uint8_t *wp;
 
+    uint8_t *sp;  // start of the term's groups
     uint8_t *tp;  // for the whole term
     uint8_t *etp;
 
@@ -47,6 +102,19 @@ typedef struct {
 
     char **term;
     char **eterm;
+
+    uint32_t flags;            // SIL_IMAGE_* flags from the image
+    uint32_t group_min_value;  // value summary of the current second level group
+    uint32_t group_max_value;
+    uint32_t value_lo;         // range for sil_term_value_range
+    uint32_t value_hi;
+    uint32_t group_count;      // number of ids in the current second level group (0 if unknown)
+    uint8_t *gp;               // first posting of the current second level group
+    sil_deleted_t *deleted;    // NULL unless the image had deleted documents when the term was opened
+    const sil_value_update_t *updates;  // the term's published value updates sorted by id (NULL if none)
+    const sil_value_update_t *eupdates;
+    const sil_value_update_t *update;   // first update at or after the current posting
+    struct value_updates_s *update_table;  // the published table updates points into
 } sil_term_ext_t;
 
 typedef struct {
@@ -98,7 +166,7 @@ static inline uint8_t *__decode_high_bit32(uint32_t *value, uint8_t *p) {
     *value |= (bits << 21);
     bits = *p++;
     // not possible to overflow here to due 32 bit limit
-    *value = v | (bits << 28);
+    *value |= (bits << 28);
     return p;
 }
 
@@ -215,6 +283,32 @@ double sil_bm25_plus_score(double idf_qtf, double bm25_plus_tf) {
     return idf_qtf * bm25_plus_tf;
 }
 
+// BM25+ parameters shared by the scoring helpers above and the query evaluators
+typedef struct {
+    double k1;     // term frequency scaling (typically 1.2)
+    double b;      // document length scaling (typically 0.75)
+    double delta;  // BM25+ lower bound for matching terms (typically 1.0)
+    double k3;     // query term frequency scaling (typically 8.0)
+} sil_bm25_params_t;
+
+static inline
+void sil_bm25_params_init(sil_bm25_params_t *params) {
+    params->k1 = 1.2;
+    params->b = 0.75;
+    params->delta = 1.0;
+    params->k3 = 8.0;
+}
+
+// An upper bound on sil_term_bm25_plus for any document and term frequency.  The tf part
+// approaches (k1+1) as the term frequency grows and peaks at a term frequency of 1 in an
+// empty document when delta is large.
+static inline
+double sil_bm25_plus_max_score(const sil_bm25_params_t *params, double idf_qtf) {
+    double min_norm = params->k1 * (1 - params->b);
+    double first = (1 + params->delta) / (1 + min_norm);
+    return idf_qtf * (params->k1 + 1) * (first > 1.0 ? first : 1.0);
+}
+
 static inline
 uint32_t sil_pair_proximity(sil_term_t *t1, sil_term_t *t2) {
     uint32_t *i = t1->term_positions, *j = t2->term_positions;
@@ -259,6 +353,38 @@ static inline void sil_term_decode_positions(sil_term_t *t) {
 }
 
 
+// Count the term positions for the current id without decoding them.  Each position delta
+// ends with a byte that does not have the high bit set.
+static inline uint32_t sil_term_position_count(sil_term_t *t) {
+    sil_term_ext_t *ext = (sil_term_ext_t *)t;
+    uint8_t *p = ext->wp;
+    uint8_t *ep = ext->p;
+    uint32_t count = 0;
+    while(p < ep) {
+        count += (*p & 0x80) ? 0 : 1;
+        p++;
+    }
+    return count;
+}
+
+// BM25+ score of the id the term is currently on.  The term frequency is the number of
+// positions (1 for postings without positions).
+static inline
+double sil_term_bm25_plus(sil_term_t *t, const sil_bm25_params_t *params, double idf_qtf,
+                          double doc_length, double aveD) {
+    uint32_t term_freq = sil_term_position_count(t);
+    if(!term_freq)
+        term_freq = 1;
+    double norm = sil_bm25_doc_norm(doc_length, aveD, params->k1, params->b);
+    return sil_bm25_plus_score(idf_qtf, sil_bm25_plus_tf(term_freq, params->delta, params->k1, norm));
+}
+
+// The number of bytes in the term's posting list (0 for document image terms)
+static inline size_t sil_term_posting_bytes(sil_term_t *t) {
+    sil_term_ext_t *ext = (sil_term_ext_t *)t;
+    return ext->etp - ext->sp;
+}
+
 static inline uint8_t *decode_position_value(uint32_t *value, uint8_t *p) {
     if(*p < SMALL_GROUP_2BYTE_POS_VALUE) {
         *value = *p;
@@ -304,6 +430,64 @@ static inline uint8_t *decode_single_value(uint32_t *value, uint32_t flags, uint
     }
 }
 
+/* Cursors mostly move forward, so the search for id starts at the update found for the
+   previous posting and usually ends there. */
+static inline const sil_value_update_t *find_value_update(sil_term_ext_t *t, uint32_t id) {
+    const sil_value_update_t *lo = t->update, *hi = t->eupdates;
+    if(lo < hi && lo->id >= id && (lo == t->updates || lo[-1].id < id))
+        return lo;
+    if(lo > t->updates && lo[-1].id >= id) {
+        hi = lo;
+        lo = t->updates;
+    }
+    while(lo < hi) {
+        const sil_value_update_t *mid = lo + ((hi - lo) >> 1);
+        if(mid->id < id)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static inline void update_value(sil_term_ext_t *t) {
+    t->update = find_value_update(t, t->pub.c.id);
+    if(t->update < t->eupdates && t->update->id == t->pub.c.id)
+        t->pub.value = t->update->value;
+}
+
+// widen the value summary of the current group to cover the values updated in it
+static inline void update_group_values(sil_term_ext_t *t) {
+    const sil_value_update_t *u = find_value_update(t, t->gid);
+    for(; u < t->eupdates && (u->id >> 10) == (t->gid >> 10); u++) {
+        if(u->value < t->group_min_value)
+            t->group_min_value = u->value;
+        if(u->value > t->group_max_value)
+            t->group_max_value = u->value;
+    }
+}
+
+// called once p is set to the start of a second level group
+static inline void start_small_group(sil_term_ext_t *t) {
+    if(t->flags & SIL_IMAGE_VALUE_SUMMARIES) {
+        uint32_t min_value, value_range;
+        t->p = __decode_high_bit32(&min_value, t->p);
+        t->p = __decode_high_bit32(&value_range, t->p);
+        t->group_min_value = min_value;
+        t->group_max_value = min_value + value_range;
+    } else {
+        t->group_min_value = 0;
+        t->group_max_value = UINT32_MAX;
+    }
+    if(t->flags & SIL_IMAGE_GROUP_COUNTS)
+        t->p = __decode_high_bit32(&t->group_count, t->p);
+    else
+        t->group_count = 0;
+    t->gp = t->p;
+    if(t->updates)
+        update_group_values(t);
+}
+
 static inline void advance_id(sil_term_ext_t *t) {
     uint8_t *p = t->p;
     uint16_t control = (*(uint16_t *)p); // Read the 16-bit control word
@@ -316,6 +500,7 @@ static inline void advance_id(sil_term_ext_t *t) {
     t->pub.c.id = id + t->gid; // Combine with group ID
     if (flags & SMALL_GROUP_POS_MASK) {
         // Position data is present
+        t->pub.value = 0;
         if (flags & SMALL_GROUP_VALUE_PRESENT_MASK) {
             // Value data is present
             p = decode_position_value(&t->pub.value, p);
@@ -325,6 +510,8 @@ static inline void advance_id(sil_term_ext_t *t) {
         t->p = decode_single_value(&t->pub.value, flags, p);
         t->wp = t->p;
     }
+    if(t->updates)
+        update_value(t);
 }
 
 static inline void advance_document_id(sil_term_ext_t *t) {
@@ -0,0 +1,156 @@
+// SPDX-FileCopyrightText: 2023–2025 Andy Curtis <contactandyc@gmail.com>
+// SPDX-FileCopyrightText: 2024–2025 Knode.ai — technical questions: contact Andy (above)
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef _sil_top_k_impl_h
+#define _sil_top_k_impl_h
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "the-macro-library/macro_sort.h"
+
+typedef struct {
+    uint32_t id;
+    float score;
+} sil_scored_id_t;
+
+/*
+    A bounded min heap of scored ids.  The caller owns an array of k entries and the
+    number of entries in use.  Once the heap is full, heap[0] is the lowest score kept
+    and anything at or below it can be skipped.
+*/
+
+static inline void sil_top_k_sift_down(sil_scored_id_t *heap, size_t num, size_t i) {
+    sil_scored_id_t v = heap[i];
+    while(true) {
+        size_t child = (i << 1) + 1;
+        if(child >= num)
+            break;
+        if(child+1 < num && heap[child+1].score < heap[child].score)
+            child++;
+        if(heap[child].score >= v.score)
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = v;
+}
+
+static inline void sil_top_k_sift_up(sil_scored_id_t *heap, size_t i) {
+    sil_scored_id_t v = heap[i];
+    while(i > 0) {
+        size_t parent = (i - 1) >> 1;
+        if(heap[parent].score <= v.score)
+            break;
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = v;
+}
+
+// the score a new id must beat to enter the heap
+static inline float sil_top_k_threshold(sil_scored_id_t *heap, size_t num, size_t k) {
+    return num < k ? 0.0f : heap[0].score;
+}
+
+static inline void sil_top_k_push(sil_scored_id_t *heap, size_t *num, size_t k,
+                                  uint32_t id, float score) {
+    if(*num < k) {
+        heap[*num].id = id;
+        heap[*num].score = score;
+        sil_top_k_sift_up(heap, *num);
+        (*num)++;
+    } else if(score > heap[0].score) {
+        heap[0].id = id;
+        heap[0].score = score;
+        sil_top_k_sift_down(heap, k, 0);
+    }
+}
+
+static inline bool sil_top_k_compare(const sil_scored_id_t *a, const sil_scored_id_t *b) {
+    if(a->score != b->score)
+        return a->score > b->score;
+    return a->id < b->id;
+}
+
+// order the heap by descending score
+static inline
+macro_sort(sil_top_k_sort, sil_scored_id_t, sil_top_k_compare);
+
+typedef struct {
+    uint32_t id;
+    uint32_t value;
+} sil_valued_id_t;
+
+/*
+    The same bounded min heap ordered by posting value.  Values are exact, so ties are
+    broken by id (lower ids win) to keep results stable.
+*/
+
+static inline bool sil_value_top_k_less(const sil_valued_id_t *a, const sil_valued_id_t *b) {
+    if(a->value != b->value)
+        return a->value < b->value;
+    return a->id > b->id;
+}
+
+static inline void sil_value_top_k_sift_down(sil_valued_id_t *heap, size_t num, size_t i) {
+    sil_valued_id_t v = heap[i];
+    while(true) {
+        size_t child = (i << 1) + 1;
+        if(child >= num)
+            break;
+        if(child+1 < num && sil_value_top_k_less(heap+child+1, heap+child))
+            child++;
+        if(!sil_value_top_k_less(heap+child, &v))
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = v;
+}
+
+static inline void sil_value_top_k_sift_up(sil_valued_id_t *heap, size_t i) {
+    sil_valued_id_t v = heap[i];
+    while(i > 0) {
+        size_t parent = (i - 1) >> 1;
+        if(!sil_value_top_k_less(&v, heap+parent))
+            break;
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = v;
+}
+
+// true if id / value would enter a heap holding num of k entries
+static inline bool sil_value_top_k_accepts(sil_valued_id_t *heap, size_t num, size_t k,
+                                           uint32_t id, uint32_t value) {
+    if(num < k)
+        return true;
+    sil_valued_id_t v = { id, value };
+    return sil_value_top_k_less(heap, &v);
+}
+
+static inline void sil_value_top_k_push(sil_valued_id_t *heap, size_t *num, size_t k,
+                                        uint32_t id, uint32_t value) {
+    if(*num < k) {
+        heap[*num].id = id;
+        heap[*num].value = value;
+        sil_value_top_k_sift_up(heap, *num);
+        (*num)++;
+    } else if(sil_value_top_k_accepts(heap, *num, k, id, value)) {
+        heap[0].id = id;
+        heap[0].value = value;
+        sil_value_top_k_sift_down(heap, k, 0);
+    }
+}
+
+static inline bool sil_value_top_k_compare(const sil_valued_id_t *a, const sil_valued_id_t *b) {
+    return sil_value_top_k_less(b, a);
+}
+
+// order the heap by descending value
+static inline
+macro_sort(sil_value_top_k_sort, sil_valued_id_t, sil_value_top_k_compare);
+
+#endif
@@ -35,7 +35,8 @@ struct sil_document_image_s {
 
 typedef void (*update_terms_cb)(aml_pool_t *pool, char **terms, uint32_t num_terms, void *arg);
 
-/* Initialize a search document image from a binary document built from sil_document_builder. */
+/* Initialize a search document image from a binary document built from sil_document_builder.
+   The document starts after the uint32_t length the builder writes first. */
 void sil_document_image_init(sil_document_image_t *image, const char *document, uint32_t length);
 
 /* Construct a term set from a query. */
@@ -95,7 +96,8 @@ typedef struct {
     char *term;
 } sil_id_term_t;
 
-/* Write the terms to a buffer which can be used to build an inverted index. */
+/* Append a sil_id_term_t for each term to bh which can be used to build an inverted index.
+   The terms point into img. */
 void sil_document_image_terms_to_buffer(aml_buffer_t *bh, sil_document_image_t *img, uint32_t id);
 
 #include "search-index-library/impl/sil_document_image_impl.h"
@@ -0,0 +1,93 @@
+// SPDX-FileCopyrightText: 2023–2025 Andy Curtis <contactandyc@gmail.com>
+// SPDX-FileCopyrightText: 2024–2025 Knode.ai — technical questions: contact Andy (above)
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef _sil_memory_index_h
+#define _sil_memory_index_h
+
+/*
+ * Documents held in memory so they are searchable as soon as they are added, before they
+ * are written to an image.  Each document (a sil_document_builder blob, whose data starts
+ * with its id) is copied into an arena and every term of it appends a posting to a
+ * growable array for the term.  While a term's documents are added in id order its cursor
+ * reads the postings in place, skipping the ones it cannot see; otherwise the cursor copies
+ * the postings it can see and sorts them by id.  Either way the postings are decoded in
+ * place, so the position functions of sil_term.h work on it.
+ *
+ * Documents are added from one thread at a time while other threads search.  The
+ * documents a search sees are fixed by a count of documents added (see
+ * sil_memory_index_num_added), so several cursors can agree on what the index holds.
+ * Adding a document with an id already in the index replaces the earlier version.  The
+ * totals and the set of ids are kept up to date as documents are added, so checking for an
+ * id or taking the totals does not depend on the number of documents.
+ *
+ * sil_memory_index_flush adds the current version of every document to a
+ * sil_search_builder, so the index can be written out as a regular image once it grows
+ * past some size.  sil_segments uses it to make new documents searchable before a segment
+ * is written (sil_segments_add_document).
+ */
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "a-memory-library/aml_pool.h"
+#include "search-index-library/sil_term.h"
+#include "search-index-library/sil_document_image.h"
+#include "search-index-library/sil_search_builder.h"
+
+struct sil_memory_index_s;
+typedef struct sil_memory_index_s sil_memory_index_t;
+
+sil_memory_index_t *sil_memory_index_init();
+
+/* Copy doc into the index.  It replaces the document with the same id if there is one. */
+void sil_memory_index_add(sil_memory_index_t *h, const sil_document_image_t *doc);
+
+/* Delete the current version of id.  Returns false if the index does not have it. */
+bool sil_memory_index_delete(sil_memory_index_t *h, uint32_t id);
+
+/* The number of documents added so far (counting every version), which is passed to the
+   functions below to search the documents added up to that point. */
+uint32_t sil_memory_index_num_added(sil_memory_index_t *h);
+
+/* The bytes held by the index (documents and postings). */
+size_t sil_memory_index_size(sil_memory_index_t *h);
+
+/* Like sil_memory_index_num_added, also setting the totals of
+   sil_memory_index_total_documents as of the number returned. */
+uint32_t sil_memory_index_num_added_totals(sil_memory_index_t *h, uint32_t *total_documents,
+                                           double *document_lengths);
+
+/* True if id was in the first num_added documents, even if it was deleted.  This does not
+   take the lock. */
+bool sil_memory_index_has(sil_memory_index_t *h, uint32_t num_added, uint32_t id);
+
+/* Set ids to the ids first added by documents first_added to num_added (in the order they
+   were added) and return how many there are.  ids needs room for num_added - first_added. */
+uint32_t sil_memory_index_added_ids(sil_memory_index_t *h, uint32_t *ids, uint32_t first_added,
+                                    uint32_t num_added);
+
+/* The number of documents (not counting replaced or deleted ones) and the sum of their
+   lengths for bm25 as of num_added.  This is kept as documents are added, older counts are
+   found by going over the documents. */
+uint32_t sil_memory_index_total_documents(sil_memory_index_t *h, uint32_t num_added,
+                                          double *document_lengths);
+
+/* Set doc to the current version of id as of num_added.  doc points into the index and
+   stays valid until the index is destroyed.  Returns false if there is no such document. */
+bool sil_memory_index_document(sil_memory_index_t *h, uint32_t num_added, uint32_t id,
+                               sil_document_image_t *doc);
+
+/* A cursor over the postings of term in the first num_added documents, skipping replaced
+   and deleted ones.  Like the image cursors it starts on its first posting.  Returns NULL
+   if no document has the term. */
+sil_term_t *sil_memory_index_term(sil_memory_index_t *h, aml_pool_t *pool, uint32_t num_added,
+                                  const char *term);
+
+/* Add the current version of every document to builder.  Returns the number added. */
+uint32_t sil_memory_index_flush(sil_memory_index_t *h, sil_search_builder_t *builder);
+
+/* Every cursor from the index must be done with before it is destroyed. */
+void sil_memory_index_destroy(sil_memory_index_t *h);
+
+#endif
@@ -0,0 +1,135 @@
+// SPDX-FileCopyrightText: 2023–2025 Andy Curtis <contactandyc@gmail.com>
+// SPDX-FileCopyrightText: 2024–2025 Knode.ai — technical questions: contact Andy (above)
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef _sil_query_plan_h
+#define _sil_query_plan_h
+
+/*
+ * A cost based planner for queries made of required terms (all must match) and optional
+ * terms (add to the score).  Before anything is decoded, the planner looks at each term's
+ * document_frequency and posting list size and picks how to evaluate the query instead of
+ * following the order of the query text.
+ *
+ * - Conjunctions are driven by the rarest required term, with the remaining required
+ *   terms checked rarest first through advance_to.
+ * - Required terms matching at least dense_ratio of the documents are decoded once into a
+ *   bitmap which is probed to filter the candidates.  Only the ids which match every
+ *   required term are looked up in their postings to be scored.
+ * - Queries with no required terms and at least term_at_a_time_min_terms terms are scored
+ *   with sil_term_accumulator.
+ * - Optional terms whose best possible score is below drop_ratio of the query's best
+ *   possible score are dropped.  This is lossy: such a term only reorders near ties, but
+ *   that can change which documents make the top k.  The default of 0 drops nothing.
+ * - With early_termination, evaluation stops as soon as k results each score at least
+ *   (1 - early_termination_margin) of the best score found so far.  Postings are walked in
+ *   id order, so this is meant for images whose ids follow a static rank
+ *   (sil_search_builder_options_static_rank_order): the documents visited first are the
+ *   best by rank, and a head query stops once its first k good matches are found instead
+ *   of walking every posting for the exact top k.  A margin of 0 only stops when no
+ *   document could score higher than the k-th result.
+ *   Queries which would be evaluated term at a time are evaluated as a disjunction.
+ *
+ * The plan is allocated from the pool and is released with it.
+ *
+ * Example Usage:
+ * ```c
+ * sil_query_planner_options_t options;
+ * sil_query_planner_options_init(&options);
+ * sil_query_plan_t *plan = sil_query_plan_init(pool, img, &options);
+ * sil_query_plan_required(plan, "error");
+ * sil_query_plan_required(plan, "service:api");
+ * sil_query_plan_optional(plan, "timeout");
+ * sil_query_plan_build(plan, 10);
+ * sil_query_plan_dump(plan);
+ * sil_scored_id_t res[10];
+ * size_t num_res = sil_query_plan_top_k(plan, res, 10);
+ * ```
+ */
+
+#include <inttypes.h>
+#include <stddef.h>
+#include "a-memory-library/aml_pool.h"
+#include "search-index-library/sil_term.h"
+#include "search-index-library/sil_search_image.h"
+#include "search-index-library/sil_term_accumulator.h"
+
+typedef enum {
+    SIL_PLAN_EMPTY,              // a required term is missing, nothing can match
+    SIL_PLAN_CONJUNCTION,        // driven by the rarest required term
+    SIL_PLAN_DISJUNCTION,        // document at a time over the optional terms
+    SIL_PLAN_TERM_AT_A_TIME      // wide disjunction scored with sil_term_accumulator
+} sil_plan_strategy_t;
+
+typedef enum {
+    SIL_PLAN_TERM_CURSOR,   // evaluated with advance / advance_to
+    SIL_PLAN_TERM_BITMAP,   // decoded into a bitmap and probed
+    SIL_PLAN_TERM_DROPPED   // left out by drop_ratio
+} sil_plan_term_mode_t;
+
+typedef struct {
+    const char *term;
+    sil_term_t *cursor;
+    bool required;
+    sil_plan_term_mode_t mode;
+    uint32_t query_term_freq;
+    uint32_t document_frequency;
+    size_t posting_bytes;
+    double idf_qtf;
+    double max_score;
+
+    uint64_t *bitmap;
+    bool active;
+} sil_plan_term_t;
+
+typedef struct {
+    sil_bm25_params_t bm25;
+    double dense_ratio;                  // default 0.1
+    uint32_t term_at_a_time_min_terms;   // default 16
+    double drop_ratio;                   // default 0 (lossy when set)
+    bool early_termination;              // default false
+    double early_termination_margin;     // default 0.1
+} sil_query_planner_options_t;
+
+typedef struct {
+    aml_pool_t *pool;
+    sil_search_image_t *img;
+    sil_query_planner_options_t options;
+
+    sil_plan_strategy_t strategy;
+    sil_plan_term_t *terms;     // ordered for evaluation once built
+    uint32_t num_terms;
+    uint32_t size;
+    bool missing_required;
+    bool built;
+
+    double max_score;           // the best score a document can get once built
+    double best_score;          // the best score found so far by early_termination
+    double stop_score;          // early_termination stops once k results score this much
+    bool terminated_early;      // set if evaluation stopped before the postings ran out
+} sil_query_plan_t;
+
+void sil_query_planner_options_init(sil_query_planner_options_t *options);
+
+sil_query_plan_t *sil_query_plan_init(aml_pool_t *pool, sil_search_image_t *img,
+                                      const sil_query_planner_options_t *options);
+
+/* Add a term which every result must contain. */
+void sil_query_plan_required(sil_query_plan_t *plan, const char *term);
+
+/* Add a term which adds to the score of results containing it. */
+void sil_query_plan_optional(sil_query_plan_t *plan, const char *term);
+
+/* Choose the strategy and the order of evaluation for the top k results. */
+void sil_query_plan_build(sil_query_plan_t *plan, size_t k);
+
+/* Evaluate the plan (building it if needed) and fill res with up to k ids ordered by
+   descending BM25+ score.  A plan can only be evaluated once. */
+size_t sil_query_plan_top_k(sil_query_plan_t *plan, sil_scored_id_t *res, size_t k);
+
+const char *sil_plan_strategy_name(sil_plan_strategy_t strategy);
+
+/* Print the chosen plan for debugging. */
+void sil_query_plan_dump(sil_query_plan_t *plan);
+
+#endif
@@ -7,12 +7,156 @@
 
 #include <inttypes.h>
 #include <stddef.h>
+#include <stdbool.h>
 #include "a-memory-library/aml_pool.h"
+#include "search-index-library/sil_document_image.h"
+#include "search-index-library/sil_search_image.h"
 
 struct sil_search_builder_s;
 typedef struct sil_search_builder_s sil_search_builder_t;
 
+/* Wall clock and CPU time of one phase of a build.  cpu_seconds is the CPU time of the
+   whole process, so it includes the sort and encoder threads working for the phase. */
+typedef struct {
+    double wall_seconds;
+    double cpu_seconds;
+} sil_search_builder_phase_t;
+
+// bucket 0 counts zeros and bucket b counts the values from 2^(b-1) to 2^b - 1
+#define SIL_HISTOGRAM_BUCKETS 33
+
+typedef struct {
+    uint64_t postings_per_term[SIL_HISTOGRAM_BUCKETS];  // document frequency of each term
+    uint64_t bytes_per_posting[SIL_HISTOGRAM_BUCKETS];  // sid, value and positions of a posting
+    uint64_t value_widths[4];           // without positions: value in the sid, 1, 2 or 4 bytes
+    uint64_t position_value_widths[3];  // value ahead of positions: 1, 3 or 5 bytes
+    uint64_t position_delta_widths[5];  // position deltas by the bytes they take (1-5)
+    uint64_t extended_position_lengths; // positions too long for their length to fit in the sid
+} sil_search_builder_histograms_t;
+
+/* What a build spent its time and bytes on (see sil_search_builder_options_stats).  The
+   phases do not overlap: ingest runs from init to destroy, sort finishes the sorted runs
+   (including checkpoint runs and sorting interned postings), merge is the k-way merge of
+   the runs of every builder (timed on every 64th record and scaled up), global_write and
+   term_encode write the image less the merging they wait on, and reorder renumbers the
+   written image. */
+typedef struct {
+    sil_search_builder_phase_t ingest;
+    sil_search_builder_phase_t sort;
+    sil_search_builder_phase_t merge;
+    sil_search_builder_phase_t global_write;
+    sil_search_builder_phase_t term_encode;
+    sil_search_builder_phase_t reorder;
+    uint64_t sorted_bytes;    // records given to the external sorts
+    uint64_t runs_spilled;    // each time a sort buffer filled, plus radix sort and checkpoint runs
+    uint64_t spilled_bytes;   // bytes written to those runs and to the interned postings
+    uint64_t bytes_written;   // bytes in the files of the image
+    sil_search_builder_histograms_t histograms;
+} sil_search_builder_stats_t;
+
+typedef struct {
+    size_t buffer_size;
+    bool value_summaries;
+    bool group_counts;
+    bool intern_terms;
+    size_t max_interned_terms;
+    bool radix_sort;
+    uint32_t encoder_threads;
+    bool reorder_ids;
+    bool static_rank_order;
+    uint32_t content_block_size;
+    sil_column_t columns[SIL_MAX_COLUMNS];
+    uint32_t num_columns;
+    bool checkpoints;
+    bool collect_stats;
+    bool stats_json;
+    sil_search_builder_stats_t *stats;
+} sil_search_builder_options_t;
+
+void sil_search_builder_options_init(sil_search_builder_options_t *options);
+
+/* The size of the buffer used to sort postings (global records use a tenth of it). */
+void sil_search_builder_options_buffer_size(sil_search_builder_options_t *options,
+                                            size_t buffer_size);
+
+/* Store the min and max value of each group of 1024 ids so value range filters
+   (sil_term_value_range) can skip whole groups. */
+void sil_search_builder_options_value_summaries(sil_search_builder_options_t *options);
+
+/* Store the number of ids in each group of 1024 ids so counts (sil_term_count_and) can
+   add up whole groups without decoding them. */
+void sil_search_builder_options_group_counts(sil_search_builder_options_t *options);
+
+/* Intern terms into a hash table and spill postings as fixed 16 byte (term id, id, position,
+   value) records instead of carrying the term string through the external sort.  Term ids
+   are remapped to the sorted order of the terms when the builder is destroyed.  Once
+   max_terms distinct terms are held (0 for 1M), the table is spilled and restarted. */
+void sil_search_builder_options_intern_terms(sil_search_builder_options_t *options,
+                                             size_t max_terms);
+
+/* Sort interned postings (this implies sil_search_builder_options_intern_terms) in runs of
+   buffer_size bytes with a radix sort on (term, id, position) instead of a comparison
+   sort, and merge the runs while the image is written. */
+void sil_search_builder_options_radix_sort(sil_search_builder_options_t *options);
+
+/* Encode the posting lists of terms on num_threads threads while the builder is destroyed.
+   Terms are read and written in order by the destroying thread, a batch at a time, so the
+   image is the same as with the default of 0 (encode each term as it is read). */
+void sil_search_builder_options_encoder_threads(sil_search_builder_options_t *options,
+                                                uint32_t num_threads);
+
+/* Renumber the documents when the builder is destroyed so documents sharing terms get
+   nearby ids (see sil_search_builder_reorder). */
+void sil_search_builder_options_reorder_ids(sil_search_builder_options_t *options);
+
+/* Renumber the documents from 1 when the builder is destroyed in descending order of the
+   rank given with sil_search_builder_static_rank (ties keep their id order), so evaluating
+   postings in id order visits the best documents first (see early_termination in
+   sil_query_plan.h).  The original ids are written to filename_id_map as with
+   sil_search_builder_reorder, which this takes the place of. */
+void sil_search_builder_options_static_rank_order(sil_search_builder_options_t *options);
+
+/* Write the content in blocks of block_size bytes (0 for 64KB) compressed with LZ4, with the
+   offset of each block in filename_content_blocks.  The image keeps the compressed blocks in
+   memory and decompresses the block holding a document when its content is read
+   (sil_search_image_content_copy). */
+void sil_search_builder_options_content_blocks(sil_search_builder_options_t *options,
+                                               uint32_t block_size);
+
+/* Declare a column of values of type (see sil_search_image_column).  Columns are numbered
+   from 0 in the order they are declared.  Returns false if name is too long (more than
+   SIL_COLUMN_NAME_SIZE-1 bytes) or already used, or SIL_MAX_COLUMNS are declared. */
+bool sil_search_builder_options_column(sil_search_builder_options_t *options, const char *name,
+                                       sil_column_type_t type);
+
+/* Make the build resumable after a crash.  sil_search_builder_checkpoint writes the
+   documents added so far as a sorted run (filename_checkpoint_N_*) and records it in
+   filename_manifest.  Destroy writes the rest as a last run and records each step of
+   writing the image: the global files, then the terms every buffer_size bytes of
+   postings.  sil_search_builder_resume picks up from the manifest.  If a step cannot be
+   recorded, destroy stops without writing the image and the manifest keeps the last step
+   that was.  The runs and manifest are removed once the image is written.  Ignored when
+   terms are interned. */
+void sil_search_builder_options_checkpoints(sil_search_builder_options_t *options);
+
+/* Collect timings, spill counts and encoding histograms while building (see
+   sil_search_builder_stats_t).  Destroy copies them to stats (if not NULL) and with json
+   also writes them to filename_stats.json, next to filename_stats.txt. */
+void sil_search_builder_options_stats(sil_search_builder_options_t *options,
+                                      sil_search_builder_stats_t *stats, bool json);
+
 sil_search_builder_t *sil_search_builder_init(const char *filename, size_t buffer_size);
+sil_search_builder_t *sil_search_builder_ext_init(const char *filename,
+                                                  const sil_search_builder_options_t *options);
+
+/* A builder for one ingest thread.  The thread adds whole documents to it with the usual
+   sil_search_builder_global / term calls, keeping its own buffers and sorted runs (each
+   thread builder uses the options of h, including buffer_size).  Destroying a thread
+   builder hands its postings to h instead of writing an image.  Every thread builder must
+   be destroyed before h, whose destroy merges them into the same image a single builder
+   would have written.  Only sil_search_builder_thread_init may be called on h from
+   several threads at once. */
+sil_search_builder_t *sil_search_builder_thread_init(sil_search_builder_t *h);
 
 // The first 4 bytes of d must be the local id
 void sil_search_builder_global(sil_search_builder_t *h,
@@ -22,6 +166,22 @@ void sil_search_builder_global(sil_search_builder_t *h,
                                uint32_t content_length,
                                const void *d, uint32_t len);
 
+/* The static rank (a query independent score such as popularity, higher is better) of the
+   document last passed to sil_search_builder_global.  Documents without one have a rank of
+   0.  It is only used by sil_search_builder_options_static_rank_order. */
+void sil_search_builder_static_rank(sil_search_builder_t *h, uint32_t rank);
+
+/* Set column (numbered as declared) of the document last passed to
+   sil_search_builder_global, converted to the type of the column.  Values which are not
+   set are 0. */
+void sil_search_builder_column(sil_search_builder_t *h, uint32_t column, uint64_t value);
+void sil_search_builder_column_float(sil_search_builder_t *h, uint32_t column, float value);
+
+/* Add a document built with sil_document_builder.  Its data, embeddings and content become
+   the global record and the postings are taken from its already sorted and encoded terms,
+   so this is the same as calling sil_search_builder_global and replaying every term. */
+void sil_search_builder_add_document(sil_search_builder_t *h, const sil_document_image_t *img);
+
 void sil_search_builder_term(sil_search_builder_t *h, const char *term );
 void sil_search_builder_termf(sil_search_builder_t *h, const char *term, ... );
 
@@ -30,19 +190,81 @@ void sil_search_builder_wterm(sil_search_builder_t *h, size_t sp, const char *te
 void sil_search_builder_wtermf(sil_search_builder_t *h, size_t sp, const char *term, ... );
 
 void sil_search_builder_term_position(sil_search_builder_t *h, uint32_t pos, const char *term );
-void sil_search_builder_termf_position(sil_search_builder_t *h, uint32_t pos, const char *term, ... );
+void sil_search_builder_termf_position(sil_search_builder_t *h, uint32_t pos,
+                                       const char *term, ... );
 
 // adds the term and wildcard starting at sp position in string
-void sil_search_builder_wterm_position(sil_search_builder_t *h, uint32_t pos, size_t sp, const char *term );
-void sil_search_builder_wtermf_position(sil_search_builder_t *h, uint32_t pos, size_t sp, const char *term, ... );
+void sil_search_builder_wterm_position(sil_search_builder_t *h, uint32_t pos, size_t sp,
+                                       const char *term );
+void sil_search_builder_wtermf_position(sil_search_builder_t *h, uint32_t pos, size_t sp,
+                                        const char *term, ... );
 
 void sil_search_builder_term_value(sil_search_builder_t *h, uint32_t value, const char *term );
-void sil_search_builder_termf_value(sil_search_builder_t *h, uint32_t value, const char *term, ... );
+void sil_search_builder_termf_value(sil_search_builder_t *h, uint32_t value,
+                                    const char *term, ... );
 
 // adds the term and wildcard starting at sp position in string
-void sil_search_builder_wterm_value(sil_search_builder_t *h, uint32_t value, size_t sp, const char *term );
-void sil_search_builder_wtermf_value(sil_search_builder_t *h, uint32_t value, size_t sp, const char *term, ... );
+void sil_search_builder_wterm_value(sil_search_builder_t *h, uint32_t value, size_t sp,
+                                    const char *term );
+void sil_search_builder_wtermf_value(sil_search_builder_t *h, uint32_t value, size_t sp,
+                                     const char *term, ... );
 
 void sil_search_builder_destroy(sil_search_builder_t *h);
 
+/* Make the documents added so far durable (see sil_search_builder_options_checkpoints).
+   Call it between documents on the builder itself, not a thread builder.  The run includes
+   the documents of every thread builder destroyed so far, and the checkpoint is refused
+   while a thread builder is still open.  Returns false if checkpoints are off, a thread
+   builder is open (nothing is written) or the run could not be written, in which case the
+   documents since the previous checkpoint must be added again after resuming. */
+bool sil_search_builder_checkpoint(sil_search_builder_t *h);
+
+/* Reopen the build of filename from its manifest, using the options it was started with.
+   num_documents is set to the number of documents in the runs: the caller adds the
+   documents after those and destroys the builder as usual.  If the crash happened in
+   sil_search_builder_destroy, every document is in the runs and destroy continues from
+   the last step recorded (documents added in the meantime are ignored).  Returns NULL if
+   there is no usable manifest, so the build has to start over. */
+sil_search_builder_t *sil_search_builder_resume(const char *filename,
+                                                const sil_search_builder_options_t *options,
+                                                size_t *num_documents);
+
+typedef struct {
+    size_t input_documents;   // documents in the merged images
+    size_t documents;         // documents written, the rest were deleted or replaced
+    size_t input_bytes;       // bytes in the files of the merged images
+    size_t output_bytes;      // bytes in the files written
+} sil_search_builder_merge_stats_t;
+
+/* Write the image filename with the documents of images.  When several images have a
+   document with the same id, the one from the latest image is kept.  Documents deleted
+   from an image (sil_search_image_delete) are dropped along with their postings, as are
+   the ids set in deleted[i] (deleted or deleted[i] may be NULL), a bitmap which must cover
+   sil_search_image_max_id(images[i]) ids.  Posting lists are decoded and encoded again
+   with options (NULL for the defaults), so the images may have been built with different
+   options.  The columns declared in options (or the columns of images[0] when options
+   declares none) are written with each document's values from the column of the same
+   name in its image, 0 if the image lacks it.  Merging a single image compacts it.
+   stats (if not NULL) reports the documents dropped and the space reclaimed
+   (input_bytes - output_bytes).  Returns false if the image cannot be written. */
+bool sil_search_builder_merge(const char *filename, sil_search_image_t **images,
+                              const uint64_t **deleted, size_t num_images,
+                              const sil_search_builder_options_t *options,
+                              sil_search_builder_merge_stats_t *stats);
+
+/* Write the image filename with the documents of img renumbered from 1 in an order found
+   by recursive graph bisection: the documents are split in halves, and documents are
+   swapped between the halves while that lowers the estimated cost of the gaps between
+   postings, then each half is split the same way.  Documents sharing terms end up with
+   nearby ids, so postings fill the groups of 1024 ids densely and the deltas between them
+   shrink.
+
+   The first 4 bytes of each document's data become its new id and the original ids are
+   written to filename_id_map (see sil_search_image_original_id).  Columns follow their
+   documents as in sil_search_builder_merge.  Deleted documents are dropped.  filename
+   must differ from the image being read.  Returns false if the image cannot be
+   written. */
+bool sil_search_builder_reorder(const char *filename, sil_search_image_t *img,
+                                const sil_search_builder_options_t *options);
+
 #endif
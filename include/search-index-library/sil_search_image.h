@@ -8,12 +8,18 @@
 #include <inttypes.h>
 #include <stddef.h>
 #include "a-memory-library/aml_pool.h"
+#include "a-memory-library/aml_buffer.h"
 #include "search-index-library/sil_term.h"
+#include "search-index-library/impl/sil_top_k_impl.h"
 #include "a-tokenizer-library/atl_cursor.h"
 
 struct sil_search_image_s;
 typedef struct sil_search_image_s sil_search_image_t;
 
+/* Open the image written to filename.  Images written before SIL_IMAGE_FORMAT_V2 are read
+   as well.  Returns NULL if the files are missing, truncated or inconsistent (a global
+   record, content, embedding or posting list outside of its file) or the image has flags
+   from a newer format. */
 sil_search_image_t *sil_search_image_init(const char *filename);
 
 const sil_global_header_t * sil_search_image_global(uint32_t *length,
@@ -21,17 +27,266 @@ const sil_global_header_t * sil_search_image_global(uint32_t *length,
                                                     uint32_t id);
 const int8_t *sil_search_image_embeddings(sil_search_image_t *h,
                                           const sil_global_header_t *gh);
+/* The content of the document (a uint32_t length followed by the bytes).  Returns NULL
+   for images whose content is compressed (sil_search_builder_options_content_blocks). */
 const char *sil_search_image_content(sil_search_image_t *h,
                                      const sil_global_header_t *gh);
 
+/* Copy the content of the document (the length and the bytes as above) into bh and return
+   it, decompressing the blocks holding it if the content is compressed.  Returns NULL if
+   the blocks cannot be read. */
+const char *sil_search_image_content_copy(sil_search_image_t *h,
+                                          const sil_global_header_t *gh,
+                                          aml_buffer_t *bh);
+
+/* Keep up to max_blocks decompressed content blocks so documents sharing a block do not
+   decompress it again, evicting the least recently used block.  Blocks are decompressed
+   and copied from outside the cache's lock.  Without a cache each read decompresses the
+   blocks holding the document once, into bh.  The cache is shared by the threads reading
+   the image and can only be set once, before content is read. */
+void sil_search_image_content_cache(sil_search_image_t *h, size_t max_blocks);
+
 uint32_t sil_search_image_max_id(sil_search_image_t *img);
 
+// collection statistics used for BM25 scoring
+uint32_t sil_search_image_total_documents(sil_search_image_t *img);
+double sil_search_image_average_document_length(sil_search_image_t *img);
+
+// the ids of the documents in the image in ascending order
+const uint32_t *sil_search_image_ids(sil_search_image_t *img, uint32_t *num_ids);
+
+// the terms of the image in sorted order
+char **sil_search_image_terms(sil_search_image_t *img, size_t *num_terms);
+
+/* An image written by sil_search_builder_reorder keeps the id each document had before it
+   was renumbered (base_id_map).  For other images these return the id unchanged.
+   sil_search_image_reordered_id returns false if no document had original_id. */
+uint32_t sil_search_image_original_id(sil_search_image_t *img, uint32_t id);
+bool sil_search_image_reordered_id(sil_search_image_t *img, uint32_t original_id, uint32_t *id);
+
+// the number of bytes in the image's files (counting cold postings as compressed)
+size_t sil_search_image_size(sil_search_image_t *img);
+
+/* Columns hold a fixed width value of every document, declared with
+   sil_search_builder_options_column and set with sil_search_builder_column. */
+typedef enum {
+    SIL_COLUMN_U8 = 1,
+    SIL_COLUMN_U16 = 2,
+    SIL_COLUMN_U32 = 3,
+    SIL_COLUMN_U64 = 4,
+    SIL_COLUMN_FLOAT = 5
+} sil_column_type_t;
+
+typedef struct {
+    char name[SIL_COLUMN_NAME_SIZE];
+    sil_column_type_t type;
+} sil_column_t;
+
+static inline uint32_t sil_column_width(sil_column_type_t type) {
+    switch(type) {
+    case SIL_COLUMN_U8: return 1;
+    case SIL_COLUMN_U16: return 2;
+    case SIL_COLUMN_U32: return 4;
+    case SIL_COLUMN_U64: return 8;
+    case SIL_COLUMN_FLOAT: return 4;
+    }
+    return 0;
+}
+
+/* The value at index of a column of type, floats are truncated. */
+static inline uint64_t sil_column_value(const void *values, sil_column_type_t type, uint32_t index) {
+    switch(type) {
+    case SIL_COLUMN_U8: return ((const uint8_t *)values)[index];
+    case SIL_COLUMN_U16: return ((const uint16_t *)values)[index];
+    case SIL_COLUMN_U32: return ((const uint32_t *)values)[index];
+    case SIL_COLUMN_U64: return ((const uint64_t *)values)[index];
+    case SIL_COLUMN_FLOAT: return (uint64_t)((const float *)values)[index];
+    }
+    return 0;
+}
+
+static inline double sil_column_double(const void *values, sil_column_type_t type, uint32_t index) {
+    if(type == SIL_COLUMN_FLOAT)
+        return ((const float *)values)[index];
+    return (double)sil_column_value(values, type, index);
+}
+
+/* The position of id in sil_search_image_ids, which is also its index in the columns.
+   Returns UINT32_MAX if the image does not have id. */
+uint32_t sil_search_image_document_index(sil_search_image_t *img, uint32_t id);
+
+/* The values of the column name, one per document in the order of sil_search_image_ids,
+   64 byte aligned so a batch of candidates can be filtered with plain loads.  type (if not
+   NULL) is set to the type of the values.  Returns NULL if the image has no such column. */
+const void *sil_search_image_column(sil_search_image_t *img, const char *name,
+                                    sil_column_type_t *type);
+
+/* The columns of the image, as declared when it was built. */
+uint32_t sil_search_image_num_columns(sil_search_image_t *img);
+const sil_column_t *sil_search_image_columns(sil_search_image_t *img);
+
+/* Posting lists of terms which are rarely queried can be kept LZ4 compressed in memory.
+   A cold term is decompressed into the pool of each cursor opened on it.  Once a term has
+   been opened promote_after times within window opens of cold terms (the counters are
+   halved after every window), its decompressed postings are kept in a cache of
+   cache_size bytes, and the least recently used terms are evicted to make room. */
+typedef struct {
+    uint32_t max_document_frequency;  // terms in more documents stay hot (default 4096)
+    size_t min_bytes;                 // smaller posting lists stay hot (default 64)
+    size_t cache_size;                // default 16MB
+    uint32_t promote_after;           // default 2
+    uint32_t window;                  // default 64K
+} sil_cold_postings_options_t;
+
+typedef struct {
+    size_t cold_terms;
+    size_t cold_bytes;        // the posting lists of the cold terms
+    size_t compressed_bytes;  // the same lists compressed
+    size_t cached_bytes;      // decompressed lists in the cache
+    size_t hits;              // cold terms opened from the cache
+    size_t misses;            // cold terms decompressed
+} sil_cold_postings_stats_t;
+
+void sil_cold_postings_options_init(sil_cold_postings_options_t *options);
+
+/* Compress the posting lists of the terms chosen by options (NULL for the defaults) and
+   release the uncompressed copies.  Must be called before any term is opened.  Returns
+   false if it was already called. */
+bool sil_search_image_cold_postings(sil_search_image_t *img,
+                                    const sil_cold_postings_options_t *options);
+
+void sil_search_image_cold_stats(sil_search_image_t *img, sil_cold_postings_stats_t *stats);
+
+/* Mark the document id as deleted.  Cursors opened afterwards from sil_search_image_term
+   skip it in advance and advance_to, skipping whole groups of 1024 ids once all of their
+   documents are deleted, and it is left out of counts and value top k.  Deletes may happen
+   while other threads read the image.  The postings stay in the image until it is merged
+   (sil_search_builder_merge), and the collection statistics still count the document.
+   Returns false if there is no such document or it was already deleted. */
+bool sil_search_image_delete(sil_search_image_t *img, uint32_t id);
+bool sil_search_image_is_deleted(sil_search_image_t *img, uint32_t id);
+uint32_t sil_search_image_deleted_documents(sil_search_image_t *img);
+
+/* Write the deleted ids to base_deleted, which sil_search_image_init loads. */
+bool sil_search_image_save_deleted(sil_search_image_t *img);
+
+/* Replace the value of the posting of id in term without rebuilding the image.  Updates
+   are appended to a pending list (so many threads can update at a high rate) and take
+   effect for terms opened after the next sil_search_image_publish_updates.  A later update
+   of the same posting replaces an earlier one and an update for a document without the
+   term has no effect.  Value summaries of groups holding updates are widened so value
+   ranges and value top k still see the new values.  sil_search_builder_merge and
+   reordering write the updated values into the new image, sil_search_image_concat refuses
+   an image with saved updates.  Returns false if the image has no such term or document. */
+bool sil_search_image_update_value(sil_search_image_t *img, const char *term, uint32_t id,
+                                   uint32_t value);
+
+/* Merge the pending updates into a new sorted table of updates and publish it.  Cursors
+   which are already open keep reading the table they started with, which is freed once
+   each of them is released (sil_search_image_term_release) - tables held by cursors which
+   are never released are freed with the image.  Each publish copies the whole table, so
+   publish in batches rather than after every update.  Returns the number of postings with
+   an updated value. */
+size_t sil_search_image_publish_updates(sil_search_image_t *img);
+
+/* Write the published updates to base_updates, which sil_search_image_init loads. */
+bool sil_search_image_save_updates(sil_search_image_t *img);
+
 sil_term_t *sil_search_image_term(sil_search_image_t *img, aml_pool_t *pool, const char *term);
 sil_term_t *sil_search_image_termf(sil_search_image_t *img, aml_pool_t *pool, const char *term, ...);
 
+/* Let go of the published value updates a cursor from sil_search_image_term reads, so a
+   table replaced since it was opened can be freed.  The cursor must not be used after.
+   Does nothing if t is NULL or its term has no updates. */
+void sil_search_image_term_release(sil_term_t *t);
+
+/* Restrict a term from sil_search_image_term to postings with lo <= value <= hi.  For
+   images built with sil_search_builder_options_value_summaries, groups of 1024 ids whose
+   values are all outside of the range are skipped without being decoded.  Must be called
+   before the first advance.  document_frequency still counts every posting. */
+sil_term_t *sil_term_value_range(sil_term_t *t, uint32_t lo, uint32_t hi);
+
+/* Fill res with up to k postings of t ordered by descending value (newest first when the
+   value is a timestamp).  Groups of 1024 ids are visited in descending order of their
+   max value and the search stops once the kth best value beats every remaining group, so
+   only a few groups are decoded.  Without value summaries every group is decoded.  t
+   must come from sil_search_image_term and is consumed. */
+size_t sil_term_value_top_k(sil_term_t *t, sil_valued_id_t *res, size_t k);
+
+/* Same as sil_term_value_top_k, limited to ids which also match every term in filters.
+   Groups are bounded by t's values, so t should be the term whose value orders the
+   results.  The filters may be value ranges (sil_term_value_range). */
+size_t sil_term_value_top_k_and(sil_term_t *t, sil_term_t **filters, size_t num_filters,
+                                sil_valued_id_t *res, size_t k);
+
+/* The number of postings in t without iterating over them.  For a term this is the
+   document_frequency from its header.  Value ranges (sil_term_value_range) add up whole
+   groups which are inside of the range and only decode groups crossing it.  t must not
+   have been advanced and is consumed. */
+uint32_t sil_term_count(sil_term_t *t);
+
+/* The number of ids matching every term (which may be value ranges).  Groups of 1024 ids
+   are counted from the group headers (sil_search_builder_options_group_counts) when the
+   other terms contain every document in the group; only the remaining groups are
+   decoded.  The terms must not have been advanced and are consumed.  A missing (NULL)
+   term matches nothing. */
+uint32_t sil_term_count_and(sil_search_image_t *img, sil_term_t **terms, size_t num_terms);
+
+/* Facets count the values of a field over the documents matching a query, such as the
+   services or hosts of the matching log lines.  The matches are a bitmap with a bit for
+   each id, sil_search_image_match_words(img) words long (whole groups of 1024 ids). */
+typedef struct {
+    size_t top_n;              // the most frequent values returned (default 10)
+    uint32_t sample_above;     // sample once more documents than this match (default 0, never)
+    uint32_t sample_groups;    // when sampling count one in sample_groups groups of 1024 ids
+                               // and scale the counts up by as much (default 8)
+} sil_facet_options_t;
+
+typedef struct {
+    const char *value;         // the term less the prefix (NULL for a column)
+    uint64_t column_value;     // the value of a column
+    uint32_t count;            // an estimate when sampled
+} sil_facet_count_t;
+
+void sil_facet_options_init(sil_facet_options_t *options);
+
+size_t sil_search_image_match_words(sil_search_image_t *img);
+
+/* The bitmap of the ids c returns, allocated from pool.  num_matches (if not NULL) is set
+   to the number of ids. */
+uint64_t *sil_search_image_matches(sil_search_image_t *img, aml_pool_t *pool, atl_cursor_t *c,
+                                   uint32_t *num_matches);
+
+/* Fill res (which must hold top_n counts) with the terms starting with prefix (for example
+   "service:") which the most matches have, in descending order of count.  Each term is
+   intersected with the matches a group of 1024 ids at a time: groups without matches are
+   skipped, groups the term covers take the popcount of the matches and the rest are
+   decoded.  options may be NULL for the defaults.  sampled (if not NULL) is set if the
+   counts are estimates.  Returns the number of counts. */
+size_t sil_search_image_facet(sil_search_image_t *img, const uint64_t *matches, const char *prefix,
+                              const sil_facet_options_t *options, sil_facet_count_t *res,
+                              bool *sampled);
+
+/* Same as sil_search_image_facet for the values of an integer column (floats are
+   truncated), ties in count are in ascending order of value. */
+size_t sil_search_image_facet_column(sil_search_image_t *img, const uint64_t *matches, const char *column,
+                                     const sil_facet_options_t *options, sil_facet_count_t *res,
+                                     bool *sampled);
+
 // to support and, or, not, phrase, etc
 atl_cursor_t *sil_search_image_custom_cb(aml_pool_t *pool, atl_token_t *token, void *arg);
 
 void sil_search_image_destroy(sil_search_image_t *h);
 
+/* Write the image filename from the images in bases, which must cover disjoint ranges of
+   ids with no group of 1024 ids (id >> 10) in more than one image.  Posting lists are
+   concatenated a group at a time without being decoded and the global, embedding and
+   content files are appended with their offsets moved.  Documents deleted from the images
+   (base_deleted) stay deleted in filename.  The images may be given in any order and must
+   have been built with the same options in SIL_IMAGE_FORMAT_V2.  Renumbered images (with
+   a base_id_map) and images with saved value updates (base_updates) are not taken - merge
+   them first.  Returns false if the images overlap, differ in options or format, are
+   renumbered, have value updates or cannot be read. */
+bool sil_search_image_concat(const char *filename, const char **bases, size_t num_bases);
+
 #endif
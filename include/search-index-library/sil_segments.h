@@ -0,0 +1,158 @@
+// SPDX-FileCopyrightText: 2023–2025 Andy Curtis <contactandyc@gmail.com>
+// SPDX-FileCopyrightText: 2024–2025 Knode.ai — technical questions: contact Andy (above)
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef _sil_segments_h
+#define _sil_segments_h
+
+/*
+ * An index which keeps growing as documents arrive.  A sil_search_image_t is immutable and
+ * a build is all or nothing, so documents are added in small segments, each one an image
+ * written by sil_search_builder.  Queries run against a snapshot of the segments: a term
+ * is a cursor over the union of its posting lists in every segment and the collection
+ * statistics are combined across segments.
+ *
+ * - A document added again (the same id in a later segment) replaces the earlier one.
+ *   The older postings are skipped by the cursors and dropped when segments are merged.
+ * - A deleted document is marked in the segment holding it (sil_search_image_delete) and
+ *   dropped by the next merge of that segment.
+ * - Segments are grouped into tiers by the number of documents they hold (a tier for
+ *   every power of merge_factor).  A background thread merges merge_factor neighbouring
+ *   segments of the same tier into one segment of the next tier.
+ * - Merges are written next to the segments they replace and swapped in by publishing a
+ *   new snapshot.  Readers keep the snapshot they acquired, so they never wait for a
+ *   merge, and the files of merged segments are removed when the last snapshot using
+ *   them is released.
+ * - The list of segments is kept in the file base_segments and replaced atomically, so
+ *   sil_segments_init reopens the index as of the last add or merge.
+ * - Documents passed to sil_segments_add_document go to a sil_memory_index and are
+ *   searchable by the next acquire.  They replace documents with the same id in the
+ *   segments, and the memory index is written out as a new segment once it grows past
+ *   memory_size (or on compact and destroy).  Documents which have not been written out are
+ *   lost if the process exits without sil_segments_destroy.
+ *
+ * The document_frequency of a term is the sum over the segments, so it also counts
+ * documents which have been replaced but not yet merged away.
+ *
+ * Example Usage:
+ * ```c
+ * sil_segments_t *segments = sil_segments_init("index", NULL);
+ * sil_search_builder_t *builder = sil_segments_builder(segments);
+ * sil_search_builder_global(builder, NULL, 0, content, content_length, &id, sizeof(id));
+ * sil_search_builder_term(builder, "error");
+ * sil_segments_add(segments, builder);
+ *
+ * sil_segments_snapshot_t *snapshot = sil_segments_acquire(segments);
+ * sil_term_t *t = sil_segments_term(snapshot, pool, "error");
+ * while(t && t->c.advance((atl_cursor_t *)t))
+ *     printf("%u\n", t->c.id);
+ * sil_segments_release(snapshot);
+ * sil_segments_destroy(segments);
+ * ```
+ */
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "a-memory-library/aml_pool.h"
+#include "search-index-library/sil_term.h"
+#include "search-index-library/sil_search_image.h"
+#include "search-index-library/sil_search_builder.h"
+#include "search-index-library/sil_memory_index.h"
+
+struct sil_segments_s;
+typedef struct sil_segments_s sil_segments_t;
+
+struct sil_segments_snapshot_s;
+typedef struct sil_segments_snapshot_s sil_segments_snapshot_t;
+
+typedef struct {
+    sil_search_builder_options_t builder_options;
+    uint32_t merge_factor;    // default 4
+    bool background;          // default true
+    size_t memory_size;       // default 16MB
+} sil_segments_options_t;
+
+void sil_segments_options_init(sil_segments_options_t *options);
+
+/* The options used to build new segments and to write merged segments. */
+void sil_segments_options_builder(sil_segments_options_t *options,
+                                  const sil_search_builder_options_t *builder_options);
+
+/* The number of segments of a tier which are merged together (at least 2). */
+void sil_segments_options_merge_factor(sil_segments_options_t *options, uint32_t merge_factor);
+
+/* Only merge segments when sil_segments_compact is called instead of on a background
+   thread. */
+void sil_segments_options_manual_compaction(sil_segments_options_t *options);
+
+/* The size the memory index of sil_segments_add_document may grow to before it is written
+   out as a segment. */
+void sil_segments_options_memory_size(sil_segments_options_t *options, size_t memory_size);
+
+/* Open (or create) the segmented index whose files start with base.  options may be NULL
+   for the defaults. */
+sil_segments_t *sil_segments_init(const char *base, const sil_segments_options_t *options);
+
+/* A builder for a new segment.  Documents are added to it with the usual
+   sil_search_builder calls and the segment becomes searchable once it is passed to
+   sil_segments_add.  Several builders may be open at once from different threads. */
+sil_search_builder_t *sil_segments_builder(sil_segments_t *h);
+
+/* Destroy builder (writing its segment) and publish the segment.  Its documents replace
+   documents with the same id in the segments added before it. */
+void sil_segments_add(sil_segments_t *h, sil_search_builder_t *builder);
+
+/* Add a document (a sil_document_builder blob) to the memory index, where the next
+   snapshot acquired finds it.  It replaces a document with the same id in the segments or
+   the memory index.  The call which takes the memory index past memory_size writes it out
+   as a segment, other calls to add documents wait for it. */
+void sil_segments_add_document(sil_segments_t *h, const sil_document_image_t *doc);
+
+/* The current segments, which stay usable until the snapshot is released even if they
+   are merged in the meantime.  Each acquire must be paired with a release. */
+sil_segments_snapshot_t *sil_segments_acquire(sil_segments_t *h);
+void sil_segments_release(sil_segments_snapshot_t *snapshot);
+
+size_t sil_segments_num_segments(sil_segments_snapshot_t *snapshot);
+
+// collection statistics across the segments and the memory index, not counting replaced documents
+uint32_t sil_segments_total_documents(sil_segments_snapshot_t *snapshot);
+double sil_segments_average_document_length(sil_segments_snapshot_t *snapshot);
+
+/* Delete the current version of the document id.  Deletes are saved with each segment
+   (base_seg_N_deleted) when the index is destroyed.  Returns false if there is no such
+   document. */
+bool sil_segments_delete(sil_segments_t *h, uint32_t id);
+
+/* The bytes reclaimed by merges since the index was opened (the size of the merged
+   segments less the size of the segment they became).  dropped_documents (if not NULL)
+   is set to the number of replaced or deleted documents the merges left out. */
+size_t sil_segments_reclaimed_bytes(sil_segments_t *h, size_t *dropped_documents);
+
+/* The image holding the current version of the document id (NULL if there is none or it
+   is in the memory index), to be used with sil_search_image_global,
+   sil_search_image_content, etc. */
+sil_search_image_t *sil_segments_image(sil_segments_snapshot_t *snapshot, uint32_t id);
+
+/* Set doc to the current version of id if it is in the memory index.  doc stays valid until
+   the snapshot is released. */
+bool sil_segments_document(sil_segments_snapshot_t *snapshot, uint32_t id,
+                           sil_document_image_t *doc);
+
+/* A cursor over the postings of term in every segment and the memory index, in id order
+   and skipping replaced documents.  It supports advance, advance_to and the position
+   functions of sil_term.h.  Returns NULL if no segment has the term. */
+sil_term_t *sil_segments_term(sil_segments_snapshot_t *snapshot, aml_pool_t *pool,
+                              const char *term);
+
+/* Write out the memory index and merge every segment into one (a single segment is
+   rewritten if it has deleted documents), waiting for a background merge to finish
+   first. */
+void sil_segments_compact(sil_segments_t *h);
+
+/* Writes out the memory index and stops the background thread.  Every snapshot must have
+   been released and every builder added. */
+void sil_segments_destroy(sil_segments_t *h);
+
+#endif
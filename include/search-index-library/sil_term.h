@@ -78,8 +78,8 @@ typedef struct {
 typedef struct {
     uint32_t document_length;  // term count for BM25
     uint32_t num_embeddings;
-    uint64_t content_offset : 36;
-    uint64_t embeddings_offset : 28;
+    uint64_t content_offset;
+    uint64_t embeddings_offset;
 } sil_global_header_t;
 
 struct sil_term_s {
@@ -99,6 +99,12 @@ struct sil_term_s {
 
 static inline void sil_term_decode_positions(sil_term_t *t);
 
+// the number of term positions for the current id (0 if the posting has no positions)
+static inline uint32_t sil_term_position_count(sil_term_t *t);
+
+// the number of bytes in the term's posting list, used to estimate the cost of decoding it
+static inline size_t sil_term_posting_bytes(sil_term_t *t);
+
 void sil_term_dump(sil_term_t *t);
 
 #include "impl/sil_term_impl.h"
@@ -0,0 +1,63 @@
+// SPDX-FileCopyrightText: 2023–2025 Andy Curtis <contactandyc@gmail.com>
+// SPDX-FileCopyrightText: 2024–2025 Knode.ai — technical questions: contact Andy (above)
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef _sil_term_accumulator_h
+#define _sil_term_accumulator_h
+
+/*
+ * Term-at-a-time evaluation for wide disjunctive queries (synonym, prefix or learned
+ * sparse expansions with many terms).  Instead of keeping one cursor per term open and
+ * merging them document by document, each term is walked sequentially into a dense
+ * score accumulator.  The id space is split into partitions (by default the 18 bit top
+ * level posting group, which keeps the float accumulator at 1MB so it stays in L2) and
+ * the top k documents are extracted after each partition is scored.
+ *
+ * Scores are BM25+ using the same parameters as the helpers in sil_term_impl.h.
+ *
+ * Example Usage:
+ * ```c
+ * sil_bm25_params_t params;
+ * sil_bm25_params_init(&params);
+ * sil_term_accumulator_t *acc = sil_term_accumulator_init(img, &params, 0);
+ * for(size_t i=0; i<num_terms; i++) {
+ *     sil_term_t *t = sil_search_image_term(img, pool, terms[i]);
+ *     if(t) sil_term_accumulator_add(acc, t, 1);
+ * }
+ * sil_scored_id_t res[100];
+ * size_t num_res = sil_term_accumulator_top_k(acc, res, 100);
+ * sil_term_accumulator_destroy(acc);
+ * ```
+ */
+
+#include <inttypes.h>
+#include <stddef.h>
+#include "search-index-library/sil_term.h"
+#include "search-index-library/sil_search_image.h"
+#include "search-index-library/impl/sil_top_k_impl.h"
+
+struct sil_term_accumulator_s;
+typedef struct sil_term_accumulator_s sil_term_accumulator_t;
+
+#define SIL_TERM_ACCUMULATOR_MIN_PARTITION_BITS 10
+#define SIL_TERM_ACCUMULATOR_MAX_PARTITION_BITS 18
+
+/* partition_bits is log2 of the number of ids scored per partition (10-18).  Passing 0
+   uses the 18 bit top level group. */
+sil_term_accumulator_t *sil_term_accumulator_init(sil_search_image_t *img,
+                                                  const sil_bm25_params_t *params,
+                                                  uint32_t partition_bits);
+
+/* Add a term to the query.  t must be a cursor which has not been advanced yet. */
+void sil_term_accumulator_add(sil_term_accumulator_t *h, sil_term_t *t, uint32_t query_term_freq);
+
+/* Score all of the added terms and fill res with up to k ids ordered by descending score.
+   The terms are consumed, call sil_term_accumulator_clear before adding new terms. */
+size_t sil_term_accumulator_top_k(sil_term_accumulator_t *h, sil_scored_id_t *res, size_t k);
+
+/* Remove all terms so the accumulator can be reused for another query. */
+void sil_term_accumulator_clear(sil_term_accumulator_t *h);
+
+void sil_term_accumulator_destroy(sil_term_accumulator_t *h);
+
+#endif
@@ -343,7 +343,7 @@ void sil_document_image_terms_to_buffer(aml_buffer_t *bh, sil_document_image_t *
         sil_id_term_t it;
         it.id = id;
         it.term = p;
-        aml_buffer_append(bh, &it, sizeof(id));
+        aml_buffer_append(bh, &it, sizeof(it));
         p += strlen(p) + 1;
         p = (char*)sil_skip_id((uint8_t*)p);
     }
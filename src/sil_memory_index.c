@@ -0,0 +1,567 @@
+// SPDX-FileCopyrightText: 2023–2025 Andy Curtis <contactandyc@gmail.com>
+// SPDX-FileCopyrightText: 2024–2025 Knode.ai — technical questions: contact Andy (above)
+// SPDX-License-Identifier: Apache-2.0
+
+#include "search-index-library/sil_memory_index.h"
+#include "search-index-library/impl/sil_constants.h"
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "the-macro-library/macro_sort.h"
+
+/* Documents sit in chunks which never move and the version table is replaced as it grows
+   (old tables stay in the arena), so searches can check whether a document is current or an
+   id is in the index without taking the lock while documents are added. */
+#define DOCUMENT_CHUNK_BITS 10
+#define DOCUMENT_CHUNK (1u << DOCUMENT_CHUNK_BITS)
+
+typedef struct {
+    uint32_t id;
+    uint32_t replaced_by;        // 1 + the number of the version which replaced this one, 0 if none
+    bool deleted;
+    bool first_version;          // no earlier version of the id was added
+    sil_document_image_t img;    // copied into the arena
+} memory_document_t;
+
+typedef struct {
+    uint32_t document;           // the number of the document in the order it was added
+    uint32_t id;
+    uint8_t *posting;            // the encoded posting within the document
+} memory_posting_t;
+
+typedef struct {
+    char *term;
+    uint32_t hash;
+    uint32_t num_postings;
+    uint32_t size;
+    memory_posting_t *postings;  // doubled within the arena as it fills
+    bool unsorted;               // a posting was added with an id not above the one before it
+    uint32_t num_dead;           // postings of replaced or deleted documents
+    uint32_t max_term_size;      // the most positions of a posting
+} memory_term_t;
+
+typedef struct {
+    uint32_t id;
+    uint32_t first;              // 1 + the number of the first version, set last
+    uint32_t current;            // 1 + the number of the current version
+} memory_version_t;
+
+typedef struct {
+    size_t mask;
+    memory_version_t slots[];    // open addressing on the hash of the id
+} version_table_t;
+
+struct sil_memory_index_s {
+    pthread_rwlock_t lock;       // documents are added with the write lock held
+    aml_pool_t *arena;
+
+    memory_document_t **documents; // chunks of DOCUMENT_CHUNK in the order they were added
+    uint32_t num_documents;
+    uint32_t num_chunks;           // room in documents
+
+    memory_term_t **terms;       // open addressing on the hash of the term
+    size_t num_terms;
+    size_t terms_mask;
+
+    version_table_t *versions;
+    size_t num_ids;
+
+    uint32_t total_documents;    // neither replaced nor deleted
+    double document_lengths;
+    size_t size;
+};
+
+static version_table_t *version_table_init(aml_pool_t *arena, size_t mask) {
+    version_table_t *v = (version_table_t *)aml_pool_zalloc(arena, sizeof(*v) +
+                                                           sizeof(memory_version_t) * (mask+1));
+    v->mask = mask;
+    return v;
+}
+
+sil_memory_index_t *sil_memory_index_init() {
+    sil_memory_index_t *h = (sil_memory_index_t *)aml_zalloc(sizeof(*h));
+    pthread_rwlock_init(&h->lock, NULL);
+    h->arena = aml_pool_init(1024*1024);
+    h->terms_mask = 1023;
+    h->terms = (memory_term_t **)aml_zalloc(sizeof(memory_term_t *) * (h->terms_mask+1));
+    h->versions = version_table_init(h->arena, 1023);
+    return h;
+}
+
+static inline memory_document_t *document_at(memory_document_t **documents, uint32_t number) {
+    return documents[number >> DOCUMENT_CHUNK_BITS] + (number & (DOCUMENT_CHUNK-1));
+}
+
+static inline uint32_t hash_term(const char *term) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for(const unsigned char *p = (const unsigned char *)term; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static inline size_t hash_id(uint32_t id) {
+    return id * 2654435761u;
+}
+
+static memory_term_t *find_term(sil_memory_index_t *h, const char *term, uint32_t hash) {
+    size_t slot = hash & h->terms_mask;
+    while(h->terms[slot]) {
+        memory_term_t *t = h->terms[slot];
+        if(t->hash == hash && !strcmp(t->term, term))
+            return t;
+        slot = (slot+1) & h->terms_mask;
+    }
+    return NULL;
+}
+
+static void grow_terms(sil_memory_index_t *h) {
+    size_t mask = h->terms_mask * 2 + 1;
+    memory_term_t **terms = (memory_term_t **)aml_zalloc(sizeof(memory_term_t *) * (mask+1));
+    for(size_t i=0; i<=h->terms_mask; i++) {
+        if(!h->terms[i])
+            continue;
+        size_t slot = h->terms[i]->hash & mask;
+        while(terms[slot])
+            slot = (slot+1) & mask;
+        terms[slot] = h->terms[i];
+    }
+    aml_free(h->terms);
+    h->terms = terms;
+    h->terms_mask = mask;
+}
+
+static memory_term_t *add_term(sil_memory_index_t *h, const char *term) {
+    uint32_t hash = hash_term(term);
+    memory_term_t *t = find_term(h, term, hash);
+    if(t)
+        return t;
+    if((h->num_terms+1) * 2 > h->terms_mask)
+        grow_terms(h);
+    t = (memory_term_t *)aml_pool_zalloc(h->arena, sizeof(*t));
+    t->term = aml_pool_strdup(h->arena, term);
+    t->hash = hash;
+    size_t slot = hash & h->terms_mask;
+    while(h->terms[slot])
+        slot = (slot+1) & h->terms_mask;
+    h->terms[slot] = t;
+    h->num_terms++;
+    h->size += sizeof(*t) + strlen(term) + 1;
+    return t;
+}
+
+// the number of positions of a posting, decoded the way a cursor decodes it
+static uint32_t posting_term_size(uint8_t *posting) {
+    sil_term_ext_t ext;
+    memset(&ext, 0, sizeof(ext));
+    ext.p = posting;
+    advance_document_id(&ext);
+    return ext.p - ext.wp;
+}
+
+static void add_posting(sil_memory_index_t *h, memory_term_t *t, uint32_t document, uint32_t id,
+                        uint8_t *posting) {
+    if(t->num_postings == t->size) {
+        // the old array stays in the arena, like the slices of an append only pool
+        uint32_t size = t->size ? t->size * 2 : 4;
+        memory_posting_t *postings = (memory_posting_t *)aml_pool_alloc(h->arena, sizeof(memory_posting_t) * size);
+        if(t->num_postings)
+            memcpy(postings, t->postings, sizeof(memory_posting_t) * t->num_postings);
+        t->postings = postings;
+        t->size = size;
+        h->size += sizeof(memory_posting_t) * size;
+    }
+    if(t->num_postings && id <= t->postings[t->num_postings-1].id)
+        t->unsorted = true;
+    uint32_t term_size = posting_term_size(posting);
+    if(term_size > t->max_term_size)
+        t->max_term_size = term_size;
+    t->postings[t->num_postings].document = document;
+    t->postings[t->num_postings].id = id;
+    t->postings[t->num_postings].posting = posting;
+    t->num_postings++;
+}
+
+// the terms of d no longer count its posting
+static void remove_postings(sil_memory_index_t *h, memory_document_t *d) {
+    uint8_t *p = (uint8_t *)d->img.terms;
+    uint8_t *ep = (uint8_t *)d->img.content;
+    while(p < ep) {
+        memory_term_t *t = find_term(h, (const char *)p, hash_term((const char *)p));
+        p += strlen((const char *)p) + 1;
+        t->num_dead++;
+        p = sil_skip_id(p);
+    }
+    h->total_documents--;
+    h->document_lengths -= d->img.header.document_length_for_bm25;
+}
+
+static memory_version_t *find_version(version_table_t *v, uint32_t id) {
+    size_t slot = hash_id(id) & v->mask;
+    while(v->slots[slot].first && v->slots[slot].id != id)
+        slot = (slot+1) & v->mask;
+    return v->slots + slot;
+}
+
+// the new table is filled before it is published, readers may still be on the old one
+static void grow_versions(sil_memory_index_t *h) {
+    version_table_t *old = h->versions;
+    version_table_t *v = version_table_init(h->arena, old->mask * 2 + 1);
+    for(size_t i=0; i<=old->mask; i++)
+        if(old->slots[i].first)
+            *find_version(v, old->slots[i].id) = old->slots[i];
+    h->size += sizeof(memory_version_t) * (v->mask+1);
+    __atomic_store_n(&h->versions, v, __ATOMIC_RELEASE);
+}
+
+// room for document number in a chunk, the directory is replaced (in the arena) as it grows
+static void add_chunk(sil_memory_index_t *h, uint32_t number) {
+    uint32_t chunk = number >> DOCUMENT_CHUNK_BITS;
+    if(chunk == h->num_chunks) {
+        uint32_t num_chunks = h->num_chunks ? h->num_chunks * 2 : 16;
+        memory_document_t **documents =
+            (memory_document_t **)aml_pool_zalloc(h->arena, sizeof(memory_document_t *) * num_chunks);
+        if(h->num_chunks)
+            memcpy(documents, h->documents, sizeof(memory_document_t *) * h->num_chunks);
+        __atomic_store_n(&h->documents, documents, __ATOMIC_RELEASE);
+        h->num_chunks = num_chunks;
+    }
+    h->documents[chunk] = (memory_document_t *)aml_pool_alloc(h->arena,
+                                                              sizeof(memory_document_t) * DOCUMENT_CHUNK);
+    h->size += sizeof(memory_document_t) * DOCUMENT_CHUNK;
+}
+
+void sil_memory_index_add(sil_memory_index_t *h, const sil_document_image_t *doc) {
+    // the header, data, terms and content are contiguous, the embeddings are aligned apart
+    size_t length = (doc->content + doc->header.content_length) - doc->document;
+    size_t embeddings_length = (size_t)doc->header.num_embeddings * 512;
+
+    pthread_rwlock_wrlock(&h->lock);
+    uint32_t number = h->num_documents;
+    if(!(number & (DOCUMENT_CHUNK-1)))
+        add_chunk(h, number);
+    memory_document_t *d = document_at(h->documents, number);
+    memset(d, 0, sizeof(*d));
+    d->id = *(uint32_t *)doc->data;
+    char *document = (char *)aml_pool_dup(h->arena, doc->document, length);
+    d->img.document = document;
+    d->img.length = length;
+    d->img.header = doc->header;
+    d->img.data = document + (doc->data - doc->document);
+    d->img.terms = document + (doc->terms - doc->document);
+    d->img.content = document + (doc->content - doc->document);
+    if(embeddings_length)
+        d->img.embeddings = (int8_t *)aml_pool_dup(h->arena, doc->embeddings, embeddings_length);
+    h->size += length + embeddings_length;
+
+    uint8_t *p = (uint8_t *)d->img.terms;
+    uint8_t *ep = (uint8_t *)d->img.content;
+    while(p < ep) {
+        memory_term_t *t = add_term(h, (const char *)p);
+        p += strlen((const char *)p) + 1;
+        add_posting(h, t, number, d->id, p);
+        p = sil_skip_id(p);
+    }
+
+    if((h->num_ids+1) * 2 > h->versions->mask)
+        grow_versions(h);
+    memory_version_t *version = find_version(h->versions, d->id);
+    if(version->first) {
+        memory_document_t *replaced = document_at(h->documents, version->current-1);
+        __atomic_store_n(&replaced->replaced_by, number + 1, __ATOMIC_RELEASE);
+        if(!replaced->deleted)
+            remove_postings(h, replaced);
+    }
+    else {
+        d->first_version = true;
+        version->id = d->id;
+        __atomic_store_n(&version->first, number + 1, __ATOMIC_RELEASE);
+        h->num_ids++;
+    }
+    version->current = number + 1;
+    h->total_documents++;
+    h->document_lengths += d->img.header.document_length_for_bm25;
+    // searches which see the new count see the document
+    __atomic_store_n(&h->num_documents, number + 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&h->lock);
+}
+
+bool sil_memory_index_delete(sil_memory_index_t *h, uint32_t id) {
+    bool deleted = false;
+    pthread_rwlock_wrlock(&h->lock);
+    memory_version_t *version = find_version(h->versions, id);
+    if(version->first) {
+        memory_document_t *d = document_at(h->documents, version->current-1);
+        if(!d->deleted) {
+            __atomic_store_n(&d->deleted, true, __ATOMIC_RELEASE);
+            remove_postings(h, d);
+            deleted = true;
+        }
+    }
+    pthread_rwlock_unlock(&h->lock);
+    return deleted;
+}
+
+uint32_t sil_memory_index_num_added(sil_memory_index_t *h) {
+    return __atomic_load_n(&h->num_documents, __ATOMIC_ACQUIRE);
+}
+
+size_t sil_memory_index_size(sil_memory_index_t *h) {
+    pthread_rwlock_rdlock(&h->lock);
+    size_t size = h->size;
+    pthread_rwlock_unlock(&h->lock);
+    return size;
+}
+
+// document number is the version of its id as of num_added
+static inline bool is_current(memory_document_t **documents, uint32_t number, uint32_t num_added) {
+    if(number >= num_added)
+        return false;
+    uint32_t replaced_by = __atomic_load_n(&document_at(documents, number)->replaced_by, __ATOMIC_ACQUIRE);
+    return !replaced_by || replaced_by > num_added;
+}
+
+static inline bool is_deleted(memory_document_t **documents, uint32_t number) {
+    return __atomic_load_n(&document_at(documents, number)->deleted, __ATOMIC_ACQUIRE);
+}
+
+bool sil_memory_index_has(sil_memory_index_t *h, uint32_t num_added, uint32_t id) {
+    const version_table_t *v = __atomic_load_n(&h->versions, __ATOMIC_ACQUIRE);
+    size_t slot = hash_id(id) & v->mask;
+    while(true) {
+        uint32_t first = __atomic_load_n(&v->slots[slot].first, __ATOMIC_ACQUIRE);
+        if(!first)
+            return false;
+        if(v->slots[slot].id == id)
+            return first <= num_added;
+        slot = (slot+1) & v->mask;
+    }
+}
+
+uint32_t sil_memory_index_added_ids(sil_memory_index_t *h, uint32_t *ids, uint32_t first_added,
+                                    uint32_t num_added) {
+    uint32_t num_ids = 0;
+    memory_document_t **documents = __atomic_load_n(&h->documents, __ATOMIC_ACQUIRE);
+    for(uint32_t i=first_added; i<num_added; i++) {
+        memory_document_t *d = document_at(documents, i);
+        if(d->first_version)
+            ids[num_ids++] = d->id;
+    }
+    return num_ids;
+}
+
+uint32_t sil_memory_index_num_added_totals(sil_memory_index_t *h, uint32_t *total_documents,
+                                           double *document_lengths) {
+    pthread_rwlock_rdlock(&h->lock);
+    uint32_t num_added = h->num_documents;
+    *total_documents = h->total_documents;
+    *document_lengths = h->document_lengths;
+    pthread_rwlock_unlock(&h->lock);
+    return num_added;
+}
+
+uint32_t sil_memory_index_total_documents(sil_memory_index_t *h, uint32_t num_added,
+                                          double *document_lengths) {
+    uint32_t total_documents = 0;
+    double lengths = 0.0;
+    pthread_rwlock_rdlock(&h->lock);
+    if(num_added >= h->num_documents) {
+        total_documents = h->total_documents;
+        lengths = h->document_lengths;
+    }
+    else {
+        // documents were added since num_added, count the ones it sees
+        for(uint32_t i=0; i<num_added; i++) {
+            if(is_current(h->documents, i, num_added) && !document_at(h->documents, i)->deleted) {
+                total_documents++;
+                lengths += document_at(h->documents, i)->img.header.document_length_for_bm25;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&h->lock);
+    if(document_lengths)
+        *document_lengths = lengths;
+    return total_documents;
+}
+
+bool sil_memory_index_document(sil_memory_index_t *h, uint32_t num_added, uint32_t id,
+                               sil_document_image_t *doc) {
+    bool found = false;
+    pthread_rwlock_rdlock(&h->lock);
+    // the current version may be newer than num_added, so look for the one before it
+    memory_version_t *version = find_version(h->versions, id);
+    for(uint32_t i=version->first ? version->current : 0; i-- > 0;) {
+        memory_document_t *d = document_at(h->documents, i);
+        if(d->id != id || !is_current(h->documents, i, num_added))
+            continue;
+        if(!d->deleted) {
+            *doc = d->img;
+            found = true;
+        }
+        break;
+    }
+    pthread_rwlock_unlock(&h->lock);
+    return found;
+}
+
+/*
+    A term whose postings were added in id order is read in place, skipping the postings of
+    documents which are replaced or deleted (the postings and documents do not move while
+    more are added).  Otherwise the cursor owns a sorted copy of the postings it can see.
+    Each posting is decoded into ext the way a document image decodes its one posting.
+*/
+typedef struct {
+    sil_term_ext_t ext;
+    const memory_posting_t *postings;
+    memory_document_t **documents;  // to skip postings, NULL when every posting is seen
+    uint32_t num_added;
+    uint32_t num_postings;
+    uint32_t current;
+} memory_term_cursor_t;
+
+static inline bool compare_postings(const memory_posting_t *a, const memory_posting_t *b) {
+    return a->id < b->id;
+}
+
+macro_sort(sort_memory_postings, memory_posting_t, compare_postings);
+
+static inline bool posting_seen(memory_term_cursor_t *c, uint32_t i) {
+    if(!c->documents)
+        return true;
+    uint32_t document = c->postings[i].document;
+    return is_current(c->documents, document, c->num_added) && !is_deleted(c->documents, document);
+}
+
+// move to the first posting from current on which the cursor sees
+static bool seek_posting(memory_term_cursor_t *c) {
+    while(c->current < c->num_postings && !posting_seen(c, c->current))
+        c->current++;
+    if(c->current >= c->num_postings) {
+        atl_cursor_empty(&c->ext.pub.c);
+        return false;
+    }
+    c->ext.p = c->postings[c->current].posting;
+    c->ext.wp = NULL;
+    c->ext.pub.value = 0;
+    advance_document_id(&c->ext);
+    c->ext.pub.c.id = c->postings[c->current].id;
+    return true;
+}
+
+static bool memory_term_advance(memory_term_cursor_t *c) {
+    if(c->current >= c->num_postings)
+        return false;
+    c->current++;
+    return seek_posting(c);
+}
+
+static bool memory_term_first_advance(memory_term_cursor_t *c) {
+    c->ext.pub.c.advance = (atl_cursor_advance_cb)memory_term_advance;
+    return true;
+}
+
+static bool memory_term_advance_to(memory_term_cursor_t *c, uint32_t id) {
+    if(c->current >= c->num_postings)
+        return false;
+    if(id <= c->ext.pub.c.id)
+        return true;
+    uint32_t lo = c->current+1, hi = c->num_postings;
+    while(lo < hi) {
+        uint32_t mid = lo + ((hi - lo) >> 1);
+        if(c->postings[mid].id < id)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    c->current = lo;
+    return seek_posting(c);
+}
+
+// the number of postings of t from documents before num_added (which are in order)
+static uint32_t postings_before(const memory_term_t *t, uint32_t num_added) {
+    uint32_t lo = 0, hi = t->num_postings;
+    while(lo < hi) {
+        uint32_t mid = lo + ((hi - lo) >> 1);
+        if(t->postings[mid].document < num_added)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+sil_term_t *sil_memory_index_term(sil_memory_index_t *h, aml_pool_t *pool, uint32_t num_added,
+                                  const char *term) {
+    pthread_rwlock_rdlock(&h->lock);
+    memory_term_t *t = find_term(h, term, hash_term(term));
+    if(!t) {
+        pthread_rwlock_unlock(&h->lock);
+        return NULL;
+    }
+    memory_term_cursor_t *c = (memory_term_cursor_t *)aml_pool_zalloc(pool, sizeof(*c));
+    c->num_added = num_added;
+    uint32_t document_frequency = 0, max_term_size = 0;
+    if(!t->unsorted) {
+        c->postings = t->postings;
+        c->num_postings = postings_before(t, num_added);
+        c->documents = h->documents;
+        // postings replaced or deleted since num_added are not counted
+        document_frequency = c->num_postings > t->num_dead ? c->num_postings - t->num_dead : 1;
+        max_term_size = t->max_term_size;
+        pthread_rwlock_unlock(&h->lock);
+    }
+    else {
+        memory_posting_t *postings = (memory_posting_t *)aml_pool_alloc(pool, sizeof(memory_posting_t) * (t->num_postings+1));
+        for(uint32_t i=0; i<t->num_postings; i++) {
+            memory_posting_t *mp = t->postings + i;
+            if(!is_current(h->documents, mp->document, num_added) ||
+               document_at(h->documents, mp->document)->deleted)
+                continue;
+            postings[c->num_postings++] = *mp;
+        }
+        pthread_rwlock_unlock(&h->lock);
+        // postings are in the order documents were added
+        sort_memory_postings(postings, c->num_postings);
+        c->postings = postings;
+        document_frequency = c->num_postings;
+        for(c->current=0; c->current<c->num_postings; c->current++) {
+            seek_posting(c);
+            uint32_t term_size = c->ext.p - c->ext.wp;
+            if(term_size > max_term_size)
+                max_term_size = term_size;
+        }
+    }
+    c->current = 0;
+    if(!seek_posting(c))
+        return NULL;
+    c->ext.gid = 1;
+    c->ext.pub.max_term_size = max_term_size;
+    c->ext.pub.document_frequency = document_frequency;
+    c->ext.pub.term_positions = (uint32_t *)aml_pool_alloc(pool, sizeof(uint32_t) * (max_term_size+1));
+    c->ext.pub.c.advance = (atl_cursor_advance_cb)memory_term_first_advance;
+    c->ext.pub.c.advance_to = (atl_cursor_advance_to_cb)memory_term_advance_to;
+    c->ext.pub.c.type = TERM_CURSOR;
+    return (sil_term_t *)c;
+}
+
+uint32_t sil_memory_index_flush(sil_memory_index_t *h, sil_search_builder_t *builder) {
+    uint32_t num_flushed = 0;
+    pthread_rwlock_rdlock(&h->lock);
+    for(uint32_t i=0; i<h->num_documents; i++) {
+        memory_document_t *d = document_at(h->documents, i);
+        if(d->replaced_by || d->deleted)
+            continue;
+        sil_search_builder_add_document(builder, &d->img);
+        num_flushed++;
+    }
+    pthread_rwlock_unlock(&h->lock);
+    return num_flushed;
+}
+
+void sil_memory_index_destroy(sil_memory_index_t *h) {
+    aml_free(h->terms);
+    aml_pool_destroy(h->arena);
+    pthread_rwlock_destroy(&h->lock);
+    aml_free(h);
+}
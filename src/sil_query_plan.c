@@ -0,0 +1,425 @@
+// SPDX-FileCopyrightText: 2023–2025 Andy Curtis <contactandyc@gmail.com>
+// SPDX-FileCopyrightText: 2024–2025 Knode.ai — technical questions: contact Andy (above)
+// SPDX-License-Identifier: Apache-2.0
+
+#include "search-index-library/sil_query_plan.h"
+#include <inttypes.h>
+
+#include "the-macro-library/macro_sort.h"
+
+void sil_query_planner_options_init(sil_query_planner_options_t *options) {
+    sil_bm25_params_init(&options->bm25);
+    options->dense_ratio = 0.1;
+    options->term_at_a_time_min_terms = 16;
+    options->drop_ratio = 0.0;
+    options->early_termination = false;
+    options->early_termination_margin = 0.1;
+}
+
+sil_query_plan_t *sil_query_plan_init(aml_pool_t *pool, sil_search_image_t *img,
+                                      const sil_query_planner_options_t *options) {
+    sil_query_plan_t *plan = (sil_query_plan_t *)aml_pool_zalloc(pool, sizeof(*plan));
+    plan->pool = pool;
+    plan->img = img;
+    if(options)
+        plan->options = *options;
+    else
+        sil_query_planner_options_init(&plan->options);
+    plan->strategy = SIL_PLAN_EMPTY;
+    plan->size = 8;
+    plan->terms = (sil_plan_term_t *)aml_pool_zalloc(pool, sizeof(sil_plan_term_t) * plan->size);
+    return plan;
+}
+
+static void add_term(sil_query_plan_t *plan, const char *term, bool required) {
+    // a repeated term raises the query term frequency
+    for(uint32_t i=0; i<plan->num_terms; i++) {
+        if(!strcmp(plan->terms[i].term, term)) {
+            plan->terms[i].query_term_freq++;
+            if(required && !plan->terms[i].required) {
+                plan->terms[i].required = true;
+                if(!plan->terms[i].cursor)
+                    plan->missing_required = true;
+            }
+            return;
+        }
+    }
+    if(plan->num_terms == plan->size) {
+        sil_plan_term_t *terms = (sil_plan_term_t *)aml_pool_zalloc(plan->pool, sizeof(sil_plan_term_t) * plan->size * 2);
+        memcpy(terms, plan->terms, sizeof(sil_plan_term_t) * plan->num_terms);
+        plan->terms = terms;
+        plan->size *= 2;
+    }
+    sil_plan_term_t *pt = plan->terms + plan->num_terms;
+    plan->num_terms++;
+    pt->term = aml_pool_strdup(plan->pool, term);
+    pt->cursor = sil_search_image_term(plan->img, plan->pool, term);
+    pt->required = required;
+    pt->query_term_freq = 1;
+    pt->mode = SIL_PLAN_TERM_CURSOR;
+    if(pt->cursor) {
+        pt->document_frequency = pt->cursor->document_frequency;
+        pt->posting_bytes = sil_term_posting_bytes(pt->cursor);
+    } else {
+        pt->mode = SIL_PLAN_TERM_DROPPED;
+        if(required)
+            plan->missing_required = true;
+    }
+}
+
+void sil_query_plan_required(sil_query_plan_t *plan, const char *term) {
+    add_term(plan, term, true);
+}
+
+void sil_query_plan_optional(sil_query_plan_t *plan, const char *term) {
+    add_term(plan, term, false);
+}
+
+/* required cursors rarest first, then required bitmaps, then optional terms with the
+   highest possible score first and dropped terms last */
+static inline int plan_term_rank(const sil_plan_term_t *t) {
+    if(t->mode == SIL_PLAN_TERM_DROPPED)
+        return 3;
+    if(!t->required)
+        return 2;
+    return t->mode == SIL_PLAN_TERM_BITMAP ? 1 : 0;
+}
+
+static inline bool compare_plan_terms(const sil_plan_term_t *a, const sil_plan_term_t *b) {
+    int ra = plan_term_rank(a);
+    int rb = plan_term_rank(b);
+    if(ra != rb)
+        return ra < rb;
+    if(ra == 2) {
+        if(a->max_score != b->max_score)
+            return a->max_score > b->max_score;
+        return a->document_frequency < b->document_frequency;
+    }
+    if(a->document_frequency != b->document_frequency)
+        return a->document_frequency < b->document_frequency;
+    return a->posting_bytes < b->posting_bytes;
+}
+
+static inline
+macro_sort(sort_plan_terms, sil_plan_term_t, compare_plan_terms);
+
+void sil_query_plan_build(sil_query_plan_t *plan, size_t k) {
+    if(plan->built)
+        return;
+    plan->built = true;
+
+    sil_query_planner_options_t *options = &plan->options;
+    double total_documents = sil_search_image_total_documents(plan->img);
+    uint32_t num_required = 0, num_optional = 0;
+    double query_max_score = 0.0;
+    for(uint32_t i=0; i<plan->num_terms; i++) {
+        sil_plan_term_t *t = plan->terms + i;
+        if(!t->cursor)
+            continue;
+        t->idf_qtf = sil_idf_qtf(total_documents, t->document_frequency,
+                                 t->query_term_freq, options->bm25.k3);
+        t->max_score = sil_bm25_plus_max_score(&options->bm25, t->idf_qtf);
+        query_max_score += t->max_score;
+        if(t->required)
+            num_required++;
+        else
+            num_optional++;
+    }
+
+    if(plan->missing_required || num_required + num_optional == 0) {
+        plan->strategy = SIL_PLAN_EMPTY;
+        return;
+    }
+
+    if(num_required) {
+        plan->strategy = SIL_PLAN_CONJUNCTION;
+        // dense required terms become bitmaps, the rarest required term always drives
+        sil_plan_term_t *rarest = NULL;
+        for(uint32_t i=0; i<plan->num_terms; i++) {
+            sil_plan_term_t *t = plan->terms + i;
+            if(t->required && (!rarest || t->document_frequency < rarest->document_frequency))
+                rarest = t;
+        }
+        for(uint32_t i=0; i<plan->num_terms; i++) {
+            sil_plan_term_t *t = plan->terms + i;
+            if(t->required && t != rarest &&
+               t->document_frequency >= options->dense_ratio * total_documents)
+                t->mode = SIL_PLAN_TERM_BITMAP;
+        }
+    } else if(num_optional >= options->term_at_a_time_min_terms && !options->early_termination)
+        plan->strategy = SIL_PLAN_TERM_AT_A_TIME;
+    else
+        plan->strategy = SIL_PLAN_DISJUNCTION;
+
+    /* Optional terms which can add less than drop_ratio of the query's maximum score are
+       dropped.  This is lossy, such a term can still decide the order of near ties and so
+       the top k.  In a disjunction a term is only dropped if a stronger term alone still
+       matches k documents so the number of results is unchanged. */
+    uint32_t max_kept_frequency = 0;
+    for(uint32_t i=0; i<plan->num_terms; i++) {
+        sil_plan_term_t *t = plan->terms + i;
+        if(t->cursor && !t->required && t->max_score >= options->drop_ratio * query_max_score &&
+           t->document_frequency > max_kept_frequency)
+            max_kept_frequency = t->document_frequency;
+    }
+    for(uint32_t i=0; i<plan->num_terms; i++) {
+        sil_plan_term_t *t = plan->terms + i;
+        if(!t->cursor || t->required || t->max_score >= options->drop_ratio * query_max_score)
+            continue;
+        if(plan->strategy == SIL_PLAN_CONJUNCTION || max_kept_frequency >= k)
+            t->mode = SIL_PLAN_TERM_DROPPED;
+    }
+    sort_plan_terms(plan->terms, plan->num_terms);
+
+    // the best score a document can get from the terms which are kept
+    for(uint32_t i=0; i<plan->num_terms; i++)
+        if(plan->terms[i].mode != SIL_PLAN_TERM_DROPPED)
+            plan->max_score += plan->terms[i].max_score;
+    // without a margin only a k-th result nothing can beat stops the evaluation
+    plan->stop_score = options->early_termination_margin > 0.0 ? 0.0 : plan->max_score;
+}
+
+/* With early_termination, evaluation stops once k results score at least stop_score.  With
+   a margin that is (1 - margin) of the best score found so far, which later documents (lower
+   by static rank) rarely beat by much. */
+static inline bool stop_early(sil_query_plan_t *plan, sil_scored_id_t *res, size_t num, size_t k,
+                              double score) {
+    if(!plan->options.early_termination)
+        return false;
+    if(score > plan->best_score) {
+        plan->best_score = score;
+        if(plan->options.early_termination_margin > 0.0)
+            plan->stop_score = (1.0 - plan->options.early_termination_margin) * score;
+    }
+    if(num < k || sil_top_k_threshold(res, num, k) < plan->stop_score)
+        return false;
+    plan->terminated_early = true;
+    return true;
+}
+
+/* The bitmap only decides which ids match.  The term keeps a cursor of its own which
+   matched ids are scored from, so the plan does not change the scores. */
+static void fill_bitmap(sil_query_plan_t *plan, sil_plan_term_t *t) {
+    size_t num_words = (sil_search_image_max_id(plan->img) >> 6) + 1;
+    t->bitmap = (uint64_t *)aml_pool_zalloc(plan->pool, sizeof(uint64_t) * num_words);
+    sil_term_t *c = t->cursor;
+    while(c->c.advance((atl_cursor_t *)c))
+        t->bitmap[c->c.id >> 6] |= ((uint64_t)1) << (c->c.id & 63);
+    sil_search_image_term_release(c);
+    t->cursor = sil_search_image_term(plan->img, plan->pool, t->term);
+    t->active = t->cursor->c.advance((atl_cursor_t *)t->cursor);
+}
+
+static inline bool bitmap_test(const uint64_t *bitmap, uint32_t id) {
+    return (bitmap[id >> 6] >> (id & 63)) & 1;
+}
+
+static inline double document_length(sil_query_plan_t *plan, uint32_t id, double aveD) {
+    uint32_t length;
+    const sil_global_header_t *gh = sil_search_image_global(&length, plan->img, id);
+    return gh ? gh->document_length : aveD;
+}
+
+static size_t evaluate_conjunction(sil_query_plan_t *plan, sil_scored_id_t *res, size_t k) {
+    sil_bm25_params_t *params = &plan->options.bm25;
+    double aveD = sil_search_image_average_document_length(plan->img);
+    if(aveD <= 0.0)
+        aveD = 1.0;
+
+    // terms are ordered with the required cursors first and the rarest leading
+    sil_plan_term_t *terms = plan->terms;
+    uint32_t num_cursors = 0;
+    while(num_cursors < plan->num_terms && terms[num_cursors].required &&
+          terms[num_cursors].mode == SIL_PLAN_TERM_CURSOR)
+        num_cursors++;
+
+    for(uint32_t i=0; i<plan->num_terms; i++) {
+        sil_plan_term_t *t = terms + i;
+        if(t->mode == SIL_PLAN_TERM_BITMAP)
+            fill_bitmap(plan, t);
+        else if(t->mode == SIL_PLAN_TERM_CURSOR) {
+            t->active = t->cursor->c.advance((atl_cursor_t *)t->cursor);
+            if(!t->active && t->required)
+                return 0;
+        }
+    }
+
+    size_t num = 0;
+    sil_term_t *lead = terms[0].cursor;
+    uint32_t id = lead->c.id;
+    while(true) {
+        // leapfrog the required cursors until they agree on an id
+        uint32_t i = 1;
+        while(i < num_cursors) {
+            sil_term_t *c = terms[i].cursor;
+            if(!c->c.advance_to((atl_cursor_t *)c, id))
+                goto done;
+            if(c->c.id > id) {
+                id = c->c.id;
+                if(!lead->c.advance_to((atl_cursor_t *)lead, id))
+                    goto done;
+                id = lead->c.id;
+                i = 1;
+                continue;
+            }
+            i++;
+        }
+
+        bool match = true;
+        for(uint32_t j=num_cursors; j<plan->num_terms && terms[j].required; j++) {
+            if(!bitmap_test(terms[j].bitmap, id)) {
+                match = false;
+                break;
+            }
+        }
+
+        if(match) {
+            double doc_length = document_length(plan, id, aveD);
+            double score = 0.0;
+            for(uint32_t j=0; j<plan->num_terms; j++) {
+                sil_plan_term_t *t = terms + j;
+                if(t->mode == SIL_PLAN_TERM_DROPPED)
+                    break;
+                if(!t->required || t->mode == SIL_PLAN_TERM_BITMAP) {
+                    if(!t->active)
+                        continue;
+                    if(!t->cursor->c.advance_to((atl_cursor_t *)t->cursor, id)) {
+                        t->active = false;
+                        continue;
+                    }
+                    if(t->cursor->c.id != id)
+                        continue;
+                }
+                score += sil_term_bm25_plus(t->cursor, params, t->idf_qtf, doc_length, aveD);
+            }
+            sil_top_k_push(res, &num, k, id, (float)score);
+            if(stop_early(plan, res, num, k, score))
+                break;
+        }
+
+        if(!lead->c.advance((atl_cursor_t *)lead))
+            break;
+        id = lead->c.id;
+    }
+done:
+    sil_top_k_sort(res, num);
+    return num;
+}
+
+static size_t evaluate_disjunction(sil_query_plan_t *plan, sil_scored_id_t *res, size_t k) {
+    sil_bm25_params_t *params = &plan->options.bm25;
+    double aveD = sil_search_image_average_document_length(plan->img);
+    if(aveD <= 0.0)
+        aveD = 1.0;
+
+    sil_plan_term_t *terms = plan->terms;
+    uint32_t num_terms = 0;
+    while(num_terms < plan->num_terms && terms[num_terms].mode != SIL_PLAN_TERM_DROPPED) {
+        terms[num_terms].active = terms[num_terms].cursor->c.advance((atl_cursor_t *)terms[num_terms].cursor);
+        num_terms++;
+    }
+
+    size_t num = 0;
+    while(true) {
+        uint32_t id = UINT32_MAX;
+        bool any = false;
+        for(uint32_t i=0; i<num_terms; i++) {
+            if(terms[i].active && terms[i].cursor->c.id < id) {
+                id = terms[i].cursor->c.id;
+                any = true;
+            }
+        }
+        if(!any)
+            break;
+
+        double doc_length = document_length(plan, id, aveD);
+        double score = 0.0;
+        for(uint32_t i=0; i<num_terms; i++) {
+            sil_plan_term_t *t = terms + i;
+            if(!t->active || t->cursor->c.id != id)
+                continue;
+            score += sil_term_bm25_plus(t->cursor, params, t->idf_qtf, doc_length, aveD);
+            t->active = t->cursor->c.advance((atl_cursor_t *)t->cursor);
+        }
+        sil_top_k_push(res, &num, k, id, (float)score);
+        if(stop_early(plan, res, num, k, score))
+            break;
+    }
+    sil_top_k_sort(res, num);
+    return num;
+}
+
+static size_t evaluate_term_at_a_time(sil_query_plan_t *plan, sil_scored_id_t *res, size_t k) {
+    sil_term_accumulator_t *acc = sil_term_accumulator_init(plan->img, &plan->options.bm25, 0);
+    for(uint32_t i=0; i<plan->num_terms; i++) {
+        sil_plan_term_t *t = plan->terms + i;
+        if(t->mode != SIL_PLAN_TERM_DROPPED)
+            sil_term_accumulator_add(acc, t->cursor, t->query_term_freq);
+    }
+    size_t num = sil_term_accumulator_top_k(acc, res, k);
+    sil_term_accumulator_destroy(acc);
+    return num;
+}
+
+size_t sil_query_plan_top_k(sil_query_plan_t *plan, sil_scored_id_t *res, size_t k) {
+    if(k == 0)
+        return 0;
+    sil_query_plan_build(plan, k);
+    size_t num = 0;
+    switch(plan->strategy) {
+        case SIL_PLAN_CONJUNCTION:
+            num = evaluate_conjunction(plan, res, k);
+            break;
+        case SIL_PLAN_DISJUNCTION:
+            num = evaluate_disjunction(plan, res, k);
+            break;
+        case SIL_PLAN_TERM_AT_A_TIME:
+            num = evaluate_term_at_a_time(plan, res, k);
+            break;
+        default:
+            break;
+    }
+    // the cursors are spent, let go of the value updates they read
+    for(uint32_t i=0; i<plan->num_terms; i++)
+        sil_search_image_term_release(plan->terms[i].cursor);
+    return num;
+}
+
+const char *sil_plan_strategy_name(sil_plan_strategy_t strategy) {
+    switch(strategy) {
+        case SIL_PLAN_CONJUNCTION:
+            return "conjunction";
+        case SIL_PLAN_DISJUNCTION:
+            return "disjunction";
+        case SIL_PLAN_TERM_AT_A_TIME:
+            return "term_at_a_time";
+        default:
+            return "empty";
+    }
+}
+
+static const char *plan_term_mode_name(sil_plan_term_mode_t mode) {
+    switch(mode) {
+        case SIL_PLAN_TERM_CURSOR:
+            return "cursor";
+        case SIL_PLAN_TERM_BITMAP:
+            return "bitmap";
+        default:
+            return "dropped";
+    }
+}
+
+void sil_query_plan_dump(sil_query_plan_t *plan) {
+    printf("Plan: %s (%u terms)\n", sil_plan_strategy_name(plan->strategy), plan->num_terms);
+    for(uint32_t i=0; i<plan->num_terms; i++) {
+        sil_plan_term_t *t = plan->terms + i;
+        printf("  %u. %s %s %s df: %u, bytes: %zu, qtf: %u, max_score: %f%s\n",
+               i+1, t->term, t->required ? "required" : "optional",
+               plan_term_mode_name(t->mode), t->document_frequency, t->posting_bytes,
+               t->query_term_freq, t->max_score, t->cursor ? "" : " (not found)");
+    }
+    if(plan->options.early_termination)
+        printf("  early termination at %f (best %f, max_score %f)%s\n", plan->stop_score,
+               plan->best_score, plan->max_score,
+               plan->terminated_early ? " (stopped early)" : "");
+}
@@ -6,17 +6,25 @@
 #include "search-index-library/impl/sil_constants.h"
 #include "search-index-library/sil_term.h"
 #include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #include "the-io-library/io_out.h"
 #include "a-memory-library/aml_buffer.h"
+#include "the-macro-library/macro_sort.h"
+#include "the-lz4-library/lz4.h"
 
-static io_out_t *open_sorted(char *filename, io_compare_cb compare, size_t buffer_size) {
+static io_out_t *open_sorted(char *filename, io_compare_cb compare, size_t buffer_size,
+                             io_format_t format) {
   io_out_options_t options;
   io_out_ext_options_t ext_options;
   io_out_options_init(&options);
   io_out_ext_options_init(&ext_options);
 
-  io_out_options_format(&options, io_prefix());
+  io_out_options_format(&options, format);
   io_out_options_buffer_size(&options, buffer_size);
   io_out_ext_options_compare(&ext_options, compare, NULL);
   io_out_ext_options_reducer(&ext_options,
@@ -26,7 +34,14 @@ static io_out_t *open_sorted(char *filename, io_compare_cb compare, size_t buffe
   return io_out_ext_init(filename, &options, &ext_options);
 }
 
+typedef struct {
+    char *term;
+    uint32_t hash;
+    uint32_t term_id;
+} interned_term_t;
+
 struct sil_search_builder_s {
+    sil_search_builder_options_t options;
     char *filename;
     char *base_filename;
     size_t filename_len;
@@ -41,6 +56,40 @@ struct sil_search_builder_s {
     uint32_t document_length;
     size_t total_terms;
     size_t total_documents;
+
+    // interned terms (sil_search_builder_options_intern_terms)
+    interned_term_t *slots;
+    size_t num_slots;
+    size_t num_interned;
+    uint32_t next_term_id;
+    aml_pool_t *term_pool;
+    io_out_t *dictionary;
+    FILE *interned_data;
+    aml_buffer_t *interned_bh;
+
+    // (id, rank) pairs (sil_search_builder_static_rank)
+    aml_buffer_t *static_ranks;
+
+    // the values of the columns follow each global record, at column_offsets in a row
+    uint32_t column_offsets[SIL_MAX_COLUMNS];
+    uint32_t row_width;
+
+    // thread builders (sil_search_builder_thread_init)
+    sil_search_builder_t *parent;
+    pthread_mutex_t mutex;
+    uint32_t num_thread_builders;
+    uint32_t num_open_thread_builders;  // not destroyed yet
+    aml_buffer_t *thread_builders;  // finished thread builders
+
+    // progress as of the last checkpoint (sil_search_builder_options_checkpoints)
+    sil_checkpoint_t checkpoint;
+    char *last_term;                // the last term written before a resumed destroy
+
+    // what the build spent (sil_search_builder_options_stats)
+    sil_search_builder_stats_t stats;
+    size_t buffered[2];             // bytes in the sort buffers of the postings and globals
+    double phase_wall;              // when the current phase began
+    double phase_cpu;
 };
 
 struct term_data_s;
@@ -65,6 +114,39 @@ static int compare_term_data(const io_record_t *r1, const io_record_t *r2, void
     return 0;
 }
 
+/* With interned terms, postings are spilled as fixed records and only sorted once the
+   term ids have been remapped to the sorted order of the terms. */
+typedef struct {
+    uint32_t term;
+    term_data_t data;
+} interned_term_data_t;
+
+static inline int compare_interned(const interned_term_data_t *a, const interned_term_data_t *b) {
+    if(a->term != b->term)
+        return (a->term < b->term) ? -1 : 1;
+    if(a->data.id != b->data.id)
+        return (a->data.id < b->data.id) ? -1 : 1;
+    if(a->data.position != b->data.position)
+        return (a->data.position < b->data.position) ? -1 : 1;
+    return 0;
+}
+
+static int compare_interned_term_data(const io_record_t *r1, const io_record_t *r2, void *arg) {
+    return compare_interned((interned_term_data_t *)r1->record, (interned_term_data_t *)r2->record);
+}
+
+// dictionary records are the term id followed by the term
+static int compare_dictionary(const io_record_t *r1, const io_record_t *r2, void *arg) {
+    int n=strcmp(r1->record+sizeof(uint32_t), r2->record+sizeof(uint32_t));
+    if(n)
+        return n;
+    uint32_t a = (*(uint32_t *)r1->record);
+    uint32_t b = (*(uint32_t *)r2->record);
+    if(a != b)
+        return (a < b) ? -1 : 1;
+    return 0;
+}
+
 static int compare_global_data(const io_record_t *r1, const io_record_t *r2, void *arg) {
     sil_global_header_t *ap = (sil_global_header_t *)r1->record;
     sil_global_header_t *bp = (sil_global_header_t *)r2->record;
@@ -75,21 +157,164 @@ static int compare_global_data(const io_record_t *r1, const io_record_t *r2, voi
     return 0;
 }
 
+void sil_search_builder_options_init(sil_search_builder_options_t *options) {
+    memset(options, 0, sizeof(*options));
+    options->buffer_size = 1024*1024*100;
+}
+
+void sil_search_builder_options_buffer_size(sil_search_builder_options_t *options, size_t buffer_size) {
+    options->buffer_size = buffer_size;
+}
+
+void sil_search_builder_options_value_summaries(sil_search_builder_options_t *options) {
+    options->value_summaries = true;
+}
+
+void sil_search_builder_options_group_counts(sil_search_builder_options_t *options) {
+    options->group_counts = true;
+}
+
+void sil_search_builder_options_intern_terms(sil_search_builder_options_t *options, size_t max_terms) {
+    options->intern_terms = true;
+    options->max_interned_terms = max_terms ? max_terms : 1024*1024;
+}
+
+void sil_search_builder_options_radix_sort(sil_search_builder_options_t *options) {
+    if(!options->intern_terms)
+        sil_search_builder_options_intern_terms(options, 0);
+    options->radix_sort = true;
+}
+
+void sil_search_builder_options_encoder_threads(sil_search_builder_options_t *options, uint32_t num_threads) {
+    options->encoder_threads = num_threads;
+}
+
+void sil_search_builder_options_reorder_ids(sil_search_builder_options_t *options) {
+    options->reorder_ids = true;
+}
+
+void sil_search_builder_options_static_rank_order(sil_search_builder_options_t *options) {
+    options->static_rank_order = true;
+}
+
+bool sil_search_builder_options_column(sil_search_builder_options_t *options, const char *name,
+                                       sil_column_type_t type) {
+    if(options->num_columns == SIL_MAX_COLUMNS || strlen(name) >= SIL_COLUMN_NAME_SIZE ||
+       !sil_column_width(type))
+        return false;
+    for(uint32_t i=0; i<options->num_columns; i++)
+        if(!strcmp(options->columns[i].name, name))
+            return false;
+    sil_column_t *c = options->columns + options->num_columns;
+    memset(c, 0, sizeof(*c));
+    strcpy(c->name, name);
+    c->type = type;
+    options->num_columns++;
+    return true;
+}
+
+void sil_search_builder_options_checkpoints(sil_search_builder_options_t *options) {
+    options->checkpoints = true;
+}
+
+void sil_search_builder_options_stats(sil_search_builder_options_t *options,
+                                      sil_search_builder_stats_t *stats, bool json) {
+    options->collect_stats = true;
+    options->stats = stats;
+    options->stats_json = json;
+}
+
+void sil_search_builder_options_content_blocks(sil_search_builder_options_t *options, uint32_t block_size) {
+    options->content_block_size = block_size ? block_size : SIL_DEFAULT_CONTENT_BLOCK_SIZE;
+}
+
+static inline double clock_seconds(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/* Add the time since the current phase began to phase and begin the next one.  The
+   merging done meanwhile (the merge phase grew from merged) is left out of phase. */
+static void end_phase(sil_search_builder_t *h, sil_search_builder_phase_t *phase,
+                      const sil_search_builder_phase_t *merged) {
+    if(!h->options.collect_stats)
+        return;
+    double wall = clock_seconds(CLOCK_MONOTONIC);
+    double cpu = clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+    double wall_seconds = wall - h->phase_wall;
+    double cpu_seconds = cpu - h->phase_cpu;
+    if(merged) {
+        wall_seconds -= h->stats.merge.wall_seconds - merged->wall_seconds;
+        cpu_seconds -= h->stats.merge.cpu_seconds - merged->cpu_seconds;
+    }
+    phase->wall_seconds += wall_seconds > 0 ? wall_seconds : 0;
+    phase->cpu_seconds += cpu_seconds > 0 ? cpu_seconds : 0;
+    h->phase_wall = wall;
+    h->phase_cpu = cpu;
+}
+
+/* A record of length bytes given to a sorted stream (0 for postings, 1 for globals) whose
+   sort buffer is spilled as a run each time it fills. */
+static inline void count_sorted(sil_search_builder_t *h, uint32_t stream, size_t length) {
+    size_t buffer_size = stream ? h->buffer_size/10 : h->buffer_size;
+    h->stats.sorted_bytes += length;
+    h->buffered[stream] += length;
+    if(h->buffered[stream] >= buffer_size) {
+        h->stats.runs_spilled++;
+        h->stats.spilled_bytes += h->buffered[stream];
+        h->buffered[stream] = 0;
+    }
+}
+
 sil_search_builder_t *sil_search_builder_init(const char *filename, size_t buffer_size) {
+    sil_search_builder_options_t options;
+    sil_search_builder_options_init(&options);
+    sil_search_builder_options_buffer_size(&options, buffer_size);
+    return sil_search_builder_ext_init(filename, &options);
+}
+
+sil_search_builder_t *sil_search_builder_ext_init(const char *filename,
+                                                  const sil_search_builder_options_t *options) {
+    size_t buffer_size = options->buffer_size;
     sil_search_builder_t *h = (sil_search_builder_t *)aml_zalloc(sizeof(*h) + (strlen(filename)*2) + 50);
+    h->options = *options;
     h->base_filename = (char *)(h+1);
     strcpy(h->base_filename, filename);
     h->filename_len = strlen(filename);
     h->filename = h->base_filename + h->filename_len + 1;
 
-    snprintf(h->filename, h->filename_len+40, "%s_data", filename );
-    h->term_data = open_sorted(h->filename, compare_term_data, buffer_size);
+    if(options->intern_terms) {
+        snprintf(h->filename, h->filename_len+40, "%s_interned_data", filename );
+        h->interned_data = fopen(h->filename, "wb");
+        h->interned_bh = aml_buffer_init(1024*1024);
+        snprintf(h->filename, h->filename_len+40, "%s_dictionary", filename );
+        h->dictionary = open_sorted(h->filename, compare_dictionary, buffer_size/10, io_prefix());
+        h->num_slots = 1024;
+        h->slots = (interned_term_t *)aml_zalloc(sizeof(interned_term_t) * h->num_slots);
+        h->term_pool = aml_pool_init(1024*1024);
+    }
+    else {
+        snprintf(h->filename, h->filename_len+40, "%s_data", filename );
+        h->term_data = open_sorted(h->filename, compare_term_data, buffer_size, io_prefix());
+    }
     snprintf(h->filename, h->filename_len+40, "%s_gbl", filename );
-    h->global_data = open_sorted(h->filename, compare_global_data, buffer_size/10);
+    h->global_data = open_sorted(h->filename, compare_global_data, buffer_size/10, io_prefix());
     h->global_bh = aml_buffer_init(256);
     h->buffer_size = buffer_size;
     h->bh = aml_buffer_init(256);
     h->tmp_pool = aml_pool_init(1024);
+    h->static_ranks = aml_buffer_init(options->static_rank_order ? 1024 : 16);
+    for(uint32_t i=0; i<options->num_columns; i++) {
+        h->column_offsets[i] = h->row_width;
+        h->row_width += sil_column_width(options->columns[i].type);
+    }
+    h->thread_builders = aml_buffer_init(sizeof(sil_search_builder_t *) * 16);
+    pthread_mutex_init(&h->mutex, NULL);
+    if(options->collect_stats) {
+        h->phase_wall = clock_seconds(CLOCK_MONOTONIC);
+        h->phase_cpu = clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+    }
     return h;
 }
 
@@ -100,6 +325,7 @@ static inline void _finish_document(sil_search_builder_t *h) {
         h->total_documents++;
         h->total_terms += h->document_length;
         io_out_write_record(h->global_data, aml_buffer_data(h->global_bh), aml_buffer_length(h->global_bh));
+        count_sorted(h, 1, aml_buffer_length(h->global_bh));
     }
 }
 
@@ -121,6 +347,8 @@ void sil_search_builder_global(sil_search_builder_t *h,
     aml_buffer_append(h->global_bh, embeddings, num_embeddings*512);
     aml_buffer_append(h->global_bh, &content_length, sizeof(content_length));
     aml_buffer_append(h->global_bh, content, content_length);
+    static const uint64_t zeros[SIL_MAX_COLUMNS] = { 0 };
+    aml_buffer_append(h->global_bh, zeros, h->row_width);
 
     uint32_t id = (*(uint32_t *)d);
     if(id > h->max_id)
@@ -129,7 +357,122 @@ void sil_search_builder_global(sil_search_builder_t *h,
     h->document_length = 0;
 }
 
+void sil_search_builder_static_rank(sil_search_builder_t *h, uint32_t rank) {
+    uint32_t pair[2] = { h->current_id, rank };
+    aml_buffer_append(h->static_ranks, pair, sizeof(pair));
+}
+
+// write value as a column of type at p
+static inline void column_store(void *p, sil_column_type_t type, uint64_t value, double float_value) {
+    switch(type) {
+    case SIL_COLUMN_U8: { uint8_t v = value; memcpy(p, &v, sizeof(v)); break; }
+    case SIL_COLUMN_U16: { uint16_t v = value; memcpy(p, &v, sizeof(v)); break; }
+    case SIL_COLUMN_U32: { uint32_t v = value; memcpy(p, &v, sizeof(v)); break; }
+    case SIL_COLUMN_U64: memcpy(p, &value, sizeof(value)); break;
+    case SIL_COLUMN_FLOAT: { float v = float_value; memcpy(p, &v, sizeof(v)); break; }
+    }
+}
+
+static inline void *column_in_row(sil_search_builder_t *h, uint32_t column) {
+    if(column >= h->options.num_columns || !aml_buffer_length(h->global_bh))
+        return NULL;
+    return aml_buffer_end(h->global_bh) - h->row_width + h->column_offsets[column];
+}
+
+void sil_search_builder_column(sil_search_builder_t *h, uint32_t column, uint64_t value) {
+    void *p = column_in_row(h, column);
+    if(p)
+        column_store(p, h->options.columns[column].type, value, (double)value);
+}
+
+void sil_search_builder_column_float(sil_search_builder_t *h, uint32_t column, float value) {
+    void *p = column_in_row(h, column);
+    if(p)
+        column_store(p, h->options.columns[column].type, value < 0 ? 0 : (uint64_t)value, value);
+}
+
+static inline uint32_t hash_term(const char *term) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for(const unsigned char *p = (const unsigned char *)term; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void grow_slots(sil_search_builder_t *h) {
+    size_t num_slots = h->num_slots << 1;
+    interned_term_t *slots = (interned_term_t *)aml_zalloc(sizeof(interned_term_t) * num_slots);
+    for(size_t i=0; i<h->num_slots; i++) {
+        if(!h->slots[i].term)
+            continue;
+        size_t j = h->slots[i].hash & (num_slots-1);
+        while(slots[j].term)
+            j = (j+1) & (num_slots-1);
+        slots[j] = h->slots[i];
+    }
+    aml_free(h->slots);
+    h->slots = slots;
+    h->num_slots = num_slots;
+}
+
+/* Each distinct term gets an id and is written to the dictionary once.  When the dictionary
+   is full it is cleared and terms seen again get new ids, the ids of a term are merged when
+   the dictionary is sorted. */
+static uint32_t intern_term(sil_search_builder_t *h, const char *term) {
+    uint32_t hash = hash_term(term);
+    size_t i = hash & (h->num_slots-1);
+    while(h->slots[i].term) {
+        if(h->slots[i].hash == hash && !strcmp(h->slots[i].term, term))
+            return h->slots[i].term_id;
+        i = (i+1) & (h->num_slots-1);
+    }
+
+    if(h->num_interned >= h->options.max_interned_terms) {
+        memset(h->slots, 0, sizeof(interned_term_t) * h->num_slots);
+        aml_pool_clear(h->term_pool);
+        h->num_interned = 0;
+        i = hash & (h->num_slots-1);
+    }
+    else if((h->num_interned+1) * 2 > h->num_slots) {
+        grow_slots(h);
+        i = hash & (h->num_slots-1);
+        while(h->slots[i].term)
+            i = (i+1) & (h->num_slots-1);
+    }
+
+    interned_term_t *it = h->slots + i;
+    it->term = aml_pool_strdup(h->term_pool, term);
+    it->hash = hash;
+    it->term_id = h->next_term_id++;
+    h->num_interned++;
+
+    aml_buffer_set(h->bh, &it->term_id, sizeof(it->term_id));
+    aml_buffer_append(h->bh, term, strlen(term)+1);
+    io_out_write_record(h->dictionary, aml_buffer_data(h->bh), aml_buffer_length(h->bh));
+    count_sorted(h, 1, aml_buffer_length(h->bh));
+    return it->term_id;
+}
+
+static void append_interned_term(sil_search_builder_t *h, uint32_t term_id, uint32_t value, uint32_t pos ) {
+    interned_term_data_t t;
+    t.term = term_id;
+    t.data.id = h->current_id;
+    t.data.position = pos;
+    t.data.value = value;
+    aml_buffer_append(h->interned_bh, &t, sizeof(t));
+    if(aml_buffer_length(h->interned_bh) >= 1024*1024) {
+        fwrite(aml_buffer_data(h->interned_bh), aml_buffer_length(h->interned_bh), 1, h->interned_data);
+        h->stats.spilled_bytes += aml_buffer_length(h->interned_bh);
+        aml_buffer_clear(h->interned_bh);
+    }
+}
+
 static void _sil_search_builder_term(sil_search_builder_t *h, uint32_t value, uint32_t pos, const char *term ) {
+    if(h->options.intern_terms) {
+        append_interned_term(h, intern_term(h, term), value, pos);
+        return;
+    }
     term_data_t t;
     t.id = h->current_id;
     t.position = pos;
@@ -138,6 +481,7 @@ static void _sil_search_builder_term(sil_search_builder_t *h, uint32_t value, ui
     aml_buffer_append(h->bh, term, strlen(term)+1);
     // printf( "%s %u %u %u bh len(%zu)\n", term, id, value, pos, aml_buffer_length(h->bh) );
     io_out_write_record(h->term_data, aml_buffer_data(h->bh), aml_buffer_length(h->bh));
+    count_sorted(h, 0, aml_buffer_length(h->bh));
 }
 
 void sil_search_builder_term(sil_search_builder_t *h, const char *term ) {
@@ -269,6 +613,53 @@ void sil_search_builder_wtermf_value(sil_search_builder_t *h, uint32_t value, si
     sil_search_builder_wterm_value(h, value, sp, r);
 }
 
+static inline void spill_posting(sil_search_builder_t *h, uint32_t term_id, uint32_t value, uint32_t pos,
+                                 const char *term) {
+    if(h->options.intern_terms)
+        append_interned_term(h, term_id, value, pos);
+    else
+        _sil_search_builder_term(h, value, pos, term);
+}
+
+/* The terms of a document blob are sorted and unique, each followed by one posting encoded
+   the way the image encodes a posting after its sid.  The value and positions are decoded
+   straight from those bytes instead of replaying the term calls. */
+void sil_search_builder_add_document(sil_search_builder_t *h, const sil_document_image_t *img) {
+    sil_search_builder_global(h, img->embeddings, img->header.num_embeddings,
+                              img->content, img->header.content_length,
+                              img->data, img->header.data_length);
+    h->document_length = img->header.document_length_for_bm25;
+
+    uint8_t *p = (uint8_t *)img->terms;
+    uint8_t *ep = (uint8_t *)img->content;
+    sil_term_ext_t t;
+    while(p < ep) {
+        const char *term = (const char *)p;
+        p += strlen(term) + 1;
+        uint32_t term_id = h->options.intern_terms ? intern_term(h, term) : 0;
+        uint8_t control = *p;
+        t.p = p;
+        t.wp = NULL;
+        t.pub.value = 0;
+        advance_document_id(&t);
+        if(control & SMALL_GROUP_POS_MASK) {
+            if(control & SMALL_GROUP_VALUE_PRESENT_MASK)
+                spill_posting(h, term_id, t.pub.value, 0, term);
+            uint32_t pos = t.first_base;
+            uint8_t *wp = t.wp;
+            while(wp < t.p) {
+                uint32_t delta;
+                wp = __decode_high_bit32(&delta, wp);
+                pos += delta;
+                spill_posting(h, term_id, 0, pos, term);
+            }
+        }
+        else
+            spill_posting(h, term_id, t.pub.value, 0, term);
+        p = t.p;
+    }
+}
+
 static void encode_high_bit(aml_buffer_t *bh, uint32_t value) {
     do {
         uint8_t byte = value & 0x7F;  // Extract the lowest 7 bits
@@ -280,24 +671,29 @@ static void encode_high_bit(aml_buffer_t *bh, uint32_t value) {
     } while (value != 0);
 }
 
-static void encode_single_value(aml_buffer_t *bh, uint16_t sid, uint32_t value) {
+// returns which of the widths of sil_search_builder_histograms_t.value_widths was used
+static uint32_t encode_single_value(aml_buffer_t *bh, uint16_t sid, uint32_t value) {
     if(value < SMALL_GROUP_1BYTE_VALUE) {
         sid |= value;
         aml_buffer_append(bh, &sid, sizeof(sid));
+        return 0;
     } else if(value < 256) {
         sid |= SMALL_GROUP_1BYTE_VALUE;
         uint8_t v = value;
         aml_buffer_append(bh, &sid, sizeof(sid));
         aml_buffer_append(bh, &v, sizeof(v));
+        return 1;
     } else if(value < 65536) {
         sid |= SMALL_GROUP_2BYTE_VALUE;
         uint16_t v = value;
         aml_buffer_append(bh, &sid, sizeof(sid));
         aml_buffer_append(bh, &v, sizeof(v));
+        return 2;
     } else {
         sid |= SMALL_GROUP_4BYTE_VALUE;
         aml_buffer_append(bh, &sid, sizeof(sid));
         aml_buffer_append(bh, &value, sizeof(value));
+        return 3;
     }
 }
 
@@ -320,7 +716,8 @@ static uint32_t encode_position_value(uint8_t *p, uint32_t value) {
     }
 }
 
-static uint32_t encode_term_positions(aml_buffer_t *bh, term_data_t *p, term_data_t *ep) {
+static uint32_t encode_term_positions(aml_buffer_t *bh, term_data_t *p, term_data_t *ep,
+                                      sil_search_builder_histograms_t *hist) {
     // extract bits 8-9 from p->position
     uint32_t first_base = p->position & FIRST_POSITION_BASE;
     uint32_t last_pos = first_base;
@@ -330,241 +727,2531 @@ static uint32_t encode_term_positions(aml_buffer_t *bh, term_data_t *p, term_dat
         last_pos = pos;
         size_t len = aml_buffer_length(bh);
         encode_high_bit(bh, delta);
-        // printf( "encoded %u (%u) in %zu byte(s)\n", delta, pos, aml_buffer_length(bh) - len );
+        if(hist)
+            hist->position_delta_widths[aml_buffer_length(bh) - len - 1]++;
         p++;
     }
     return first_base;
 }
 
-static uint32_t compress_single_id(uint16_t sid,
-                                   term_data_t *cur, term_data_t *p,
-                                   aml_buffer_t *group_bh,
-                                   aml_buffer_t *tmp_bh) {
-    uint32_t num_positions = 0;
-    if(p-cur == 1 && cur->position == 0) { // no term positions
-        encode_single_value(group_bh, sid, cur->value);
-    } else {
-        aml_buffer_clear(tmp_bh);
-        term_data_t *p2 = cur;
-        uint8_t value_data[8];
-        uint32_t value_data_length = 0;
+// the value of a posting is carried by its first record when that record has no position
+static void encode_value_summary(aml_buffer_t *bh, term_data_t *p, term_data_t *ep) {
+    uint32_t min_value = UINT32_MAX, max_value = 0;
+    while(p < ep) {
+        term_data_t *cur = p;
+        uint32_t id = cur->id;
+        p++;
+        while(p < ep && p->id == id)
+            p++;
+        uint32_t value = cur->position == 0 ? cur->value : 0;
+        if(value < min_value)
+            min_value = value;
+        if(value > max_value)
+            max_value = value;
+    }
+    encode_high_bit(bh, min_value);
+    encode_high_bit(bh, max_value - min_value);
+}
 
-        if(p2->position == 0 && p2->value != 0) {
-            sid |= SMALL_GROUP_VALUE_PRESENT_MASK;
-            value_data_length = encode_position_value(value_data, p2->value);
-            p2++;
+// SIL_IMAGE_* flags describing the optional group data written with these options
+static uint32_t image_flags(const sil_search_builder_options_t *options) {
+    uint32_t flags = SIL_IMAGE_FORMAT_V2;
+    if(options->value_summaries)
+        flags |= SIL_IMAGE_VALUE_SUMMARIES;
+    if(options->group_counts)
+        flags |= SIL_IMAGE_GROUP_COUNTS;
+    if(options->content_block_size)
+        flags |= SIL_IMAGE_CONTENT_BLOCKS;
+    return flags;
+}
+
+/* Content records are written to _content as they are, or with content_block_size cut
+   into blocks which are compressed with LZ4 and indexed by _content_blocks. */
+typedef struct {
+    FILE *out;
+    uint32_t block_size;
+    char *block;
+    uint32_t block_length;
+    char *compressed;
+    int compressed_size;
+    uint64_t offset;        // bytes written to out
+    aml_buffer_t *offsets;  // of each block in out
+} content_writer_t;
+
+static void content_writer_init(content_writer_t *w, FILE *out,
+                                const sil_search_builder_options_t *options) {
+    memset(w, 0, sizeof(*w));
+    w->out = out;
+    w->block_size = options->content_block_size;
+    if(!w->block_size)
+        return;
+    w->block = (char *)aml_malloc(w->block_size);
+    w->compressed_size = LZ4_compressBound(w->block_size);
+    w->compressed = (char *)aml_malloc(w->compressed_size);
+    w->offsets = aml_buffer_init(1024);
+}
+
+static void content_writer_flush(content_writer_t *w) {
+    if(!w->block_length)
+        return;
+    int n = LZ4_compress_default(w->block, w->compressed, w->block_length, w->compressed_size);
+    aml_buffer_append(w->offsets, &w->offset, sizeof(w->offset));
+    fwrite(w->compressed, n, 1, w->out);
+    w->offset += n;
+    w->block_length = 0;
+}
+
+static void content_writer_write(content_writer_t *w, const void *d, size_t len) {
+    if(!w->block_size) {
+        fwrite(d, len, 1, w->out);
+        w->offset += len;
+        return;
+    }
+    const char *p = (const char *)d;
+    while(len) {
+        size_t n = w->block_size - w->block_length;
+        if(n > len)
+            n = len;
+        memcpy(w->block + w->block_length, p, n);
+        w->block_length += n;
+        p += n;
+        len -= n;
+        if(w->block_length == w->block_size)
+            content_writer_flush(w);
+    }
+}
+
+/* Write the last block and the block index of the image filename (or remove a stale
+   one).  Returns the bytes written to the index. */
+static size_t content_writer_finish(content_writer_t *w, const char *filename) {
+    size_t len = strlen(filename) + 20;
+    char *name = (char *)aml_malloc(len);
+    snprintf(name, len, "%s_content_blocks", filename);
+    size_t written = 0;
+    if(!w->block_size)
+        remove(name);
+    else {
+        content_writer_flush(w);
+        aml_buffer_append(w->offsets, &w->offset, sizeof(w->offset));
+        sil_content_blocks_header_t header;
+        header.block_size = w->block_size;
+        header.num_blocks = aml_buffer_length(w->offsets) / sizeof(uint64_t) - 1;
+        FILE *out = fopen(name, "wb");
+        if(out) {
+            fwrite(&header, sizeof(header), 1, out);
+            fwrite(aml_buffer_data(w->offsets), aml_buffer_length(w->offsets), 1, out);
+            fclose(out);
+            written = sizeof(header) + aml_buffer_length(w->offsets);
         }
-        num_positions = p-p2;
-
-        // term positions should be delta encoded and then use high bit to indicate byte overflow
-        uint32_t first_base = encode_term_positions(tmp_bh, p2, p);
-        uint32_t len = aml_buffer_length(tmp_bh) - 1; // must always be at least one byte
-        sid |= SMALL_GROUP_POS_MASK;
-        sid |= (first_base >> 7);
-        if(len < 0x3) {
-            sid |= (len << 2);
-            aml_buffer_append(group_bh, &sid, sizeof(sid));
-            if(value_data_length)
-                aml_buffer_append(group_bh, value_data, value_data_length);
-        } else {
-            sid |= SMALL_GROUP_EXTENDED_POS_LENGTH;
-            aml_buffer_append(group_bh, &sid, sizeof(sid));
-            if(value_data_length)
-                aml_buffer_append(group_bh, value_data, value_data_length);
-            encode_high_bit(group_bh, len);
-        }
-        aml_buffer_append(group_bh, aml_buffer_data(tmp_bh), aml_buffer_length(tmp_bh));
+        aml_buffer_destroy(w->offsets);
+        aml_free(w->compressed);
+        aml_free(w->block);
     }
-    return num_positions;
+    aml_free(name);
+    return written;
 }
 
-static uint32_t compress_small_group_data_into_group(uint32_t *document_frequency,
-                                                     aml_buffer_t *group_bh,
-                                                     aml_buffer_t *tmp_bh,
-                                                     term_data_t *p, term_data_t *ep) {
-    uint32_t id;
-    uint32_t max_positions = 0;
-    aml_buffer_clear(group_bh);
+/* Column values are collected by column and written to _columns once every document is
+   known. */
+typedef struct {
+    uint32_t num_columns;
+    const sil_column_t *columns;
+    aml_buffer_t *values[SIL_MAX_COLUMNS];
+    uint32_t num_documents;
+    // the columns of the image each document is copied from (column_writer_copy)
+    sil_search_image_t *img;
+    const void *source[SIL_MAX_COLUMNS];
+    sil_column_type_t source_type[SIL_MAX_COLUMNS];
+} column_writer_t;
+
+static void column_writer_init(column_writer_t *w, const sil_column_t *columns, uint32_t num_columns) {
+    memset(w, 0, sizeof(*w));
+    w->columns = columns;
+    w->num_columns = num_columns;
+    for(uint32_t i=0; i<num_columns; i++)
+        w->values[i] = aml_buffer_init(1024);
+}
+
+// a row of values as the builder keeps them after each global record
+static void column_writer_row(column_writer_t *w, const char *row) {
+    for(uint32_t i=0; i<w->num_columns; i++) {
+        uint32_t width = sil_column_width(w->columns[i].type);
+        aml_buffer_append(w->values[i], row, width);
+        row += width;
+    }
+    w->num_documents++;
+}
+
+// the values of the document at index of img, by column name (0 if img lacks the column)
+static void column_writer_copy(column_writer_t *w, sil_search_image_t *img, uint32_t index) {
+    if(w->img != img) {
+        w->img = img;
+        for(uint32_t i=0; i<w->num_columns; i++)
+            w->source[i] = sil_search_image_column(img, w->columns[i].name, w->source_type+i);
+    }
+    for(uint32_t i=0; i<w->num_columns; i++) {
+        sil_column_type_t type = w->columns[i].type;
+        uint64_t value = 0;
+        if(w->source[i] && w->source_type[i] == type)
+            memcpy(&value, (const char *)w->source[i] + (size_t)index * sil_column_width(type),
+                   sil_column_width(type));
+        else if(w->source[i])
+            column_store(&value, type, sil_column_value(w->source[i], w->source_type[i], index),
+                         sil_column_double(w->source[i], w->source_type[i], index));
+        aml_buffer_append(w->values[i], &value, sil_column_width(type));
+    }
+    w->num_documents++;
+}
+
+/* Write _columns for the image filename (or remove a stale one).  Returns the bytes
+   written. */
+static size_t column_writer_finish(column_writer_t *w, const char *filename) {
+    size_t len = strlen(filename) + 20;
+    char *name = (char *)aml_malloc(len);
+    snprintf(name, len, "%s_columns", filename);
+    size_t written = 0;
+    FILE *out = w->num_columns ? fopen(name, "wb") : NULL;
+    if(!out)
+        remove(name);
+    else {
+        sil_columns_header_t header;
+        header.num_columns = w->num_columns;
+        header.num_documents = w->num_documents;
+        fwrite(&header, sizeof(header), 1, out);
+        written = sizeof(header) + sizeof(sil_column_header_t) * w->num_columns;
+        for(uint32_t i=0; i<w->num_columns; i++) {
+            sil_column_header_t ch;
+            memset(&ch, 0, sizeof(ch));
+            strcpy(ch.name, w->columns[i].name);
+            ch.type = w->columns[i].type;
+            ch.width = sil_column_width(w->columns[i].type);
+            written = (written + 63) & ~(size_t)63;
+            ch.offset = written;
+            written += aml_buffer_length(w->values[i]);
+            fwrite(&ch, sizeof(ch), 1, out);
+        }
+        for(uint32_t i=0; i<w->num_columns; i++) {
+            static const char zeros[64] = { 0 };
+            long pos = ftell(out);
+            fwrite(zeros, ((pos + 63) & ~63L) - pos, 1, out);
+            fwrite(aml_buffer_data(w->values[i]), aml_buffer_length(w->values[i]), 1, out);
+        }
+        fclose(out);
+    }
+    for(uint32_t i=0; i<w->num_columns; i++)
+        aml_buffer_destroy(w->values[i]);
+    aml_free(name);
+    return written;
+}
+
+/* The columns a merge or renumber writes: those declared in options, or the columns of img
+   when none are. */
+static const sil_column_t *output_columns(const sil_search_builder_options_t *options,
+                                          sil_search_image_t *img, uint32_t *num_columns) {
+    if(options->num_columns || !img) {
+        *num_columns = options->num_columns;
+        return options->columns;
+    }
+    *num_columns = sil_search_image_num_columns(img);
+    return sil_search_image_columns(img);
+}
+
+// the number of distinct ids in a group
+static void encode_group_count(aml_buffer_t *bh, term_data_t *p, term_data_t *ep) {
+    uint32_t count = 0;
     while(p < ep) {
-        term_data_t *cur = p;
+        uint32_t id = p->id;
         p++;
-        id = cur->id & SMALL_GROUP_MASK;
-        while(p < ep && id == (p->id & SMALL_GROUP_MASK))
+        while(p < ep && p->id == id)
             p++;
-        uint16_t sid = id << SMALL_GROUP_SHIFT;
-        *document_frequency += 1;
-        uint32_t num_positions=compress_single_id(sid, cur, p, group_bh, tmp_bh);
-        if(num_positions > max_positions)
-            max_positions = num_positions;
+        count++;
+    }
+    encode_high_bit(bh, count);
+}
+
+// write the high bit encoding of value ahead of the bytes from offset on
+static void insert_high_bit(aml_buffer_t *bh, size_t offset, uint32_t value) {
+    uint8_t bytes[5];
+    size_t n = 0;
+    do {
+        bytes[n] = value & 0x7F;
+        value >>= 7;
+        if(value != 0)
+            bytes[n] |= 0x80;
+        n++;
+    } while(value != 0);
+    size_t tail = aml_buffer_length(bh) - offset;
+    aml_buffer_alloc(bh, n);
+    char *d = aml_buffer_data(bh) + offset;
+    memmove(d + n, d, tail);
+    memcpy(d, bytes, n);
+}
+
+// bucket 0 holds zeros and bucket b the values from 2^(b-1) to 2^b - 1
+static inline uint32_t histogram_bucket(uint64_t value) {
+    uint32_t b = 0;
+    while(value) {
+        b++;
+        value >>= 1;
+    }
+    return b < SIL_HISTOGRAM_BUCKETS ? b : SIL_HISTOGRAM_BUCKETS-1;
+}
+
+/* The positions are encoded right after the sid.  Their length is patched into the sid
+   once known or, when it does not fit, inserted ahead of them.  hist (if not NULL) counts
+   the encoding chosen. */
+static uint32_t encode_single_id(aml_buffer_t *bh, uint16_t sid, term_data_t *cur, term_data_t *p,
+                                 sil_search_builder_histograms_t *hist) {
+    if(p-cur == 1 && cur->position == 0) { // no term positions
+        size_t start = aml_buffer_length(bh);
+        uint32_t width = encode_single_value(bh, sid, cur->value);
+        if(hist) {
+            hist->value_widths[width]++;
+            hist->bytes_per_posting[histogram_bucket(aml_buffer_length(bh) - start)]++;
+        }
+        return 0;
+    }
+    term_data_t *p2 = cur;
+    uint8_t value_data[8];
+    uint32_t value_data_length = 0;
+
+    if(p2->position == 0 && p2->value != 0) {
+        sid |= SMALL_GROUP_VALUE_PRESENT_MASK;
+        value_data_length = encode_position_value(value_data, p2->value);
+        p2++;
     }
-    return max_positions;
+    uint32_t num_positions = p-p2;
+
+    size_t sid_offset = aml_buffer_length(bh);
+    aml_buffer_append(bh, &sid, sizeof(sid));
+    if(value_data_length)
+        aml_buffer_append(bh, value_data, value_data_length);
+    size_t positions_offset = aml_buffer_length(bh);
+
+    // term positions should be delta encoded and then use high bit to indicate byte overflow
+    uint32_t first_base = encode_term_positions(bh, p2, p, hist);
+    uint32_t len = aml_buffer_length(bh) - positions_offset - 1; // must always be at least one byte
+    sid |= SMALL_GROUP_POS_MASK;
+    sid |= (first_base >> 7);
+    if(len < 0x3)
+        sid |= (len << 2);
+    else {
+        sid |= SMALL_GROUP_EXTENDED_POS_LENGTH;
+        insert_high_bit(bh, positions_offset, len);
+        if(hist)
+            hist->extended_position_lengths++;
+    }
+    memcpy(aml_buffer_data(bh) + sid_offset, &sid, sizeof(sid));
+    if(hist) {
+        if(value_data_length)
+            hist->position_value_widths[value_data_length >> 1]++;
+        hist->bytes_per_posting[histogram_bucket(aml_buffer_length(bh) - sid_offset)]++;
+    }
+    return num_positions;
+}
+
+// the group header is written with a one byte length which is patched by end_group
+static size_t begin_group(aml_buffer_t *bh, uint8_t gid) {
+    uint8_t header[2] = { gid, 0 };
+    aml_buffer_append(bh, header, sizeof(header));
+    return aml_buffer_length(bh);
 }
 
-static void encode_group_to_buffer(aml_buffer_t *bh, uint8_t gid, aml_buffer_t *group_bh) {
-    uint32_t len = aml_buffer_length(group_bh);
+// the top level group id is bits 18-31 of the id (two bytes with SIL_IMAGE_FORMAT_V2)
+static size_t begin_top_group(aml_buffer_t *bh, uint32_t id, uint32_t flags) {
+    if(!(flags & SIL_IMAGE_FORMAT_V2))
+        return begin_group(bh, (id & TOP_GROUP_MASK) >> 18);
+    uint16_t gid = (id & TOP_GROUP_MASK) >> 18;
     aml_buffer_append(bh, &gid, sizeof(gid));
+    uint8_t length = 0;
+    aml_buffer_append(bh, &length, sizeof(length));
+    return aml_buffer_length(bh);
+}
+
+static void end_group(aml_buffer_t *bh, size_t start) {
+    uint32_t len = aml_buffer_length(bh) - start;
     if(len < GROUP_2BYTE_LENGTH) {
-        uint8_t value = len;
-        aml_buffer_append(bh, &value, sizeof(value));
-    } else if(len < 65536) {
-        uint8_t value = GROUP_2BYTE_LENGTH;
-        aml_buffer_append(bh, &value, sizeof(value));
+        aml_buffer_data(bh)[start-1] = len;
+        return;
+    }
+    // the rare long group makes room for a wider length
+    size_t extra = len < 65536 ? sizeof(uint16_t) : sizeof(uint32_t);
+    aml_buffer_alloc(bh, extra);
+    char *d = aml_buffer_data(bh);
+    memmove(d + start + extra, d + start, len);
+    if(extra == sizeof(uint16_t)) {
         uint16_t v = len;
-        aml_buffer_append(bh, &v, sizeof(v));
-    } else {
-        uint8_t value = GROUP_4BYTE_LENGTH;
-        aml_buffer_append(bh, &value, sizeof(value));
-        aml_buffer_append(bh, &len, sizeof(len));
+        d[start-1] = (char)GROUP_2BYTE_LENGTH;
+        memcpy(d + start, &v, sizeof(v));
+    }
+    else {
+        d[start-1] = (char)GROUP_4BYTE_LENGTH;
+        memcpy(d + start, &len, sizeof(len));
     }
-    aml_buffer_append(bh, aml_buffer_data(group_bh), len);
 }
 
-uint32_t compress_groups(uint32_t *document_frequency, aml_buffer_t **bhs, term_data_t *p, term_data_t *ep) {
+/* Appends [length][sil_term_header_t][groups] for one term in a single pass over its
+   postings.  Group lengths are patched in once each group is written instead of building
+   every level in its own buffer. */
+static void encode_term(aml_buffer_t *bh, term_data_t *p, term_data_t *ep, uint32_t flags,
+                        sil_search_builder_histograms_t *hist) {
+    size_t start = aml_buffer_length(bh);
+    aml_buffer_alloc(bh, sizeof(uint32_t) + sizeof(sil_term_header_t));
+    uint32_t document_frequency = 0;
     uint32_t max_positions = 0;
-    aml_buffer_clear(bhs[0]);
     while(p < ep) {
-        // 26 bits, so bits 22-25
+        // bits 18-31
         term_data_t *cur = p;
-        uint32_t id = cur->id & 0x3FC0000;
+        uint32_t id = cur->id & TOP_GROUP_MASK;
         p++;
-        while(p < ep && id == (p->id & 0x3FC0000))
+        while(p < ep && id == (p->id & TOP_GROUP_MASK))
             p++;
 
-        aml_buffer_clear(bhs[1]);
+        size_t group_start = begin_top_group(bh, cur->id, flags);
         term_data_t *p2 = cur;
         while(p2 < p) {
             term_data_t *cur2 = p2;
-            id = cur2->id & 0x3FFFC00;
+            id = cur2->id & GROUP_MASK;
             p2++;
-            while(p2 < p && id == (p2->id & 0x3FFFC00))
+            while(p2 < p && id == (p2->id & GROUP_MASK))
                 p2++;
-            aml_buffer_clear(bhs[2]);
-            uint32_t max_positions_in_group = compress_small_group_data_into_group(document_frequency,
-                                                                                   bhs[2], bhs[3], cur2, p2);
-            if(max_positions_in_group > max_positions)
-                max_positions = max_positions_in_group;
-            uint32_t group_id = (cur2->id & 0x3FC00) >> 10;
-            uint8_t gid = group_id;
-            encode_group_to_buffer(bhs[1], gid, bhs[2]);
-        }
 
-        uint32_t group_id = (cur->id & 0x3FC0000) >> 18;
-        uint8_t gid = group_id;
-        encode_group_to_buffer(bhs[0], gid, bhs[1]);
+            size_t small_group_start = begin_group(bh, (cur2->id & SECOND_GROUP_MASK) >> 10);
+            if(flags & SIL_IMAGE_VALUE_SUMMARIES)
+                encode_value_summary(bh, cur2, p2);
+            if(flags & SIL_IMAGE_GROUP_COUNTS)
+                encode_group_count(bh, cur2, p2);
+            term_data_t *p3 = cur2;
+            while(p3 < p2) {
+                term_data_t *cur3 = p3;
+                uint32_t small_id = cur3->id & SMALL_GROUP_MASK;
+                p3++;
+                while(p3 < p2 && small_id == (p3->id & SMALL_GROUP_MASK))
+                    p3++;
+                document_frequency++;
+                uint32_t num_positions = encode_single_id(bh, small_id << SMALL_GROUP_SHIFT, cur3, p3, hist);
+                if(num_positions > max_positions)
+                    max_positions = num_positions;
+            }
+            end_group(bh, small_group_start);
+        }
+        end_group(bh, group_start);
     }
-    return max_positions;
+    if(hist)
+        hist->postings_per_term[histogram_bucket(document_frequency)]++;
+    uint32_t len = aml_buffer_length(bh) - start - sizeof(uint32_t);
+    sil_term_header_t header;
+    header.max_positions = max_positions;
+    header.document_frequency = document_frequency;
+    char *d = aml_buffer_data(bh) + start;
+    memcpy(d, &len, sizeof(len));
+    memcpy(d + sizeof(len), &header, sizeof(header));
 }
 
-void sil_search_builder_destroy(sil_search_builder_t *h) {
-    _finish_document(h); // finish the last document
+/*
+    Terms are independent once their postings are grouped, so writing them is pipelined.
+    The destroying thread groups the sorted postings by term into a batch while a pool of
+    encoder threads (sil_search_builder_options_encoder_threads) encodes the previous batch.
+    Each batch is written in term order once it is encoded.  Without encoder threads, each
+    term is encoded and written as soon as it is read.
+*/
+typedef struct {
+    size_t term;          // offset of the term in the batch's terms
+    size_t term_length;
+    size_t postings;      // index of the first posting
+    size_t num_postings;
+    uint32_t encoder;     // whose output holds the encoded term
+    size_t offset;
+    size_t length;
+} batch_term_t;
 
-    io_record_t *r;
-    aml_buffer_t *bhs[4];
-    bhs[0] = aml_buffer_init(1024*1024);
-    bhs[1] = aml_buffer_init(1024*1024);
-    bhs[2] = aml_buffer_init(1024*1024);
-    bhs[3] = aml_buffer_init(1024*1024);
+typedef struct {
+    aml_buffer_t *terms;
+    aml_buffer_t *postings;
+    aml_buffer_t *entries;
+    aml_buffer_t **out;   // one per encoder thread
+    size_t num_entries;
+    size_t next;          // next entry to encode
+    size_t done;          // entries encoded
+} term_batch_t;
 
-    aml_buffer_t *key = aml_buffer_init(128);
-    aml_buffer_t *bh = aml_buffer_init(1024*1024);
-    io_in_t *in;
-    FILE *out_idx, *out_data, *out_stats, *out_gbl, *out_emb, *out_content;
+struct term_encoder_s;
+typedef struct term_encoder_s term_encoder_t;
+
+typedef struct {
+    term_encoder_t *e;
+    uint32_t index;
+} encoder_thread_t;
+
+struct term_encoder_s {
+    uint32_t flags;
+    size_t batch_size;
+    FILE *out_idx;
+    FILE *out_data;
     size_t offs;
+    uint32_t total_terms;
 
-    uint32_t total_embeddings = 0;
-    uint64_t content_offset = 0;
+    term_batch_t batches[2];
+    term_batch_t *reading;    // being filled by the reader
+    term_batch_t *submitted;  // handed to the encoder threads and not yet written
 
-    in = io_out_in(h->global_data);
-    snprintf(h->filename, h->filename_len+40, "%s_gbl", h->base_filename);
-    out_gbl = fopen(h->filename, "wb");
-    snprintf(h->filename, h->filename_len+40, "%s_embeddings", h->base_filename);
-    out_emb = fopen(h->filename, "wb");
-    snprintf(h->filename, h->filename_len+40, "%s_content", h->base_filename);
-    out_content = fopen(h->filename, "wb");
+    pthread_mutex_t mutex;
+    pthread_cond_t work;      // a batch was submitted or the encoder is stopping
+    pthread_cond_t finished;  // the submitted batch is encoded
+    pthread_t *threads;
+    encoder_thread_t *thread_args;
+    uint32_t num_threads;
+    term_batch_t *encoding;   // NULL once the submitted batch is encoded
+    bool stop;
+
+    // counted per encoder thread and added to histograms by term_encoder_finish
+    sil_search_builder_histograms_t *histograms;
+    sil_search_builder_histograms_t *thread_histograms;
+};
+
+static void encode_batch_term(term_encoder_t *e, term_batch_t *b, size_t i, uint32_t encoder) {
+    batch_term_t *bt = (batch_term_t *)aml_buffer_data(b->entries) + i;
+    term_data_t *p = (term_data_t *)aml_buffer_data(b->postings) + bt->postings;
+    aml_buffer_t *out = b->out[encoder];
+    bt->encoder = encoder;
+    bt->offset = aml_buffer_length(out);
+    encode_term(out, p, p + bt->num_postings, e->flags,
+                e->thread_histograms ? e->thread_histograms + encoder : NULL);
+    bt->length = aml_buffer_length(out) - bt->offset;
+}
 
-    while((r=io_in_advance(in)) != NULL) {
-        sil_global_header_t *gh = ( sil_global_header_t *)r->record;
-        char *main_global_data = r->record;
-        uint32_t main_global_length = gh->embeddings_offset;
-        uint32_t content_length = gh->content_offset;
-        int8_t *embedding_data = (int8_t *)(main_global_data + main_global_length);
-        char *content_data = (char *)(embedding_data + (gh->num_embeddings * 512));
+static void *encoder_thread(void *arg) {
+    encoder_thread_t *et = (encoder_thread_t *)arg;
+    term_encoder_t *e = et->e;
+    pthread_mutex_lock(&e->mutex);
+    while(true) {
+        term_batch_t *b = e->encoding;
+        if(!b || b->next == b->num_entries) {
+            if(e->stop)
+                break;
+            pthread_cond_wait(&e->work, &e->mutex);
+            continue;
+        }
+        size_t i = b->next++;
+        pthread_mutex_unlock(&e->mutex);
+        encode_batch_term(e, b, i, et->index);
+        pthread_mutex_lock(&e->mutex);
+        b->done++;
+        if(b->done == b->num_entries) {
+            e->encoding = NULL;
+            pthread_cond_signal(&e->finished);
+        }
+    }
+    pthread_mutex_unlock(&e->mutex);
+    return NULL;
+}
 
-        gh->content_offset = content_offset;
-        gh->embeddings_offset = total_embeddings;
+static void term_batch_clear(term_batch_t *b, uint32_t num_out) {
+    aml_buffer_clear(b->terms);
+    aml_buffer_clear(b->postings);
+    aml_buffer_clear(b->entries);
+    for(uint32_t i=0; i<num_out; i++)
+        aml_buffer_clear(b->out[i]);
+    b->num_entries = 0;
+    b->next = 0;
+    b->done = 0;
+}
+
+static void write_batch(term_encoder_t *e, term_batch_t *b) {
+    batch_term_t *bt = (batch_term_t *)aml_buffer_data(b->entries);
+    const char *terms = aml_buffer_data(b->terms);
+    for(size_t i=0; i<b->num_entries; i++, bt++) {
+        fwrite(terms + bt->term, bt->term_length, 1, e->out_idx);
+        fwrite(&e->offs, sizeof(e->offs), 1, e->out_idx);
+        fwrite(aml_buffer_data(b->out[bt->encoder]) + bt->offset, bt->length, 1, e->out_data);
+        e->offs += bt->length;
+        e->total_terms++;
+    }
+    term_batch_clear(b, e->num_threads ? e->num_threads : 1);
+}
 
-        uint32_t *id = (uint32_t *)(main_global_data + sizeof(sil_global_header_t));
+// histograms (if not NULL) receives the histograms of the terms encoded
+static void term_encoder_init(term_encoder_t *e, const sil_search_builder_options_t *options,
+                              FILE *out_idx, FILE *out_data,
+                              sil_search_builder_histograms_t *histograms) {
+    memset(e, 0, sizeof(*e));
+    e->flags = image_flags(options);
+    e->batch_size = options->buffer_size / 4;
+    if(e->batch_size < 64*1024)
+        e->batch_size = 64*1024;
+    e->out_idx = out_idx;
+    e->out_data = out_data;
+    e->offs = 4;
+    e->num_threads = options->encoder_threads;
+    uint32_t num_out = e->num_threads ? e->num_threads : 1;
+    e->histograms = histograms;
+    if(histograms)
+        e->thread_histograms = (sil_search_builder_histograms_t *)
+            aml_zalloc(sizeof(sil_search_builder_histograms_t) * num_out);
+    for(uint32_t i=0; i<2; i++) {
+        term_batch_t *b = e->batches + i;
+        b->terms = aml_buffer_init(1024*1024);
+        b->postings = aml_buffer_init(e->num_threads ? e->batch_size + 1024 : 1024*1024);
+        b->entries = aml_buffer_init(sizeof(batch_term_t) * 1024);
+        b->out = (aml_buffer_t **)aml_malloc(sizeof(aml_buffer_t *) * num_out);
+        for(uint32_t j=0; j<num_out; j++)
+            b->out[j] = aml_buffer_init(1024*1024);
+    }
+    e->reading = e->batches;
+    if(!e->num_threads)
+        return;
+    pthread_mutex_init(&e->mutex, NULL);
+    pthread_cond_init(&e->work, NULL);
+    pthread_cond_init(&e->finished, NULL);
+    e->threads = (pthread_t *)aml_malloc(sizeof(pthread_t) * e->num_threads);
+    e->thread_args = (encoder_thread_t *)aml_malloc(sizeof(encoder_thread_t) * e->num_threads);
+    for(uint32_t i=0; i<e->num_threads; i++) {
+        e->thread_args[i].e = e;
+        e->thread_args[i].index = i;
+        pthread_create(e->threads+i, NULL, encoder_thread, e->thread_args+i);
+    }
+}
 
-        fwrite(&main_global_length, sizeof(main_global_length), 1, out_gbl);
-        fwrite(main_global_data, main_global_length, 1, out_gbl);
+static void wait_for_batch(term_encoder_t *e) {
+    pthread_mutex_lock(&e->mutex);
+    while(e->encoding)
+        pthread_cond_wait(&e->finished, &e->mutex);
+    pthread_mutex_unlock(&e->mutex);
+}
 
-        fwrite(embedding_data, gh->num_embeddings*512, 1, out_emb);
-        fwrite(content_data, content_length, 1, out_content);
+// hand the batch being read to the encoder threads and write the one they just finished
+static void submit_batch(term_encoder_t *e) {
+    wait_for_batch(e);
+    term_batch_t *finished = e->submitted;
+    pthread_mutex_lock(&e->mutex);
+    e->encoding = e->reading;
+    pthread_cond_broadcast(&e->work);
+    pthread_mutex_unlock(&e->mutex);
+    e->submitted = e->reading;
+    e->reading = e->reading == e->batches ? e->batches + 1 : e->batches;
+    if(finished)
+        write_batch(e, finished);
+}
 
-        total_embeddings += gh->num_embeddings;
-        content_offset += content_length;
+static inline void term_encoder_posting(term_encoder_t *e, const term_data_t *d) {
+    aml_buffer_append(e->reading->postings, d, sizeof(*d));
+}
+
+// the postings appended since the last term belong to term
+static void term_encoder_term(term_encoder_t *e, const char *term, size_t term_length) {
+    term_batch_t *b = e->reading;
+    batch_term_t bt;
+    memset(&bt, 0, sizeof(bt));
+    bt.term = aml_buffer_length(b->terms);
+    bt.term_length = term_length;
+    aml_buffer_append(b->terms, term, term_length);
+    size_t num_postings = aml_buffer_length(b->postings) / sizeof(term_data_t);
+    if(b->num_entries) {
+        batch_term_t *last = (batch_term_t *)aml_buffer_end(b->entries) - 1;
+        bt.postings = last->postings + last->num_postings;
     }
-    io_in_destroy(in);
-    fclose(out_gbl);
-    fclose(out_emb);
-    fclose(out_content);
-    snprintf(h->filename, h->filename_len+40, "%s_term_idx", h->base_filename);
-    out_idx = fopen(h->filename, "wb");
-    snprintf(h->filename, h->filename_len+40, "%s_term_data", h->base_filename);
-    out_data = fopen(h->filename, "wb");
-
-    uint32_t total_terms = 0;
-    offs = 4;
-    in = io_out_in(h->term_data);
-    r=io_in_advance(in);
-    while(r != NULL) {
-        aml_buffer_set(key, r->record+sizeof(term_data_t), r->length-sizeof(term_data_t));
-        aml_buffer_set(bh, r->record, sizeof(term_data_t));
-        while((r=io_in_advance(in)) != NULL &&
-              !strcmp(r->record+sizeof(term_data_t), aml_buffer_data(key))) {
-            aml_buffer_append(bh, r->record, sizeof(term_data_t));
-        }
-        term_data_t *p = (term_data_t *)aml_buffer_data(bh);
-        term_data_t *ep = (term_data_t *)aml_buffer_end(bh);
-        uint32_t document_frequency = 0;
-        uint32_t max_positions = compress_groups(&document_frequency, bhs, p, ep);
-        fwrite(aml_buffer_data(key), aml_buffer_length(key), 1, out_idx);
-        fwrite(&offs, sizeof(offs), 1, out_idx);
-
-        uint32_t len = aml_buffer_length(bhs[0]) + sizeof(sil_term_header_t);
-        offs += len + 4;
-        fwrite(&len, sizeof(len), 1, out_data);
-        sil_term_header_t header;
-        header.max_positions = max_positions;
-        header.document_frequency = document_frequency;
-        fwrite(&header, sizeof(header), 1, out_data);
-        fwrite(aml_buffer_data(bhs[0]), aml_buffer_length(bhs[0]), 1, out_data);
-        total_terms++;
+    bt.num_postings = num_postings - bt.postings;
+    aml_buffer_append(b->entries, &bt, sizeof(bt));
+    b->num_entries++;
+    if(!e->num_threads) {
+        encode_batch_term(e, b, 0, 0);
+        write_batch(e, b);
     }
-    fclose(out_idx);
-    fclose(out_data);
-    io_in_destroy(in);
+    else if(aml_buffer_length(b->postings) >= e->batch_size)
+        submit_batch(e);
+}
 
-    aml_buffer_destroy(bhs[0]);
-    aml_buffer_destroy(bhs[1]);
-    aml_buffer_destroy(bhs[2]);
-    aml_buffer_destroy(bhs[3]);
+// write every term given so far, so the files end on a term
+static void term_encoder_flush(term_encoder_t *e) {
+    if(!e->num_threads)
+        return;
+    if(e->reading->num_entries)
+        submit_batch(e);
+    wait_for_batch(e);
+    if(e->submitted)
+        write_batch(e, e->submitted);
+    e->submitted = NULL;
+}
 
-    aml_buffer_destroy(bh);
-    aml_buffer_destroy(key);
+static void term_encoder_finish(term_encoder_t *e) {
+    if(e->num_threads) {
+        if(e->reading->num_entries)
+            submit_batch(e);
+        wait_for_batch(e);
+        if(e->submitted)
+            write_batch(e, e->submitted);
+        pthread_mutex_lock(&e->mutex);
+        e->stop = true;
+        pthread_cond_broadcast(&e->work);
+        pthread_mutex_unlock(&e->mutex);
+        for(uint32_t i=0; i<e->num_threads; i++)
+            pthread_join(e->threads[i], NULL);
+        aml_free(e->threads);
+        aml_free(e->thread_args);
+        pthread_mutex_destroy(&e->mutex);
+        pthread_cond_destroy(&e->work);
+        pthread_cond_destroy(&e->finished);
+    }
+    uint32_t num_out = e->num_threads ? e->num_threads : 1;
+    for(uint32_t i=0; i<2; i++) {
+        term_batch_t *b = e->batches + i;
+        aml_buffer_destroy(b->terms);
+        aml_buffer_destroy(b->postings);
+        aml_buffer_destroy(b->entries);
+        for(uint32_t j=0; j<num_out; j++)
+            aml_buffer_destroy(b->out[j]);
+        aml_free(b->out);
+    }
+    if(e->thread_histograms) {
+        uint64_t *sum = (uint64_t *)e->histograms;
+        size_t n = sizeof(sil_search_builder_histograms_t) / sizeof(uint64_t);
+        for(uint32_t i=0; i<num_out; i++) {
+            uint64_t *counts = (uint64_t *)(e->thread_histograms + i);
+            for(size_t j=0; j<n; j++)
+                sum[j] += counts[j];
+        }
+        aml_free(e->thread_histograms);
+    }
+}
 
-    aml_buffer_destroy(h->bh);
-    aml_pool_destroy(h->tmp_pool);
+// a sorted run written by a checkpoint, each record follows its four byte length
+typedef struct {
+    FILE *in;
+    aml_buffer_t *bh;
+    io_record_t r;
+} run_reader_t;
 
-    snprintf(h->filename, h->filename_len+40, "%s_stats.txt", h->base_filename);
-    out_stats = fopen(h->filename, "wb");
-    fprintf(out_stats, "%u %zu %zu %u\n", total_terms, h->total_documents, h->total_terms, h->max_id );
-    fprintf(out_stats, "total_terms: %u\n", total_terms );
-    fprintf(out_stats, "max_id: %u\n", h->max_id );
-    fprintf(out_stats, "total_documents: %zu\n", h->total_documents );
-    fprintf(out_stats, "total_terms_in_documents: %zu\n", h->total_terms );
-    fprintf(out_stats, "average document length: %f\n",
-            h->total_documents > 0 ? (double)h->total_terms / (double)h->total_documents : 0.0);
-    fclose(out_stats);
-    aml_free(h);
+static io_record_t *run_advance(run_reader_t *r) {
+    uint32_t length;
+    if(!r->in || fread(&length, sizeof(length), 1, r->in) != 1)
+        return NULL;
+    char *p = (char *)aml_buffer_resize(r->bh, length+1);
+    if(fread(p, 1, length, r->in) != length)
+        return NULL;
+    p[length] = 0;
+    r->r.record = p;
+    r->r.length = length;
+    r->r.tag = 0;
+    return &r->r;
+}
+
+/*
+    k-way merge of sorted streams, one from each builder (the builder itself first, then the
+    thread builders in the order they finished).  Ties go to the earlier stream and with
+    dedupe, records equal to the one returned are dropped like io_keep_first does within a
+    stream.
+*/
+typedef struct {
+    io_in_t **in;
+    io_record_t **cur;
+    size_t num_in;
+    size_t *heap;
+    size_t heap_size;
+    io_compare_cb compare;
+    bool dedupe;
+    bool has_pending;
+    size_t pending; // stream to advance on the next call
+    run_reader_t *runs;  // the streams are checkpointed runs instead of in
+    sil_search_builder_phase_t *timing;  // the merge phase of the build stats (if collected)
+    uint32_t calls;
+    sil_search_builder_phase_t clock_cost;  // of timing a call which does nothing
+} sorted_merge_t;
+
+static inline bool merge_less(sorted_merge_t *m, size_t a, size_t b) {
+    int n = m->compare(m->cur[a], m->cur[b], NULL);
+    return n < 0 || (n == 0 && a < b);
+}
+
+static void merge_sift_down(sorted_merge_t *m, size_t i) {
+    size_t v = m->heap[i];
+    while(true) {
+        size_t child = (i << 1) + 1;
+        if(child >= m->heap_size)
+            break;
+        if(child+1 < m->heap_size && merge_less(m, m->heap[child+1], m->heap[child]))
+            child++;
+        if(!merge_less(m, m->heap[child], v))
+            break;
+        m->heap[i] = m->heap[child];
+        i = child;
+    }
+    m->heap[i] = v;
+}
+
+static void merge_push(sorted_merge_t *m, size_t stream) {
+    size_t i = m->heap_size++;
+    while(i > 0) {
+        size_t parent = (i - 1) >> 1;
+        if(!merge_less(m, stream, m->heap[parent]))
+            break;
+        m->heap[i] = m->heap[parent];
+        i = parent;
+    }
+    m->heap[i] = stream;
+}
+
+static void merge_pop(sorted_merge_t *m) {
+    m->heap[0] = m->heap[--m->heap_size];
+    if(m->heap_size)
+        merge_sift_down(m, 0);
+}
+
+static inline io_record_t *merge_advance(sorted_merge_t *m, size_t stream) {
+    return m->runs ? run_advance(m->runs + stream) : io_in_advance(m->in[stream]);
+}
+
+static void merge_start(sorted_merge_t *m, size_t num_in, io_compare_cb compare, bool dedupe) {
+    m->num_in = num_in;
+    m->compare = compare;
+    m->dedupe = dedupe;
+    m->cur = (io_record_t **)aml_zalloc(sizeof(io_record_t *) * (num_in+1));
+    m->heap = (size_t *)aml_zalloc(sizeof(size_t) * (num_in+1));
+    for(size_t i=0; i<num_in; i++) {
+        m->cur[i] = merge_advance(m, i);
+        if(m->cur[i])
+            merge_push(m, i);
+    }
+}
+
+static void merge_init(sorted_merge_t *m, io_in_t **in, size_t num_in, io_compare_cb compare, bool dedupe) {
+    memset(m, 0, sizeof(*m));
+    m->in = in;
+    merge_start(m, num_in, compare, dedupe);
+}
+
+static void checkpoint_filename(sil_search_builder_t *h, uint32_t run, const char *suffix) {
+    snprintf(h->filename, h->filename_len+40, "%s_checkpoint_%u%s", h->base_filename, run, suffix);
+}
+
+static void remove_run(sil_search_builder_t *h, uint32_t run) {
+    static const char *suffixes[] = { "_gbl", "_data", "_ranks" };
+    for(size_t k=0; k<sizeof(suffixes)/sizeof(suffixes[0]); k++) {
+        checkpoint_filename(h, run, suffixes[k]);
+        remove(h->filename);
+    }
+}
+
+// merge the checkpointed runs of h (earlier runs win ties like earlier streams)
+static void merge_init_runs(sorted_merge_t *m, sil_search_builder_t *h, const char *suffix,
+                            io_compare_cb compare) {
+    memset(m, 0, sizeof(*m));
+    uint32_t num_runs = h->checkpoint.num_runs;
+    m->runs = (run_reader_t *)aml_zalloc(sizeof(run_reader_t) * (num_runs+1));
+    for(uint32_t i=0; i<num_runs; i++) {
+        checkpoint_filename(h, i, suffix);
+        m->runs[i].in = fopen(h->filename, "rb");
+        m->runs[i].bh = aml_buffer_init(1024);
+    }
+    merge_start(m, num_runs, compare, true);
+}
+
+static io_record_t *merge_next_record(sorted_merge_t *m, size_t *stream) {
+    if(m->has_pending) {
+        m->cur[m->pending] = merge_advance(m, m->pending);
+        if(m->cur[m->pending])
+            merge_push(m, m->pending);
+        m->has_pending = false;
+    }
+    if(!m->heap_size)
+        return NULL;
+    size_t top = m->heap[0];
+    io_record_t *r = m->cur[top];
+    merge_pop(m);
+    while(m->dedupe && m->heap_size && !m->compare(m->cur[m->heap[0]], r, NULL)) {
+        size_t dup = m->heap[0];
+        m->cur[dup] = merge_advance(m, dup);
+        if(m->cur[dup])
+            merge_sift_down(m, 0);
+        else
+            merge_pop(m);
+    }
+    m->pending = top;
+    m->has_pending = true;
+    if(stream)
+        *stream = top;
+    return r;
+}
+
+/* Timing every record would cost as much as merging it, so every 64th one is timed and
+   the cost of reading the clocks (the thread CPU clock is a system call) is taken off. */
+#define MERGE_TIMING_SAMPLE 64
+
+// time the next record into t (or just the clocks without stream)
+static io_record_t *timed_merge_next(sorted_merge_t *m, size_t *stream, sil_search_builder_phase_t *t) {
+    double wall = clock_seconds(CLOCK_MONOTONIC);
+    double cpu = clock_seconds(CLOCK_THREAD_CPUTIME_ID);
+    io_record_t *r = stream ? merge_next_record(m, stream) : NULL;
+    cpu = clock_seconds(CLOCK_THREAD_CPUTIME_ID) - cpu;
+    wall = clock_seconds(CLOCK_MONOTONIC) - wall;
+    t->wall_seconds = wall > m->clock_cost.wall_seconds ? wall - m->clock_cost.wall_seconds : 0;
+    t->cpu_seconds = cpu > m->clock_cost.cpu_seconds ? cpu - m->clock_cost.cpu_seconds : 0;
+    return r;
+}
+
+// time the merge into phase (if not NULL)
+static void merge_timing(sorted_merge_t *m, sil_search_builder_phase_t *phase) {
+    m->timing = phase;
+    if(!phase)
+        return;
+    sil_search_builder_phase_t t, cost = { 1, 1 };
+    for(uint32_t i=0; i<16; i++) {
+        timed_merge_next(m, NULL, &t);
+        if(t.wall_seconds < cost.wall_seconds)
+            cost.wall_seconds = t.wall_seconds;
+        if(t.cpu_seconds < cost.cpu_seconds)
+            cost.cpu_seconds = t.cpu_seconds;
+    }
+    m->clock_cost = cost;
+}
+
+// the returned record is valid until the next call, stream is set to where it came from
+static io_record_t *merge_next(sorted_merge_t *m, size_t *stream) {
+    if(!m->timing || (++m->calls % MERGE_TIMING_SAMPLE))
+        return merge_next_record(m, stream);
+    size_t from;
+    sil_search_builder_phase_t t;
+    io_record_t *r = timed_merge_next(m, stream ? stream : &from, &t);
+    m->timing->wall_seconds += t.wall_seconds * MERGE_TIMING_SAMPLE;
+    m->timing->cpu_seconds += t.cpu_seconds * MERGE_TIMING_SAMPLE;
+    return r;
+}
+
+static void merge_destroy(sorted_merge_t *m) {
+    for(size_t i=0; i<m->num_in; i++) {
+        if(!m->runs)
+            io_in_destroy(m->in[i]);
+        else {
+            if(m->runs[i].in)
+                fclose(m->runs[i].in);
+            aml_buffer_destroy(m->runs[i].bh);
+        }
+    }
+    if(m->runs)
+        aml_free(m->runs);
+    aml_free(m->cur);
+    aml_free(m->heap);
+}
+
+/* Find the ordinal of every term id of every builder in sorted term order.  Each distinct
+   term is appended to terms. */
+static uint32_t **interned_ordinals(sil_search_builder_t **builders, size_t num_builders,
+                                    aml_buffer_t *terms, aml_buffer_t *last_term) {
+    uint32_t **ordinals = (uint32_t **)aml_zalloc(sizeof(uint32_t *) * num_builders);
+    io_in_t **in = (io_in_t **)aml_zalloc(sizeof(io_in_t *) * num_builders);
+    for(size_t i=0; i<num_builders; i++) {
+        ordinals[i] = (uint32_t *)aml_malloc(sizeof(uint32_t) * (builders[i]->next_term_id+1));
+        in[i] = io_out_in(builders[i]->dictionary);
+    }
+
+    sorted_merge_t m;
+    merge_init(&m, in, num_builders, compare_dictionary, false);
+    uint32_t ordinal = 0;
+    io_record_t *r;
+    size_t stream;
+    const char *last = NULL;
+    while((r=merge_next(&m, &stream)) != NULL) {
+        const char *term = r->record+sizeof(uint32_t);
+        if(!last || strcmp(last, term)) {
+            if(last)
+                ordinal++;
+            aml_buffer_append(terms, term, strlen(term)+1);
+            aml_buffer_set(last_term, term, strlen(term)+1);
+            last = aml_buffer_data(last_term);
+        }
+        ordinals[stream][(*(uint32_t *)r->record)] = ordinal;
+    }
+    merge_destroy(&m);
+    aml_free(in);
+    return ordinals;
+}
+
+// reads the spilled postings of each builder in turn, remapped to ordinals
+typedef struct {
+    sil_search_builder_t **builders;
+    size_t num_builders;
+    uint32_t **ordinals;
+    size_t current;
+    FILE *raw;
+} interned_reader_t;
+
+static size_t read_interned(interned_reader_t *r, interned_term_data_t *records, size_t capacity) {
+    size_t num = 0;
+    while(num < capacity && r->current < r->num_builders) {
+        sil_search_builder_t *b = r->builders[r->current];
+        if(!r->raw) {
+            snprintf(b->filename, b->filename_len+40, "%s_interned_data", b->base_filename);
+            r->raw = fopen(b->filename, "rb");
+        }
+        size_t n = fread(records+num, sizeof(interned_term_data_t), capacity-num, r->raw);
+        uint32_t *ordinals = r->ordinals[r->current];
+        for(size_t i=num; i<num+n; i++)
+            records[i].term = ordinals[records[i].term];
+        num += n;
+        if(num < capacity) {
+            fclose(r->raw);
+            r->raw = NULL;
+            snprintf(b->filename, b->filename_len+40, "%s_interned_data", b->base_filename);
+            remove(b->filename);
+            r->current++;
+        }
+    }
+    return num;
+}
+
+#define SORTED_RUN_RECORDS 4096
+
+typedef struct {
+    FILE *in;      // NULL when the run is held in memory
+    interned_term_data_t *records;
+    size_t num;
+    size_t pos;
+} sorted_run_t;
+
+/* The remapped postings in sorted order, either from io_out or merged from runs which
+   were radix sorted in memory (sil_search_builder_options_radix_sort). */
+typedef struct {
+    io_in_t *in;
+
+    sorted_run_t *runs;
+    size_t num_runs;
+    size_t *heap;
+    size_t heap_size;
+    interned_term_data_t last;
+    bool started;
+    interned_term_data_t *buffers[2];
+} interned_postings_t;
+
+static inline uint32_t interned_key_byte(const interned_term_data_t *r, uint32_t pass) {
+    uint32_t v = pass < 4 ? r->data.position : pass < 8 ? r->data.id : r->term;
+    return (v >> ((pass & 3) << 3)) & 0xFF;
+}
+
+/* LSD radix sort on (term, id, position) a byte at a time.  The histograms for every pass
+   are built in a single scan and passes where every record has the same byte are skipped.
+   The sort is stable so the first of equal postings stays first.  Returns whichever of a
+   or tmp holds the sorted records. */
+static interned_term_data_t *radix_sort_interned(interned_term_data_t *a, interned_term_data_t *tmp,
+                                                 size_t num) {
+    size_t (*counts)[256] = (size_t (*)[256])aml_zalloc(sizeof(size_t) * 12 * 256);
+    for(size_t i=0; i<num; i++) {
+        for(uint32_t pass=0; pass<12; pass++)
+            counts[pass][interned_key_byte(a+i, pass)]++;
+    }
+    for(uint32_t pass=0; pass<12; pass++) {
+        size_t *c = counts[pass];
+        if(c[interned_key_byte(a, pass)] == num)
+            continue;
+        size_t offset = 0;
+        for(uint32_t d=0; d<256; d++) {
+            size_t n = c[d];
+            c[d] = offset;
+            offset += n;
+        }
+        for(size_t i=0; i<num; i++)
+            tmp[c[interned_key_byte(a+i, pass)]++] = a[i];
+        interned_term_data_t *t = a;
+        a = tmp;
+        tmp = t;
+    }
+    aml_free(counts);
+    return a;
+}
+
+static inline bool sorted_run_fill(sorted_run_t *run) {
+    if(run->pos < run->num)
+        return true;
+    if(!run->in)
+        return false;
+    run->num = fread(run->records, sizeof(interned_term_data_t), SORTED_RUN_RECORDS, run->in);
+    run->pos = 0;
+    return run->num > 0;
+}
+
+static inline bool sorted_run_less(interned_postings_t *p, size_t a, size_t b) {
+    int n = compare_interned(p->runs[a].records + p->runs[a].pos, p->runs[b].records + p->runs[b].pos);
+    return n < 0 || (n == 0 && a < b);
+}
+
+static void sorted_run_sift_down(interned_postings_t *p, size_t i) {
+    size_t v = p->heap[i];
+    while(true) {
+        size_t child = (i << 1) + 1;
+        if(child >= p->heap_size)
+            break;
+        if(child+1 < p->heap_size && sorted_run_less(p, p->heap[child+1], p->heap[child]))
+            child++;
+        if(!sorted_run_less(p, p->heap[child], v))
+            break;
+        p->heap[i] = p->heap[child];
+        i = child;
+    }
+    p->heap[i] = v;
+}
+
+static void radix_sort_runs(sil_search_builder_t *h, interned_postings_t *p, interned_reader_t *reader) {
+    size_t capacity = h->buffer_size / sizeof(interned_term_data_t);
+    if(capacity < SORTED_RUN_RECORDS)
+        capacity = SORTED_RUN_RECORDS;
+    p->buffers[0] = (interned_term_data_t *)aml_malloc(sizeof(interned_term_data_t) * capacity);
+    p->buffers[1] = (interned_term_data_t *)aml_malloc(sizeof(interned_term_data_t) * capacity);
+    aml_buffer_t *runs = aml_buffer_init(sizeof(sorted_run_t) * 16);
+    size_t num;
+    while((num = read_interned(reader, p->buffers[0], capacity)) > 0) {
+        sorted_run_t run;
+        run.records = radix_sort_interned(p->buffers[0], p->buffers[1], num);
+        run.num = num;
+        run.pos = 0;
+        run.in = NULL;
+        if(num == capacity || aml_buffer_length(runs)) {
+            // more than one run, spill it
+            snprintf(h->filename, h->filename_len+40, "%s_run_%zu", h->base_filename,
+                     aml_buffer_length(runs) / sizeof(sorted_run_t));
+            FILE *out = fopen(h->filename, "wb");
+            fwrite(run.records, sizeof(interned_term_data_t), num, out);
+            fclose(out);
+            h->stats.runs_spilled++;
+            h->stats.spilled_bytes += sizeof(interned_term_data_t) * num;
+            run.in = fopen(h->filename, "rb");
+            run.records = NULL;
+            run.num = 0;
+        }
+        aml_buffer_append(runs, &run, sizeof(run));
+    }
+    p->num_runs = aml_buffer_length(runs) / sizeof(sorted_run_t);
+    p->runs = (sorted_run_t *)aml_malloc(sizeof(sorted_run_t) * (p->num_runs+1));
+    memcpy(p->runs, aml_buffer_data(runs), sizeof(sorted_run_t) * p->num_runs);
+    aml_buffer_destroy(runs);
+
+    p->heap = (size_t *)aml_malloc(sizeof(size_t) * (p->num_runs+1));
+    p->heap_size = 0;
+    for(size_t i=0; i<p->num_runs; i++) {
+        sorted_run_t *run = p->runs + i;
+        if(run->in) {
+            if(i == 0) {
+                // the sort buffers are no longer needed, reuse the first one for reading
+                run->records = p->buffers[0];
+            }
+            else
+                run->records = (interned_term_data_t *)aml_malloc(sizeof(interned_term_data_t) * SORTED_RUN_RECORDS);
+        }
+        if(sorted_run_fill(run))
+            p->heap[p->heap_size++] = i;
+    }
+    for(size_t i=p->heap_size; i>0; i--)
+        sorted_run_sift_down(p, i-1);
+}
+
+// stop interning and flush the remaining postings
+static void finish_interned_terms(sil_search_builder_t *h) {
+    fwrite(aml_buffer_data(h->interned_bh), aml_buffer_length(h->interned_bh), 1, h->interned_data);
+    h->stats.spilled_bytes += aml_buffer_length(h->interned_bh);
+    fclose(h->interned_data);
+    aml_buffer_destroy(h->interned_bh);
+    aml_pool_destroy(h->term_pool);
+    aml_free(h->slots);
+}
+
+/* Find the ordinal of every term id, then sort the spilled postings of every builder by
+   ordinal. */
+static void open_interned_postings(sil_search_builder_t *h, sil_search_builder_t **builders,
+                                   size_t num_builders, aml_buffer_t *terms, interned_postings_t *p) {
+    memset(p, 0, sizeof(*p));
+    interned_reader_t reader;
+    memset(&reader, 0, sizeof(reader));
+    reader.builders = builders;
+    reader.num_builders = num_builders;
+    reader.ordinals = interned_ordinals(builders, num_builders, terms, h->bh);
+    if(h->options.radix_sort)
+        radix_sort_runs(h, p, &reader);
+    else {
+        snprintf(h->filename, h->filename_len+40, "%s_data", h->base_filename);
+        io_out_t *out = open_sorted(h->filename, compare_interned_term_data, h->buffer_size,
+                                    io_fixed(sizeof(interned_term_data_t)));
+        interned_term_data_t records[SORTED_RUN_RECORDS];
+        size_t num;
+        while((num = read_interned(&reader, records, SORTED_RUN_RECORDS)) > 0) {
+            for(size_t i=0; i<num; i++) {
+                io_out_write_record(out, records+i, sizeof(interned_term_data_t));
+                count_sorted(h, 0, sizeof(interned_term_data_t));
+            }
+        }
+        p->in = io_out_in(out);
+    }
+    for(size_t i=0; i<num_builders; i++)
+        aml_free(reader.ordinals[i]);
+    aml_free(reader.ordinals);
+}
+
+// equal postings from the runs are reduced to the first, like io_keep_first
+static interned_term_data_t *next_interned_posting(interned_postings_t *p) {
+    if(p->in) {
+        io_record_t *r = io_in_advance(p->in);
+        return r ? (interned_term_data_t *)r->record : NULL;
+    }
+    while(p->heap_size) {
+        sorted_run_t *run = p->runs + p->heap[0];
+        interned_term_data_t *d = run->records + run->pos;
+        bool duplicate = p->started && !compare_interned(d, &p->last);
+        p->last = *d;
+        p->started = true;
+        run->pos++;
+        if(!sorted_run_fill(run))
+            p->heap[0] = p->heap[--p->heap_size];
+        if(p->heap_size)
+            sorted_run_sift_down(p, 0);
+        if(!duplicate)
+            return &p->last;
+    }
+    return NULL;
+}
+
+static void close_interned_postings(sil_search_builder_t *h, interned_postings_t *p) {
+    if(p->in)
+        io_in_destroy(p->in);
+    for(size_t i=0; i<p->num_runs; i++) {
+        sorted_run_t *run = p->runs + i;
+        if(!run->in)
+            continue;
+        fclose(run->in);
+        if(i > 0)
+            aml_free(run->records);
+        snprintf(h->filename, h->filename_len+40, "%s_run_%zu", h->base_filename, i);
+        remove(h->filename);
+    }
+    if(p->runs)
+        aml_free(p->runs);
+    if(p->heap)
+        aml_free(p->heap);
+    if(p->buffers[0])
+        aml_free(p->buffers[0]);
+    if(p->buffers[1])
+        aml_free(p->buffers[1]);
+}
+
+sil_search_builder_t *sil_search_builder_thread_init(sil_search_builder_t *h) {
+    pthread_mutex_lock(&h->mutex);
+    uint32_t thread_id = h->num_thread_builders++;
+    h->num_open_thread_builders++;
+    pthread_mutex_unlock(&h->mutex);
+
+    size_t len = strlen(h->base_filename)+40;
+    char *filename = (char *)aml_malloc(len);
+    snprintf(filename, len, "%s_thread_%u", h->base_filename, thread_id);
+    sil_search_builder_t *r = sil_search_builder_ext_init(filename, &h->options);
+    aml_free(filename);
+    r->parent = h;
+    return r;
+}
+
+// a thread builder hands its sorted postings and globals to the builder it came from
+static void finish_thread_builder(sil_search_builder_t *h) {
+    _finish_document(h);
+    if(h->options.intern_terms)
+        finish_interned_terms(h);
+    sil_search_builder_t *parent = h->parent;
+    pthread_mutex_lock(&parent->mutex);
+    aml_buffer_append(parent->thread_builders, &h, sizeof(h));
+    parent->num_open_thread_builders--;
+    pthread_mutex_unlock(&parent->mutex);
+}
+
+static void free_builder(sil_search_builder_t *h) {
+    aml_buffer_destroy(h->bh);
+    aml_buffer_destroy(h->global_bh);
+    aml_pool_destroy(h->tmp_pool);
+    aml_buffer_destroy(h->static_ranks);
+    aml_buffer_destroy(h->thread_builders);
+    pthread_mutex_destroy(&h->mutex);
+    if(h->last_term)
+        aml_free(h->last_term);
+    aml_free(h);
+}
+
+static void write_stats(const char *filename, uint32_t total_terms, size_t total_documents,
+                        size_t total_terms_in_documents, uint32_t max_id, uint32_t flags) {
+    FILE *out_stats = fopen(filename, "wb");
+    fprintf(out_stats, "%u %zu %zu %u %u\n", total_terms, total_documents, total_terms_in_documents, max_id, flags );
+    fprintf(out_stats, "total_terms: %u\n", total_terms );
+    fprintf(out_stats, "max_id: %u\n", max_id );
+    fprintf(out_stats, "flags: %u\n", flags );
+    fprintf(out_stats, "total_documents: %zu\n", total_documents );
+    fprintf(out_stats, "total_terms_in_documents: %zu\n", total_terms_in_documents );
+    fprintf(out_stats, "average document length: %f\n",
+            total_documents > 0 ? (double)total_terms_in_documents / (double)total_documents : 0.0);
+    fclose(out_stats);
+}
+
+static void write_json_phase(FILE *out, const char *name, const sil_search_builder_phase_t *phase,
+                             bool last) {
+    fprintf(out, "    \"%s\": { \"wall_seconds\": %.6f, \"cpu_seconds\": %.6f }%s\n",
+            name, phase->wall_seconds, phase->cpu_seconds, last ? "" : ",");
+}
+
+static void write_json_counts(FILE *out, const char *name, const uint64_t *counts, size_t num,
+                              const char **labels, bool last) {
+    fprintf(out, labels ? "    \"%s\": { " : "    \"%s\": [ ", name);
+    for(size_t i=0; i<num; i++) {
+        if(labels)
+            fprintf(out, "\"%s\": ", labels[i]);
+        fprintf(out, "%" PRIu64 "%s", counts[i], i+1 < num ? ", " : "");
+    }
+    fprintf(out, labels ? " }%s\n" : " ]%s\n", last ? "" : ",");
+}
+
+// sil_search_builder_stats_t as JSON, for tools which tune buffer sizes and encodings
+static void write_stats_json(const char *filename, const sil_search_builder_stats_t *stats,
+                             uint32_t total_terms, size_t total_documents) {
+    static const char *value_widths[] = { "sid", "1", "2", "4" };
+    static const char *position_value_widths[] = { "1", "3", "5" };
+    static const char *position_delta_widths[] = { "1", "2", "3", "4", "5" };
+    const sil_search_builder_histograms_t *hist = &stats->histograms;
+    FILE *out = fopen(filename, "wb");
+    if(!out)
+        return;
+    fprintf(out, "{\n");
+    fprintf(out, "  \"total_terms\": %u,\n", total_terms);
+    fprintf(out, "  \"total_documents\": %zu,\n", total_documents);
+    fprintf(out, "  \"phases\": {\n");
+    write_json_phase(out, "ingest", &stats->ingest, false);
+    write_json_phase(out, "sort", &stats->sort, false);
+    write_json_phase(out, "merge", &stats->merge, false);
+    write_json_phase(out, "global_write", &stats->global_write, false);
+    write_json_phase(out, "term_encode", &stats->term_encode, false);
+    write_json_phase(out, "reorder", &stats->reorder, true);
+    fprintf(out, "  },\n");
+    fprintf(out, "  \"sorted_bytes\": %" PRIu64 ",\n", stats->sorted_bytes);
+    fprintf(out, "  \"runs_spilled\": %" PRIu64 ",\n", stats->runs_spilled);
+    fprintf(out, "  \"spilled_bytes\": %" PRIu64 ",\n", stats->spilled_bytes);
+    fprintf(out, "  \"bytes_written\": %" PRIu64 ",\n", stats->bytes_written);
+    fprintf(out, "  \"histograms\": {\n");
+    write_json_counts(out, "postings_per_term", hist->postings_per_term, SIL_HISTOGRAM_BUCKETS,
+                      NULL, false);
+    write_json_counts(out, "bytes_per_posting", hist->bytes_per_posting, SIL_HISTOGRAM_BUCKETS,
+                      NULL, false);
+    write_json_counts(out, "value_widths", hist->value_widths, 4, value_widths, false);
+    write_json_counts(out, "position_value_widths", hist->position_value_widths, 3,
+                      position_value_widths, false);
+    write_json_counts(out, "position_delta_widths", hist->position_delta_widths, 5,
+                      position_delta_widths, false);
+    fprintf(out, "    \"extended_position_lengths\": %" PRIu64 "\n", hist->extended_position_lengths);
+    fprintf(out, "  }\n");
+    fprintf(out, "}\n");
+    fclose(out);
+}
+
+/* The documents of img (by index into ids, the ids which are not deleted) in the order
+   they are renumbered in. */
+typedef uint32_t *(*document_order_t)(sil_search_image_t *img, const uint32_t *ids,
+                                      uint32_t num_ids, void *arg);
+
+static bool renumber_image(const char *filename, sil_search_image_t *img,
+                           const sil_search_builder_options_t *options,
+                           document_order_t document_order, void *arg);
+
+static uint32_t *static_rank_order(sil_search_image_t *img, const uint32_t *ids,
+                                   uint32_t num_ids, void *arg);
+static uint32_t *bisection_order(sil_search_image_t *img, const uint32_t *ids,
+                                 uint32_t num_ids, void *arg);
+
+// the files of an image written by the builder
+static const char *image_suffixes[] = { "_gbl", "_embeddings", "_content", "_term_idx",
+                                        "_term_data", "_stats.txt", "_id_map", "_content_blocks",
+                                        "_columns" };
+
+/* Renumber the image the builder wrote into files next to it and rename them over the
+   image. */
+static void reorder_written_image(const char *filename, const sil_search_builder_options_t *options,
+                                  document_order_t document_order, void *arg) {
+    sil_search_image_t *img = sil_search_image_init(filename);
+    if(!img)
+        return;
+    size_t len = strlen(filename) + 60;
+    char *tmp = (char *)aml_malloc(len);
+    char *from = (char *)aml_malloc(len);
+    char *to = (char *)aml_malloc(len);
+    snprintf(tmp, len, "%s_reordering", filename);
+    bool ok = renumber_image(tmp, img, options, document_order, arg);
+    sil_search_image_destroy(img);
+    for(size_t i=0; i<sizeof(image_suffixes)/sizeof(image_suffixes[0]); i++) {
+        snprintf(from, len, "%s%s", tmp, image_suffixes[i]);
+        snprintf(to, len, "%s%s", filename, image_suffixes[i]);
+        if(ok)
+            rename(from, to);
+        else
+            remove(from);
+    }
+    aml_free(to);
+    aml_free(from);
+    aml_free(tmp);
+}
+
+static inline bool uses_checkpoints(sil_search_builder_t *h) {
+    return h->options.checkpoints && !h->options.intern_terms;
+}
+
+// make out durable and close it
+static bool sync_close(FILE *out) {
+    bool ok = fflush(out) == 0 && fsync(fileno(out)) == 0;
+    return fclose(out) == 0 && ok;
+}
+
+static inline bool write_run_record(FILE *out, const io_record_t *r) {
+    uint32_t length = r->length;
+    return fwrite(&length, sizeof(length), 1, out) == 1 &&
+           fwrite(r->record, 1, length, out) == length;
+}
+
+/* Write the sorted streams of builders, merged the way destroy merges them, and their
+   static ranks as run num_runs of h.  The streams are consumed. */
+static bool write_run(sil_search_builder_t *h, sil_search_builder_t **builders, size_t num_builders) {
+    static const char *suffixes[] = { "_gbl", "_data" };
+    static const io_compare_cb compare[] = { compare_global_data, compare_term_data };
+    uint32_t run = h->checkpoint.num_runs;
+    io_in_t **in = (io_in_t **)aml_zalloc(sizeof(io_in_t *) * num_builders);
+    bool ok = true;
+    for(size_t k=0; k<2; k++) {
+        for(size_t i=0; i<num_builders; i++)
+            in[i] = io_out_in(k == 0 ? builders[i]->global_data : builders[i]->term_data);
+        sorted_merge_t m;
+        merge_init(&m, in, num_builders, compare[k], true);
+        checkpoint_filename(h, run, suffixes[k]);
+        FILE *out = fopen(h->filename, "wb");
+        ok = ok && out;
+        io_record_t *r;
+        while((r=merge_next(&m, NULL)) != NULL) {
+            ok = ok && write_run_record(out, r);
+            h->stats.spilled_bytes += sizeof(uint32_t) + r->length;
+        }
+        merge_destroy(&m);
+        h->stats.runs_spilled++;
+        if(out)
+            ok = sync_close(out) && ok;
+    }
+    aml_free(in);
+
+    checkpoint_filename(h, run, "_ranks");
+    FILE *out = fopen(h->filename, "wb");
+    ok = ok && out;
+    for(size_t i=0; i<num_builders; i++) {
+        aml_buffer_t *ranks = builders[i]->static_ranks;
+        if(out && aml_buffer_length(ranks))
+            ok = ok && fwrite(aml_buffer_data(ranks), aml_buffer_length(ranks), 1, out) == 1;
+        aml_buffer_clear(ranks);
+    }
+    if(out)
+        ok = sync_close(out) && ok;
+    return ok;
+}
+
+// replace _manifest with h->checkpoint and the last term written (if any)
+static bool write_manifest(sil_search_builder_t *h, const char *last_term) {
+    sil_checkpoint_t *c = &h->checkpoint;
+    c->magic = SIL_CHECKPOINT_MAGIC;
+    c->last_term_length = last_term ? strlen(last_term)+1 : 0;
+    size_t len = h->filename_len + 40;
+    char *tmp = (char *)aml_malloc(len);
+    snprintf(tmp, len, "%s_manifest.tmp", h->base_filename);
+    FILE *out = fopen(tmp, "wb");
+    bool ok = out != NULL;
+    if(ok) {
+        ok = fwrite(c, sizeof(*c), 1, out) == 1 &&
+             (!last_term || fwrite(last_term, c->last_term_length, 1, out) == 1);
+        ok = sync_close(out) && ok;
+    }
+    snprintf(h->filename, len, "%s_manifest", h->base_filename);
+    ok = ok && rename(tmp, h->filename) == 0;
+    aml_free(tmp);
+    return ok;
+}
+
+bool sil_search_builder_checkpoint(sil_search_builder_t *h) {
+    if(!uses_checkpoints(h) || h->parent || h->checkpoint.phase != SIL_CHECKPOINT_RUNS)
+        return false;
+    // the documents of a thread builder are only in the run once it is destroyed
+    pthread_mutex_lock(&h->mutex);
+    if(h->num_open_thread_builders) {
+        pthread_mutex_unlock(&h->mutex);
+        return false;
+    }
+    // this builder's stream goes first, as in destroy
+    size_t num_builders = 1 + aml_buffer_length(h->thread_builders) / sizeof(sil_search_builder_t *);
+    sil_search_builder_t **builders = (sil_search_builder_t **)aml_malloc(sizeof(*builders) * num_builders);
+    builders[0] = h;
+    memcpy(builders + 1, aml_buffer_data(h->thread_builders), sizeof(*builders) * (num_builders - 1));
+    aml_buffer_clear(h->thread_builders);
+    pthread_mutex_unlock(&h->mutex);
+
+    _finish_document(h);
+    aml_buffer_clear(h->global_bh);
+    bool ok = write_run(h, builders, num_builders);
+    // the finished thread builders are part of h from here on
+    for(size_t i=1; i<num_builders; i++) {
+        sil_search_builder_t *b = builders[i];
+        h->total_documents += b->total_documents;
+        h->total_terms += b->total_terms;
+        if(b->max_id > h->max_id)
+            h->max_id = b->max_id;
+        h->stats.sorted_bytes += b->stats.sorted_bytes;
+        h->stats.runs_spilled += b->stats.runs_spilled;
+        h->stats.spilled_bytes += b->stats.spilled_bytes;
+        free_builder(b);
+    }
+    aml_free(builders);
+
+    // documents added from here on go to new streams
+    h->buffered[0] = h->buffered[1] = 0;
+    snprintf(h->filename, h->filename_len+40, "%s_data", h->base_filename);
+    h->term_data = open_sorted(h->filename, compare_term_data, h->buffer_size, io_prefix());
+    snprintf(h->filename, h->filename_len+40, "%s_gbl", h->base_filename);
+    h->global_data = open_sorted(h->filename, compare_global_data, h->buffer_size/10, io_prefix());
+    if(!ok) {
+        remove_run(h, h->checkpoint.num_runs);
+        return false;
+    }
+
+    sil_checkpoint_t *c = &h->checkpoint;
+    sil_checkpoint_t previous = *c;
+    c->num_runs++;
+    c->max_id = h->max_id;
+    c->total_documents = h->total_documents;
+    c->total_terms = h->total_terms;
+    if(write_manifest(h, NULL))
+        return true;
+    *c = previous;
+    remove_run(h, c->num_runs);
+    return false;
+}
+
+/* Once buffer_size bytes of postings are written since the last checkpoint, make the term
+   files durable up to term (the last one given to e) and record how far they got.  False if
+   they could not be recorded, in which case the manifest still has the previous checkpoint. */
+static bool checkpoint_terms(sil_search_builder_t *h, term_encoder_t *e, const char *term) {
+    sil_checkpoint_t *c = &h->checkpoint;
+    if(e->offs - sizeof(uint32_t) - c->data_bytes < h->buffer_size)
+        return true;
+    term_encoder_flush(e);
+    if(fflush(e->out_idx) || fsync(fileno(e->out_idx)) ||
+       fflush(e->out_data) || fsync(fileno(e->out_data)))
+        return false;
+    sil_checkpoint_t previous = *c;
+    c->terms_written = e->total_terms;
+    c->idx_bytes = ftell(e->out_idx);
+    c->data_bytes = ftell(e->out_data);
+    if(write_manifest(h, term))
+        return true;
+    *c = previous;
+    return false;
+}
+
+// open a term file written up to length bytes before a resumed destroy
+static FILE *reopen_term_file(sil_search_builder_t *h, const char *suffix, uint64_t length) {
+    snprintf(h->filename, h->filename_len+40, "%s%s", h->base_filename, suffix);
+    FILE *out = fopen(h->filename, "r+b");
+    if(!out)
+        return NULL;
+    if(ftruncate(fileno(out), length) || fseek(out, 0, SEEK_END)) {
+        fclose(out);
+        return NULL;
+    }
+    return out;
+}
+
+// the static ranks of every run
+static void load_checkpoint_ranks(sil_search_builder_t *h) {
+    aml_buffer_clear(h->static_ranks);
+    for(uint32_t i=0; i<h->checkpoint.num_runs; i++) {
+        checkpoint_filename(h, i, "_ranks");
+        size_t len = 0;
+        char *ranks = io_read_file(&len, h->filename);
+        if(!ranks)
+            continue;
+        aml_buffer_append(h->static_ranks, ranks, len);
+        aml_free(ranks);
+    }
+}
+
+static void remove_checkpoint_files(sil_search_builder_t *h) {
+    for(uint32_t i=0; i<h->checkpoint.num_runs; i++)
+        remove_run(h, i);
+    snprintf(h->filename, h->filename_len+40, "%s_manifest", h->base_filename);
+    remove(h->filename);
+}
+
+// the length of the file filename, 0 if it does not exist
+static uint64_t file_length(const char *filename) {
+    struct stat st;
+    return stat(filename, &st) == 0 ? (uint64_t)st.st_size : 0;
+}
+
+sil_search_builder_t *sil_search_builder_resume(const char *filename,
+                                                const sil_search_builder_options_t *options,
+                                                size_t *num_documents) {
+    if(!options->checkpoints || options->intern_terms)
+        return NULL;
+    size_t len = strlen(filename) + 50;
+    char *name = (char *)aml_malloc(len);
+    snprintf(name, len, "%s_manifest", filename);
+    size_t length = 0;
+    char *manifest = io_read_file(&length, name);
+    sil_checkpoint_t c;
+    bool ok = manifest && length >= sizeof(c);
+    if(ok) {
+        memcpy(&c, manifest, sizeof(c));
+        ok = c.magic == SIL_CHECKPOINT_MAGIC && c.phase <= SIL_CHECKPOINT_ENCODED &&
+             length == sizeof(c) + c.last_term_length &&
+             (!c.last_term_length || !manifest[length-1]);
+    }
+    // every run must still be there
+    for(uint32_t i=0; ok && i<c.num_runs; i++) {
+        snprintf(name, len, "%s_checkpoint_%u_gbl", filename, i);
+        ok = io_file_exists(name);
+        snprintf(name, len, "%s_checkpoint_%u_data", filename, i);
+        ok = ok && io_file_exists(name);
+    }
+    if(!ok) {
+        if(manifest)
+            aml_free(manifest);
+        aml_free(name);
+        return NULL;
+    }
+
+    sil_search_builder_t *h = sil_search_builder_ext_init(filename, options);
+    h->checkpoint = c;
+    h->max_id = c.max_id;
+    h->total_documents = c.total_documents;
+    h->total_terms = c.total_terms;
+    if(c.phase == SIL_CHECKPOINT_TERMS && c.terms_written) {
+        // the terms are started over if the files do not hold the terms recorded
+        snprintf(name, len, "%s_term_idx", filename);
+        bool written = c.last_term_length && file_length(name) >= c.idx_bytes;
+        snprintf(name, len, "%s_term_data", filename);
+        written = written && file_length(name) >= c.data_bytes;
+        if(written)
+            h->last_term = aml_strdup(manifest + sizeof(c));
+        else {
+            h->checkpoint.terms_written = 0;
+            h->checkpoint.idx_bytes = h->checkpoint.data_bytes = 0;
+        }
+    }
+    *num_documents = c.total_documents;
+    aml_free(manifest);
+    aml_free(name);
+    return h;
+}
+
+void sil_search_builder_destroy(sil_search_builder_t *h) {
+    if(h->parent) {
+        finish_thread_builder(h);
+        return;
+    }
+    end_phase(h, &h->stats.ingest, NULL);
+    _finish_document(h); // finish the last document
+    if(h->options.intern_terms)
+        finish_interned_terms(h);
+
+    // the builder and every thread builder, each contributes a sorted stream
+    aml_buffer_append(h->thread_builders, &h, sizeof(h));
+    sil_search_builder_t **builders = (sil_search_builder_t **)aml_buffer_data(h->thread_builders);
+    size_t num_builders = aml_buffer_length(h->thread_builders) / sizeof(sil_search_builder_t *);
+    // this builder's stream goes first
+    for(size_t i=num_builders-1; i>0; i--)
+        builders[i] = builders[i-1];
+    builders[0] = h;
+    for(size_t i=1; i<num_builders; i++) {
+        h->stats.sorted_bytes += builders[i]->stats.sorted_bytes;
+        h->stats.runs_spilled += builders[i]->stats.runs_spilled;
+        h->stats.spilled_bytes += builders[i]->stats.spilled_bytes;
+    }
+    sil_search_builder_stats_t *stats = h->options.collect_stats ? &h->stats : NULL;
+
+    /* With checkpoints every document goes to a last run before anything is written, and
+       each step below is skipped if a resumed destroy already finished it. */
+    bool checkpoints = uses_checkpoints(h);
+    sil_checkpoint_t *c = &h->checkpoint;
+    size_t total_documents = 0, total_terms_in_documents = 0;
+    uint32_t max_id = 0;
+    if(!checkpoints || c->phase == SIL_CHECKPOINT_RUNS) {
+        for(size_t i=0; i<num_builders; i++) {
+            total_documents += builders[i]->total_documents;
+            total_terms_in_documents += builders[i]->total_terms;
+            if(builders[i]->max_id > max_id)
+                max_id = builders[i]->max_id;
+        }
+    }
+    /* when a step cannot be recorded, destroy stops without writing the image and a later
+       build resumes from the last step the manifest has */
+    bool recorded = true;
+    if(checkpoints && c->phase == SIL_CHECKPOINT_RUNS) {
+        sil_checkpoint_t previous = *c;
+        recorded = write_run(h, builders, num_builders);
+        if(recorded) {
+            c->num_runs++;
+            c->phase = SIL_CHECKPOINT_GLOBALS;
+            c->max_id = max_id;
+            c->total_documents = total_documents;
+            c->total_terms = total_terms_in_documents;
+            recorded = write_manifest(h, NULL);
+        }
+        if(!recorded) {
+            *c = previous;
+            remove_run(h, c->num_runs);
+            for(size_t i=1; i<num_builders; i++)
+                free_builder(builders[i]);
+            free_builder(h);
+            return;
+        }
+    }
+    else if(checkpoints) {
+        // documents added after the runs were complete are not part of the image
+        for(size_t i=0; i<num_builders; i++) {
+            io_in_destroy(io_out_in(builders[i]->global_data));
+            io_in_destroy(io_out_in(builders[i]->term_data));
+        }
+    }
+    if(checkpoints) {
+        max_id = c->max_id;
+        total_documents = c->total_documents;
+        total_terms_in_documents = c->total_terms;
+    }
+
+    io_record_t *r;
+    aml_buffer_t *key = aml_buffer_init(128);
+    io_in_t **in = (io_in_t **)aml_zalloc(sizeof(io_in_t *) * num_builders);
+    sorted_merge_t m;
+    FILE *out_idx, *out_data, *out_gbl, *out_emb, *out_content;
+    term_encoder_t encoder;
+
+    uint64_t total_embeddings = 0;
+    uint64_t content_offset = 0;
+    sil_search_builder_phase_t merged;  // the merge phase as of the start of a write
+
+    if(!checkpoints || c->phase == SIL_CHECKPOINT_GLOBALS) {
+        if(checkpoints)
+            merge_init_runs(&m, h, "_gbl", compare_global_data);
+        else {
+            for(size_t i=0; i<num_builders; i++)
+                in[i] = io_out_in(builders[i]->global_data);
+            merge_init(&m, in, num_builders, compare_global_data, true);
+        }
+        end_phase(h, &h->stats.sort, NULL);
+        merged = h->stats.merge;
+        merge_timing(&m, stats ? &stats->merge : NULL);
+        snprintf(h->filename, h->filename_len+40, "%s_gbl", h->base_filename);
+        out_gbl = fopen(h->filename, "wb");
+        snprintf(h->filename, h->filename_len+40, "%s_embeddings", h->base_filename);
+        out_emb = fopen(h->filename, "wb");
+        snprintf(h->filename, h->filename_len+40, "%s_content", h->base_filename);
+        out_content = fopen(h->filename, "wb");
+        content_writer_t content_out;
+        content_writer_init(&content_out, out_content, &h->options);
+        column_writer_t columns_out;
+        column_writer_init(&columns_out, h->options.columns, h->options.num_columns);
+
+        while((r=merge_next(&m, NULL)) != NULL) {
+            sil_global_header_t *gh = ( sil_global_header_t *)r->record;
+            char *main_global_data = r->record;
+            uint32_t main_global_length = gh->embeddings_offset;
+            uint32_t content_length = gh->content_offset;
+            int8_t *embedding_data = (int8_t *)(main_global_data + main_global_length);
+            char *content_data = (char *)(embedding_data + (gh->num_embeddings * 512));
+
+            gh->content_offset = content_offset;
+            gh->embeddings_offset = total_embeddings;
+
+            uint32_t *id = (uint32_t *)(main_global_data + sizeof(sil_global_header_t));
+
+            fwrite(&main_global_length, sizeof(main_global_length), 1, out_gbl);
+            fwrite(main_global_data, main_global_length, 1, out_gbl);
+
+            fwrite(embedding_data, gh->num_embeddings*512, 1, out_emb);
+            content_writer_write(&content_out, content_data, content_length);
+            column_writer_row(&columns_out, content_data + content_length);
+
+            total_embeddings += gh->num_embeddings;
+            content_offset += content_length;
+        }
+        merge_destroy(&m);
+        content_writer_finish(&content_out, h->base_filename);
+        column_writer_finish(&columns_out, h->base_filename);
+        fclose(out_gbl);
+        fclose(out_emb);
+        fclose(out_content);
+        if(checkpoints) {
+            // the global files are complete once they are durable
+            static const char *suffixes[] = { "_gbl", "_embeddings", "_content",
+                                              "_content_blocks", "_columns" };
+            for(size_t i=0; i<sizeof(suffixes)/sizeof(suffixes[0]); i++) {
+                snprintf(h->filename, h->filename_len+40, "%s%s", h->base_filename, suffixes[i]);
+                FILE *f = fopen(h->filename, "rb");
+                if(f) {
+                    fsync(fileno(f));
+                    fclose(f);
+                }
+            }
+            c->phase = SIL_CHECKPOINT_TERMS;
+            c->terms_written = 0;
+            c->idx_bytes = c->data_bytes = 0;
+            recorded = write_manifest(h, NULL);
+        }
+        end_phase(h, &h->stats.global_write, &merged);
+    }
+
+    uint32_t total_terms = c->terms_written;
+    if(recorded && (!checkpoints || c->phase == SIL_CHECKPOINT_TERMS)) {
+        out_idx = out_data = NULL;
+        if(h->last_term) {
+            out_idx = reopen_term_file(h, "_term_idx", c->idx_bytes);
+            out_data = reopen_term_file(h, "_term_data", c->data_bytes);
+        }
+        if(!out_idx || !out_data) {
+            // nothing to resume from, start the terms over
+            if(out_idx)
+                fclose(out_idx);
+            if(out_data)
+                fclose(out_data);
+            if(h->last_term)
+                aml_free(h->last_term);
+            h->last_term = NULL;
+            c->terms_written = 0;
+            c->idx_bytes = c->data_bytes = 0;
+            snprintf(h->filename, h->filename_len+40, "%s_term_idx", h->base_filename);
+            out_idx = fopen(h->filename, "wb");
+            snprintf(h->filename, h->filename_len+40, "%s_term_data", h->base_filename);
+            out_data = fopen(h->filename, "wb");
+        }
+
+        term_encoder_init(&encoder, &h->options, out_idx, out_data,
+                          h->options.collect_stats ? &h->stats.histograms : NULL);
+        encoder.offs += c->data_bytes;
+        encoder.total_terms = c->terms_written;
+        if(h->options.intern_terms) {
+            aml_buffer_t *terms = aml_buffer_init(1024*1024);
+            interned_postings_t postings;
+            open_interned_postings(h, builders, num_builders, terms, &postings);
+            end_phase(h, &h->stats.sort, NULL);
+            merged = h->stats.merge;
+            // ordinals follow the sorted terms, so the terms are walked alongside the postings
+            const char *term = (const char *)aml_buffer_data(terms);
+            uint32_t ordinal = 0;
+            interned_term_data_t *d = next_interned_posting(&postings);
+            while(d != NULL) {
+                uint32_t t = d->term;
+                term_encoder_posting(&encoder, &d->data);
+                while((d=next_interned_posting(&postings)) != NULL && d->term == t)
+                    term_encoder_posting(&encoder, &d->data);
+                for(; ordinal < t; ordinal++)
+                    term += strlen(term) + 1;
+                term_encoder_term(&encoder, term, strlen(term)+1);
+            }
+            close_interned_postings(h, &postings);
+            aml_buffer_destroy(terms);
+        }
+        else {
+            if(checkpoints)
+                merge_init_runs(&m, h, "_data", compare_term_data);
+            else {
+                for(size_t i=0; i<num_builders; i++)
+                    in[i] = io_out_in(builders[i]->term_data);
+                merge_init(&m, in, num_builders, compare_term_data, true);
+            }
+            end_phase(h, &h->stats.sort, NULL);
+            merged = h->stats.merge;
+            merge_timing(&m, stats ? &stats->merge : NULL);
+            // terms up to the last one written before the checkpoint are skipped
+            const char *skip = h->last_term;
+            r=merge_next(&m, NULL);
+            while(r != NULL) {
+                aml_buffer_set(key, r->record+sizeof(term_data_t), r->length-sizeof(term_data_t));
+                if(skip && strcmp(aml_buffer_data(key), skip) <= 0) {
+                    while((r=merge_next(&m, NULL)) != NULL &&
+                          !strcmp(r->record+sizeof(term_data_t), aml_buffer_data(key)))
+                        ;
+                    continue;
+                }
+                skip = NULL;
+                term_encoder_posting(&encoder, (term_data_t *)r->record);
+                while((r=merge_next(&m, NULL)) != NULL &&
+                      !strcmp(r->record+sizeof(term_data_t), aml_buffer_data(key))) {
+                    term_encoder_posting(&encoder, (term_data_t *)r->record);
+                }
+                term_encoder_term(&encoder, aml_buffer_data(key), aml_buffer_length(key));
+                if(checkpoints && !(recorded=checkpoint_terms(h, &encoder, aml_buffer_data(key))))
+                    break;
+            }
+            merge_destroy(&m);
+        }
+        term_encoder_finish(&encoder);
+        total_terms = encoder.total_terms;
+        if(checkpoints) {
+            recorded = sync_close(out_idx) && recorded;
+            recorded = sync_close(out_data) && recorded;
+            if(recorded) {
+                c->phase = SIL_CHECKPOINT_ENCODED;
+                c->terms_written = total_terms;
+                recorded = write_manifest(h, NULL);
+            }
+        }
+        else {
+            fclose(out_idx);
+            fclose(out_data);
+        }
+        end_phase(h, &h->stats.term_encode, &merged);
+    }
+    aml_free(in);
+    aml_buffer_destroy(key);
+    if(!recorded) {
+        for(size_t i=1; i<num_builders; i++)
+            free_builder(builders[i]);
+        free_builder(h);
+        return;
+    }
+
+    snprintf(h->filename, h->filename_len+40, "%s_stats.txt", h->base_filename);
+    write_stats(h->filename, total_terms, total_documents, total_terms_in_documents, max_id,
+                image_flags(&h->options));
+
+    if(h->options.static_rank_order) {
+        if(checkpoints)
+            load_checkpoint_ranks(h);
+        else {
+            for(size_t i=1; i<num_builders; i++)
+                aml_buffer_append(h->static_ranks, aml_buffer_data(builders[i]->static_ranks),
+                                  aml_buffer_length(builders[i]->static_ranks));
+        }
+        reorder_written_image(h->base_filename, &h->options, static_rank_order, h->static_ranks);
+    }
+    else if(h->options.reorder_ids)
+        reorder_written_image(h->base_filename, &h->options, bisection_order, NULL);
+    else {
+        snprintf(h->filename, h->filename_len+40, "%s_id_map", h->base_filename);
+        remove(h->filename);
+    }
+    if(checkpoints)
+        remove_checkpoint_files(h);
+    end_phase(h, &h->stats.reorder, NULL);
+
+    if(stats) {
+        for(size_t i=0; i<sizeof(image_suffixes)/sizeof(image_suffixes[0]); i++) {
+            snprintf(h->filename, h->filename_len+40, "%s%s", h->base_filename, image_suffixes[i]);
+            stats->bytes_written += file_length(h->filename);
+        }
+        if(h->options.stats_json) {
+            snprintf(h->filename, h->filename_len+40, "%s_stats.json", h->base_filename);
+            write_stats_json(h->filename, stats, total_terms, total_documents);
+        }
+        if(h->options.stats)
+            *h->options.stats = *stats;
+    }
+
+    for(size_t i=1; i<num_builders; i++)
+        free_builder(builders[i]);
+    free_builder(h);
+}
+
+static inline bool bit_set(const uint64_t *bits, uint32_t id) {
+    return (bits[id >> 6] >> (id & 63)) & 1;
+}
+
+/* The ids each image keeps in a merge, set when no later image has the id and the id is
+   neither deleted from the image nor dropped by its deleted bitmap (if any).  Every bitmap
+   covers ids up to max_id. */
+static uint64_t **merge_kept_ids(sil_search_image_t **images, const uint64_t **deleted,
+                                 size_t num_images, uint32_t max_id) {
+    size_t num_words = (max_id >> 6) + 1;
+    uint64_t *seen = (uint64_t *)aml_zalloc(sizeof(uint64_t) * num_words);
+    uint64_t **kept = (uint64_t **)aml_malloc(sizeof(uint64_t *) * num_images);
+    for(size_t i=num_images; i-- > 0;) {
+        kept[i] = (uint64_t *)aml_zalloc(sizeof(uint64_t) * num_words);
+        uint32_t num_ids;
+        const uint32_t *ids = sil_search_image_ids(images[i], &num_ids);
+        for(uint32_t j=0; j<num_ids; j++) {
+            uint32_t id = ids[j];
+            if(bit_set(seen, id))
+                continue;
+            seen[id >> 6] |= 1ULL << (id & 63);
+            if((!deleted || !deleted[i] || !bit_set(deleted[i], id)) &&
+               !sil_search_image_is_deleted(images[i], id))
+                kept[i][id >> 6] |= 1ULL << (id & 63);
+        }
+    }
+    aml_free(seen);
+    return kept;
+}
+
+// move the cursor of image i to its next kept posting
+static bool merge_next_kept(sil_term_t *t, const uint64_t *kept) {
+    while(t->c.advance((atl_cursor_t *)t)) {
+        if(bit_set(kept, t->c.id))
+            return true;
+    }
+    return false;
+}
+
+/* Append the current posting of t (as id) to bh as the records the builder would have
+   spilled for it: the value (if any) and then each position, or just the value. */
+static void posting_records(aml_buffer_t *bh, sil_term_t *t, uint32_t id) {
+    sil_term_ext_t *ext = (sil_term_ext_t *)t;
+    term_data_t d;
+    d.id = id;
+    d.position = 0;
+    d.value = t->value;
+    if(ext->wp == ext->p) {
+        aml_buffer_append(bh, &d, sizeof(d));
+        return;
+    }
+    if(t->value)
+        aml_buffer_append(bh, &d, sizeof(d));
+    d.value = 0;
+    uint8_t *wp = ext->wp;
+    uint32_t pos = ext->first_base;
+    while(wp < ext->p) {
+        uint32_t delta;
+        wp = __decode_high_bit32(&delta, wp);
+        pos += delta;
+        d.position = pos;
+        aml_buffer_append(bh, &d, sizeof(d));
+    }
+}
+
+static inline void merge_posting(term_encoder_t *e, sil_term_t *t) {
+    posting_records(e->reading->postings, t, t->c.id);
+}
+
+static FILE *open_image_file(char *name, size_t name_len, const char *filename, const char *suffix) {
+    snprintf(name, name_len, "%s%s", filename, suffix);
+    return fopen(name, "wb");
+}
+
+static size_t file_size(FILE *out) {
+    long size = ftell(out);
+    return size > 0 ? (size_t)size : 0;
+}
+
+bool sil_search_builder_merge(const char *filename, sil_search_image_t **images,
+                              const uint64_t **deleted, size_t num_images,
+                              const sil_search_builder_options_t *options,
+                              sil_search_builder_merge_stats_t *stats) {
+    sil_search_builder_options_t default_options;
+    if(!options) {
+        sil_search_builder_options_init(&default_options);
+        options = &default_options;
+    }
+    size_t name_len = strlen(filename) + 40;
+    char *name = (char *)aml_malloc(name_len);
+    FILE *out_gbl = open_image_file(name, name_len, filename, "_gbl");
+    FILE *out_emb = open_image_file(name, name_len, filename, "_embeddings");
+    FILE *out_content = open_image_file(name, name_len, filename, "_content");
+    FILE *out_idx = open_image_file(name, name_len, filename, "_term_idx");
+    FILE *out_data = open_image_file(name, name_len, filename, "_term_data");
+    snprintf(name, name_len, "%s_id_map", filename);
+    remove(name); // the merged ids are the ids of the images
+    if(!out_gbl || !out_emb || !out_content || !out_idx || !out_data) {
+        FILE *files[] = { out_gbl, out_emb, out_content, out_idx, out_data };
+        for(size_t i=0; i<sizeof(files)/sizeof(files[0]); i++)
+            if(files[i])
+                fclose(files[i]);
+        aml_free(name);
+        return false;
+    }
+
+    uint32_t max_id = 0;
+    for(size_t i=0; i<num_images; i++)
+        if(sil_search_image_max_id(images[i]) > max_id)
+            max_id = sil_search_image_max_id(images[i]);
+    uint64_t **kept = merge_kept_ids(images, deleted, num_images, max_id);
+
+    // the kept ids of each image are disjoint, so the global records interleave by id
+    size_t *next = (size_t *)aml_zalloc(sizeof(size_t) * num_images);
+    aml_buffer_t *content_bh = aml_buffer_init(1024);
+    content_writer_t content_out;
+    content_writer_init(&content_out, out_content, options);
+    column_writer_t columns_out;
+    uint32_t num_columns;
+    const sil_column_t *columns = output_columns(options, num_images ? images[0] : NULL, &num_columns);
+    column_writer_init(&columns_out, columns, num_columns);
+    size_t total_documents = 0, total_terms_in_documents = 0;
+    uint64_t content_offset = 0;
+    uint64_t total_embeddings = 0;
+    uint32_t last_id = 0;
+    while(true) {
+        size_t best = num_images;
+        uint32_t best_id = 0;
+        for(size_t i=0; i<num_images; i++) {
+            uint32_t num_ids;
+            const uint32_t *ids = sil_search_image_ids(images[i], &num_ids);
+            while(next[i] < num_ids && !bit_set(kept[i], ids[next[i]]))
+                next[i]++;
+            if(next[i] < num_ids && (best == num_images || ids[next[i]] < best_id)) {
+                best = i;
+                best_id = ids[next[i]];
+            }
+        }
+        if(best == num_images)
+            break;
+        next[best]++;
+
+        uint32_t length;
+        sil_search_image_t *img = images[best];
+        const sil_global_header_t *gh = sil_search_image_global(&length, img, best_id);
+        const char *content = sil_search_image_content_copy(img, gh, content_bh);
+        uint32_t content_length = sizeof(uint32_t) + (*(uint32_t *)content);
+        sil_global_header_t header = *gh;
+        header.content_offset = content_offset;
+        header.embeddings_offset = total_embeddings;
+        uint32_t record_length = sizeof(header) + length;
+        fwrite(&record_length, sizeof(record_length), 1, out_gbl);
+        fwrite(&header, sizeof(header), 1, out_gbl);
+        fwrite(gh+1, length, 1, out_gbl);
+        fwrite(sil_search_image_embeddings(img, gh), gh->num_embeddings*512, 1, out_emb);
+        content_writer_write(&content_out, content, content_length);
+        column_writer_copy(&columns_out, img, next[best]-1);
+
+        total_embeddings += gh->num_embeddings;
+        content_offset += content_length;
+        total_documents++;
+        total_terms_in_documents += gh->document_length;
+        last_id = best_id;
+    }
+    size_t output_bytes = content_writer_finish(&content_out, filename);
+    output_bytes += column_writer_finish(&columns_out, filename);
+    aml_buffer_destroy(content_bh);
+    output_bytes += file_size(out_gbl) + file_size(out_emb) + file_size(out_content);
+    fclose(out_gbl);
+    fclose(out_emb);
+    fclose(out_content);
+
+    // walk the sorted terms of every image together
+    char ***terms = (char ***)aml_malloc(sizeof(char **) * num_images);
+    char ***eterms = (char ***)aml_malloc(sizeof(char **) * num_images);
+    for(size_t i=0; i<num_images; i++) {
+        size_t num_terms;
+        terms[i] = sil_search_image_terms(images[i], &num_terms);
+        eterms[i] = terms[i] + num_terms;
+    }
+    sil_term_t **cursors = (sil_term_t **)aml_malloc(sizeof(sil_term_t *) * num_images);
+    size_t *owners = (size_t *)aml_malloc(sizeof(size_t) * num_images);
+    aml_pool_t *pool = aml_pool_init(1024*64);
+    term_encoder_t encoder;
+    term_encoder_init(&encoder, options, out_idx, out_data, NULL);
+    while(true) {
+        const char *term = NULL;
+        for(size_t i=0; i<num_images; i++)
+            if(terms[i] < eterms[i] && (!term || strcmp(*terms[i], term) < 0))
+                term = *terms[i];
+        if(!term)
+            break;
+
+        aml_pool_clear(pool);
+        size_t num_cursors = 0;
+        for(size_t i=0; i<num_images; i++) {
+            if(terms[i] == eterms[i] || strcmp(*terms[i], term))
+                continue;
+            sil_term_t *t = sil_search_image_term(images[i], pool, *terms[i]);
+            if(t && merge_next_kept(t, kept[i])) {
+                cursors[num_cursors] = t;
+                owners[num_cursors++] = i;
+            }
+            else
+                sil_search_image_term_release(t);
+        }
+        size_t posted = num_cursors;
+        while(num_cursors) {
+            size_t best = 0;
+            for(size_t i=1; i<num_cursors; i++)
+                if(cursors[i]->c.id < cursors[best]->c.id)
+                    best = i;
+            merge_posting(&encoder, cursors[best]);
+            if(!merge_next_kept(cursors[best], kept[owners[best]])) {
+                sil_search_image_term_release(cursors[best]);
+                num_cursors--;
+                cursors[best] = cursors[num_cursors];
+                owners[best] = owners[num_cursors];
+            }
+        }
+        // a term is dropped along with the last of its documents
+        if(posted)
+            term_encoder_term(&encoder, term, strlen(term)+1);
+        for(size_t i=0; i<num_images; i++)
+            if(terms[i] < eterms[i] && !strcmp(*terms[i], term))
+                terms[i]++;
+    }
+    term_encoder_finish(&encoder);
+    output_bytes += file_size(out_idx) + file_size(out_data);
+    fclose(out_idx);
+    fclose(out_data);
+
+    if(stats) {
+        memset(stats, 0, sizeof(*stats));
+        for(size_t i=0; i<num_images; i++) {
+            stats->input_documents += sil_search_image_total_documents(images[i]);
+            stats->input_bytes += sil_search_image_size(images[i]);
+        }
+        stats->documents = total_documents;
+        stats->output_bytes = output_bytes;
+    }
+
+    snprintf(name, name_len, "%s_stats.txt", filename);
+    write_stats(name, encoder.total_terms, total_documents, total_terms_in_documents, last_id,
+                image_flags(options));
+
+    aml_pool_destroy(pool);
+    aml_free(owners);
+    aml_free(cursors);
+    aml_free(eterms);
+    aml_free(terms);
+    aml_free(next);
+    for(size_t i=0; i<num_images; i++)
+        aml_free(kept[i]);
+    aml_free(kept);
+    aml_free(name);
+    return true;
+}
+
+/*
+    Recursive graph bisection (Dhulipala et al., "Compressing Graphs and Indexes with
+    Recursive Graph Bisection").  Each document is the list of terms it shares with at least
+    one other document.  A range of documents is split in halves and the cost of a term is
+    estimated as the bits of its gaps, degree * log2(n / (degree + 1)) in each half.  The
+    documents of each half are sorted by how much moving them to the other half would save
+    and swapped in pairs while the pair saves something, a few times over, before each half
+    is split the same way.
+*/
+#define REORDER_ITERATIONS 20
+#define REORDER_MIN_DOCUMENTS 16
+
+typedef struct {
+    double gain;
+    uint32_t document;
+} reorder_gain_t;
+
+typedef struct {
+    uint32_t *offsets;           // the terms of document i are terms[offsets[i]..offsets[i+1])
+    uint32_t *terms;
+    uint32_t *left_degree;       // per term, documents of the left half having it
+    uint32_t *right_degree;
+    reorder_gain_t *gains;
+} bisection_t;
+
+static inline double gap_cost(uint32_t degree, uint32_t n) {
+    return degree * log2((double)n / (degree + 1));
+}
+
+static inline bool compare_gains(const reorder_gain_t *a, const reorder_gain_t *b) {
+    if(a->gain != b->gain)
+        return a->gain > b->gain;
+    return a->document < b->document;
+}
+
+macro_sort(sort_reorder_gains, reorder_gain_t, compare_gains);
+
+static inline bool compare_documents(const uint32_t *a, const uint32_t *b) {
+    return *a < *b;
+}
+
+macro_sort(sort_reorder_documents, uint32_t, compare_documents);
+
+// the saving of moving each document of from (with n_from documents) to the other half
+static void move_gains(bisection_t *b, reorder_gain_t *gains, uint32_t *docs, uint32_t n,
+                       uint32_t *from_degree, uint32_t n_from, uint32_t *to_degree, uint32_t n_to) {
+    for(uint32_t i=0; i<n; i++) {
+        uint32_t d = docs[i];
+        double gain = 0.0;
+        for(uint32_t k=b->offsets[d]; k<b->offsets[d+1]; k++) {
+            uint32_t t = b->terms[k];
+            gain += gap_cost(from_degree[t], n_from) + gap_cost(to_degree[t], n_to) -
+                    gap_cost(from_degree[t]-1, n_from) - gap_cost(to_degree[t]+1, n_to);
+        }
+        gains[i].gain = gain;
+        gains[i].document = d;
+    }
+    sort_reorder_gains(gains, n);
+}
+
+static void bisect(bisection_t *b, uint32_t *docs, uint32_t n) {
+    if(n <= REORDER_MIN_DOCUMENTS)
+        return;
+    uint32_t *left = docs, *right = docs + n/2;
+    uint32_t nl = n/2, nr = n - nl;
+    reorder_gain_t *left_gains = b->gains, *right_gains = b->gains + nl;
+    for(uint32_t iteration=0; iteration<REORDER_ITERATIONS; iteration++) {
+        for(uint32_t i=0; i<n; i++) {
+            uint32_t d = docs[i];
+            for(uint32_t k=b->offsets[d]; k<b->offsets[d+1]; k++)
+                b->left_degree[b->terms[k]] = b->right_degree[b->terms[k]] = 0;
+        }
+        for(uint32_t i=0; i<n; i++) {
+            uint32_t d = docs[i];
+            uint32_t *degree = i < nl ? b->left_degree : b->right_degree;
+            for(uint32_t k=b->offsets[d]; k<b->offsets[d+1]; k++)
+                degree[b->terms[k]]++;
+        }
+        move_gains(b, left_gains, left, nl, b->left_degree, nl, b->right_degree, nr);
+        move_gains(b, right_gains, right, nr, b->right_degree, nr, b->left_degree, nl);
+        uint32_t swapped = 0;
+        while(swapped < nl && swapped < nr &&
+              left_gains[swapped].gain + right_gains[swapped].gain > 0.0)
+            swapped++;
+        if(!swapped)
+            break;
+        for(uint32_t i=0; i<nl; i++)
+            left[i] = i < swapped ? right_gains[i].document : left_gains[i].document;
+        for(uint32_t i=0; i<nr; i++)
+            right[i] = i < swapped ? left_gains[i].document : right_gains[i].document;
+    }
+    // keep the original order within each half where nothing says otherwise
+    sort_reorder_documents(left, nl);
+    sort_reorder_documents(right, nr);
+    bisect(b, left, nl);
+    bisect(b, right, nr);
+}
+
+/* The documents of img (by index into ids) in their new order.  Terms held by a single
+   document (or by every document) cannot be helped by any order and are left out. */
+static uint32_t *reorder_documents(sil_search_image_t *img, const uint32_t *ids, uint32_t num_ids) {
+    uint32_t *index = (uint32_t *)aml_malloc(sizeof(uint32_t) * (sil_search_image_max_id(img)+1));
+    for(uint32_t i=0; i<num_ids; i++)
+        index[ids[i]] = i;
+
+    aml_buffer_t *edges = aml_buffer_init(1024*1024);  // (document, term) pairs
+    aml_pool_t *pool = aml_pool_init(1024*64);
+    size_t num_terms;
+    char **terms = sil_search_image_terms(img, &num_terms);
+    uint32_t num_kept_terms = 0;
+    for(size_t i=0; i<num_terms; i++) {
+        aml_pool_clear(pool);
+        sil_term_t *t = sil_search_image_term(img, pool, terms[i]);
+        if(!t || t->document_frequency < 2 || t->document_frequency >= num_ids) {
+            sil_search_image_term_release(t);
+            continue;
+        }
+        while(t->c.advance((atl_cursor_t *)t)) {
+            uint32_t edge[2] = { index[t->c.id], num_kept_terms };
+            aml_buffer_append(edges, edge, sizeof(edge));
+        }
+        sil_search_image_term_release(t);
+        num_kept_terms++;
+    }
+    aml_pool_destroy(pool);
+
+    bisection_t b;
+    uint32_t *e = (uint32_t *)aml_buffer_data(edges);
+    size_t num_edges = aml_buffer_length(edges) / (sizeof(uint32_t) * 2);
+    b.offsets = (uint32_t *)aml_zalloc(sizeof(uint32_t) * (num_ids+1));
+    b.terms = (uint32_t *)aml_malloc(sizeof(uint32_t) * (num_edges+1));
+    for(size_t i=0; i<num_edges; i++)
+        b.offsets[e[i*2]+1]++;
+    for(uint32_t i=0; i<num_ids; i++)
+        b.offsets[i+1] += b.offsets[i];
+    uint32_t *fill = (uint32_t *)aml_malloc(sizeof(uint32_t) * (num_ids+1));
+    memcpy(fill, b.offsets, sizeof(uint32_t) * (num_ids+1));
+    for(size_t i=0; i<num_edges; i++)
+        b.terms[fill[e[i*2]]++] = e[i*2+1];
+    aml_free(fill);
+    aml_buffer_destroy(edges);
+
+    b.left_degree = (uint32_t *)aml_zalloc(sizeof(uint32_t) * (num_kept_terms+1));
+    b.right_degree = (uint32_t *)aml_zalloc(sizeof(uint32_t) * (num_kept_terms+1));
+    b.gains = (reorder_gain_t *)aml_malloc(sizeof(reorder_gain_t) * (num_ids+1));
+    uint32_t *order = (uint32_t *)aml_malloc(sizeof(uint32_t) * (num_ids+1));
+    for(uint32_t i=0; i<num_ids; i++)
+        order[i] = i;
+    bisect(&b, order, num_ids);
+
+    aml_free(b.gains);
+    aml_free(b.right_degree);
+    aml_free(b.left_degree);
+    aml_free(b.terms);
+    aml_free(b.offsets);
+    aml_free(index);
+    return order;
+}
+
+static inline bool compare_reordered_postings(const term_data_t *a, const term_data_t *b) {
+    if(a->id != b->id)
+        return a->id < b->id;
+    return a->position < b->position;
+}
+
+macro_sort(sort_reordered_postings, term_data_t, compare_reordered_postings);
+
+static uint32_t *bisection_order(sil_search_image_t *img, const uint32_t *ids,
+                                 uint32_t num_ids, void *arg) {
+    (void)arg;
+    return reorder_documents(img, ids, num_ids);
+}
+
+typedef struct {
+    uint32_t rank;
+    uint32_t index;
+} ranked_document_t;
+
+static inline bool compare_static_ranks(const uint64_t *a, const uint64_t *b) {
+    return *a < *b;
+}
+
+macro_sort(sort_static_ranks, uint64_t, compare_static_ranks);
+
+static inline bool compare_ranked_documents(const ranked_document_t *a, const ranked_document_t *b) {
+    if(a->rank != b->rank)
+        return a->rank > b->rank;
+    return a->index < b->index;
+}
+
+macro_sort(sort_ranked_documents, ranked_document_t, compare_ranked_documents);
+
+/* Descending static rank, ties in id order.  arg is the buffer of (id, rank) pairs from
+   sil_search_builder_static_rank, documents without a rank have a rank of 0. */
+static uint32_t *static_rank_order(sil_search_image_t *img, const uint32_t *ids,
+                                   uint32_t num_ids, void *arg) {
+    (void)img;
+    aml_buffer_t *bh = (aml_buffer_t *)arg;
+    const uint32_t *pairs = (const uint32_t *)aml_buffer_data(bh);
+    size_t num_pairs = aml_buffer_length(bh) / (sizeof(uint32_t) * 2);
+    // id in the high half so the pairs sort by id, the highest rank given for an id wins
+    uint64_t *ranks = (uint64_t *)aml_malloc(sizeof(uint64_t) * (num_pairs+1));
+    for(size_t i=0; i<num_pairs; i++)
+        ranks[i] = (((uint64_t)pairs[i*2]) << 32) | pairs[i*2+1];
+    sort_static_ranks(ranks, num_pairs);
+
+    ranked_document_t *docs = (ranked_document_t *)aml_malloc(sizeof(ranked_document_t) * (num_ids+1));
+    size_t r = 0;
+    for(uint32_t i=0; i<num_ids; i++) {
+        docs[i].index = i;
+        docs[i].rank = 0;
+        while(r < num_pairs && (ranks[r] >> 32) < ids[i])
+            r++;
+        while(r < num_pairs && (ranks[r] >> 32) == ids[i])
+            docs[i].rank = (uint32_t)ranks[r++];
+    }
+    sort_ranked_documents(docs, num_ids);
+
+    uint32_t *order = (uint32_t *)aml_malloc(sizeof(uint32_t) * (num_ids+1));
+    for(uint32_t i=0; i<num_ids; i++)
+        order[i] = docs[i].index;
+    aml_free(docs);
+    aml_free(ranks);
+    return order;
+}
+
+bool sil_search_builder_reorder(const char *filename, sil_search_image_t *img,
+                                const sil_search_builder_options_t *options) {
+    return renumber_image(filename, img, options, bisection_order, NULL);
+}
+
+static bool renumber_image(const char *filename, sil_search_image_t *img,
+                           const sil_search_builder_options_t *options,
+                           document_order_t document_order, void *arg) {
+    sil_search_builder_options_t default_options;
+    if(!options) {
+        sil_search_builder_options_init(&default_options);
+        options = &default_options;
+    }
+    size_t name_len = strlen(filename) + 40;
+    char *name = (char *)aml_malloc(name_len);
+    FILE *out_gbl = open_image_file(name, name_len, filename, "_gbl");
+    FILE *out_emb = open_image_file(name, name_len, filename, "_embeddings");
+    FILE *out_content = open_image_file(name, name_len, filename, "_content");
+    FILE *out_idx = open_image_file(name, name_len, filename, "_term_idx");
+    FILE *out_data = open_image_file(name, name_len, filename, "_term_data");
+    FILE *out_map = open_image_file(name, name_len, filename, "_id_map");
+    if(!out_gbl || !out_emb || !out_content || !out_idx || !out_data || !out_map) {
+        FILE *files[] = { out_gbl, out_emb, out_content, out_idx, out_data, out_map };
+        for(size_t i=0; i<sizeof(files)/sizeof(files[0]); i++)
+            if(files[i])
+                fclose(files[i]);
+        aml_free(name);
+        return false;
+    }
+
+    // deleted documents are left out before the order is found
+    uint32_t num_image_ids, num_ids = 0;
+    const uint32_t *image_ids = sil_search_image_ids(img, &num_image_ids);
+    uint32_t *ids = (uint32_t *)aml_malloc(sizeof(uint32_t) * (num_image_ids+1));
+    for(uint32_t i=0; i<num_image_ids; i++)
+        if(!sil_search_image_is_deleted(img, image_ids[i]))
+            ids[num_ids++] = image_ids[i];
+    uint32_t *order = document_order(img, ids, num_ids, arg);
+    uint32_t *new_ids = (uint32_t *)aml_zalloc(sizeof(uint32_t) * (sil_search_image_max_id(img)+1));
+    for(uint32_t i=0; i<num_ids; i++)
+        new_ids[ids[order[i]]] = i+1;
+
+    size_t total_terms_in_documents = 0;
+    uint64_t content_offset = 0;
+    uint64_t total_embeddings = 0;
+    aml_buffer_t *content_bh = aml_buffer_init(1024);
+    content_writer_t content_out;
+    content_writer_init(&content_out, out_content, options);
+    column_writer_t columns_out;
+    uint32_t num_columns;
+    const sil_column_t *columns = output_columns(options, img, &num_columns);
+    column_writer_init(&columns_out, columns, num_columns);
+    for(uint32_t i=0; i<num_ids; i++) {
+        uint32_t id = ids[order[i]], new_id = i+1;
+        uint32_t length;
+        const sil_global_header_t *gh = sil_search_image_global(&length, img, id);
+        const char *content = sil_search_image_content_copy(img, gh, content_bh);
+        uint32_t content_length = sizeof(uint32_t) + (*(uint32_t *)content);
+        sil_global_header_t header = *gh;
+        header.content_offset = content_offset;
+        header.embeddings_offset = total_embeddings;
+        uint32_t record_length = sizeof(header) + length;
+        fwrite(&record_length, sizeof(record_length), 1, out_gbl);
+        fwrite(&header, sizeof(header), 1, out_gbl);
+        fwrite(&new_id, sizeof(new_id), 1, out_gbl);
+        fwrite((const char *)(gh+1) + sizeof(uint32_t), length - sizeof(uint32_t), 1, out_gbl);
+        fwrite(sil_search_image_embeddings(img, gh), gh->num_embeddings*512, 1, out_emb);
+        content_writer_write(&content_out, content, content_length);
+        column_writer_copy(&columns_out, img, sil_search_image_document_index(img, id));
+        fwrite(&id, sizeof(id), 1, out_map);
+
+        total_embeddings += gh->num_embeddings;
+        content_offset += content_length;
+        total_terms_in_documents += gh->document_length;
+    }
+    content_writer_finish(&content_out, filename);
+    column_writer_finish(&columns_out, filename);
+    aml_buffer_destroy(content_bh);
+    fclose(out_gbl);
+    fclose(out_emb);
+    fclose(out_content);
+    fclose(out_map);
+
+    // each term's postings are renumbered and sorted again before they are encoded
+    size_t num_terms;
+    char **terms = sil_search_image_terms(img, &num_terms);
+    aml_pool_t *pool = aml_pool_init(1024*64);
+    aml_buffer_t *records = aml_buffer_init(1024*64);
+    term_encoder_t encoder;
+    term_encoder_init(&encoder, options, out_idx, out_data, NULL);
+    for(size_t i=0; i<num_terms; i++) {
+        aml_pool_clear(pool);
+        aml_buffer_clear(records);
+        sil_term_t *t = sil_search_image_term(img, pool, terms[i]);
+        while(t && t->c.advance((atl_cursor_t *)t))
+            posting_records(records, t, new_ids[t->c.id]);
+        sil_search_image_term_release(t);
+        term_data_t *p = (term_data_t *)aml_buffer_data(records);
+        size_t num_records = aml_buffer_length(records) / sizeof(term_data_t);
+        if(!num_records)
+            continue;
+        sort_reordered_postings(p, num_records);
+        for(size_t j=0; j<num_records; j++)
+            term_encoder_posting(&encoder, p+j);
+        term_encoder_term(&encoder, terms[i], strlen(terms[i])+1);
+    }
+    term_encoder_finish(&encoder);
+    fclose(out_idx);
+    fclose(out_data);
+
+    snprintf(name, name_len, "%s_stats.txt", filename);
+    write_stats(name, encoder.total_terms, num_ids, total_terms_in_documents, num_ids,
+                image_flags(options));
+
+    aml_buffer_destroy(records);
+    aml_pool_destroy(pool);
+    aml_free(new_ids);
+    aml_free(order);
+    aml_free(ids);
+    aml_free(name);
+    return true;
 }
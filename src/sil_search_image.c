@@ -5,10 +5,13 @@
 #include "search-index-library/sil_search_image.h"
 #include "search-index-library/impl/sil_constants.h"
 #include <inttypes.h>
+#include <pthread.h>
 
 #include "the-io-library/io.h"
 #include "a-memory-library/aml_buffer.h"
 #include "the-macro-library/macro_bsearch.h"
+#include "the-macro-library/macro_sort.h"
+#include "the-lz4-library/lz4.h"
 
 static uint8_t *extract_group_bytes(uint8_t **sp, uint8_t *p) {
     uint8_t control = *p++;
@@ -29,13 +32,93 @@ static uint8_t *extract_group_bytes(uint8_t **sp, uint8_t *p) {
     }
 }
 
+/* A decompressed content block in the cache.  Readers take a reference under cache_mutex
+   and copy out of it after unlocking, so a block evicted meanwhile is freed by its last
+   reader. */
+typedef struct cached_block_s cached_block_t;
+
+struct cached_block_s {
+    uint32_t block;
+    uint32_t length;
+    uint32_t refs;                  // the cache's and each reader copying from it
+    cached_block_t *prev, *next;    // most recently used first
+    char data[];
+};
+
+/* The decompressed postings of a cached cold term.  A cursor opening the term takes a
+   reference while it copies them outside cold_mutex, so the term may be evicted meanwhile
+   and whoever drops the last reference frees them. */
+typedef struct {
+    uint32_t refs;
+    char data[];
+} cold_buffer_t;
+
+typedef struct cold_term_s cold_term_t;
+
+struct cold_term_s {
+    const char *compressed;
+    uint32_t compressed_length;
+    uint32_t length;            // of the term header and groups
+    uint32_t accesses;          // halved for every window since epoch
+    uint32_t epoch;             // the window accesses was last counted in
+    cold_buffer_t *cached;      // decompressed copy or NULL
+    cold_term_t *prev, *next;   // cached terms, most recently used first
+};
+
+/* A published table of value updates sorted by term and id.  It is never changed once
+   published and is freed when the image and every cursor reading it have let go of it. */
+typedef struct value_updates_s value_updates_t;
+
+struct value_updates_s {
+    sil_search_image_t *img;
+    uint32_t refs;                     // the image while it is published and each cursor
+    value_updates_t *prev, *next;      // replaced tables which cursors still hold
+    size_t num_updates;
+    sil_value_update_t updates[];
+};
+
+// an update waiting to be published, seq orders updates of the same posting
+typedef struct {
+    sil_value_update_t u;
+    uint32_t seq;
+} pending_update_t;
+
+// set in the offset of a cold term in term_idx, the rest is its index in cold
+#define COLD_TERM 0x8000000000000000ULL
+
+// the id of the top level group at p (shifted into place), returns p past it
+static inline uint8_t *top_group_id(uint32_t *gid, uint8_t *p, uint32_t flags) {
+    if(flags & SIL_IMAGE_FORMAT_V2) {
+        uint16_t v;
+        memcpy(&v, p, sizeof(v));
+        *gid = ((uint32_t)v) << 18;
+        return p + sizeof(v);
+    }
+    *gid = ((uint32_t)p[0]) << 18;
+    return p + 1;
+}
+
 struct sil_search_image_s {
+    char *base;
+    uint32_t flags;
     uint32_t total_terms;
     uint32_t total_documents;
     double average_document_length;
 
-    void **gbls;
-    uint32_t num_gbls;
+    /* The global record of the document at index i of ids starts at gbl_offsets[i] in
+       gbl_data (32 bit offsets unless gbl_data is 4GB or more).  group_start and
+       group_documents locate the ids of a group of 1024 ids, so a lookup indexes a full
+       group directly and otherwise searches the few ids of its group. */
+    uint32_t num_gbls;         // max_id+1
+    uint16_t *group_documents; // documents in each group of 1024 ids
+    uint32_t *group_start;     // index in ids of the first document of each group
+    void *gbl_offsets;
+    bool wide_gbl_offsets;
+    aml_buffer_t *ids;         // ids of the documents in ascending order
+    sil_deleted_t deleted;
+    uint32_t *original_ids;    // by id - 1 when the image was reordered, otherwise NULL
+    uint32_t *reordered;       // (original id, id) pairs sorted by original id
+    uint32_t num_original_ids;
 
     char *gbl_data;
     size_t gbl_data_len;
@@ -46,31 +129,154 @@ struct sil_search_image_s {
     char *content_data;
     size_t content_data_len;
 
+    // content in LZ4 blocks (SIL_IMAGE_CONTENT_BLOCKS)
+    char *content_blocks;       // the _content_blocks file
+    size_t content_blocks_len;
+    uint32_t content_block_size;
+    uint32_t num_content_blocks;
+    const uint64_t *block_offsets;
+
+    // fixed width values by document index (_columns)
+    char *columns_data;
+    size_t columns_data_len;
+    sil_column_t columns[SIL_MAX_COLUMNS];
+    const void *column_values[SIL_MAX_COLUMNS];
+    uint32_t num_columns;
+
+    // decompressed blocks (sil_search_image_content_cache)
+    pthread_mutex_t cache_mutex;
+    cached_block_t **cached;    // by block, NULL if the block is not cached
+    cached_block_t *cache_head, *cache_tail;
+    size_t max_cached;
+    size_t num_cached;
+
     char *term_idx;
     size_t term_idx_len;
     char **terms;
     size_t num_terms;
     char *term_data;
     size_t term_data_len;
+
+    // compressed posting lists (sil_search_image_cold_postings)
+    sil_cold_postings_options_t cold_options;
+    cold_term_t *cold;
+    char *cold_data;
+    size_t cold_data_len;
+    pthread_mutex_t cold_mutex;
+    cold_term_t *lru_head, *lru_tail;
+    size_t cold_accesses;       // within the current window
+    uint32_t cold_epoch;        // the number of windows so far
+    sil_cold_postings_stats_t cold_stats;
+
+    // value updates (sil_search_image_update_value)
+    pthread_mutex_t pending_mutex;
+    aml_buffer_t *pending_updates;  // pending_update_t in the order they were made
+    pthread_mutex_t publish_mutex;
+    pthread_mutex_t updates_mutex;  // held to take or drop a reference to a table
+    value_updates_t *updates;       // the published table
+    value_updates_t *replaced;      // replaced tables which cursors still hold
 };
 
 void sil_search_image_destroy(sil_search_image_t *h) {
-    aml_free(h->gbls);
+    aml_free(h->gbl_offsets);
+    aml_free(h->group_documents);
+    aml_free(h->group_start);
+    if(h->ids)
+        aml_buffer_destroy(h->ids);
+    if(h->deleted.pages) {
+        for(size_t i=0; i<=((h->num_gbls-1) >> SIL_DELETED_PAGE_BITS); i++)
+            aml_free(h->deleted.pages[i]);
+        aml_free(h->deleted.pages);
+    }
+    aml_free(h->original_ids);
+    aml_free(h->reordered);
     aml_free(h->gbl_data);
     free(h->embedding_data);
     aml_free(h->content_data);
+    aml_free(h->content_blocks);
+    free(h->columns_data);
+    while(h->cache_head) {
+        cached_block_t *c = h->cache_head;
+        h->cache_head = c->next;
+        aml_free(c);
+    }
+    aml_free(h->cached);
+    pthread_mutex_destroy(&h->cache_mutex);
+    for(cold_term_t *c = h->lru_head; c; c = c->next)
+        aml_free(c->cached);  // every cursor is done copying
+    aml_free(h->cold);
+    aml_free(h->cold_data);
+    pthread_mutex_destroy(&h->cold_mutex);
+    if(h->pending_updates)
+        aml_buffer_destroy(h->pending_updates);
+    if(h->updates)
+        aml_free(h->updates);
+    for(value_updates_t *u = h->replaced, *next; u; u = next) {
+        next = u->next;
+        aml_free(u);
+    }
+    pthread_mutex_destroy(&h->pending_mutex);
+    pthread_mutex_destroy(&h->publish_mutex);
+    pthread_mutex_destroy(&h->updates_mutex);
     aml_free(h->term_idx);
     aml_free(h->terms);
     aml_free(h->term_data);
     aml_free(h);
 }
 
-const sil_global_header_t * sil_search_image_global(uint32_t *length, sil_search_image_t *h, uint32_t id) {
+// the index of id in ids, UINT32_MAX if the image does not have it
+static inline uint32_t document_index(sil_search_image_t *h, uint32_t id) {
     if(id >= h->num_gbls)
+        return UINT32_MAX;
+    uint32_t gid = id >> 10;
+    uint32_t start = h->group_start[gid], n = h->group_documents[gid];
+    if(n == 1024)
+        return start + (id & 1023);
+    const uint32_t *ids = (const uint32_t *)aml_buffer_data(h->ids) + start;
+    uint32_t lo = 0, hi = n;
+    while(lo < hi) {
+        uint32_t mid = (lo + hi) >> 1;
+        if(ids[mid] < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < n && ids[lo] == id ? start + lo : UINT32_MAX;
+}
+
+uint32_t sil_search_image_document_index(sil_search_image_t *img, uint32_t id) {
+    return document_index(img, id);
+}
+
+const void *sil_search_image_column(sil_search_image_t *img, const char *name,
+                                    sil_column_type_t *type) {
+    for(uint32_t i=0; i<img->num_columns; i++) {
+        if(!strcmp(img->columns[i].name, name)) {
+            if(type)
+                *type = img->columns[i].type;
+            return img->column_values[i];
+        }
+    }
+    return NULL;
+}
+
+uint32_t sil_search_image_num_columns(sil_search_image_t *img) {
+    return img->num_columns;
+}
+
+const sil_column_t *sil_search_image_columns(sil_search_image_t *img) {
+    return img->columns;
+}
+
+const sil_global_header_t * sil_search_image_global(uint32_t *length, sil_search_image_t *h, uint32_t id) {
+    uint32_t index = document_index(h, id);
+    if(index == UINT32_MAX)
         return NULL;
-    char *p = h->gbls[id];
-    if(!p)
-        return NULL;
+    char *p = h->gbl_data;
+    if(h->wide_gbl_offsets)
+        p += ((uint64_t *)h->gbl_offsets)[index];
+    else
+        p += ((uint32_t *)h->gbl_offsets)[index];
     *length = (*(uint32_t *)p);
     return (sil_global_header_t*)(p + sizeof(uint32_t));
 }
@@ -83,69 +289,560 @@ const int8_t *sil_search_image_embeddings(sil_search_image_t *h, const sil_globa
 
 const char *sil_search_image_content(sil_search_image_t *h,
                                      const sil_global_header_t *gh) {
+    if(h->flags & SIL_IMAGE_CONTENT_BLOCKS)
+        return NULL;
     return (char *)(h->content_data + gh->content_offset);
 }
 
+void sil_search_image_content_cache(sil_search_image_t *h, size_t max_blocks) {
+    if(!h->block_offsets || h->cached)
+        return;
+    h->max_cached = max_blocks;
+    if(!max_blocks)
+        return;
+    h->cached = (cached_block_t **)aml_zalloc(sizeof(cached_block_t *) * (h->num_content_blocks+1));
+}
+
+static inline const char *compressed_block(sil_search_image_t *h, uint32_t block, int *length) {
+    *length = (int)(h->block_offsets[block+1] - h->block_offsets[block]);
+    return h->content_data + h->block_offsets[block];
+}
+
+static inline void release_block(cached_block_t *c) {
+    if(__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        aml_free(c);
+}
+
+static inline void block_remove(sil_search_image_t *h, cached_block_t *c) {
+    if(c->prev)
+        c->prev->next = c->next;
+    else
+        h->cache_head = c->next;
+    if(c->next)
+        c->next->prev = c->prev;
+    else
+        h->cache_tail = c->prev;
+    c->prev = c->next = NULL;
+}
+
+static inline void block_push(sil_search_image_t *h, cached_block_t *c) {
+    c->prev = NULL;
+    c->next = h->cache_head;
+    if(h->cache_head)
+        h->cache_head->prev = c;
+    else
+        h->cache_tail = c;
+    h->cache_head = c;
+}
+
+/* The cached copy of block with a reference for the caller.  A block which is not cached is
+   decompressed outside cache_mutex, into the least recently used block when no reader
+   holds it. */
+static cached_block_t *cached_block(sil_search_image_t *h, uint32_t block) {
+    pthread_mutex_lock(&h->cache_mutex);
+    cached_block_t *c = h->cached[block];
+    if(c) {
+        __atomic_add_fetch(&c->refs, 1, __ATOMIC_RELAXED);
+        block_remove(h, c);
+        block_push(h, c);
+        pthread_mutex_unlock(&h->cache_mutex);
+        return c;
+    }
+    c = NULL;
+    if(h->num_cached >= h->max_cached && __atomic_load_n(&h->cache_tail->refs, __ATOMIC_ACQUIRE) == 1) {
+        c = h->cache_tail;
+        block_remove(h, c);
+        h->cached[c->block] = NULL;
+        h->num_cached--;
+    }
+    pthread_mutex_unlock(&h->cache_mutex);
+
+    if(!c)
+        c = (cached_block_t *)aml_malloc(sizeof(cached_block_t) + h->content_block_size);
+    int compressed_length;
+    const char *src = compressed_block(h, block, &compressed_length);
+    int n = LZ4_decompress_safe(src, c->data, compressed_length, h->content_block_size);
+    c->block = block;
+    c->length = n > 0 ? n : 0;
+    c->refs = 2;  // the cache's and the caller's
+
+    pthread_mutex_lock(&h->cache_mutex);
+    if(h->cached[block]) {
+        // another thread cached it first, c is only the caller's
+        c->refs = 1;
+        pthread_mutex_unlock(&h->cache_mutex);
+        return c;
+    }
+    while(h->num_cached >= h->max_cached) {
+        cached_block_t *e = h->cache_tail;
+        block_remove(h, e);
+        h->cached[e->block] = NULL;
+        h->num_cached--;
+        release_block(e);
+    }
+    h->cached[block] = c;
+    h->num_cached++;
+    block_push(h, c);
+    pthread_mutex_unlock(&h->cache_mutex);
+    return c;
+}
+
+// copy len bytes of the uncompressed content from offset to dest through the cache
+static bool read_cached_blocks(sil_search_image_t *h, uint64_t offset, uint32_t len, char *dest) {
+    bool ok = true;
+    while(ok && len) {
+        uint32_t block = offset / h->content_block_size;
+        uint32_t start = offset % h->content_block_size;
+        uint32_t n = h->content_block_size - start;
+        if(n > len)
+            n = len;
+        if(block >= h->num_content_blocks)
+            return false;
+        cached_block_t *c = cached_block(h, block);
+        ok = start + n <= c->length;
+        if(ok)
+            memcpy(dest, c->data + start, n);
+        release_block(c);
+        offset += n;
+        dest += n;
+        len -= n;
+    }
+    return ok;
+}
+
+/* Without a cache the content is decoded into bh.  The block it starts in is decoded once
+   to its end (the length is only known once it is decoded) and the content moved to the
+   front, the blocks after it are decoded in place up to the bytes still needed. */
+static const char *decode_content(sil_search_image_t *h, uint64_t offset, aml_buffer_t *bh) {
+    uint32_t block = offset / h->content_block_size;
+    uint32_t start = offset % h->content_block_size;
+    uint32_t length = 0, have = 0, total = 0;  // total is 0 until the length is decoded
+    while(!total || have < total) {
+        if(block >= h->num_content_blocks)
+            return NULL;
+        uint32_t want = h->content_block_size - start;
+        if(total && total - have < want)
+            want = total - have;
+        char *p = (char *)aml_buffer_resize(bh, have + start + want);
+        int compressed_length;
+        const char *src = compressed_block(h, block, &compressed_length);
+        int decoded = LZ4_decompress_safe_partial(src, p + have, compressed_length, start + want,
+                                                  start + want);
+        if(decoded <= (int)start)
+            return NULL;
+        if(decoded < (int)(start + want))
+            want = decoded - start;  // the last block may be short
+        if(start)
+            memmove(p + have, p + have + start, want);
+        have += want;
+        if(!total && have >= sizeof(length)) {
+            memcpy(&length, p, sizeof(length));
+            total = sizeof(length) + length;
+        }
+        block++;
+        start = 0;
+    }
+    return aml_buffer_resize(bh, total);
+}
+
+const char *sil_search_image_content_copy(sil_search_image_t *h, const sil_global_header_t *gh,
+                                          aml_buffer_t *bh) {
+    uint32_t length;
+    if(!(h->flags & SIL_IMAGE_CONTENT_BLOCKS)) {
+        const char *content = h->content_data + gh->content_offset;
+        memcpy(&length, content, sizeof(length));
+        aml_buffer_set(bh, content, sizeof(length) + length);
+        return aml_buffer_data(bh);
+    }
+    if(!h->block_offsets)
+        return NULL;
+    if(!h->cached)
+        return decode_content(h, gh->content_offset, bh);
+    if(!read_cached_blocks(h, gh->content_offset, sizeof(length), (char *)&length))
+        return NULL;
+    aml_buffer_resize(bh, sizeof(length) + length);
+    char *p = aml_buffer_data(bh);
+    memcpy(p, &length, sizeof(length));
+    if(!read_cached_blocks(h, gh->content_offset + sizeof(length), length, p + sizeof(length)))
+        return NULL;
+    return p;
+}
+
 
 uint32_t sil_search_image_max_id(sil_search_image_t *img) {
     return img->num_gbls;
 }
 
-sil_search_image_t *sil_search_image_init(const char *base) {
-    char *p, *ep, **wp;
-    size_t filename_len = strlen(base)+50;
-    char *filename = (char *)aml_malloc(filename_len);
-    sil_search_image_t *h = (sil_search_image_t *)aml_zalloc(sizeof(*h));
+uint32_t sil_search_image_total_documents(sil_search_image_t *img) {
+    return img->total_documents;
+}
 
-    snprintf(filename, filename_len, "%s_stats.txt", base );
+double sil_search_image_average_document_length(sil_search_image_t *img) {
+    return img->average_document_length;
+}
+
+const uint32_t *sil_search_image_ids(sil_search_image_t *img, uint32_t *num_ids) {
+    *num_ids = aml_buffer_length(img->ids) / sizeof(uint32_t);
+    return (const uint32_t *)aml_buffer_data(img->ids);
+}
+
+char **sil_search_image_terms(sil_search_image_t *img, size_t *num_terms) {
+    *num_terms = img->num_terms;
+    return img->terms;
+}
+
+size_t sil_search_image_size(sil_search_image_t *img) {
+    return img->gbl_data_len + img->embedding_data_len + img->content_data_len +
+           img->content_blocks_len + img->columns_data_len + img->term_idx_len + img->term_data_len +
+           img->cold_data_len;
+}
+
+// the page of deleted documents holding id, allocated by whichever delete gets there first
+static sil_deleted_page_t *deleted_page(sil_search_image_t *img, uint32_t id) {
+    sil_deleted_page_t **pagep = img->deleted.pages + (id >> SIL_DELETED_PAGE_BITS);
+    sil_deleted_page_t *page = __atomic_load_n(pagep, __ATOMIC_ACQUIRE);
+    if(page)
+        return page;
+    sil_deleted_page_t *new_page = (sil_deleted_page_t *)aml_zalloc(sizeof(*new_page));
+    if(__atomic_compare_exchange_n(pagep, &page, new_page, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return new_page;
+    aml_free(new_page);
+    return page;
+}
+
+// mark id (a document of img) deleted, false if it already was
+static bool mark_deleted(sil_search_image_t *img, uint32_t id) {
+    sil_deleted_page_t *page = deleted_page(img, id);
+    uint64_t bit = ((uint64_t)1) << (id & 63);
+    if(__atomic_fetch_or(page->bits + ((id >> 6) & ((1 << (SIL_DELETED_PAGE_BITS - 6)) - 1)), bit,
+                         __ATOMIC_RELAXED) & bit)
+        return false;
+    __atomic_fetch_add(page->group_deleted + ((id >> 10) & ((1 << (SIL_DELETED_PAGE_BITS - 10)) - 1)), 1,
+                       __ATOMIC_RELAXED);
+    __atomic_fetch_add(&img->deleted.num_deleted, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+bool sil_search_image_delete(sil_search_image_t *img, uint32_t id) {
+    uint32_t length;
+    if(!sil_search_image_global(&length, img, id))
+        return false;
+    return mark_deleted(img, id);
+}
+
+bool sil_search_image_is_deleted(sil_search_image_t *img, uint32_t id) {
+    return id < img->num_gbls && sil_deleted_id(&img->deleted, id);
+}
+
+uint32_t sil_search_image_deleted_documents(sil_search_image_t *img) {
+    return __atomic_load_n(&img->deleted.num_deleted, __ATOMIC_RELAXED);
+}
+
+static size_t deleted_words(sil_search_image_t *img) {
+    return ((img->num_gbls-1) >> 6) + 1;
+}
+
+uint32_t sil_search_image_original_id(sil_search_image_t *img, uint32_t id) {
+    if(!img->original_ids || id == 0 || id > img->num_original_ids)
+        return id;
+    return img->original_ids[id-1];
+}
+
+bool sil_search_image_reordered_id(sil_search_image_t *img, uint32_t original_id, uint32_t *id) {
+    uint32_t length;
+    if(!img->original_ids) {
+        *id = original_id;
+        return sil_search_image_global(&length, img, original_id) != NULL;
+    }
+    uint32_t lo = 0, hi = img->num_original_ids;
+    while(lo < hi) {
+        uint32_t mid = lo + ((hi - lo) >> 1);
+        if(img->reordered[mid*2] < original_id)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    if(lo == img->num_original_ids || img->reordered[lo*2] != original_id)
+        return false;
+    *id = img->reordered[lo*2+1];
+    return true;
+}
+
+// written to a temporary file which replaces base_deleted
+bool sil_search_image_save_deleted(sil_search_image_t *img) {
+    size_t len = strlen(img->base) + 20;
+    char *filename = (char *)aml_malloc(len);
+    char *tmp = (char *)aml_malloc(len);
+    snprintf(filename, len, "%s_deleted", img->base);
+    snprintf(tmp, len, "%s_deleted.tmp", img->base);
+    FILE *out = fopen(tmp, "wb");
+    bool ok = out != NULL;
+    if(ok) {
+        // pages nothing was deleted from are written as zeros
+        size_t num_words = deleted_words(img);
+        for(size_t i=0; i<num_words; i++) {
+            const sil_deleted_page_t *page = sil_deleted_page(&img->deleted, (uint32_t)(i << 6));
+            uint64_t w = page ? __atomic_load_n(page->bits + (i & ((1 << (SIL_DELETED_PAGE_BITS - 6)) - 1)),
+                                                __ATOMIC_RELAXED) : 0;
+            ok = fwrite(&w, sizeof(w), 1, out) == 1 && ok;
+        }
+        ok = fclose(out) == 0 && ok && rename(tmp, filename) == 0;
+    }
+    aml_free(tmp);
+    aml_free(filename);
+    return ok;
+}
+
+/* base_deleted is optional, ids without a document are ignored.  It is read a page at a
+   time, so only the pages with deleted documents are kept. */
+static void load_deleted(sil_search_image_t *h, char *filename, size_t filename_len) {
+    h->deleted.pages = (sil_deleted_page_t **)aml_zalloc(sizeof(sil_deleted_page_t *) *
+                                                         (((h->num_gbls-1) >> SIL_DELETED_PAGE_BITS)+1));
+    h->deleted.group_documents = h->group_documents;
+
+    snprintf(filename, filename_len, "%s_deleted", h->base);
     FILE *in = fopen(filename, "rb");
-    if(fgets(filename, filename_len, in)  == NULL)
-        return NULL;
+    if(!in)
+        return;
+    size_t num_words = deleted_words(h);
+    uint64_t bits[1 << (SIL_DELETED_PAGE_BITS - 6)];
+    for(size_t base = 0; base < num_words; base += sizeof(bits) / sizeof(bits[0])) {
+        size_t n = fread(bits, sizeof(uint64_t), sizeof(bits) / sizeof(bits[0]), in);
+        for(size_t i=0; i<n && base+i < num_words; i++) {
+            for(uint64_t w = bits[i]; w; w &= w - 1) {
+                uint32_t id = (uint32_t)(((base + i) << 6) + __builtin_ctzll(w)), length;
+                if(sil_search_image_global(&length, h, id))
+                    mark_deleted(h, id);
+            }
+        }
+        if(n < sizeof(bits) / sizeof(bits[0]))
+            break;
+    }
     fclose(in);
+}
 
-    uint32_t num_terms, max_id;
-    size_t total_documents, total_terms_in_documents;
-    if(sscanf(filename, "%u %zu %zu %u", &num_terms, &total_documents, &total_terms_in_documents, &max_id) != 4)
-        return NULL;
+static inline bool compare_reordered(const uint64_t *a, const uint64_t *b) {
+    return *a < *b;
+}
 
-    h->total_terms = num_terms;
-    h->total_documents = total_documents;
-    h->average_document_length = total_documents > 0 ? (double)total_terms_in_documents / (double)total_documents : 0.0;
+macro_sort(sort_reordered, uint64_t, compare_reordered);
 
-    h->gbls = (void **)aml_zalloc(sizeof(void *) * (max_id+1));
-    h->num_gbls = max_id+1;
+// base_id_map is only written by sil_search_builder_reorder
+static void load_id_map(sil_search_image_t *h, char *filename, size_t filename_len) {
+    snprintf(filename, filename_len, "%s_id_map", h->base);
+    FILE *in = fopen(filename, "rb");
+    if(!in)
+        return;
+    uint32_t n = h->num_gbls - 1;
+    h->original_ids = (uint32_t *)aml_malloc(sizeof(uint32_t) * (n+1));
+    h->num_original_ids = fread(h->original_ids, sizeof(uint32_t), n, in);
+    fclose(in);
+
+    // the original id in the high bits sorts the pairs by it
+    uint64_t *pairs = (uint64_t *)aml_malloc(sizeof(uint64_t) * (h->num_original_ids+1));
+    for(uint32_t i=0; i<h->num_original_ids; i++)
+        pairs[i] = ((uint64_t)h->original_ids[i] << 32) | (i+1);
+    sort_reordered(pairs, h->num_original_ids);
+    h->reordered = (uint32_t *)aml_malloc(sizeof(uint32_t) * 2 * (h->num_original_ids+1));
+    for(uint32_t i=0; i<h->num_original_ids; i++) {
+        h->reordered[i*2] = pairs[i] >> 32;
+        h->reordered[i*2+1] = (uint32_t)pairs[i];
+    }
+    aml_free(pairs);
+}
+
+static void load_content_blocks(sil_search_image_t *h, char *filename, size_t filename_len) {
+    if(!(h->flags & SIL_IMAGE_CONTENT_BLOCKS))
+        return;
+    snprintf(filename, filename_len, "%s_content_blocks", h->base);
+    h->content_blocks = (char *)io_read_file(&h->content_blocks_len, filename);
+    if(!h->content_blocks || h->content_blocks_len < sizeof(sil_content_blocks_header_t))
+        return;
+    sil_content_blocks_header_t *header = (sil_content_blocks_header_t *)h->content_blocks;
+    if(h->content_blocks_len < sizeof(*header) + sizeof(uint64_t) * (header->num_blocks+1) ||
+       !header->block_size)
+        return;
+    h->content_block_size = header->block_size;
+    h->num_content_blocks = header->num_blocks;
+    h->block_offsets = (const uint64_t *)(header+1);
+}
 
-    snprintf(filename, filename_len, "%s_gbl", base );
+// images written before SIL_IMAGE_FORMAT_V2 have narrower global headers, so their records
+// are copied into the current layout.  Returns NULL if a record runs past the end.
+static char *upgrade_globals(char *data, size_t *data_len) {
+    char *p = data, *ep = data + *data_len;
+    size_t num_records = 0;
+    while(p < ep) {
+        uint32_t len;
+        if((size_t)(ep - p) < sizeof(len))
+            return NULL;
+        memcpy(&len, p, sizeof(len));
+        if(len < sizeof(sil_global_header_v1_t) || len > (size_t)(ep - p) - sizeof(len))
+            return NULL;
+        p += sizeof(len) + len;
+        num_records++;
+    }
+    size_t grow = sizeof(sil_global_header_t) - sizeof(sil_global_header_v1_t);
+    char *r = (char *)aml_malloc(*data_len + num_records * grow + 1);
+    char *wp = r;
+    for(p = data; p < ep; ) {
+        uint32_t len;
+        memcpy(&len, p, sizeof(len));
+        sil_global_header_v1_t v1;
+        memcpy(&v1, p + sizeof(len), sizeof(v1));
+        sil_global_header_t gh;
+        gh.document_length = v1.document_length;
+        gh.num_embeddings = v1.num_embeddings;
+        gh.content_offset = v1.content_offset;
+        gh.embeddings_offset = v1.embeddings_offset;
+        uint32_t new_len = len + grow;
+        memcpy(wp, &new_len, sizeof(new_len));
+        memcpy(wp + sizeof(new_len), &gh, sizeof(gh));
+        memcpy(wp + sizeof(new_len) + sizeof(gh), p + sizeof(len) + sizeof(v1), len - sizeof(v1));
+        wp += sizeof(new_len) + new_len;
+        p += sizeof(len) + len;
+    }
+    *data_len = wp - r;
+    return r;
+}
+
+// every global record must hold an id no greater than max_id, in ascending order
+static bool load_globals(sil_search_image_t *h, char *filename, size_t filename_len) {
+    snprintf(filename, filename_len, "%s_gbl", h->base );
     h->gbl_data = (char *)io_read_file(&h->gbl_data_len, filename);
-    p = h->gbl_data;
-    ep = p + h->gbl_data_len;
+    if(h->gbl_data && !(h->flags & SIL_IMAGE_FORMAT_V2)) {
+        char *data = upgrade_globals(h->gbl_data, &h->gbl_data_len);
+        aml_free(h->gbl_data);
+        h->gbl_data = data;
+        if(!data)
+            return false;
+    }
+    char *p = h->gbl_data;
+    char *ep = p + h->gbl_data_len;
+    uint32_t last_id = 0;
     while(p < ep) {
-        uint32_t len = (*(uint32_t *)p);
+        uint32_t len;
+        if((size_t)(ep - p) < sizeof(len))
+            return false;
+        memcpy(&len, p, sizeof(len));
+        if(len < sizeof(sil_global_header_t) + sizeof(uint32_t) || len > (size_t)(ep - p) - sizeof(len))
+            return false;
         (*(uint32_t *)p) = len - sizeof(sil_global_header_t);
         char *np = p + sizeof(uint32_t) + sizeof(sil_global_header_t);
-        uint32_t *id = (uint32_t *)np;
-        h->gbls[*id] = p;
+        uint32_t id;
+        memcpy(&id, np, sizeof(id));
+        if(id >= h->num_gbls || (aml_buffer_length(h->ids) && id <= last_id))
+            return false;
+        last_id = id;
+        h->group_documents[id >> 10]++;
+        aml_buffer_append(h->ids, &id, sizeof(id));
         p += sizeof(uint32_t) + len;
     }
 
-    snprintf(filename, filename_len, "%s_embeddings", base );
-    h->embedding_data = (int8_t *)io_read_file_aligned(&h->embedding_data_len, 64, filename);
-    snprintf(filename, filename_len, "%s_content", base );
-    h->content_data = (char *)io_read_file(&h->content_data_len, filename);
+    uint32_t num_ids = aml_buffer_length(h->ids) / sizeof(uint32_t);
+    uint32_t num_groups = ((h->num_gbls-1) >> 10) + 1;
+    uint32_t start = 0;
+    for(uint32_t i=0; i<num_groups; i++) {
+        h->group_start[i] = start;
+        start += h->group_documents[i];
+    }
+    h->wide_gbl_offsets = h->gbl_data_len > UINT32_MAX;
+    h->gbl_offsets = aml_malloc((h->wide_gbl_offsets ? sizeof(uint64_t) : sizeof(uint32_t)) * (num_ids+1));
+    p = h->gbl_data;
+    for(uint32_t i=0; i<num_ids; i++) {
+        if(h->wide_gbl_offsets)
+            ((uint64_t *)h->gbl_offsets)[i] = p - h->gbl_data;
+        else
+            ((uint32_t *)h->gbl_offsets)[i] = p - h->gbl_data;
+        p += sizeof(uint32_t) + sizeof(sil_global_header_t) + (*(uint32_t *)p);
+    }
+    return true;
+}
+
+// base_columns is optional, when present it must have a value of every document in each column
+static bool load_columns(sil_search_image_t *h, char *filename, size_t filename_len) {
+    snprintf(filename, filename_len, "%s_columns", h->base);
+    h->columns_data = (char *)io_read_file_aligned(&h->columns_data_len, 64, filename);
+    if(!h->columns_data)
+        return true;
+    sil_columns_header_t header;
+    if(h->columns_data_len < sizeof(header))
+        return false;
+    memcpy(&header, h->columns_data, sizeof(header));
+    if(header.num_columns > SIL_MAX_COLUMNS ||
+       header.num_documents != aml_buffer_length(h->ids) / sizeof(uint32_t) ||
+       h->columns_data_len < sizeof(header) + sizeof(sil_column_header_t) * header.num_columns)
+        return false;
+    const sil_column_header_t *ch = (const sil_column_header_t *)(h->columns_data + sizeof(header));
+    for(uint32_t i=0; i<header.num_columns; i++, ch++) {
+        if(!memchr(ch->name, 0, sizeof(ch->name)) || !sil_column_width(ch->type) ||
+           ch->width != sil_column_width(ch->type) || (ch->offset & 63) ||
+           ch->offset > h->columns_data_len ||
+           (uint64_t)ch->width * header.num_documents > h->columns_data_len - ch->offset)
+            return false;
+        memcpy(h->columns[i].name, ch->name, sizeof(ch->name));
+        h->columns[i].type = (sil_column_type_t)ch->type;
+        h->column_values[i] = h->columns_data + ch->offset;
+    }
+    h->num_columns = header.num_columns;
+    return true;
+}
+
+// the content and embeddings of every document must be within their files
+static bool valid_offsets(sil_search_image_t *h) {
+    uint64_t content_len = h->content_data_len;
+    if(h->flags & SIL_IMAGE_CONTENT_BLOCKS) {
+        if(h->content_data_len && !h->block_offsets)
+            return false;
+        content_len = 0;
+        if(h->block_offsets) {
+            if(h->block_offsets[h->num_content_blocks] > h->content_data_len)
+                return false;
+            content_len = (uint64_t)h->num_content_blocks * h->content_block_size;
+        }
+    }
+    uint32_t num_ids;
+    const uint32_t *ids = sil_search_image_ids(h, &num_ids);
+    for(uint32_t i=0; i<num_ids; i++) {
+        uint32_t length;
+        const sil_global_header_t *gh = sil_search_image_global(&length, h, ids[i]);
+        if(gh->content_offset + sizeof(uint32_t) > content_len)
+            return false;
+        if(gh->num_embeddings &&
+           (gh->embeddings_offset + gh->num_embeddings) * 512 > h->embedding_data_len)
+            return false;
+    }
+    return true;
+}
 
-    snprintf(filename, filename_len, "%s_term_idx", base );
+// each term must be terminated within _term_idx and point at a posting list within _term_data
+static bool load_terms(sil_search_image_t *h, char *filename, size_t filename_len) {
+    snprintf(filename, filename_len, "%s_term_idx", h->base );
     h->term_idx = (char *)io_read_file(&h->term_idx_len, filename);
+    snprintf(filename, filename_len, "%s_term_data", h->base );
+    h->term_data = (char *)io_read_file(&h->term_data_len, filename);
+
     h->num_terms = 0;
-    p = h->term_idx;
-    ep = p+h->term_idx_len;
+    char *p = h->term_idx;
+    char *ep = p+h->term_idx_len;
     while(p < ep) {
+        char *e = (char *)memchr(p, 0, ep - p);
+        if(!e || (size_t)(ep - e - 1) < sizeof(size_t))
+            return false;
+        size_t offs;
+        memcpy(&offs, e + 1, sizeof(offs));
+        if(offs < sizeof(uint32_t) || offs > h->term_data_len)
+            return false;
+        uint32_t len;
+        memcpy(&len, h->term_data + offs - sizeof(uint32_t), sizeof(len));
+        if(len < sizeof(sil_term_header_t) || len > h->term_data_len - offs)
+            return false;
         h->num_terms++;
-        p += strlen(p) + 1;
-        p += sizeof(size_t); // offset
+        p = e + 1 + sizeof(size_t);
     }
 
-    h->terms = (char **)aml_zalloc(sizeof(char *) * h->num_terms);
-    wp = h->terms;
+    h->terms = (char **)aml_zalloc(sizeof(char *) * (h->num_terms+1));
+    char **wp = h->terms;
     p = h->term_idx;
     while(p < ep) {
         *wp = p;
@@ -153,13 +850,171 @@ sil_search_image_t *sil_search_image_init(const char *base) {
         p += strlen(p) + 1;
         p += sizeof(size_t);
     }
+    return true;
+}
 
-    snprintf(filename, filename_len, "%s_term_data", base );
-    h->term_data = (char *)io_read_file(&h->term_data_len, filename);
+static void load_updates(sil_search_image_t *h, char *filename, size_t filename_len);
+
+sil_search_image_t *sil_search_image_init(const char *base) {
+    size_t filename_len = strlen(base)+50;
+    char *filename = (char *)aml_malloc(filename_len);
+    sil_search_image_t *h = (sil_search_image_t *)aml_zalloc(sizeof(*h) + strlen(base) + 1);
+    h->base = (char *)(h+1);
+    strcpy(h->base, base);
+    pthread_mutex_init(&h->cache_mutex, NULL);
+    pthread_mutex_init(&h->cold_mutex, NULL);
+    pthread_mutex_init(&h->pending_mutex, NULL);
+    pthread_mutex_init(&h->publish_mutex, NULL);
+    pthread_mutex_init(&h->updates_mutex, NULL);
+    h->pending_updates = aml_buffer_init(sizeof(pending_update_t) * 64);
+
+    snprintf(filename, filename_len, "%s_stats.txt", base );
+    FILE *in = fopen(filename, "rb");
+    bool ok = in && fgets(filename, filename_len, in) != NULL;
+    if(in)
+        fclose(in);
+
+    uint32_t num_terms, max_id, flags = 0;
+    size_t total_documents, total_terms_in_documents;
+    // flags were added as a fifth field, older images only have four
+    ok = ok && sscanf(filename, "%u %zu %zu %u %u", &num_terms, &total_documents,
+                      &total_terms_in_documents, &max_id, &flags) >= 4;
+    // unknown flags are from a newer format which this reader would misread
+    ok = ok && !(flags & ~SIL_IMAGE_KNOWN_FLAGS) && max_id < UINT32_MAX;
+    if(!ok) {
+        aml_free(filename);
+        sil_search_image_destroy(h);
+        return NULL;
+    }
+
+    h->flags = flags;
+    h->total_terms = num_terms;
+    h->total_documents = total_documents;
+    h->average_document_length = total_documents > 0 ? (double)total_terms_in_documents / (double)total_documents : 0.0;
+
+    h->num_gbls = max_id+1;
+    h->group_documents = (uint16_t *)aml_zalloc(sizeof(uint16_t) * ((max_id >> 10)+1));
+    h->group_start = (uint32_t *)aml_zalloc(sizeof(uint32_t) * ((max_id >> 10)+1));
+    h->ids = aml_buffer_init(sizeof(uint32_t) * (total_documents+1));
+
+    ok = load_globals(h, filename, filename_len);
+    if(ok) {
+        load_deleted(h, filename, filename_len);
+        load_id_map(h, filename, filename_len);
+
+        snprintf(filename, filename_len, "%s_embeddings", base );
+        h->embedding_data = (int8_t *)io_read_file_aligned(&h->embedding_data_len, 64, filename);
+        snprintf(filename, filename_len, "%s_content", base );
+        h->content_data = (char *)io_read_file(&h->content_data_len, filename);
+        load_content_blocks(h, filename, filename_len);
+        ok = valid_offsets(h) && load_columns(h, filename, filename_len) &&
+             load_terms(h, filename, filename_len);
+        if(ok)
+            load_updates(h, filename, filename_len);
+    }
     aml_free(filename);
+    if(!ok) {
+        sil_search_image_destroy(h);
+        return NULL;
+    }
     return h;
 }
 
+void sil_cold_postings_options_init(sil_cold_postings_options_t *options) {
+    options->max_document_frequency = 4096;
+    options->min_bytes = 64;
+    options->cache_size = 16*1024*1024;
+    options->promote_after = 2;
+    options->window = 64*1024;
+}
+
+static inline size_t *term_offset(char *term) {
+    return (size_t *)(term + strlen(term) + 1);
+}
+
+static inline bool cold_term(sil_search_image_t *h, size_t offs,
+                             const sil_cold_postings_options_t *options) {
+    sil_term_header_t *header = (sil_term_header_t *)(h->term_data + offs);
+    uint32_t len = (*(uint32_t *)(h->term_data + offs - sizeof(uint32_t)));
+    return header->document_frequency <= options->max_document_frequency && len >= options->min_bytes;
+}
+
+bool sil_search_image_cold_postings(sil_search_image_t *h, const sil_cold_postings_options_t *options) {
+    sil_cold_postings_options_t default_options;
+    if(!options) {
+        sil_cold_postings_options_init(&default_options);
+        options = &default_options;
+    }
+    if(h->cold || !h->term_data)
+        return false;
+    h->cold_options = *options;
+    if(!h->cold_options.window)
+        h->cold_options.window = 1;
+
+    size_t hot_len = sizeof(uint32_t), num_cold = 0;
+    for(size_t i=0; i<h->num_terms; i++) {
+        size_t offs = *term_offset(h->terms[i]);
+        uint32_t len = (*(uint32_t *)(h->term_data + offs - sizeof(uint32_t)));
+        if(cold_term(h, offs, options))
+            num_cold++;
+        else
+            hot_len += sizeof(uint32_t) + len;
+    }
+    if(!num_cold)
+        return true;
+
+    // the cold lists are compressed into one buffer and the hot lists are packed together
+    h->cold = (cold_term_t *)aml_zalloc(sizeof(cold_term_t) * num_cold);
+    aml_buffer_t *compressed = aml_buffer_init(1024*1024);
+    size_t *starts = (size_t *)aml_malloc(sizeof(size_t) * num_cold);
+    char *term_data = (char *)aml_malloc(hot_len);
+    size_t hot_offset = sizeof(uint32_t), cold_index = 0;
+    memset(term_data, 0, sizeof(uint32_t));
+    for(size_t i=0; i<h->num_terms; i++) {
+        size_t *offsp = term_offset(h->terms[i]);
+        size_t offs = *offsp;
+        uint32_t len = (*(uint32_t *)(h->term_data + offs - sizeof(uint32_t)));
+        if(!cold_term(h, offs, options)) {
+            memcpy(term_data + hot_offset - sizeof(uint32_t), h->term_data + offs - sizeof(uint32_t),
+                   sizeof(uint32_t) + len);
+            *offsp = hot_offset;
+            hot_offset += sizeof(uint32_t) + len;
+            continue;
+        }
+        cold_term_t *c = h->cold + cold_index;
+        size_t start = aml_buffer_length(compressed);
+        int bound = LZ4_compressBound(len);
+        aml_buffer_resize(compressed, start + bound);
+        int n = LZ4_compress_default(h->term_data + offs, aml_buffer_data(compressed) + start, len, bound);
+        aml_buffer_resize(compressed, start + n);
+        starts[cold_index] = start;
+        c->compressed_length = n;
+        c->length = len;
+        h->cold_stats.cold_bytes += len;
+        *offsp = COLD_TERM | cold_index++;
+    }
+    h->cold_data_len = aml_buffer_length(compressed);
+    h->cold_data = (char *)aml_malloc(h->cold_data_len + 1);
+    memcpy(h->cold_data, aml_buffer_data(compressed), h->cold_data_len);
+    aml_buffer_destroy(compressed);
+    for(size_t i=0; i<num_cold; i++)
+        h->cold[i].compressed = h->cold_data + starts[i];
+    aml_free(starts);
+
+    aml_free(h->term_data);
+    h->term_data = term_data;
+    h->term_data_len = hot_len;
+    h->cold_stats.cold_terms = num_cold;
+    h->cold_stats.compressed_bytes = h->cold_data_len;
+    return true;
+}
+
+void sil_search_image_cold_stats(sil_search_image_t *h, sil_cold_postings_stats_t *stats) {
+    pthread_mutex_lock(&h->cold_mutex);
+    *stats = h->cold_stats;
+    pthread_mutex_unlock(&h->cold_mutex);
+}
+
 static inline int compare_strings(const char *key, const char **v) {
     return strcmp(key, *v);
 }
@@ -189,36 +1044,73 @@ static bool sil_search_image_first_advance(sil_term_ext_t *t)
     return true;
 }
 
+static inline bool posting_deleted(sil_term_ext_t *t) {
+    return t->deleted && sil_deleted_id(t->deleted, t->pub.c.id);
+}
+
+/* Move to the next posting whose document is not deleted.  Groups of 1024 ids whose
+   documents are all deleted are skipped without decoding their postings. */
+static bool sil_search_image_deleted_advance(sil_term_ext_t *t)
+{
+    while(true) {
+        if(t->p < t->ep && !sil_deleted_group_all(t->deleted, t->gid))
+            advance_id(t);
+        else {
+            do {
+                if(!advance_group(t))
+                    return false;
+            } while(sil_deleted_group_all(t->deleted, t->gid));
+            advance_id(t);
+        }
+        if(!sil_deleted_id(t->deleted, t->pub.c.id))
+            return true;
+    }
+}
+
+static bool sil_search_image_deleted_first_advance(sil_term_ext_t *t)
+{
+    t->pub.c.advance = (atl_cursor_advance_cb)sil_search_image_deleted_advance;
+    if(!posting_deleted(t))
+        return true;
+    return sil_search_image_deleted_advance(t);
+}
+
+static inline bool advance_second_level_group_to(sil_term_ext_t *t, uint32_t gid)
+{
+    uint32_t target = (gid & SECOND_GROUP_MASK) >> 10;
+    while(t->ep < t->tp) {
+        // advance to the next group within same high level group
+        uint8_t control = t->ep[0];
+        t->ep = extract_group_bytes(&t->p, t->ep+1);
+        if(control >= target) {
+            uint32_t g = control;
+            g <<= 10;
+            t->gid = (t->gid & TOP_GROUP_MASK) | g;
+            start_small_group(t);
+            return true;
+        }
+    }
+    return advance_group(t);
+}
+
 static inline bool advance_group_to(sil_term_ext_t *t, uint32_t gid)
 {
     uint32_t g = t->gid;
     if(g >= gid)
         return true;
-    if((g & 0x3FC0000) == (gid & 0x3FC0000)) {
-        uint32_t target = (gid & 0x3FC00) >> 10;
-        while(t->ep < t->tp) {
-            // advance to the next group within same high level group
-            uint8_t control = t->ep[0];
-            t->ep = extract_group_bytes(&t->p, t->ep+1);
-            if(control >= target) {
-                uint32_t g = control;
-                g <<= 10;
-                t->gid = (t->gid & 0x3FC0000) | g;
-                return true;
-            }
-        }
-        return advance_group(t);
-    }
-    uint32_t target = (gid & 0x3FC0000) >> 18;
+    if((g & TOP_GROUP_MASK) == (gid & TOP_GROUP_MASK))
+        return advance_second_level_group_to(t, gid);
+
+    uint32_t target = gid & TOP_GROUP_MASK;
     while(t->tp < t->etp) {
         // advance to the next high level group
-        uint8_t control = t->tp[0];
-        t->tp = extract_group_bytes(&t->ep, t->tp+1);
-        if(control >= target) {
-            uint32_t g = control;
-            g <<= 18;
+        t->tp = extract_group_bytes(&t->ep, top_group_id(&g, t->tp, t->flags));
+        if(g >= target) {
             t->gid = g;
-            return advance_group_to(t, gid);
+            // a later high level group starts past gid, so take its first second level group
+            if(g > target)
+                return advance_group(t);
+            return advance_second_level_group_to(t, gid);
         }
     }
     return false;
@@ -229,7 +1121,7 @@ static bool sil_search_image_advance_to(sil_term_ext_t *t, uint32_t id)
     if(id <= t->pub.c.id)
         return true;
 
-    uint32_t gid = id & 0x3FFFC00; // mask off the lower 10 bits
+    uint32_t gid = id & GROUP_MASK; // mask off the lower 10 bits
     if(t->gid < gid) {
         if(!advance_group_to(t, gid))
             return false;
@@ -247,6 +1139,17 @@ static bool sil_search_image_advance_to(sil_term_ext_t *t, uint32_t id)
     return true;
 }
 
+static bool sil_search_image_deleted_advance_to(sil_term_ext_t *t, uint32_t id)
+{
+    if(id <= t->pub.c.id)
+        return true;
+    if(!sil_search_image_advance_to(t, id))
+        return false;
+    if(!posting_deleted(t))
+        return true;
+    return sil_search_image_deleted_advance(t);
+}
+
 static inline bool advance_group(sil_term_ext_t *t)
 {
     if(t->ep < t->tp) {
@@ -255,15 +1158,14 @@ static inline bool advance_group(sil_term_ext_t *t)
         uint32_t g = control;
         g <<= 10;
         t->ep = extract_group_bytes(&t->p, t->ep+1);
-        t->gid = (t->gid & 0x3FC0000) | g;
+        t->gid = (t->gid & TOP_GROUP_MASK) | g;
+        start_small_group(t);
         return true;
     }
     if(t->tp < t->etp) {
         // advance to the next high level group
-        uint8_t control = t->tp[0];
-        uint32_t g = control;
-        g <<= 18;
-        t->tp = extract_group_bytes(&t->ep, t->tp+1);
+        uint32_t g;
+        t->tp = extract_group_bytes(&t->ep, top_group_id(&g, t->tp, t->flags));
         t->gid = g;
         return advance_group(t);
     }
@@ -282,36 +1184,326 @@ static inline bool advance_group(sil_term_ext_t *t)
 */
 
 
+// position the term on its first posting
+static void start_term(sil_term_ext_t *r) {
+    r->tp = r->sp;
+    uint32_t gid;
+    r->tp = extract_group_bytes(&r->ep, top_group_id(&gid, r->tp, r->flags)); // top level group - bits 18-31
+
+    uint8_t control = (*(uint8_t *)r->ep);
+    r->ep = extract_group_bytes(&r->p, r->ep+1); // second level group - bits 10-17
+    uint32_t g = control;
+    g <<= 10;
+    gid |= g;
+    r->gid = gid;
+    r->wp = NULL;
+    r->pub.value = 0;
+    start_small_group(r);
+
+    advance_id(r);
+}
+
+static inline void lru_remove(sil_search_image_t *h, cold_term_t *c) {
+    if(c->prev)
+        c->prev->next = c->next;
+    else
+        h->lru_head = c->next;
+    if(c->next)
+        c->next->prev = c->prev;
+    else
+        h->lru_tail = c->prev;
+    c->prev = c->next = NULL;
+}
+
+static inline void lru_push(sil_search_image_t *h, cold_term_t *c) {
+    c->prev = NULL;
+    c->next = h->lru_head;
+    if(h->lru_head)
+        h->lru_head->prev = c;
+    else
+        h->lru_tail = c;
+    h->lru_head = c;
+}
+
+static inline void release_cold_buffer(cold_buffer_t *b) {
+    if(__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        aml_free(b);
+}
+
+/* Keep copy as the decompressed postings of c, evicting the least recently used terms to
+   stay within cache_size.  Evicted terms start counting accesses again.  Called with
+   cold_mutex held. */
+static void cache_cold_term(sil_search_image_t *h, cold_term_t *c, cold_buffer_t *copy) {
+    while(h->lru_tail && h->cold_stats.cached_bytes + c->length > h->cold_options.cache_size) {
+        cold_term_t *e = h->lru_tail;
+        lru_remove(h, e);
+        h->cold_stats.cached_bytes -= e->length;
+        release_cold_buffer(e->cached);
+        e->cached = NULL;
+        e->accesses = 0;
+    }
+    c->cached = copy;
+    h->cold_stats.cached_bytes += c->length;
+    lru_push(h, c);
+}
+
+/* The postings of a cold term, copied into pool (with the length in front of them as in
+   term_data) so the cursor owns them however long it lives and cached terms can be evicted
+   at any time.  A term is decompressed until it is opened promote_after times within a
+   window of accesses, then it is kept decompressed in the cache.  The counters are halved
+   after every window, which is caught up on when a term is next opened. */
+static char *open_cold_term(sil_search_image_t *h, aml_pool_t *pool, cold_term_t *c) {
+    char *p = (char *)aml_pool_alloc(pool, c->length + sizeof(uint32_t));
+    memcpy(p, &c->length, sizeof(uint32_t));
+    p += sizeof(uint32_t);
+    pthread_mutex_lock(&h->cold_mutex);
+    cold_buffer_t *b = c->cached;
+    if(b) {
+        __atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+        lru_remove(h, c);
+        lru_push(h, c);
+        h->cold_stats.hits++;
+        pthread_mutex_unlock(&h->cold_mutex);
+        memcpy(p, b->data, c->length);
+        release_cold_buffer(b);
+        return p;
+    }
+    h->cold_stats.misses++;
+    uint32_t windows = h->cold_epoch - c->epoch;
+    c->accesses = windows < 32 ? c->accesses >> windows : 0;
+    c->epoch = h->cold_epoch;
+    bool promote = ++c->accesses >= h->cold_options.promote_after &&
+                   c->length <= h->cold_options.cache_size;
+    if(++h->cold_accesses >= h->cold_options.window) {
+        h->cold_epoch++;
+        h->cold_accesses = 0;
+    }
+    pthread_mutex_unlock(&h->cold_mutex);
+
+    if(LZ4_decompress_safe(c->compressed, p, c->compressed_length, c->length) != (int)c->length)
+        return NULL;
+    if(promote) {
+        cold_buffer_t *copy = (cold_buffer_t *)aml_malloc(sizeof(cold_buffer_t) + c->length);
+        copy->refs = 1;  // the cache's
+        memcpy(copy->data, p, c->length);
+        pthread_mutex_lock(&h->cold_mutex);
+        if(c->cached)
+            aml_free(copy);  // another thread cached it first
+        else
+            cache_cold_term(h, c, copy);
+        pthread_mutex_unlock(&h->cold_mutex);
+    }
+    return p;
+}
+
+static inline bool compare_pending_updates(const pending_update_t *a, const pending_update_t *b) {
+    if(a->u.term != b->u.term)
+        return a->u.term < b->u.term;
+    if(a->u.id != b->u.id)
+        return a->u.id < b->u.id;
+    return a->seq < b->seq;
+}
+
+static inline
+macro_sort(sort_pending_updates, pending_update_t, compare_pending_updates);
+
+// the first update in u for term or a later one
+static const sil_value_update_t *first_update(const value_updates_t *u, uint32_t term) {
+    size_t lo = 0, hi = u->num_updates;
+    while(lo < hi) {
+        size_t mid = lo + ((hi - lo) >> 1);
+        if(u->updates[mid].term < term)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return u->updates + lo;
+}
+
+// drop a reference to u, freeing it if it was replaced and nothing else holds it
+static void release_updates(sil_search_image_t *img, value_updates_t *u) {
+    pthread_mutex_lock(&img->updates_mutex);
+    bool last = --u->refs == 0;
+    if(last) {
+        if(u->prev)
+            u->prev->next = u->next;
+        else
+            img->replaced = u->next;
+        if(u->next)
+            u->next->prev = u->prev;
+    }
+    pthread_mutex_unlock(&img->updates_mutex);
+    if(last)
+        aml_free(u);
+}
+
+/* Point r at the updates of the term at index term in the published table.  A term with
+   updates holds a reference to the table until the cursor is released. */
+static void term_updates(sil_search_image_t *img, sil_term_ext_t *r, uint32_t term) {
+    if(!__atomic_load_n(&img->updates, __ATOMIC_ACQUIRE))
+        return;
+    pthread_mutex_lock(&img->updates_mutex);
+    value_updates_t *u = img->updates;
+    u->refs++;
+    pthread_mutex_unlock(&img->updates_mutex);
+    const sil_value_update_t *p = first_update(u, term), *ep = p;
+    const sil_value_update_t *end = u->updates + u->num_updates;
+    while(ep < end && ep->term == term)
+        ep++;
+    if(p == ep) {
+        release_updates(img, u);
+        return;
+    }
+    r->update_table = u;
+    r->updates = r->update = p;
+    r->eupdates = ep;
+    // the first posting was decoded before the updates were known
+    update_group_values(r);
+    update_value(r);
+}
+
+bool sil_search_image_update_value(sil_search_image_t *img, const char *term, uint32_t id,
+                                   uint32_t value) {
+    uint32_t length;
+    char **termp = search_strings(term, (const char **)img->terms, img->num_terms);
+    if(!termp || !sil_search_image_global(&length, img, id))
+        return false;
+    pending_update_t p;
+    p.u.term = (uint32_t)(termp - img->terms);
+    p.u.id = id;
+    p.u.value = value;
+    pthread_mutex_lock(&img->pending_mutex);
+    p.seq = aml_buffer_length(img->pending_updates) / sizeof(p);
+    aml_buffer_append(img->pending_updates, &p, sizeof(p));
+    pthread_mutex_unlock(&img->pending_mutex);
+    return true;
+}
+
+/* The pending updates are swapped for an empty list so updates can continue while they are
+   sorted and merged with the published table (the pending update wins a tie). */
+size_t sil_search_image_publish_updates(sil_search_image_t *img) {
+    pthread_mutex_lock(&img->publish_mutex);
+    pthread_mutex_lock(&img->pending_mutex);
+    aml_buffer_t *bh = img->pending_updates;
+    img->pending_updates = aml_buffer_init(sizeof(pending_update_t) * 64);
+    pthread_mutex_unlock(&img->pending_mutex);
+
+    value_updates_t *cur = img->updates;
+    size_t num_current = cur ? cur->num_updates : 0;
+    size_t num_pending = aml_buffer_length(bh) / sizeof(pending_update_t);
+    pending_update_t *pending = (pending_update_t *)aml_buffer_data(bh);
+    if(num_pending) {
+        sort_pending_updates(pending, num_pending);
+        value_updates_t *r = (value_updates_t *)aml_malloc(sizeof(*r) +
+                              sizeof(sil_value_update_t) * (num_current + num_pending));
+        size_t i = 0, j = 0, n = 0;
+        while(j < num_pending) {
+            // the last update of a posting is the one which counts
+            while(j+1 < num_pending && pending[j+1].u.term == pending[j].u.term &&
+                  pending[j+1].u.id == pending[j].u.id)
+                j++;
+            const sil_value_update_t *u = &pending[j].u;
+            while(i < num_current && (cur->updates[i].term < u->term ||
+                  (cur->updates[i].term == u->term && cur->updates[i].id < u->id)))
+                r->updates[n++] = cur->updates[i++];
+            if(i < num_current && cur->updates[i].term == u->term && cur->updates[i].id == u->id)
+                i++;
+            r->updates[n++] = *u;
+            j++;
+        }
+        while(i < num_current)
+            r->updates[n++] = cur->updates[i++];
+        r->num_updates = n;
+        r->img = img;
+        r->refs = 1;
+        r->prev = r->next = NULL;
+        // the replaced table waits for the cursors reading it
+        pthread_mutex_lock(&img->updates_mutex);
+        __atomic_store_n(&img->updates, r, __ATOMIC_RELEASE);
+        if(cur) {
+            cur->next = img->replaced;
+            if(img->replaced)
+                img->replaced->prev = cur;
+            img->replaced = cur;
+        }
+        pthread_mutex_unlock(&img->updates_mutex);
+        if(cur)
+            release_updates(img, cur);
+        num_current = n;
+    }
+    aml_buffer_destroy(bh);
+    pthread_mutex_unlock(&img->publish_mutex);
+    return num_current;
+}
+
+// written to a temporary file which replaces base_updates
+bool sil_search_image_save_updates(sil_search_image_t *img) {
+    size_t len = strlen(img->base) + 20;
+    char *filename = (char *)aml_malloc(len);
+    char *tmp = (char *)aml_malloc(len);
+    snprintf(filename, len, "%s_updates", img->base);
+    snprintf(tmp, len, "%s_updates.tmp", img->base);
+    FILE *out = fopen(tmp, "wb");
+    bool ok = out != NULL;
+    if(ok) {
+        pthread_mutex_lock(&img->publish_mutex);
+        const value_updates_t *u = img->updates;
+        if(u && u->num_updates)
+            ok = fwrite(u->updates, sizeof(sil_value_update_t), u->num_updates, out) == u->num_updates;
+        pthread_mutex_unlock(&img->publish_mutex);
+        ok = fclose(out) == 0 && ok && rename(tmp, filename) == 0;
+    }
+    aml_free(tmp);
+    aml_free(filename);
+    return ok;
+}
+
+// base_updates is optional, updates of terms or ids which the image does not have are ignored
+static void load_updates(sil_search_image_t *h, char *filename, size_t filename_len) {
+    snprintf(filename, filename_len, "%s_updates", h->base);
+    size_t len = 0;
+    sil_value_update_t *u = (sil_value_update_t *)io_read_file(&len, filename);
+    if(!u)
+        return;
+    size_t num = len / sizeof(sil_value_update_t);
+    uint32_t length;
+    for(size_t i=0; i<num; i++) {
+        if(u[i].term >= h->num_terms || !sil_search_image_global(&length, h, u[i].id))
+            continue;
+        pending_update_t p;
+        p.u = u[i];
+        p.seq = i;
+        aml_buffer_append(h->pending_updates, &p, sizeof(p));
+    }
+    aml_free(u);
+    sil_search_image_publish_updates(h);
+}
+
 // might be useful to be a public function
-static void fill_term(sil_search_image_t *img, aml_pool_t *pool,
+static bool fill_term(sil_search_image_t *img, aml_pool_t *pool,
                       sil_term_ext_t *r, char **termp) {
     char *p = *termp;
     p = p + strlen(p) + 1;
     size_t offs = (*(size_t *)p);
     p += sizeof(offs);
 
-    sil_term_header_t *header = (sil_term_header_t *)(img->term_data + offs);
+    char *data;
+    if(offs & COLD_TERM) {
+        data = open_cold_term(img, pool, img->cold + (offs & ~COLD_TERM));
+        if(!data)
+            return false;
+    }
+    else
+        data = img->term_data + offs;
+    sil_term_header_t *header = (sil_term_header_t *)data;
     r->tp = (uint8_t *)(header);
     uint32_t len = (*(uint32_t *)(r->tp-4));
     r->tp += sizeof(sil_term_header_t);
     // printf( "%s (%u bytes)\n", *termp, len);
-    r->etp = r->tp + len;
-
-    uint8_t control = (*(uint8_t *)r->tp);
-    r->tp = extract_group_bytes(&r->ep, r->tp+1); // top level group - bits 18-25
-    uint32_t gid = control;
-    gid <<= 18;
-
-    control = (*(uint8_t *)r->ep);
-    r->ep = extract_group_bytes(&r->p, r->ep+1); // second level group - bits 10-17
-    uint32_t g = control;
-    g <<= 10;
-    gid |= g;
-    r->gid = gid;
-    r->wp = NULL;
-    r->pub.value = 0;
-
-    advance_id(r);
+    r->etp = r->tp + len - sizeof(sil_term_header_t);
+    r->sp = r->tp;
+    r->flags = img->flags;
+    start_term(r);
 
     r->pub.max_term_size = header->max_positions;
     r->pub.document_frequency = header->document_frequency;
@@ -319,10 +1511,19 @@ static void fill_term(sil_search_image_t *img, aml_pool_t *pool,
 
     r->term = termp;
     r->eterm = img->terms+img->num_terms;
-    r->pub.c.advance = (atl_cursor_advance_cb)sil_search_image_first_advance;
-    r->pub.c.advance_to = (atl_cursor_advance_to_cb)sil_search_image_advance_to;
+    term_updates(img, r, (uint32_t)(termp - img->terms));
+    if(sil_search_image_deleted_documents(img)) {
+        r->deleted = &img->deleted;
+        r->pub.c.advance = (atl_cursor_advance_cb)sil_search_image_deleted_first_advance;
+        r->pub.c.advance_to = (atl_cursor_advance_to_cb)sil_search_image_deleted_advance_to;
+    }
+    else {
+        r->pub.c.advance = (atl_cursor_advance_cb)sil_search_image_first_advance;
+        r->pub.c.advance_to = (atl_cursor_advance_to_cb)sil_search_image_advance_to;
+    }
 
     r->pub.c.type = TERM_CURSOR;
+    return true;
 }
 
 sil_term_t *sil_search_image_term(sil_search_image_t *img, aml_pool_t *pool, const char *term) {
@@ -339,10 +1540,557 @@ sil_term_t *sil_search_image_term(sil_search_image_t *img, aml_pool_t *pool, con
             return NULL;
     }
     sil_term_ext_t *r = (sil_term_ext_t *)aml_pool_zalloc(pool, sizeof(*r));
-    fill_term(img, pool, r, termp);
+    if(!fill_term(img, pool, r, termp))
+        return NULL;
     return (sil_term_t *)r;
 }
 
+void sil_search_image_term_release(sil_term_t *t) {
+    sil_term_ext_t *r = (sil_term_ext_t *)t;
+    if(!r || !r->update_table)
+        return;
+    release_updates(r->update_table->img, r->update_table);
+    r->update_table = NULL;
+    r->updates = r->update = r->eupdates = NULL;
+}
+
+// deleted documents are treated as out of range
+static inline bool value_in_range(sil_term_ext_t *t) {
+    return t->pub.value >= t->value_lo && t->pub.value <= t->value_hi && !posting_deleted(t);
+}
+
+static inline bool group_in_range(sil_term_ext_t *t) {
+    return t->group_max_value >= t->value_lo && t->group_min_value <= t->value_hi &&
+           !(t->deleted && sil_deleted_group_all(t->deleted, t->gid));
+}
+
+// move past the current posting to the next one in range, skipping groups whose summary is out of range
+static bool value_range_next(sil_term_ext_t *t) {
+    while(true) {
+        if(t->p < t->ep && group_in_range(t)) {
+            advance_id(t);
+            if(value_in_range(t))
+                return true;
+            continue;
+        }
+        if(!advance_group(t))
+            return false;
+        if(group_in_range(t)) {
+            advance_id(t);
+            if(value_in_range(t))
+                return true;
+        }
+    }
+}
+
+static bool sil_search_image_value_range_advance(sil_term_ext_t *t)
+{
+    return value_range_next(t);
+}
+
+static bool sil_search_image_value_range_first_advance(sil_term_ext_t *t)
+{
+    t->pub.c.advance = (atl_cursor_advance_cb)sil_search_image_value_range_advance;
+    if(group_in_range(t) && value_in_range(t))
+        return true;
+    return value_range_next(t);
+}
+
+static bool sil_search_image_value_range_advance_to(sil_term_ext_t *t, uint32_t id)
+{
+    if(id <= t->pub.c.id)
+        return true;
+    if(!sil_search_image_advance_to(t, id))
+        return false;
+    if(group_in_range(t) && value_in_range(t))
+        return true;
+    return value_range_next(t);
+}
+
+sil_term_t *sil_term_value_range(sil_term_t *t, uint32_t lo, uint32_t hi) {
+    if(!t)
+        return NULL;
+    sil_term_ext_t *r = (sil_term_ext_t *)t;
+    r->value_lo = lo;
+    r->value_hi = hi;
+    r->pub.c.advance = (atl_cursor_advance_cb)sil_search_image_value_range_first_advance;
+    r->pub.c.advance_to = (atl_cursor_advance_to_cb)sil_search_image_value_range_advance_to;
+    return t;
+}
+
+typedef struct {
+    uint8_t *p;
+    uint8_t *ep;
+    uint32_t gid;
+    uint32_t max_value;
+} value_group_t;
+
+static inline bool compare_value_groups(const value_group_t *a, const value_group_t *b) {
+    if(a->max_value != b->max_value)
+        return a->max_value > b->max_value;
+    return a->gid < b->gid;
+}
+
+static inline
+macro_sort(sort_value_groups, value_group_t, compare_value_groups);
+
+// list the second level groups of t along with their max value (only the summaries are read)
+static value_group_t *value_groups(sil_term_ext_t *t, aml_buffer_t *bh, size_t *num_groups) {
+    uint8_t *tp = t->sp;
+    while(tp < t->etp) {
+        uint32_t top;
+        uint8_t *gp;
+        tp = extract_group_bytes(&gp, top_group_id(&top, tp, t->flags));
+        while(gp < tp) {
+            value_group_t g;
+            g.gid = top | ((uint32_t)gp[0] << 10);
+            gp = extract_group_bytes(&t->p, gp+1);
+            t->gid = g.gid;
+            start_small_group(t);
+            g.p = t->p;
+            g.ep = gp;
+            g.max_value = t->group_max_value;
+            aml_buffer_append(bh, &g, sizeof(g));
+        }
+    }
+    *num_groups = aml_buffer_length(bh) / sizeof(value_group_t);
+    return (value_group_t *)aml_buffer_data(bh);
+}
+
+typedef struct {
+    sil_term_ext_t *t;
+    bool started;
+    bool exhausted;
+    uint32_t exhausted_at; // no ids at or after this remain
+} value_filter_t;
+
+/* Groups are visited out of id order, so a filter which has moved past id is restarted
+   from its first posting. */
+static bool value_filter_matches(value_filter_t *f, uint32_t id) {
+    sil_term_ext_t *t = f->t;
+    if(f->started && ((f->exhausted && id < f->exhausted_at) ||
+                      (!f->exhausted && id < t->pub.c.id))) {
+        start_term(t);
+        if(t->pub.c.advance_to == (atl_cursor_advance_to_cb)sil_search_image_value_range_advance_to)
+            t->pub.c.advance = (atl_cursor_advance_cb)sil_search_image_value_range_first_advance;
+        else if(t->deleted)
+            t->pub.c.advance = (atl_cursor_advance_cb)sil_search_image_deleted_first_advance;
+        else
+            t->pub.c.advance = (atl_cursor_advance_cb)sil_search_image_first_advance;
+        f->started = false;
+        f->exhausted = false;
+    }
+    if(f->exhausted)
+        return false;
+    if(!f->started) {
+        f->started = true;
+        if(!t->pub.c.advance((atl_cursor_t *)t)) {
+            f->exhausted = true;
+            f->exhausted_at = 0;
+            return false;
+        }
+    }
+    if(!t->pub.c.advance_to((atl_cursor_t *)t, id)) {
+        f->exhausted = true;
+        f->exhausted_at = id;
+        return false;
+    }
+    return t->pub.c.id == id;
+}
+
+static size_t value_top_k(sil_term_ext_t *t, value_filter_t *filters, size_t num_filters,
+                          sil_valued_id_t *res, size_t k) {
+    aml_buffer_t *bh = aml_buffer_init(sizeof(value_group_t) * 64);
+    size_t num_groups;
+    value_group_t *groups = value_groups(t, bh, &num_groups);
+    sort_value_groups(groups, num_groups);
+
+    size_t num = 0;
+    for(size_t i=0; i<num_groups; i++) {
+        value_group_t *g = groups + i;
+        // groups are ordered by max value, nothing after this one can enter the heap
+        if(num == k && res[0].value > g->max_value)
+            break;
+        if(t->deleted && sil_deleted_group_all(t->deleted, g->gid))
+            continue;
+        t->gid = g->gid;
+        t->p = g->p;
+        t->ep = g->ep;
+        while(t->p < t->ep) {
+            advance_id(t);
+            uint32_t id = t->pub.c.id, value = t->pub.value;
+            if(posting_deleted(t) || !sil_value_top_k_accepts(res, num, k, id, value))
+                continue;
+            size_t j = 0;
+            while(j < num_filters && value_filter_matches(filters + j, id))
+                j++;
+            if(j == num_filters)
+                sil_value_top_k_push(res, &num, k, id, value);
+        }
+    }
+    aml_buffer_destroy(bh);
+    sil_value_top_k_sort(res, num);
+    return num;
+}
+
+size_t sil_term_value_top_k(sil_term_t *t, sil_valued_id_t *res, size_t k) {
+    if(!t || k == 0)
+        return 0;
+    return value_top_k((sil_term_ext_t *)t, NULL, 0, res, k);
+}
+
+size_t sil_term_value_top_k_and(sil_term_t *t, sil_term_t **filters, size_t num_filters,
+                                sil_valued_id_t *res, size_t k) {
+    if(!t || k == 0)
+        return 0;
+    value_filter_t *f = (value_filter_t *)aml_zalloc(sizeof(value_filter_t) * (num_filters+1));
+    for(size_t i=0; i<num_filters; i++) {
+        if(!filters[i]) {
+            aml_free(f);
+            return 0;
+        }
+        f[i].t = (sil_term_ext_t *)filters[i];
+    }
+    size_t num = value_top_k((sil_term_ext_t *)t, f, num_filters, res, k);
+    aml_free(f);
+    return num;
+}
+
+#define GROUP_WORDS (1024 / 64)
+
+static inline bool is_value_range(sil_term_ext_t *t) {
+    return t->pub.c.advance_to == (atl_cursor_advance_to_cb)sil_search_image_value_range_advance_to;
+}
+
+typedef enum { GROUP_MATCHES_NONE, GROUP_MATCHES_SOME, GROUP_MATCHES_ALL } group_match_t;
+
+// how much of the current group matches (value ranges and deletes can exclude part or all of it)
+static inline group_match_t group_match(sil_term_ext_t *t) {
+    bool some_deleted = t->deleted && sil_deleted_group_some(t->deleted, t->gid);
+    if(some_deleted && sil_deleted_group_all(t->deleted, t->gid))
+        return GROUP_MATCHES_NONE;
+    if(!is_value_range(t))
+        return some_deleted ? GROUP_MATCHES_SOME : GROUP_MATCHES_ALL;
+    if(!group_in_range(t))
+        return GROUP_MATCHES_NONE;
+    if(!some_deleted && t->group_min_value >= t->value_lo && t->group_max_value <= t->value_hi)
+        return GROUP_MATCHES_ALL;
+    return GROUP_MATCHES_SOME;
+}
+
+// set a bit for each matching id in the current group and return the number of bits set
+static uint32_t decode_group(sil_term_ext_t *t, uint64_t *bits) {
+    bool range = is_value_range(t);
+    uint32_t count = 0;
+    memset(bits, 0, sizeof(uint64_t) * GROUP_WORDS);
+    t->p = t->gp;
+    while(t->p < t->ep) {
+        advance_id(t);
+        if(range ? !value_in_range(t) : posting_deleted(t))
+            continue;
+        uint32_t offset = t->pub.c.id & 1023;
+        bits[offset >> 6] |= ((uint64_t)1) << (offset & 63);
+        count++;
+    }
+    return count;
+}
+
+// the number of ids in the current group, decoded if the image has no group counts
+static inline uint32_t group_size(sil_term_ext_t *t) {
+    if(t->flags & SIL_IMAGE_GROUP_COUNTS)
+        return t->group_count;
+    uint64_t bits[GROUP_WORDS];
+    return decode_group(t, bits);
+}
+
+static inline uint32_t group_documents(sil_search_image_t *img, uint32_t gid) {
+    gid >>= 10;
+    return gid <= ((img->num_gbls-1) >> 10) ? img->group_documents[gid] : 0;
+}
+
+/* Every posting belongs to a document with a global record, so a term holding as many ids
+   in a group as there are documents in it contains every document of the group. */
+static inline bool group_covered(sil_search_image_t *img, sil_term_ext_t *t) {
+    return group_match(t) == GROUP_MATCHES_ALL && group_size(t) >= group_documents(img, t->gid);
+}
+
+uint32_t sil_term_count(sil_term_t *t) {
+    if(!t)
+        return 0;
+    sil_term_ext_t *r = (sil_term_ext_t *)t;
+    if(!is_value_range(r) && !r->deleted)
+        return t->document_frequency;
+
+    uint64_t bits[GROUP_WORDS];
+    uint32_t count = 0;
+    do {
+        group_match_t m = group_match(r);
+        if(m == GROUP_MATCHES_ALL)
+            count += group_size(r);
+        else if(m == GROUP_MATCHES_SOME)
+            count += decode_group(r, bits);
+    } while(advance_group(r));
+    return count;
+}
+
+uint32_t sil_term_count_and(sil_search_image_t *img, sil_term_t **terms, size_t num_terms) {
+    if(num_terms == 0)
+        return 0;
+    for(size_t i=0; i<num_terms; i++)
+        if(!terms[i])
+            return 0;
+    if(num_terms == 1)
+        return sil_term_count(terms[0]);
+
+    // the rarest term drives, the rest are checked a group at a time
+    sil_term_ext_t **t = (sil_term_ext_t **)aml_malloc(sizeof(sil_term_ext_t *) * num_terms);
+    for(size_t i=0; i<num_terms; i++) {
+        sil_term_ext_t *v = (sil_term_ext_t *)terms[i];
+        size_t j = i;
+        for(; j > 0 && t[j-1]->pub.document_frequency > v->pub.document_frequency; j--)
+            t[j] = t[j-1];
+        t[j] = v;
+    }
+
+    uint64_t bits[GROUP_WORDS], other_bits[GROUP_WORDS];
+    uint32_t count = 0;
+    sil_term_ext_t *d = t[0];
+    while(true) {
+        uint32_t gid = d->gid, next_gid = gid;
+        group_match_t m = group_match(d);
+        bool matched = m != GROUP_MATCHES_NONE;
+        bool covered = m == GROUP_MATCHES_ALL;
+        for(size_t i=1; matched && i<num_terms; i++) {
+            if(!advance_group_to(t[i], gid))
+                goto done;
+            if(t[i]->gid != gid) {
+                next_gid = t[i]->gid;
+                matched = false;
+            }
+            else if(group_match(t[i]) == GROUP_MATCHES_NONE)
+                matched = false;
+            else if(!group_covered(img, t[i]))
+                covered = false;
+        }
+        if(matched) {
+            if(covered)
+                count += group_size(d);
+            else {
+                decode_group(d, bits);
+                for(size_t i=1; i<num_terms; i++) {
+                    if(group_covered(img, t[i]))
+                        continue;
+                    decode_group(t[i], other_bits);
+                    for(uint32_t w=0; w<GROUP_WORDS; w++)
+                        bits[w] &= other_bits[w];
+                }
+                for(uint32_t w=0; w<GROUP_WORDS; w++)
+                    count += __builtin_popcountll(bits[w]);
+            }
+        }
+        if(!(next_gid > gid ? advance_group_to(d, next_gid) : advance_group(d)))
+            break;
+    }
+done:
+    aml_free(t);
+    return count;
+}
+
+void sil_facet_options_init(sil_facet_options_t *options) {
+    options->top_n = 10;
+    options->sample_above = 0;
+    options->sample_groups = 8;
+}
+
+// whole groups of 1024 ids, so each group of a term lines up with GROUP_WORDS words
+size_t sil_search_image_match_words(sil_search_image_t *img) {
+    return (size_t)(((img->num_gbls-1) >> 10) + 1) * GROUP_WORDS;
+}
+
+uint64_t *sil_search_image_matches(sil_search_image_t *img, aml_pool_t *pool, atl_cursor_t *c,
+                                   uint32_t *num_matches) {
+    uint64_t *matches = (uint64_t *)aml_pool_zalloc(pool, sizeof(uint64_t) * sil_search_image_match_words(img));
+    uint32_t n = 0;
+    while(c && c->advance(c)) {
+        if(c->id >= img->num_gbls)
+            break;
+        matches[c->id >> 6] |= ((uint64_t)1) << (c->id & 63);
+        n++;
+    }
+    if(num_matches)
+        *num_matches = n;
+    return matches;
+}
+
+static inline uint32_t group_popcount(const uint64_t *bits) {
+    uint32_t count = 0;
+    for(uint32_t w=0; w<GROUP_WORDS; w++)
+        count += __builtin_popcountll(bits[w]);
+    return count;
+}
+
+static inline bool group_sampled(uint32_t gid, uint32_t sample_groups) {
+    return sample_groups <= 1 || ((gid >> 10) % sample_groups) == 0;
+}
+
+/* The number of matches in t, a group at a time.  Groups without matches are skipped
+   without being decoded, a group the term covers adds the popcount of the matches. */
+static uint32_t facet_term_count(sil_search_image_t *img, sil_term_ext_t *t, const uint64_t *matches,
+                                 uint32_t sample_groups) {
+    uint64_t bits[GROUP_WORDS];
+    uint32_t count = 0;
+    do {
+        const uint64_t *m = matches + (size_t)(t->gid >> 10) * GROUP_WORDS;
+        if(!group_sampled(t->gid, sample_groups) || !group_popcount(m))
+            continue;
+        if(group_covered(img, t))
+            count += group_popcount(m);
+        else if(group_match(t) != GROUP_MATCHES_NONE) {
+            decode_group(t, bits);
+            for(uint32_t w=0; w<GROUP_WORDS; w++)
+                bits[w] &= m[w];
+            count += group_popcount(bits);
+        }
+    } while(advance_group(t));
+    return count;
+}
+
+static inline bool compare_facet_counts(const sil_facet_count_t *a, const sil_facet_count_t *b) {
+    if(a->count != b->count)
+        return a->count > b->count;
+    if(a->value && b->value)
+        return strcmp(a->value, b->value) < 0;
+    return a->column_value < b->column_value;
+}
+
+macro_sort(sort_facet_counts, sil_facet_count_t, compare_facet_counts);
+
+static inline bool compare_column_values(const uint64_t *a, const uint64_t *b) {
+    return *a < *b;
+}
+
+macro_sort(sort_column_values, uint64_t, compare_column_values);
+
+// every sample_groups'th group is counted once there are more than sample_above matches
+static uint32_t facet_sample_groups(sil_search_image_t *img, const uint64_t *matches,
+                                    const sil_facet_options_t *options) {
+    if(!options->sample_above || options->sample_groups <= 1)
+        return 1;
+    size_t num_words = sil_search_image_match_words(img);
+    uint64_t num_matches = 0;
+    for(size_t i=0; i<num_words; i++)
+        num_matches += __builtin_popcountll(matches[i]);
+    return num_matches > options->sample_above ? options->sample_groups : 1;
+}
+
+// the top_n counts of facets, which are scaled up by sample_groups
+static size_t facet_top_n(aml_buffer_t *counts, uint32_t sample_groups, const sil_facet_options_t *options,
+                          sil_facet_count_t *res) {
+    sil_facet_count_t *c = (sil_facet_count_t *)aml_buffer_data(counts);
+    size_t num = aml_buffer_length(counts) / sizeof(sil_facet_count_t);
+    sort_facet_counts(c, num);
+    if(num > options->top_n)
+        num = options->top_n;
+    for(size_t i=0; i<num; i++) {
+        res[i] = c[i];
+        res[i].count *= sample_groups;
+    }
+    aml_buffer_destroy(counts);
+    return num;
+}
+
+size_t sil_search_image_facet(sil_search_image_t *img, const uint64_t *matches, const char *prefix,
+                              const sil_facet_options_t *options, sil_facet_count_t *res,
+                              bool *sampled) {
+    sil_facet_options_t default_options;
+    if(!options) {
+        sil_facet_options_init(&default_options);
+        options = &default_options;
+    }
+    uint32_t sample_groups = facet_sample_groups(img, matches, options);
+    if(sampled)
+        *sampled = sample_groups > 1;
+
+    // the terms are sorted, so the terms with the prefix follow the first one
+    size_t prefix_len = strlen(prefix);
+    size_t lo = 0, hi = img->num_terms;
+    while(lo < hi) {
+        size_t mid = (lo + hi) >> 1;
+        if(strcmp(img->terms[mid], prefix) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    aml_buffer_t *counts = aml_buffer_init(sizeof(sil_facet_count_t) * 64);
+    aml_pool_t *pool = aml_pool_init(1024*16);
+    for(size_t i=lo; i<img->num_terms && !strncmp(img->terms[i], prefix, prefix_len); i++) {
+        aml_pool_clear(pool);
+        sil_term_ext_t *t = (sil_term_ext_t *)aml_pool_zalloc(pool, sizeof(*t));
+        if(!fill_term(img, pool, t, img->terms + i))
+            continue;
+        sil_facet_count_t c;
+        c.value = img->terms[i] + prefix_len;
+        c.column_value = 0;
+        c.count = facet_term_count(img, t, matches, sample_groups);
+        sil_search_image_term_release((sil_term_t *)t);
+        if(c.count)
+            aml_buffer_append(counts, &c, sizeof(c));
+    }
+    aml_pool_destroy(pool);
+    return facet_top_n(counts, sample_groups, options, res);
+}
+
+size_t sil_search_image_facet_column(sil_search_image_t *img, const uint64_t *matches, const char *column,
+                                     const sil_facet_options_t *options, sil_facet_count_t *res,
+                                     bool *sampled) {
+    sil_facet_options_t default_options;
+    if(!options) {
+        sil_facet_options_init(&default_options);
+        options = &default_options;
+    }
+    uint32_t sample_groups = facet_sample_groups(img, matches, options);
+    if(sampled)
+        *sampled = sample_groups > 1;
+    sil_column_type_t type;
+    const void *values = sil_search_image_column(img, column, &type);
+    if(!values)
+        return 0;
+
+    // the values of the matches, sorted so equal values are counted together
+    aml_buffer_t *bh = aml_buffer_init(sizeof(uint64_t) * 1024);
+    uint32_t num_groups = ((img->num_gbls-1) >> 10) + 1;
+    const uint32_t *ids = (const uint32_t *)aml_buffer_data(img->ids);
+    for(uint32_t g=0; g<num_groups; g++) {
+        const uint64_t *m = matches + (size_t)g * GROUP_WORDS;
+        if(!img->group_documents[g] || !group_sampled(g << 10, sample_groups) || !group_popcount(m))
+            continue;
+        // the documents of the group are ids[start..start+n), so their values are too
+        uint32_t start = img->group_start[g], n = img->group_documents[g];
+        for(uint32_t i=start; i<start+n; i++) {
+            uint32_t offset = ids[i] & 1023;
+            if((m[offset >> 6] >> (offset & 63)) & 1) {
+                uint64_t v = sil_column_value(values, type, i);
+                aml_buffer_append(bh, &v, sizeof(v));
+            }
+        }
+    }
+    uint64_t *v = (uint64_t *)aml_buffer_data(bh);
+    size_t num = aml_buffer_length(bh) / sizeof(uint64_t);
+    sort_column_values(v, num);
+    aml_buffer_t *counts = aml_buffer_init(sizeof(sil_facet_count_t) * 64);
+    for(size_t i=0; i<num; ) {
+        sil_facet_count_t c;
+        c.value = NULL;
+        c.column_value = v[i];
+        c.count = 0;
+        for(; i<num && v[i] == c.column_value; i++)
+            c.count++;
+        aml_buffer_append(counts, &c, sizeof(c));
+    }
+    aml_buffer_destroy(bh);
+    return facet_top_n(counts, sample_groups, options, res);
+}
+
 sil_term_t *sil_search_image_termf(sil_search_image_t *img, aml_pool_t *pool, const char *term, ...) {
   va_list args;
   va_start(args, term);
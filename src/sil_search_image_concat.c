@@ -0,0 +1,541 @@
+// SPDX-FileCopyrightText: 2023–2025 Andy Curtis <contactandyc@gmail.com>
+// SPDX-FileCopyrightText: 2024–2025 Knode.ai — technical questions: contact Andy (above)
+// SPDX-License-Identifier: Apache-2.0
+
+#include "search-index-library/sil_search_image.h"
+#include "search-index-library/impl/sil_constants.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "the-io-library/io.h"
+#include "a-memory-library/aml_buffer.h"
+
+/*
+    Images over disjoint ranges of ids are concatenated without decoding any postings.
+    Postings are grouped by bits 18-31 of the id and then by bits 10-17, so as long as no
+    group of 1024 ids is split between images, the posting list of a term in the combined
+    image is the top level groups of each image in id order.  A top level group which
+    spans two images has their second level groups joined under one header.  Only
+    SIL_IMAGE_FORMAT_V2 images are concatenated (older ones have one byte group ids).
+*/
+
+typedef struct {
+    const char *base;
+    uint32_t num_terms;
+    size_t total_documents;
+    size_t total_terms;
+    uint32_t max_id;
+    uint32_t flags;
+    uint32_t first_id;
+
+    char *term_idx;
+    char *term_idx_end;
+    char *p;
+    char *term;             // the current term, NULL once every term is read
+    FILE *term_data;
+    aml_buffer_t *posting;  // [sil_term_header_t][groups] of the current term
+} concat_input_t;
+
+typedef struct {
+    uint16_t gid;
+    uint8_t *p;
+    uint32_t len;
+} top_group_t;
+
+// p is just past the gid, the group is from *sp for *len bytes
+static uint8_t *next_group(uint8_t **sp, uint32_t *len, uint8_t *p) {
+    uint8_t control = *p++;
+    if(control < GROUP_2BYTE_LENGTH)
+        *len = control;
+    else if(control == GROUP_2BYTE_LENGTH) {
+        uint16_t v;
+        memcpy(&v, p, sizeof(v));
+        *len = v;
+        p += sizeof(v);
+    }
+    else {
+        memcpy(len, p, sizeof(*len));
+        p += sizeof(*len);
+    }
+    *sp = p;
+    return p + *len;
+}
+
+// the top level group keys are two bytes wide in SIL_IMAGE_FORMAT_V2 images
+static inline uint32_t group_header_size(uint32_t len) {
+    if(len < GROUP_2BYTE_LENGTH)
+        return 3;
+    return len < 65536 ? 5 : 7;
+}
+
+static void write_group_header(FILE *out, uint16_t gid, uint32_t len) {
+    uint8_t header[7];
+    memcpy(header, &gid, sizeof(gid));
+    size_t n = 3;
+    if(len < GROUP_2BYTE_LENGTH)
+        header[2] = len;
+    else if(len < 65536) {
+        uint16_t v = len;
+        header[2] = GROUP_2BYTE_LENGTH;
+        memcpy(header+3, &v, sizeof(v));
+        n += sizeof(v);
+    }
+    else {
+        header[2] = GROUP_4BYTE_LENGTH;
+        memcpy(header+3, &len, sizeof(len));
+        n += sizeof(len);
+    }
+    fwrite(header, n, 1, out);
+}
+
+static FILE *open_file(char *filename, size_t filename_len, const char *base,
+                       const char *suffix, const char *mode) {
+    snprintf(filename, filename_len, "%s%s", base, suffix);
+    return fopen(filename, mode);
+}
+
+static bool read_input(concat_input_t *in, char *filename, size_t filename_len) {
+    FILE *f = open_file(filename, filename_len, in->base, "_stats.txt", "rb");
+    if(!f)
+        return false;
+    bool ok = fgets(filename, filename_len, f) != NULL;
+    fclose(f);
+    if(!ok || sscanf(filename, "%u %zu %zu %u %u", &in->num_terms, &in->total_documents,
+                     &in->total_terms, &in->max_id, &in->flags) < 4)
+        return false;
+
+    // the globals are sorted by id, so the first record has the lowest id
+    in->first_id = 0;
+    f = open_file(filename, filename_len, in->base, "_gbl", "rb");
+    if(!f)
+        return false;
+    uint32_t len;
+    char record[sizeof(sil_global_header_t)+sizeof(uint32_t)];
+    if(fread(&len, sizeof(len), 1, f) == 1 && len >= sizeof(record) &&
+       fread(record, sizeof(record), 1, f) == 1)
+        memcpy(&in->first_id, record+sizeof(sil_global_header_t), sizeof(uint32_t));
+    fclose(f);
+    return true;
+}
+
+static size_t copy_file(FILE *out, char *filename, size_t filename_len, const char *base,
+                        const char *suffix, aml_buffer_t *bh) {
+    FILE *in = open_file(filename, filename_len, base, suffix, "rb");
+    if(!in)
+        return 0;
+    size_t total = 0, n;
+    aml_buffer_resize(bh, 1024*1024);
+    while((n = fread(aml_buffer_data(bh), 1, aml_buffer_length(bh), in)) > 0) {
+        fwrite(aml_buffer_data(bh), n, 1, out);
+        total += n;
+    }
+    fclose(in);
+    return total;
+}
+
+/* Compressed content (SIL_IMAGE_CONTENT_BLOCKS) is appended a block at a time.  The
+   content offsets of an image move past the whole blocks of earlier images, so their last
+   block is left partly empty instead of being compressed again.  Returns the uncompressed
+   size of the image's blocks, or 0 if its block index cannot be read. */
+static uint64_t append_content_blocks(aml_buffer_t *offsets, uint32_t *block_size,
+                                      uint64_t compressed_offset, const char *base,
+                                      char *filename, size_t filename_len) {
+    snprintf(filename, filename_len, "%s_content_blocks", base);
+    size_t len = 0;
+    char *blocks = (char *)io_read_file(&len, filename);
+    if(!blocks)
+        return 0;
+    sil_content_blocks_header_t *header = (sil_content_blocks_header_t *)blocks;
+    uint64_t size = 0;
+    if(len >= sizeof(*header) && len >= sizeof(*header) + sizeof(uint64_t) * (header->num_blocks+1) &&
+       (!*block_size || header->block_size == *block_size)) {
+        *block_size = header->block_size;
+        const uint64_t *p = (const uint64_t *)(header+1);
+        for(uint32_t i=0; i<header->num_blocks; i++) {
+            uint64_t offset = p[i] + compressed_offset;
+            aml_buffer_append(offsets, &offset, sizeof(offset));
+        }
+        size = (uint64_t)header->num_blocks * header->block_size;
+    }
+    aml_free(blocks);
+    return size;
+}
+
+// globals keep their order, their content and embedding offsets move past earlier images
+static bool concat_globals(const char *dest, concat_input_t *inputs, size_t num_inputs,
+                           char *filename, size_t filename_len, aml_buffer_t *bh) {
+    FILE *out_gbl = open_file(filename, filename_len, dest, "_gbl", "wb");
+    FILE *out_emb = open_file(filename, filename_len, dest, "_embeddings", "wb");
+    FILE *out_content = open_file(filename, filename_len, dest, "_content", "wb");
+    bool ok = out_gbl && out_emb && out_content;
+    bool blocks = num_inputs && (inputs[0].flags & SIL_IMAGE_CONTENT_BLOCKS);
+    aml_buffer_t *block_offsets = aml_buffer_init(1024);
+    uint32_t block_size = 0;
+    uint64_t content_offset = 0, compressed_offset = 0;
+    uint64_t embeddings_offset = 0;
+    for(size_t i=0; ok && i<num_inputs; i++) {
+        FILE *in = open_file(filename, filename_len, inputs[i].base, "_gbl", "rb");
+        if(!in) {
+            ok = false;
+            break;
+        }
+        uint32_t len;
+        while(fread(&len, sizeof(len), 1, in) == 1) {
+            aml_buffer_resize(bh, len);
+            if(len < sizeof(sil_global_header_t) || fread(aml_buffer_data(bh), len, 1, in) != 1) {
+                ok = false;
+                break;
+            }
+            sil_global_header_t *gh = (sil_global_header_t *)aml_buffer_data(bh);
+            gh->content_offset += content_offset;
+            gh->embeddings_offset += embeddings_offset;
+            fwrite(&len, sizeof(len), 1, out_gbl);
+            fwrite(gh, len, 1, out_gbl);
+        }
+        fclose(in);
+        size_t content_size = copy_file(out_content, filename, filename_len, inputs[i].base, "_content", bh);
+        if(blocks && content_size) {
+            uint64_t size = append_content_blocks(block_offsets, &block_size, compressed_offset,
+                                                  inputs[i].base, filename, filename_len);
+            ok = ok && size > 0;
+            content_offset += size;
+            compressed_offset += content_size;
+        }
+        else
+            content_offset += content_size;
+        embeddings_offset += copy_file(out_emb, filename, filename_len, inputs[i].base, "_embeddings", bh) / 512;
+    }
+    if(out_gbl)
+        fclose(out_gbl);
+    if(out_emb)
+        fclose(out_emb);
+    if(out_content)
+        fclose(out_content);
+
+    if(blocks && ok) {
+        sil_content_blocks_header_t header;
+        header.block_size = block_size;
+        header.num_blocks = aml_buffer_length(block_offsets) / sizeof(uint64_t);
+        aml_buffer_append(block_offsets, &compressed_offset, sizeof(compressed_offset));
+        FILE *out_blocks = open_file(filename, filename_len, dest, "_content_blocks", "wb");
+        ok = out_blocks != NULL;
+        if(out_blocks) {
+            fwrite(&header, sizeof(header), 1, out_blocks);
+            fwrite(aml_buffer_data(block_offsets), aml_buffer_length(block_offsets), 1, out_blocks);
+            fclose(out_blocks);
+        }
+    }
+    else if(!blocks) {
+        snprintf(filename, filename_len, "%s_content_blocks", dest);
+        remove(filename);
+    }
+    aml_buffer_destroy(block_offsets);
+    return ok;
+}
+
+/* The columns of every image must be declared the same, the values of each column are
+   appended in the order of the images. */
+static bool concat_columns(const char *dest, concat_input_t *inputs, size_t num_inputs,
+                           char *filename, size_t filename_len) {
+    char **columns = (char **)aml_zalloc(sizeof(char *) * (num_inputs+1));
+    sil_columns_header_t header = { 0, 0 };
+    bool ok = true;
+    for(size_t i=0; ok && i<num_inputs; i++) {
+        snprintf(filename, filename_len, "%s_columns", inputs[i].base);
+        size_t len = 0;
+        columns[i] = (char *)io_read_file(&len, filename);
+        sil_columns_header_t h = { 0, 0 };
+        if(columns[i])
+            memcpy(&h, columns[i], sizeof(h));
+        if(columns[i] && (len < sizeof(h) || h.num_columns > SIL_MAX_COLUMNS ||
+                          len < sizeof(h) + sizeof(sil_column_header_t) * h.num_columns))
+            ok = false;
+        if(i && h.num_columns != header.num_columns)
+            ok = false;
+        for(uint32_t j=0; ok && i && j<h.num_columns; j++) {
+            const sil_column_header_t *a = (const sil_column_header_t *)(columns[0] + sizeof(h)) + j;
+            const sil_column_header_t *b = (const sil_column_header_t *)(columns[i] + sizeof(h)) + j;
+            ok = !strcmp(a->name, b->name) && a->type == b->type;
+        }
+        header.num_columns = h.num_columns;
+        header.num_documents += h.num_documents;
+    }
+
+    snprintf(filename, filename_len, "%s_columns", dest);
+    if(!ok || !header.num_columns)
+        remove(filename);
+    else {
+        FILE *out = fopen(filename, "wb");
+        ok = out != NULL;
+        if(out) {
+            fwrite(&header, sizeof(header), 1, out);
+            uint64_t offset = sizeof(header) + sizeof(sil_column_header_t) * header.num_columns;
+            for(uint32_t j=0; j<header.num_columns; j++) {
+                sil_column_header_t ch = ((const sil_column_header_t *)(columns[0] + sizeof(header)))[j];
+                offset = (offset + 63) & ~(uint64_t)63;
+                ch.offset = offset;
+                offset += (uint64_t)ch.width * header.num_documents;
+                fwrite(&ch, sizeof(ch), 1, out);
+            }
+            for(uint32_t j=0; j<header.num_columns; j++) {
+                static const char zeros[64] = { 0 };
+                long pos = ftell(out);
+                fwrite(zeros, ((pos + 63) & ~63L) - pos, 1, out);
+                for(size_t i=0; i<num_inputs; i++) {
+                    sil_columns_header_t h;
+                    memcpy(&h, columns[i], sizeof(h));
+                    const sil_column_header_t *ch = (const sil_column_header_t *)(columns[i] + sizeof(h)) + j;
+                    fwrite(columns[i] + ch->offset, (size_t)ch->width * h.num_documents, 1, out);
+                }
+            }
+            fclose(out);
+        }
+    }
+    for(size_t i=0; i<num_inputs; i++)
+        if(columns[i])
+            aml_free(columns[i]);
+    aml_free(columns);
+    return ok;
+}
+
+/* Documents deleted from an image stay deleted.  Ids keep their values in the combined
+   image, so the bits of each image's own range of ids are copied into one bitmap. */
+static bool concat_deleted(const char *dest, concat_input_t *inputs, size_t num_inputs,
+                           uint32_t max_id, char *filename, size_t filename_len) {
+    size_t num_words = (max_id >> 6) + 1;
+    uint64_t *bits = (uint64_t *)aml_zalloc(sizeof(uint64_t) * num_words);
+    bool any = false;
+    for(size_t i=0; i<num_inputs; i++) {
+        concat_input_t *in = inputs + i;
+        snprintf(filename, filename_len, "%s_deleted", in->base);
+        size_t len = 0;
+        uint64_t *in_bits = (uint64_t *)io_read_file(&len, filename);
+        if(!in_bits)
+            continue;
+        size_t n = len / sizeof(uint64_t);
+        uint32_t first = in->first_id >> 6, last = in->max_id >> 6;
+        for(size_t w=first; w<=last && w<n; w++) {
+            uint64_t mask = ~(uint64_t)0;
+            if(w == first)
+                mask &= ~(uint64_t)0 << (in->first_id & 63);
+            if(w == last && (in->max_id & 63) != 63)
+                mask &= (((uint64_t)1) << ((in->max_id & 63) + 1)) - 1;
+            bits[w] |= in_bits[w] & mask;
+            any = any || (in_bits[w] & mask);
+        }
+        aml_free(in_bits);
+    }
+
+    snprintf(filename, filename_len, "%s_deleted", dest);
+    bool ok = true;
+    if(!any)
+        remove(filename);
+    else {
+        FILE *out = fopen(filename, "wb");
+        ok = out && fwrite(bits, sizeof(uint64_t), num_words, out) == num_words;
+        if(out)
+            ok = fclose(out) == 0 && ok;
+    }
+    aml_free(bits);
+    return ok;
+}
+
+// term_data is in the same order as term_idx, so it is read sequentially
+static bool advance_input(concat_input_t *in) {
+    if(in->p >= in->term_idx_end) {
+        in->term = NULL;
+        return true;
+    }
+    in->term = in->p;
+    in->p += strlen(in->p) + 1 + sizeof(size_t);
+    uint32_t len;
+    if(fread(&len, sizeof(len), 1, in->term_data) != 1 || len < sizeof(sil_term_header_t))
+        return false;
+    aml_buffer_resize(in->posting, len);
+    return fread(aml_buffer_data(in->posting), len, 1, in->term_data) == 1;
+}
+
+static bool open_terms(concat_input_t *in, char *filename, size_t filename_len) {
+    snprintf(filename, filename_len, "%s_term_idx", in->base);
+    size_t len = 0;
+    in->term_idx = io_read_file(&len, filename);
+    in->term_idx_end = in->term_idx + len;
+    in->p = in->term_idx;
+    in->term_data = open_file(filename, filename_len, in->base, "_term_data", "rb");
+    in->posting = aml_buffer_init(1024*1024);
+    return in->term_idx && in->term_data && advance_input(in);
+}
+
+static void close_terms(concat_input_t *in) {
+    if(in->term_idx)
+        aml_free(in->term_idx);
+    if(in->term_data)
+        fclose(in->term_data);
+    if(in->posting)
+        aml_buffer_destroy(in->posting);
+}
+
+static bool concat_terms(const char *dest, concat_input_t *inputs, size_t num_inputs,
+                         char *filename, size_t filename_len, uint32_t *total_terms) {
+    bool ok = true;
+    for(size_t i=0; i<num_inputs; i++)
+        ok = open_terms(inputs+i, filename, filename_len) && ok;
+    FILE *out_idx = open_file(filename, filename_len, dest, "_term_idx", "wb");
+    FILE *out_data = open_file(filename, filename_len, dest, "_term_data", "wb");
+    ok = ok && out_idx && out_data;
+
+    aml_buffer_t *groups = aml_buffer_init(sizeof(top_group_t) * 256);
+    size_t offs = 4;
+    *total_terms = 0;
+    while(ok) {
+        const char *term = NULL;
+        for(size_t i=0; i<num_inputs; i++) {
+            if(inputs[i].term && (!term || strcmp(inputs[i].term, term) < 0))
+                term = inputs[i].term;
+        }
+        if(!term)
+            break;
+
+        // the top level groups of each image holding the term, in id order
+        sil_term_header_t header = { 0, 0 };
+        aml_buffer_clear(groups);
+        for(size_t i=0; i<num_inputs; i++) {
+            concat_input_t *in = inputs + i;
+            if(!in->term || strcmp(in->term, term))
+                continue;
+            sil_term_header_t h;
+            memcpy(&h, aml_buffer_data(in->posting), sizeof(h));
+            header.document_frequency += h.document_frequency;
+            if(h.max_positions > header.max_positions)
+                header.max_positions = h.max_positions;
+            uint8_t *p = (uint8_t *)aml_buffer_data(in->posting) + sizeof(h);
+            uint8_t *ep = (uint8_t *)aml_buffer_end(in->posting);
+            while(p < ep) {
+                top_group_t g;
+                memcpy(&g.gid, p, sizeof(g.gid));
+                p = next_group(&g.p, &g.len, p+sizeof(g.gid));
+                aml_buffer_append(groups, &g, sizeof(g));
+            }
+        }
+
+        top_group_t *g = (top_group_t *)aml_buffer_data(groups);
+        top_group_t *eg = (top_group_t *)aml_buffer_end(groups);
+        uint32_t len = sizeof(header);
+        for(top_group_t *p=g; p<eg; ) {
+            uint32_t group_len = 0;
+            uint16_t gid = p->gid;
+            for(; p<eg && p->gid == gid; p++)
+                group_len += p->len;
+            len += group_header_size(group_len) + group_len;
+        }
+        fwrite(term, strlen(term)+1, 1, out_idx);
+        fwrite(&offs, sizeof(offs), 1, out_idx);
+        offs += len + 4;
+        fwrite(&len, sizeof(len), 1, out_data);
+        fwrite(&header, sizeof(header), 1, out_data);
+        for(top_group_t *p=g; p<eg; ) {
+            top_group_t *sp = p;
+            uint32_t group_len = 0;
+            for(; p<eg && p->gid == sp->gid; p++)
+                group_len += p->len;
+            write_group_header(out_data, sp->gid, group_len);
+            for(; sp<p; sp++)
+                fwrite(sp->p, sp->len, 1, out_data);
+        }
+        (*total_terms)++;
+
+        for(size_t i=0; ok && i<num_inputs; i++) {
+            if(inputs[i].term == term || (inputs[i].term && !strcmp(inputs[i].term, term)))
+                ok = advance_input(inputs+i);
+        }
+    }
+    aml_buffer_destroy(groups);
+    if(out_idx)
+        fclose(out_idx);
+    if(out_data)
+        fclose(out_data);
+    for(size_t i=0; i<num_inputs; i++)
+        close_terms(inputs+i);
+    return ok;
+}
+
+bool sil_search_image_concat(const char *filename, const char **bases, size_t num_bases) {
+    size_t filename_len = strlen(filename)+50;
+    for(size_t i=0; i<num_bases; i++) {
+        if(strlen(bases[i])+50 > filename_len)
+            filename_len = strlen(bases[i])+50;
+    }
+    if(filename_len < 256)
+        filename_len = 256;
+    char *name = (char *)aml_malloc(filename_len);
+    concat_input_t *inputs = (concat_input_t *)aml_zalloc(sizeof(concat_input_t) * (num_bases+1));
+    size_t num_inputs = 0;
+    uint32_t flags = 0;
+    bool ok = true;
+    for(size_t i=0; ok && i<num_bases; i++) {
+        concat_input_t *in = inputs + num_inputs;
+        in->base = bases[i];
+        ok = read_input(in, name, filename_len);
+        if(!ok || !in->total_documents)
+            continue;
+        if(!(in->flags & SIL_IMAGE_FORMAT_V2))
+            ok = false; // older images have narrower globals and group keys
+        if(num_inputs && in->flags != flags)
+            ok = false; // the groups would not decode the same way
+        snprintf(name, filename_len, "%s_id_map", in->base);
+        if(io_file_exists(name))
+            ok = false; // the original ids of a renumbered image would be lost
+        struct stat st;
+        snprintf(name, filename_len, "%s_updates", in->base);
+        if(stat(name, &st) == 0 && st.st_size > 0)
+            ok = false; // published value updates are not in the postings which are copied
+        flags = in->flags;
+        // keep the images ordered by their first id
+        for(size_t j=num_inputs; j>0 && inputs[j-1].first_id > in->first_id; j--) {
+            concat_input_t tmp = inputs[j-1];
+            inputs[j-1] = inputs[j];
+            inputs[j] = tmp;
+        }
+        num_inputs++;
+    }
+    // no group of 1024 ids may be in more than one image
+    for(size_t i=1; ok && i<num_inputs; i++) {
+        if((inputs[i-1].max_id >> 10) >= (inputs[i].first_id >> 10))
+            ok = false;
+    }
+
+    uint32_t total_terms = 0;
+    aml_buffer_t *bh = aml_buffer_init(1024*1024);
+    ok = ok && concat_globals(filename, inputs, num_inputs, name, filename_len, bh);
+    ok = ok && concat_deleted(filename, inputs, num_inputs,
+                              num_inputs ? inputs[num_inputs-1].max_id : 0, name, filename_len);
+    ok = ok && concat_columns(filename, inputs, num_inputs, name, filename_len);
+    ok = ok && concat_terms(filename, inputs, num_inputs, name, filename_len, &total_terms);
+    aml_buffer_destroy(bh);
+
+    FILE *out = ok ? open_file(name, filename_len, filename, "_stats.txt", "wb") : NULL;
+    if(out) {
+        size_t total_documents = 0, total_terms_in_documents = 0;
+        uint32_t max_id = 0;
+        for(size_t i=0; i<num_inputs; i++) {
+            total_documents += inputs[i].total_documents;
+            total_terms_in_documents += inputs[i].total_terms;
+            max_id = inputs[i].max_id;
+        }
+        fprintf(out, "%u %zu %zu %u %u\n", total_terms, total_documents, total_terms_in_documents, max_id, flags );
+        fprintf(out, "total_terms: %u\n", total_terms );
+        fprintf(out, "max_id: %u\n", max_id );
+        fprintf(out, "flags: %u\n", flags );
+        fprintf(out, "total_documents: %zu\n", total_documents );
+        fprintf(out, "total_terms_in_documents: %zu\n", total_terms_in_documents );
+        fprintf(out, "average document length: %f\n",
+                total_documents > 0 ? (double)total_terms_in_documents / (double)total_documents : 0.0);
+        fclose(out);
+    }
+    else
+        ok = false;
+    aml_free(inputs);
+    aml_free(name);
+    return ok;
+}
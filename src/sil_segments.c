@@ -0,0 +1,1013 @@
+// SPDX-FileCopyrightText: 2023–2025 Andy Curtis <contactandyc@gmail.com>
+// SPDX-FileCopyrightText: 2024–2025 Knode.ai — technical questions: contact Andy (above)
+// SPDX-License-Identifier: Apache-2.0
+
+#include "search-index-library/sil_segments.h"
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "a-memory-library/aml_buffer.h"
+
+static const char *segment_suffixes[] = { "_gbl", "_embeddings", "_content", "_term_idx",
+                                          "_term_data", "_stats.txt", "_deleted", "_id_map",
+                                          "_content_blocks", "_columns", "_updates", "_stats.json" };
+
+typedef struct {
+    uint32_t number;
+    sil_search_image_t *img;
+    uint32_t num_documents;
+    double document_lengths;  // terms in all of the documents
+    int refs;                 // snapshots holding the segment
+    bool obsolete;            // merged away, the files go with the last reference
+    bool deletes_changed;     // deletes not yet saved (sil_search_image_save_deleted)
+} segment_t;
+
+/* The ids of a segment which a later segment also has.  Snapshots share these and copy
+   one before changing it.  refs is atomic, snapshots are built outside the mutex. */
+typedef struct {
+    int refs;
+    uint32_t num_documents;
+    double document_lengths;
+    size_t num_words;
+    uint64_t bits[];
+} replaced_t;
+
+/* The memory index of sil_segments_add_document, shared by the snapshots until the last
+   one which has it is released. */
+typedef struct {
+    int refs;
+    sil_memory_index_t *index;
+} memory_t;
+
+struct sil_segments_snapshot_s {
+    sil_segments_t *h;
+    int refs;
+    segment_t **segments;     // oldest first
+    replaced_t **replaced;    // per segment, NULL when nothing in it is replaced
+    size_t num_segments;
+    uint32_t total_documents;
+    double average_document_length;
+
+    memory_t *memory;
+    uint32_t memory_added;    // the documents of the memory index the snapshot sees
+    uint32_t memory_documents; // sil_memory_index_total_documents as of memory_added
+    double memory_lengths;
+    uint32_t replaced_documents; // segment documents whose ids are in the memory index
+    double replaced_lengths;
+};
+
+typedef struct {
+    sil_search_builder_t *builder;
+    uint32_t number;
+} pending_segment_t;
+
+struct sil_segments_s {
+    sil_segments_options_t options;
+    char *base;
+
+    pthread_mutex_t add_mutex;   // held while a document is added or the memory index written out
+    memory_t *memory;            // changed with both mutexes held
+
+    pthread_mutex_t mutex;       // guards everything below and every reference count
+    sil_segments_snapshot_t *current;
+    uint32_t next_number;
+    aml_buffer_t *pending;       // builders from sil_segments_builder not yet added
+
+    pthread_mutex_t merge_mutex; // held while segments are merged
+    pthread_cond_t work;
+    pthread_t thread;
+    bool background;
+    bool added;                  // a segment was added since the last merge pass
+    bool stop;
+
+    size_t reclaimed_bytes;      // by merges since the index was opened
+    size_t dropped_documents;
+};
+
+void sil_segments_options_init(sil_segments_options_t *options) {
+    memset(options, 0, sizeof(*options));
+    sil_search_builder_options_init(&options->builder_options);
+    options->merge_factor = 4;
+    options->background = true;
+    options->memory_size = 16*1024*1024;
+}
+
+void sil_segments_options_builder(sil_segments_options_t *options,
+                                  const sil_search_builder_options_t *builder_options) {
+    options->builder_options = *builder_options;
+}
+
+void sil_segments_options_merge_factor(sil_segments_options_t *options, uint32_t merge_factor) {
+    options->merge_factor = merge_factor < 2 ? 2 : merge_factor;
+}
+
+void sil_segments_options_manual_compaction(sil_segments_options_t *options) {
+    options->background = false;
+}
+
+void sil_segments_options_memory_size(sil_segments_options_t *options, size_t memory_size) {
+    options->memory_size = memory_size;
+}
+
+static char *segment_name(sil_segments_t *h, uint32_t number) {
+    size_t len = strlen(h->base) + 20;
+    char *name = (char *)aml_malloc(len);
+    snprintf(name, len, "%s_seg_%u", h->base, number);
+    return name;
+}
+
+static void remove_segment_files(sil_segments_t *h, uint32_t number) {
+    char *name = segment_name(h, number);
+    size_t len = strlen(name) + 20;
+    char *filename = (char *)aml_malloc(len);
+    for(size_t i=0; i<sizeof(segment_suffixes)/sizeof(segment_suffixes[0]); i++) {
+        snprintf(filename, len, "%s%s", name, segment_suffixes[i]);
+        remove(filename);
+    }
+    aml_free(filename);
+    aml_free(name);
+}
+
+// open a written segment, empty segments are removed
+static segment_t *open_segment(sil_segments_t *h, uint32_t number) {
+    char *name = segment_name(h, number);
+    sil_search_image_t *img = sil_search_image_init(name);
+    aml_free(name);
+    if(img && sil_search_image_total_documents(img) == 0) {
+        sil_search_image_destroy(img);
+        img = NULL;
+    }
+    if(!img) {
+        remove_segment_files(h, number);
+        return NULL;
+    }
+    segment_t *seg = (segment_t *)aml_zalloc(sizeof(*seg));
+    seg->number = number;
+    seg->img = img;
+    seg->num_documents = sil_search_image_total_documents(img);
+    seg->document_lengths = sil_search_image_average_document_length(img) * seg->num_documents;
+    return seg;
+}
+
+static void release_segment(sil_segments_t *h, segment_t *seg) {
+    if(--seg->refs)
+        return;
+    sil_search_image_destroy(seg->img);
+    if(seg->obsolete)
+        remove_segment_files(h, seg->number);
+    aml_free(seg);
+}
+
+static memory_t *memory_init() {
+    memory_t *m = (memory_t *)aml_zalloc(sizeof(*m));
+    m->refs = 1;
+    m->index = sil_memory_index_init();
+    return m;
+}
+
+static void release_memory(memory_t *m) {
+    if(m && --m->refs == 0) {
+        sil_memory_index_destroy(m->index);
+        aml_free(m);
+    }
+}
+
+static inline bool bit_set(const uint64_t *bits, size_t num_words, uint32_t id) {
+    return (id >> 6) < num_words && ((bits[id >> 6] >> (id & 63)) & 1);
+}
+
+// a bitmap covering the ids of img, copied from r if there is one
+static replaced_t *replaced_init(sil_search_image_t *img, replaced_t *r) {
+    size_t num_words = (sil_search_image_max_id(img) >> 6) + 1;
+    replaced_t *nr = (replaced_t *)aml_zalloc(sizeof(*nr) + sizeof(uint64_t) * num_words);
+    nr->refs = 1;
+    nr->num_words = num_words;
+    if(r) {
+        nr->num_documents = r->num_documents;
+        nr->document_lengths = r->document_lengths;
+        memcpy(nr->bits, r->bits, sizeof(uint64_t) * num_words);
+    }
+    return nr;
+}
+
+static void release_replaced(replaced_t *r) {
+    if(r && __atomic_sub_fetch(&r->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        aml_free(r);
+}
+
+static sil_segments_snapshot_t *snapshot_init(sil_segments_t *h, size_t num_segments) {
+    sil_segments_snapshot_t *s = (sil_segments_snapshot_t *)aml_zalloc(sizeof(*s));
+    s->h = h;
+    s->refs = 1;
+    s->num_segments = num_segments;
+    s->segments = (segment_t **)aml_zalloc(sizeof(segment_t *) * (num_segments+1));
+    s->replaced = (replaced_t **)aml_zalloc(sizeof(replaced_t *) * (num_segments+1));
+    return s;
+}
+
+// place segment i of from at i of s, sharing its replaced ids
+static void snapshot_share(sil_segments_snapshot_t *s, size_t i, sil_segments_snapshot_t *from,
+                           size_t from_i) {
+    s->segments[i] = from->segments[from_i];
+    s->segments[i]->refs++;
+    s->replaced[i] = from->replaced[from_i];
+    if(s->replaced[i])
+        __atomic_add_fetch(&s->replaced[i]->refs, 1, __ATOMIC_RELAXED);
+}
+
+// mark the ids of segment i which segment j (a later one) also has
+static void mark_replaced(sil_segments_snapshot_t *s, size_t i, size_t j) {
+    sil_search_image_t *older = s->segments[i]->img;
+    uint32_t num_ids;
+    const uint32_t *ids = sil_search_image_ids(s->segments[j]->img, &num_ids);
+    for(uint32_t k=0; k<num_ids; k++) {
+        uint32_t length;
+        const sil_global_header_t *gh = sil_search_image_global(&length, older, ids[k]);
+        if(!gh)
+            continue;
+        replaced_t *r = s->replaced[i];
+        if(r && bit_set(r->bits, r->num_words, ids[k]))
+            continue;
+        if(!r || __atomic_load_n(&r->refs, __ATOMIC_ACQUIRE) > 1) {
+            s->replaced[i] = replaced_init(older, r);
+            release_replaced(r);
+            r = s->replaced[i];
+        }
+        r->bits[ids[k] >> 6] |= 1ULL << (ids[k] & 63);
+        r->num_documents++;
+        r->document_lengths += gh->document_length;
+    }
+}
+
+/* Count the segment documents replaced by ids first added to the memory index since s last
+   looked.  This only reads the memory index and the segments, so the mutex need not be held. */
+static void count_memory(sil_segments_snapshot_t *s) {
+    uint32_t first_added = s->memory_added;
+    s->memory_added = sil_memory_index_num_added_totals(s->memory->index, &s->memory_documents,
+                                                        &s->memory_lengths);
+    if(s->memory_added <= first_added)
+        return;
+    uint32_t *ids = (uint32_t *)aml_malloc(sizeof(uint32_t) * (s->memory_added - first_added));
+    uint32_t num_ids = sil_memory_index_added_ids(s->memory->index, ids, first_added, s->memory_added);
+    // the newest segment with an id in the memory index has the version it replaces
+    for(uint32_t k=0; k<num_ids; k++) {
+        for(size_t i=s->num_segments; i-- > 0;) {
+            uint32_t length;
+            const sil_global_header_t *gh = sil_search_image_global(&length, s->segments[i]->img, ids[k]);
+            if(gh) {
+                s->replaced_documents++;
+                s->replaced_lengths += gh->document_length;
+                break;
+            }
+        }
+    }
+    aml_free(ids);
+}
+
+// start s (whose segments differ from the current ones) on the memory index, with the mutex held
+static void start_memory(sil_segments_t *h, sil_segments_snapshot_t *s) {
+    s->memory = h->memory;
+    s->memory->refs++;
+}
+
+// s has the segments of from, so it starts with what from counted, called with the mutex held
+static void share_memory(sil_segments_snapshot_t *s, sil_segments_snapshot_t *from) {
+    s->memory = from->memory;
+    s->memory->refs++;
+    s->memory_added = from->memory_added;
+    s->replaced_documents = from->replaced_documents;
+    s->replaced_lengths = from->replaced_lengths;
+}
+
+static bool in_memory(sil_segments_snapshot_t *s, uint32_t id) {
+    return s->memory_added && sil_memory_index_has(s->memory->index, s->memory_added, id);
+}
+
+// bring s up to the memory index as it is now, called with the mutex held
+static void snapshot_memory(sil_segments_t *h, sil_segments_snapshot_t *s) {
+    if(s->memory != h->memory) {
+        release_memory(s->memory);
+        s->memory = NULL;
+        start_memory(h, s);
+        s->memory_added = 0;
+        s->replaced_documents = 0;
+        s->replaced_lengths = 0.0;
+    }
+    count_memory(s);
+
+    double lengths = s->memory_lengths - s->replaced_lengths;
+    s->total_documents = s->memory_documents - s->replaced_documents;
+    for(size_t i=0; i<s->num_segments; i++) {
+        s->total_documents += s->segments[i]->num_documents;
+        lengths += s->segments[i]->document_lengths;
+        if(s->replaced[i]) {
+            s->total_documents -= s->replaced[i]->num_documents;
+            lengths -= s->replaced[i]->document_lengths;
+        }
+    }
+    s->average_document_length = s->total_documents ? lengths / s->total_documents : 0.0;
+}
+
+// called with the mutex held
+static void release_snapshot(sil_segments_snapshot_t *s) {
+    if(--s->refs)
+        return;
+    for(size_t i=0; i<s->num_segments; i++) {
+        release_replaced(s->replaced[i]);
+        release_segment(s->h, s->segments[i]);
+    }
+    release_memory(s->memory);
+    aml_free(s->segments);
+    aml_free(s->replaced);
+    aml_free(s);
+}
+
+// make s (with the memory index as it is now) the current snapshot, called with the mutex held
+static void make_current(sil_segments_t *h, sil_segments_snapshot_t *s) {
+    snapshot_memory(h, s);
+    sil_segments_snapshot_t *old = h->current;
+    h->current = s;
+    if(old)
+        release_snapshot(old);
+}
+
+// a copy of the current snapshot to change, called with the mutex held
+static sil_segments_snapshot_t *copy_current(sil_segments_t *h) {
+    sil_segments_snapshot_t *cur = h->current;
+    sil_segments_snapshot_t *s = snapshot_init(h, cur->num_segments);
+    for(size_t i=0; i<cur->num_segments; i++)
+        snapshot_share(s, i, cur, i);
+    share_memory(s, cur);
+    return s;
+}
+
+/*
+    Segments are added and merged by building the next snapshot from the current one (a base
+    held by reference) outside the mutex: marking the replaced ids, counting what the memory
+    index replaces and writing the manifest.  The mutex is then taken to check that the
+    segments did not change meanwhile and to swap the snapshot in, otherwise it is built
+    again from the new current snapshot.
+*/
+static bool same_segments(sil_segments_snapshot_t *a, sil_segments_snapshot_t *b) {
+    if(a->num_segments != b->num_segments)
+        return false;
+    for(size_t i=0; i<a->num_segments; i++)
+        if(a->segments[i] != b->segments[i])
+            return false;
+    return true;
+}
+
+// the manifest written for segment number (added or merged) before it is renamed
+static char *manifest_tmp(sil_segments_t *h, uint32_t number) {
+    size_t len = strlen(h->base) + 40;
+    char *tmp = (char *)aml_malloc(len);
+    snprintf(tmp, len, "%s_segments.%u.tmp", h->base, number);
+    return tmp;
+}
+
+/* base_segments is the next segment number followed by the segments, oldest first.  It is
+   written to tmp and synced, so renaming tmp over the old one (with the mutex held, in the
+   order snapshots become current) never leaves a partial manifest. */
+static bool write_manifest(sil_segments_snapshot_t *s, uint32_t next_number, const char *tmp) {
+    FILE *out = fopen(tmp, "wb");
+    if(!out)
+        return false;
+    bool ok = fprintf(out, "%u\n", next_number) > 0;
+    for(size_t i=0; ok && i<s->num_segments; i++)
+        ok = fprintf(out, "%u\n", s->segments[i]->number) > 0;
+    ok = fflush(out) == 0 && fsync(fileno(out)) == 0 && ok;
+    ok = fclose(out) == 0 && ok;
+    return ok;
+}
+
+static bool rename_manifest(sil_segments_t *h, const char *tmp) {
+    size_t len = strlen(h->base) + 20;
+    char *filename = (char *)aml_malloc(len);
+    snprintf(filename, len, "%s_segments", h->base);
+    bool ok = rename(tmp, filename) == 0;
+    aml_free(filename);
+    return ok;
+}
+
+static sil_segments_snapshot_t *read_manifest(sil_segments_t *h) {
+    size_t len = strlen(h->base) + 20;
+    char *filename = (char *)aml_malloc(len);
+    snprintf(filename, len, "%s_segments", h->base);
+    FILE *in = fopen(filename, "rb");
+    aml_free(filename);
+    aml_buffer_t *bh = aml_buffer_init(sizeof(segment_t *) * 16);
+    uint32_t number;
+    if(in) {
+        if(fscanf(in, "%u", &h->next_number) == 1) {
+            while(fscanf(in, "%u", &number) == 1) {
+                segment_t *seg = open_segment(h, number);
+                if(seg)
+                    aml_buffer_append(bh, &seg, sizeof(seg));
+            }
+        }
+        fclose(in);
+    }
+    segment_t **segments = (segment_t **)aml_buffer_data(bh);
+    size_t num_segments = aml_buffer_length(bh) / sizeof(segment_t *);
+    sil_segments_snapshot_t *s = snapshot_init(h, num_segments);
+    for(size_t j=0; j<num_segments; j++) {
+        s->segments[j] = segments[j];
+        s->segments[j]->refs = 1;
+        for(size_t i=0; i<j; i++)
+            mark_replaced(s, i, j);
+    }
+    aml_buffer_destroy(bh);
+    return s;
+}
+
+static uint32_t segment_tier(sil_segments_t *h, sil_segments_snapshot_t *s, size_t i) {
+    uint32_t num_documents = s->segments[i]->num_documents;
+    if(s->replaced[i])
+        num_documents -= s->replaced[i]->num_documents;
+    uint32_t tier = 0;
+    while(num_documents >= h->options.merge_factor) {
+        num_documents /= h->options.merge_factor;
+        tier++;
+    }
+    return tier;
+}
+
+/* Only neighbouring segments are merged so documents in the merged segment still replace
+   the ones in the segments before it and are replaced by the ones after it. */
+static bool find_tier_run(sil_segments_t *h, sil_segments_snapshot_t *s, size_t *first) {
+    size_t run = 0;
+    uint32_t last_tier = 0;
+    for(size_t i=0; i<s->num_segments; i++) {
+        uint32_t tier = segment_tier(h, s, i);
+        run = (run && tier == last_tier) ? run + 1 : 1;
+        last_tier = tier;
+        if(run == h->options.merge_factor) {
+            *first = i + 1 - run;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Documents deleted from the merged segments while the merge ran are deleted from the
+   merged segment, unless a later segment of the merge has the id.  Deletes are atomic on
+   the images, so this runs outside the mutex and again with it held (as deletes are) if
+   more documents were deleted meanwhile. */
+static void reapply_deletes(sil_segments_snapshot_t *s, size_t first, size_t num, segment_t *merged) {
+    for(size_t i=first; i<first+num; i++) {
+        sil_search_image_t *img = s->segments[i]->img;
+        if(!sil_search_image_deleted_documents(img))
+            continue;
+        uint32_t num_ids;
+        const uint32_t *ids = sil_search_image_ids(img, &num_ids);
+        for(uint32_t k=0; k<num_ids; k++) {
+            uint32_t length;
+            if(!sil_search_image_is_deleted(img, ids[k]))
+                continue;
+            size_t j = i+1;
+            while(j < first+num && !sil_search_image_global(&length, s->segments[j]->img, ids[k]))
+                j++;
+            if(j == first+num && sil_search_image_delete(merged->img, ids[k]))
+                merged->deletes_changed = true;
+        }
+    }
+}
+
+static uint32_t deleted_documents(sil_segments_snapshot_t *s, size_t first, size_t num) {
+    uint32_t num_deleted = 0;
+    for(size_t i=first; i<first+num; i++)
+        num_deleted += sil_search_image_deleted_documents(s->segments[i]->img);
+    return num_deleted;
+}
+
+/* Merge num segments of s starting at first into a new segment and swap it in.  Called
+   with the merge_mutex held, so the segments are still in the current snapshot at first
+   (segments are only appended while a merge runs). */
+static bool merge_segments(sil_segments_t *h, sil_segments_snapshot_t *s, size_t first, size_t num) {
+    pthread_mutex_lock(&h->mutex);
+    uint32_t number = h->next_number++;
+    pthread_mutex_unlock(&h->mutex);
+
+    sil_search_image_t **images = (sil_search_image_t **)aml_malloc(sizeof(sil_search_image_t *) * num);
+    const uint64_t **deleted = (const uint64_t **)aml_malloc(sizeof(uint64_t *) * num);
+    for(size_t i=0; i<num; i++) {
+        images[i] = s->segments[first+i]->img;
+        deleted[i] = s->replaced[first+i] ? s->replaced[first+i]->bits : NULL;
+    }
+    remove_segment_files(h, number);
+    char *name = segment_name(h, number);
+    sil_search_builder_merge_stats_t stats;
+    bool ok = sil_search_builder_merge(name, images, deleted, num, &h->options.builder_options,
+                                       &stats);
+    aml_free(name);
+    aml_free(deleted);
+    aml_free(images);
+    if(!ok) {
+        remove_segment_files(h, number);
+        return false;
+    }
+    // every document may have been replaced, then the segments are just dropped
+    segment_t *merged = open_segment(h, number);
+    if(merged)
+        merged->refs = 1; // held until a snapshot with it is current
+    char *tmp = manifest_tmp(h, number);
+    while(true) {
+        pthread_mutex_lock(&h->mutex);
+        sil_segments_snapshot_t *base = h->current;
+        base->refs++;
+        uint32_t next_number = h->next_number;
+        size_t num_segments = base->num_segments - num + (merged ? 1 : 0);
+        sil_segments_snapshot_t *ns = snapshot_init(h, num_segments);
+        size_t j = 0;
+        for(size_t i=0; i<first; i++)
+            snapshot_share(ns, j++, base, i);
+        if(merged) {
+            merged->refs++;
+            ns->segments[j++] = merged;
+        }
+        for(size_t i=first+num; i<base->num_segments; i++)
+            snapshot_share(ns, j++, base, i);
+        start_memory(h, ns);
+        pthread_mutex_unlock(&h->mutex);
+
+        uint32_t num_deleted = deleted_documents(base, first, num);
+        if(merged) {
+            for(size_t i=first+1; i<num_segments; i++)
+                mark_replaced(ns, first, i);
+            reapply_deletes(base, first, num, merged);
+        }
+        count_memory(ns);
+        bool saved = write_manifest(ns, next_number, tmp);
+
+        pthread_mutex_lock(&h->mutex);
+        if(!same_segments(h->current, base)) {
+            // a segment was added meanwhile
+            release_snapshot(ns);
+            release_snapshot(base);
+            pthread_mutex_unlock(&h->mutex);
+            continue;
+        }
+        if(merged && deleted_documents(base, first, num) != num_deleted)
+            reapply_deletes(base, first, num, merged);
+        ok = saved && rename_manifest(h, tmp);
+        if(ok) {
+            for(size_t i=first; i<first+num; i++)
+                base->segments[i]->obsolete = true;
+            h->dropped_documents += stats.input_documents - stats.documents;
+            if(stats.input_bytes > stats.output_bytes)
+                h->reclaimed_bytes += stats.input_bytes - stats.output_bytes;
+            make_current(h, ns);
+        }
+        else {
+            // the manifest still names the segments which were merged, so they stay
+            if(merged)
+                merged->obsolete = true;
+            release_snapshot(ns);
+        }
+        release_snapshot(base);
+        if(merged)
+            release_segment(h, merged);
+        pthread_mutex_unlock(&h->mutex);
+        break;
+    }
+    if(!ok)
+        remove(tmp);
+    aml_free(tmp);
+    return ok;
+}
+
+// merge runs of segments in the same tier until there are none, the merge_mutex is held
+static void merge_tiers(sil_segments_t *h) {
+    while(true) {
+        sil_segments_snapshot_t *s = sil_segments_acquire(h);
+        size_t first;
+        bool merged = find_tier_run(h, s, &first) &&
+                      merge_segments(h, s, first, h->options.merge_factor);
+        sil_segments_release(s);
+        if(!merged)
+            break;
+    }
+}
+
+static void *merge_thread(void *arg) {
+    sil_segments_t *h = (sil_segments_t *)arg;
+    pthread_mutex_lock(&h->mutex);
+    while(!h->stop) {
+        if(!h->added) {
+            pthread_cond_wait(&h->work, &h->mutex);
+            continue;
+        }
+        h->added = false;
+        pthread_mutex_unlock(&h->mutex);
+        pthread_mutex_lock(&h->merge_mutex);
+        merge_tiers(h);
+        pthread_mutex_unlock(&h->merge_mutex);
+        pthread_mutex_lock(&h->mutex);
+    }
+    pthread_mutex_unlock(&h->mutex);
+    return NULL;
+}
+
+sil_segments_t *sil_segments_init(const char *base, const sil_segments_options_t *options) {
+    sil_segments_t *h = (sil_segments_t *)aml_zalloc(sizeof(*h) + strlen(base) + 1);
+    if(options)
+        h->options = *options;
+    else
+        sil_segments_options_init(&h->options);
+    h->base = (char *)(h+1);
+    strcpy(h->base, base);
+    h->pending = aml_buffer_init(sizeof(pending_segment_t) * 4);
+    pthread_mutex_init(&h->add_mutex, NULL);
+    pthread_mutex_init(&h->mutex, NULL);
+    pthread_mutex_init(&h->merge_mutex, NULL);
+    pthread_cond_init(&h->work, NULL);
+    h->memory = memory_init();
+    make_current(h, read_manifest(h));
+    if(h->options.background) {
+        h->added = true; // the reopened segments may already need merging
+        h->background = true;
+        pthread_create(&h->thread, NULL, merge_thread, h);
+    }
+    return h;
+}
+
+sil_search_builder_t *sil_segments_builder(sil_segments_t *h) {
+    pending_segment_t p;
+    pthread_mutex_lock(&h->mutex);
+    p.number = h->next_number++;
+    pthread_mutex_unlock(&h->mutex);
+    // files left by a segment which was never added (such as a stale deleted file)
+    remove_segment_files(h, p.number);
+    char *name = segment_name(h, p.number);
+    p.builder = sil_search_builder_ext_init(name, &h->options.builder_options);
+    aml_free(name);
+    pthread_mutex_lock(&h->mutex);
+    aml_buffer_append(h->pending, &p, sizeof(p));
+    pthread_mutex_unlock(&h->mutex);
+    return p.builder;
+}
+
+/* Destroy builder and publish its segment.  flushed is set when the segment holds the
+   memory index, which is replaced by an empty one in the same snapshot. */
+static void add_segment(sil_segments_t *h, sil_search_builder_t *builder, bool flushed) {
+    pthread_mutex_lock(&h->mutex);
+    pending_segment_t *p = (pending_segment_t *)aml_buffer_data(h->pending);
+    pending_segment_t *ep = (pending_segment_t *)aml_buffer_end(h->pending);
+    while(p < ep && p->builder != builder)
+        p++;
+    if(p == ep) {
+        pthread_mutex_unlock(&h->mutex);
+        return;
+    }
+    uint32_t number = p->number;
+    *p = ep[-1];
+    aml_buffer_shrink_by(h->pending, sizeof(pending_segment_t));
+    pthread_mutex_unlock(&h->mutex);
+
+    sil_search_builder_destroy(builder);
+    // every document of the memory index may have been deleted
+    segment_t *seg = open_segment(h, number);
+    if(!seg && !flushed)
+        return;
+
+    if(seg)
+        seg->refs = 1; // held until a snapshot with it is current
+    char *tmp = manifest_tmp(h, number);
+    bool saved = false;
+    while(true) {
+        pthread_mutex_lock(&h->mutex);
+        sil_segments_snapshot_t *base = h->current;
+        base->refs++;
+        uint32_t next_number = h->next_number;
+        size_t n = base->num_segments;
+        sil_segments_snapshot_t *s = snapshot_init(h, seg ? n+1 : n);
+        for(size_t i=0; i<n; i++)
+            snapshot_share(s, i, base, i);
+        if(seg) {
+            seg->refs++;
+            s->segments[n] = seg;
+        }
+        // a flushed memory index is replaced by an empty one, which has nothing to count
+        if(!flushed)
+            start_memory(h, s);
+        pthread_mutex_unlock(&h->mutex);
+
+        if(seg)
+            for(size_t i=0; i<n; i++)
+                mark_replaced(s, i, n);
+        if(s->memory)
+            count_memory(s);
+        saved = write_manifest(s, next_number, tmp);
+
+        pthread_mutex_lock(&h->mutex);
+        if(!same_segments(h->current, base)) {
+            release_snapshot(s);
+            release_snapshot(base);
+            pthread_mutex_unlock(&h->mutex);
+            continue;
+        }
+        release_snapshot(base);
+        if(seg) {
+            release_segment(h, seg);
+            h->added = true;
+            pthread_cond_signal(&h->work);
+        }
+        if(flushed) {
+            release_memory(h->memory);
+            h->memory = memory_init();
+        }
+        // if the manifest could not be replaced, the segment is recorded by the next one
+        saved = saved && rename_manifest(h, tmp);
+        make_current(h, s);
+        pthread_mutex_unlock(&h->mutex);
+        break;
+    }
+    if(!saved)
+        remove(tmp);
+    aml_free(tmp);
+}
+
+void sil_segments_add(sil_segments_t *h, sil_search_builder_t *builder) {
+    add_segment(h, builder, false);
+}
+
+// write the memory index out as a segment, called with the add_mutex held
+static void flush_memory(sil_segments_t *h) {
+    if(!sil_memory_index_num_added(h->memory->index))
+        return;
+    sil_search_builder_t *builder = sil_segments_builder(h);
+    sil_memory_index_flush(h->memory->index, builder);
+    add_segment(h, builder, true);
+}
+
+void sil_segments_add_document(sil_segments_t *h, const sil_document_image_t *doc) {
+    pthread_mutex_lock(&h->add_mutex);
+    sil_memory_index_add(h->memory->index, doc);
+    if(sil_memory_index_size(h->memory->index) >= h->options.memory_size)
+        flush_memory(h);
+    pthread_mutex_unlock(&h->add_mutex);
+}
+
+sil_segments_snapshot_t *sil_segments_acquire(sil_segments_t *h) {
+    pthread_mutex_lock(&h->mutex);
+    sil_segments_snapshot_t *cur = h->current;
+    if(cur->memory_added != sil_memory_index_num_added(h->memory->index)) {
+        // documents were added to the memory index since the snapshot was made
+        make_current(h, copy_current(h));
+    }
+    sil_segments_snapshot_t *s = h->current;
+    s->refs++;
+    pthread_mutex_unlock(&h->mutex);
+    return s;
+}
+
+void sil_segments_release(sil_segments_snapshot_t *snapshot) {
+    sil_segments_t *h = snapshot->h;
+    pthread_mutex_lock(&h->mutex);
+    release_snapshot(snapshot);
+    pthread_mutex_unlock(&h->mutex);
+}
+
+size_t sil_segments_num_segments(sil_segments_snapshot_t *snapshot) {
+    return snapshot->num_segments;
+}
+
+uint32_t sil_segments_total_documents(sil_segments_snapshot_t *snapshot) {
+    return snapshot->total_documents;
+}
+
+double sil_segments_average_document_length(sil_segments_snapshot_t *snapshot) {
+    return snapshot->average_document_length;
+}
+
+/* A document in the memory index is also deleted from the newest segment with the id, so
+   the older version stays deleted once the memory index is written out. */
+bool sil_segments_delete(sil_segments_t *h, uint32_t id) {
+    uint32_t length;
+    pthread_mutex_lock(&h->add_mutex);
+    bool deleted = sil_memory_index_delete(h->memory->index, id);
+    pthread_mutex_lock(&h->mutex);
+    sil_segments_snapshot_t *s = h->current;
+    if(deleted) {
+        // the totals of the memory index changed
+        make_current(h, copy_current(h));
+        s = h->current;
+    }
+    for(size_t i=s->num_segments; i-- > 0;) {
+        segment_t *seg = s->segments[i];
+        if(sil_search_image_global(&length, seg->img, id)) {
+            bool deleted_from_segment = sil_search_image_delete(seg->img, id);
+            seg->deletes_changed |= deleted_from_segment;
+            deleted |= deleted_from_segment;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&h->mutex);
+    pthread_mutex_unlock(&h->add_mutex);
+    return deleted;
+}
+
+size_t sil_segments_reclaimed_bytes(sil_segments_t *h, size_t *dropped_documents) {
+    pthread_mutex_lock(&h->mutex);
+    size_t reclaimed_bytes = h->reclaimed_bytes;
+    if(dropped_documents)
+        *dropped_documents = h->dropped_documents;
+    pthread_mutex_unlock(&h->mutex);
+    return reclaimed_bytes;
+}
+
+sil_search_image_t *sil_segments_image(sil_segments_snapshot_t *snapshot, uint32_t id) {
+    uint32_t length;
+    if(in_memory(snapshot, id))
+        return NULL;
+    for(size_t i=snapshot->num_segments; i-- > 0;) {
+        sil_search_image_t *img = snapshot->segments[i]->img;
+        if(sil_search_image_global(&length, img, id))
+            return img;
+    }
+    return NULL;
+}
+
+bool sil_segments_document(sil_segments_snapshot_t *snapshot, uint32_t id, sil_document_image_t *doc) {
+    return snapshot->memory_added &&
+           sil_memory_index_document(snapshot->memory->index, snapshot->memory_added, id, doc);
+}
+
+/*
+    The union cursor keeps one cursor per segment with the term (and one for the memory
+    index), each positioned on a posting that is not replaced, and copies the posting with
+    the lowest id (along with where its positions are) into its own sil_term_ext_t so the
+    functions of sil_term.h work on it.
+*/
+typedef struct {
+    sil_term_ext_t ext;
+    sil_term_t **terms;
+    replaced_t **replaced;
+    bool *in_segment;         // false for the term of the memory index
+    sil_memory_index_t *memory;
+    uint32_t memory_added;    // ids in the memory index as of this replace ids in every segment
+    size_t num_terms;
+    size_t current;
+} segments_term_t;
+
+static inline bool is_replaced(segments_term_t *u, size_t i) {
+    replaced_t *r = u->replaced[i];
+    uint32_t id = u->terms[i]->c.id;
+    return (r && bit_set(r->bits, r->num_words, id)) ||
+           (u->in_segment[i] && u->memory_added && sil_memory_index_has(u->memory, u->memory_added, id));
+}
+
+static void remove_term(segments_term_t *u, size_t i) {
+    u->num_terms--;
+    u->terms[i] = u->terms[u->num_terms];
+    u->replaced[i] = u->replaced[u->num_terms];
+    u->in_segment[i] = u->in_segment[u->num_terms];
+}
+
+// move term i past replaced postings, removing it once it runs out
+static bool skip_replaced(segments_term_t *u, size_t i) {
+    sil_term_t *t = u->terms[i];
+    while(is_replaced(u, i)) {
+        if(!t->c.advance((atl_cursor_t *)t)) {
+            remove_term(u, i);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool select_posting(segments_term_t *u) {
+    if(!u->num_terms)
+        return false;
+    size_t best = 0;
+    for(size_t i=1; i<u->num_terms; i++)
+        if(u->terms[i]->c.id < u->terms[best]->c.id)
+            best = i;
+    u->current = best;
+    sil_term_ext_t *t = (sil_term_ext_t *)u->terms[best];
+    u->ext.pub.c.id = t->pub.c.id;
+    u->ext.pub.value = t->pub.value;
+    u->ext.wp = t->wp;
+    u->ext.p = t->p;
+    u->ext.first_base = t->first_base;
+    return true;
+}
+
+static bool segments_term_advance(segments_term_t *u) {
+    if(!u->num_terms)
+        return false;
+    size_t i = u->current;
+    sil_term_t *t = u->terms[i];
+    if(!t->c.advance((atl_cursor_t *)t))
+        remove_term(u, i);
+    else
+        skip_replaced(u, i);
+    return select_posting(u);
+}
+
+static bool segments_term_first_advance(segments_term_t *u) {
+    u->ext.pub.c.advance = (atl_cursor_advance_cb)segments_term_advance;
+    return u->num_terms > 0;
+}
+
+static bool segments_term_advance_to(segments_term_t *u, uint32_t id) {
+    if(id <= u->ext.pub.c.id)
+        return true;
+    for(size_t i=0; i<u->num_terms;) {
+        sil_term_t *t = u->terms[i];
+        if(t->c.id >= id) {
+            i++;
+            continue;
+        }
+        if(!t->c.advance_to((atl_cursor_t *)t, id)) {
+            remove_term(u, i);
+            continue;
+        }
+        if(skip_replaced(u, i))
+            i++;
+    }
+    return select_posting(u);
+}
+
+sil_term_t *sil_segments_term(sil_segments_snapshot_t *snapshot, aml_pool_t *pool, const char *term) {
+    segments_term_t *u = (segments_term_t *)aml_pool_zalloc(pool, sizeof(*u));
+    size_t n = snapshot->num_segments;
+    u->terms = (sil_term_t **)aml_pool_alloc(pool, sizeof(sil_term_t *) * (n+1));
+    u->replaced = (replaced_t **)aml_pool_alloc(pool, sizeof(replaced_t *) * (n+1));
+    u->in_segment = (bool *)aml_pool_alloc(pool, sizeof(bool) * (n+1));
+    u->memory = snapshot->memory->index;
+    u->memory_added = snapshot->memory_added;
+    uint32_t max_term_size = 0, document_frequency = 0;
+    for(size_t i=0; i<=n; i++) {
+        sil_term_t *t;
+        if(i < n)
+            t = sil_search_image_term(snapshot->segments[i]->img, pool, term);
+        else if(snapshot->memory_added)
+            t = sil_memory_index_term(snapshot->memory->index, pool, snapshot->memory_added, term);
+        else
+            t = NULL;
+        if(!t)
+            continue;
+        document_frequency += t->document_frequency;
+        if(t->max_term_size > max_term_size)
+            max_term_size = t->max_term_size;
+        t->c.advance((atl_cursor_t *)t); // always true, the term cursors start on a posting
+        u->terms[u->num_terms] = t;
+        u->replaced[u->num_terms] = i < n ? snapshot->replaced[i] : NULL;
+        u->in_segment[u->num_terms] = i < n;
+        u->num_terms++;
+        skip_replaced(u, u->num_terms-1);
+    }
+    if(!document_frequency)
+        return NULL;
+    select_posting(u);
+    u->ext.pub.max_term_size = max_term_size;
+    u->ext.pub.document_frequency = document_frequency;
+    u->ext.pub.term_positions = (uint32_t *)aml_pool_alloc(pool, sizeof(uint32_t) * (max_term_size+1));
+    u->ext.pub.c.advance = (atl_cursor_advance_cb)segments_term_first_advance;
+    u->ext.pub.c.advance_to = (atl_cursor_advance_to_cb)segments_term_advance_to;
+    u->ext.pub.c.type = TERM_CURSOR;
+    return (sil_term_t *)u;
+}
+
+void sil_segments_compact(sil_segments_t *h) {
+    pthread_mutex_lock(&h->add_mutex);
+    flush_memory(h);
+    pthread_mutex_unlock(&h->add_mutex);
+    pthread_mutex_lock(&h->merge_mutex);
+    sil_segments_snapshot_t *s = sil_segments_acquire(h);
+    if(s->num_segments > 1 ||
+       (s->num_segments == 1 && sil_search_image_deleted_documents(s->segments[0]->img)))
+        merge_segments(h, s, 0, s->num_segments);
+    sil_segments_release(s);
+    pthread_mutex_unlock(&h->merge_mutex);
+}
+
+void sil_segments_destroy(sil_segments_t *h) {
+    pthread_mutex_lock(&h->add_mutex);
+    flush_memory(h);
+    pthread_mutex_unlock(&h->add_mutex);
+    if(h->background) {
+        pthread_mutex_lock(&h->mutex);
+        h->stop = true;
+        pthread_cond_signal(&h->work);
+        pthread_mutex_unlock(&h->mutex);
+        pthread_join(h->thread, NULL);
+    }
+    pthread_mutex_lock(&h->mutex);
+    sil_segments_snapshot_t *s = h->current;
+    for(size_t i=0; i<s->num_segments; i++)
+        if(s->segments[i]->deletes_changed)
+            sil_search_image_save_deleted(s->segments[i]->img);
+    release_snapshot(s);
+    release_memory(h->memory);
+    pthread_mutex_unlock(&h->mutex);
+    aml_buffer_destroy(h->pending);
+    pthread_mutex_destroy(&h->add_mutex);
+    pthread_mutex_destroy(&h->mutex);
+    pthread_mutex_destroy(&h->merge_mutex);
+    pthread_cond_destroy(&h->work);
+    aml_free(h);
+}
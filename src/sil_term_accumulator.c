@@ -0,0 +1,160 @@
+// SPDX-FileCopyrightText: 2023–2025 Andy Curtis <contactandyc@gmail.com>
+// SPDX-FileCopyrightText: 2024–2025 Knode.ai — technical questions: contact Andy (above)
+// SPDX-License-Identifier: Apache-2.0
+
+#include "search-index-library/sil_term_accumulator.h"
+#include <inttypes.h>
+
+#include "a-memory-library/aml_buffer.h"
+
+typedef struct {
+    sil_term_t *term;
+    double idf_qtf;
+    bool active;
+} accumulator_term_t;
+
+struct sil_term_accumulator_s {
+    sil_search_image_t *img;
+    sil_bm25_params_t params;
+    double total_documents;
+    double average_document_length;
+
+    uint32_t partition_bits;
+    uint32_t partition_size;
+    float *scores;
+
+    aml_buffer_t *terms;
+};
+
+sil_term_accumulator_t *sil_term_accumulator_init(sil_search_image_t *img,
+                                                  const sil_bm25_params_t *params,
+                                                  uint32_t partition_bits) {
+    if(partition_bits == 0 || partition_bits > SIL_TERM_ACCUMULATOR_MAX_PARTITION_BITS)
+        partition_bits = SIL_TERM_ACCUMULATOR_MAX_PARTITION_BITS;
+    if(partition_bits < SIL_TERM_ACCUMULATOR_MIN_PARTITION_BITS)
+        partition_bits = SIL_TERM_ACCUMULATOR_MIN_PARTITION_BITS;
+
+    sil_term_accumulator_t *h = (sil_term_accumulator_t *)aml_zalloc(sizeof(*h));
+    h->img = img;
+    h->params = *params;
+    h->total_documents = sil_search_image_total_documents(img);
+    h->average_document_length = sil_search_image_average_document_length(img);
+    if(h->average_document_length <= 0.0)
+        h->average_document_length = 1.0;
+    h->partition_bits = partition_bits;
+    h->partition_size = 1 << partition_bits;
+    h->scores = (float *)aml_zalloc(sizeof(float) * h->partition_size);
+    h->terms = aml_buffer_init(sizeof(accumulator_term_t) * 16);
+    return h;
+}
+
+void sil_term_accumulator_add(sil_term_accumulator_t *h, sil_term_t *t, uint32_t query_term_freq) {
+    accumulator_term_t at;
+    at.term = t;
+    at.idf_qtf = sil_idf_qtf(h->total_documents, t->document_frequency,
+                             query_term_freq, h->params.k3);
+    at.active = false;
+    aml_buffer_append(h->terms, &at, sizeof(at));
+}
+
+void sil_term_accumulator_clear(sil_term_accumulator_t *h) {
+    aml_buffer_clear(h->terms);
+}
+
+void sil_term_accumulator_destroy(sil_term_accumulator_t *h) {
+    aml_buffer_destroy(h->terms);
+    aml_free(h->scores);
+    aml_free(h);
+}
+
+#define SIL_SCORE_BLOCK 16
+
+/* The threshold test over each block of scores has no data dependent branches so the
+   compiler can vectorize it.  Only blocks with a score above the heap minimum are
+   visited one score at a time. */
+static void extract_partition(sil_term_accumulator_t *h, uint32_t base,
+                              uint32_t lo, uint32_t hi,
+                              sil_scored_id_t *heap, size_t *num, size_t k) {
+    float *scores = h->scores;
+    lo &= ~(SIL_SCORE_BLOCK-1);
+    hi = (hi + SIL_SCORE_BLOCK) & ~(SIL_SCORE_BLOCK-1);
+    if(hi > h->partition_size)
+        hi = h->partition_size;
+
+    for(uint32_t i=lo; i<hi; i+=SIL_SCORE_BLOCK) {
+        float threshold = sil_top_k_threshold(heap, *num, k);
+        float *block = scores + i;
+        int above = 0;
+        for(uint32_t j=0; j<SIL_SCORE_BLOCK; j++)
+            above |= (block[j] > threshold);
+        if(above) {
+            for(uint32_t j=0; j<SIL_SCORE_BLOCK; j++) {
+                if(block[j] > threshold) {
+                    sil_top_k_push(heap, num, k, base + i + j, block[j]);
+                    threshold = sil_top_k_threshold(heap, *num, k);
+                }
+            }
+        }
+    }
+    memset(scores + lo, 0, sizeof(float) * (hi - lo));
+}
+
+static inline double document_length(sil_term_accumulator_t *h, uint32_t id) {
+    uint32_t length;
+    const sil_global_header_t *gh = sil_search_image_global(&length, h->img, id);
+    return gh ? gh->document_length : h->average_document_length;
+}
+
+size_t sil_term_accumulator_top_k(sil_term_accumulator_t *h, sil_scored_id_t *res, size_t k) {
+    if(k == 0)
+        return 0;
+
+    accumulator_term_t *terms = (accumulator_term_t *)aml_buffer_data(h->terms);
+    size_t num_terms = aml_buffer_length(h->terms) / sizeof(accumulator_term_t);
+    for(size_t i=0; i<num_terms; i++)
+        terms[i].active = terms[i].term->c.advance((atl_cursor_t *)terms[i].term);
+
+    size_t num = 0;
+    uint32_t mask = ~(h->partition_size - 1);
+    while(true) {
+        // the next partition is the one holding the lowest current id
+        uint32_t min_id = UINT32_MAX;
+        bool any = false;
+        for(size_t i=0; i<num_terms; i++) {
+            if(terms[i].active && terms[i].term->c.id < min_id) {
+                min_id = terms[i].term->c.id;
+                any = true;
+            }
+        }
+        if(!any)
+            break;
+
+        uint32_t base = min_id & mask;
+        uint64_t end = (uint64_t)base + h->partition_size;  // the last partition ends at 2^32
+        uint32_t lo = h->partition_size, hi = 0;
+        for(size_t i=0; i<num_terms; i++) {
+            accumulator_term_t *at = terms + i;
+            if(!at->active)
+                continue;
+            sil_term_t *t = at->term;
+            while(t->c.id < end) {
+                uint32_t offset = t->c.id - base;
+                h->scores[offset] += (float)sil_term_bm25_plus(t, &h->params, at->idf_qtf,
+                                                               document_length(h, t->c.id),
+                                                               h->average_document_length);
+                if(offset < lo)
+                    lo = offset;
+                if(offset > hi)
+                    hi = offset;
+                if(!t->c.advance((atl_cursor_t *)t)) {
+                    at->active = false;
+                    break;
+                }
+            }
+        }
+        if(lo <= hi)
+            extract_partition(h, base, lo, hi, res, &num, k);
+    }
+    sil_top_k_sort(res, num);
+    return num;
+}
@@ -0,0 +1,106 @@
+// SPDX-FileCopyrightText: 2023–2025 Andy Curtis <contactandyc@gmail.com>
+// SPDX-FileCopyrightText: 2024–2025 Knode.ai — technical questions: contact Andy (above)
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+    Builds the same synthetic corpus with each way of spilling and encoding postings and
+    reports how long each build took.  The images must be identical.
+
+    usage: bench_search_builder [num_documents] [buffer_size] [encoder_threads]
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "search-index-library/sil_search_builder.h"
+
+#define INDEX_NAME "bench_search_builder"
+
+typedef enum { SPILL_TERMS, SPILL_INTERNED, SPILL_RADIX, SPILL_RADIX_THREADS } spill_mode_t;
+
+static const char *mode_names[] = { "term strings", "interned", "interned + radix sort",
+                                    "radix + encoder threads" };
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+}
+
+// words are skewed towards the front of the vocabulary like natural text
+static uint32_t next_word(uint32_t vocabulary) {
+    uint32_t r = rand() % vocabulary;
+    return (uint32_t)(((uint64_t)r * r) / vocabulary);
+}
+
+static double build(const char *name, spill_mode_t mode, uint32_t num_documents, size_t buffer_size,
+                    uint32_t encoder_threads) {
+    sil_search_builder_options_t options;
+    sil_search_builder_options_init(&options);
+    sil_search_builder_options_buffer_size(&options, buffer_size);
+    if(mode == SPILL_INTERNED)
+        sil_search_builder_options_intern_terms(&options, 0);
+    else if(mode >= SPILL_RADIX)
+        sil_search_builder_options_radix_sort(&options);
+    if(mode == SPILL_RADIX_THREADS)
+        sil_search_builder_options_encoder_threads(&options, encoder_threads);
+
+    double start = now();
+    sil_search_builder_t *builder = sil_search_builder_ext_init(name, &options);
+    srand(1234);
+    for(uint32_t id=1; id<=num_documents; id++) {
+        sil_search_builder_global(builder, NULL, 0, NULL, 0, &id, sizeof(id));
+        uint32_t length = 20 + (rand() % 200);
+        for(uint32_t pos=1; pos<=length; pos++)
+            sil_search_builder_termf_position(builder, pos, "vocabulary_word_%u", next_word(50000));
+        sil_search_builder_termf_value(builder, rand() % 100000, "timestamp:%u", id % 10);
+    }
+    sil_search_builder_destroy(builder);
+    return now() - start;
+}
+
+static bool same_file(const char *base, const char *other_base, const char *suffix) {
+    char name[256], other_name[256];
+    snprintf(name, sizeof(name), "%s%s", base, suffix);
+    snprintf(other_name, sizeof(other_name), "%s%s", other_base, suffix);
+    FILE *a = fopen(name, "rb"), *b = fopen(other_name, "rb");
+    bool same = a && b;
+    while(same) {
+        int ca = fgetc(a), cb = fgetc(b);
+        same = ca == cb;
+        if(ca == EOF)
+            break;
+    }
+    if(a)
+        fclose(a);
+    if(b)
+        fclose(b);
+    return same;
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t num_documents = argc > 1 ? (uint32_t)atoi(argv[1]) : 2000;
+    size_t buffer_size = argc > 2 ? (size_t)atol(argv[2]) : 4*1024*1024;
+    uint32_t encoder_threads = argc > 3 ? (uint32_t)atoi(argv[3]) : 4;
+
+    int errors = 0;
+    double baseline = 0.0;
+    for(spill_mode_t mode=SPILL_TERMS; mode<=SPILL_RADIX_THREADS; mode++) {
+        char name[64];
+        snprintf(name, sizeof(name), "%s_%d", INDEX_NAME, (int)mode);
+        double elapsed = build(name, mode, num_documents, buffer_size, encoder_threads);
+        if(mode == SPILL_TERMS)
+            baseline = elapsed;
+        printf("%-24s %8.3lf seconds (%.2lfx)\n", mode_names[mode], elapsed,
+               elapsed > 0.0 ? baseline / elapsed : 0.0);
+        if(mode != SPILL_TERMS &&
+           (!same_file(INDEX_NAME "_0", name, "_term_idx") ||
+            !same_file(INDEX_NAME "_0", name, "_term_data"))) {
+            fprintf(stderr, "%s built a different image\n", mode_names[mode]);
+            errors++;
+        }
+    }
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
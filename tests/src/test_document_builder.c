@@ -50,7 +50,8 @@ int main() {
     sil_document_builder_global(builder, bh, embeddings, num_embeddings, content, content_length, dummy_data, dummy_data_len);
 
     sil_document_image_t image;
-    sil_document_image_init(&image, aml_buffer_data(bh), aml_buffer_length(bh));
+    sil_document_image_init(&image, aml_buffer_data(bh) + sizeof(uint32_t),
+                            aml_buffer_length(bh) - sizeof(uint32_t));
 
     aml_pool_t *pool = aml_pool_init(1024);
     uint32_t num_terms;
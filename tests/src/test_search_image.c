@@ -0,0 +1,2377 @@
+// SPDX-FileCopyrightText: 2023–2025 Andy Curtis <contactandyc@gmail.com>
+// SPDX-FileCopyrightText: 2024–2025 Knode.ai — technical questions: contact Andy (above)
+// SPDX-License-Identifier: Apache-2.0
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "search-index-library/sil_search_builder.h"
+#include "search-index-library/sil_document_builder.h"
+#include "search-index-library/sil_search_image.h"
+#include "search-index-library/sil_term_accumulator.h"
+#include "search-index-library/sil_query_plan.h"
+#include "search-index-library/sil_segments.h"
+#include "search-index-library/impl/sil_constants.h"
+#include "a-memory-library/aml_pool.h"
+#include "a-memory-library/aml_buffer.h"
+
+#define MAX_ID 1500000
+#define INDEX_NAME "test_search_image"
+#define VALUE_INDEX_NAME "test_search_image_values"
+#define INTERNED_INDEX_NAME "test_search_image_interned"
+#define THREADED_INDEX_NAME "test_search_image_threaded"
+#define BLOB_INDEX_NAME "test_search_image_blobs"
+#define CONCAT_INDEX_NAME "test_search_image_concat"
+#define SEGMENTS_INDEX_NAME "test_search_image_segments"
+#define DELETED_INDEX_NAME "test_search_image_deleted"
+#define MEMORY_INDEX_NAME "test_search_image_memory"
+#define REORDERED_INDEX_NAME "test_search_image_reordered"
+#define RANKED_INDEX_NAME "test_search_image_ranked"
+#define BLOCKS_INDEX_NAME "test_search_image_blocks"
+#define LARGE_IDS_INDEX_NAME "test_search_image_large_ids"
+#define V1_INDEX_NAME "test_search_image_v1"
+#define CORRUPT_INDEX_NAME "test_search_image_corrupt"
+#define COLUMNS_INDEX_NAME "test_search_image_columns"
+#define CHECKPOINT_INDEX_NAME "test_search_image_checkpoint"
+#define STATS_INDEX_NAME "test_search_image_stats"
+#define NUM_THREADS 4
+#define NUM_SEGMENTS 6
+
+/* Every document draws from its own generator so documents come out the same no matter
+   which builder or thread adds them. */
+static int next_rand(uint64_t *seed) {
+    *seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (int)((*seed >> 33) & RAND_MAX);
+}
+
+static uint32_t next_id(uint32_t id, uint64_t *seed) {
+    return id + 1 + (next_rand(seed) % 400);
+}
+
+/* Terms go to the document builder when there is one, its blob is added to the search
+   builder once the document is complete. */
+static void term_position(sil_search_builder_t *builder, sil_document_builder_t *doc,
+                          uint32_t pos, const char *term) {
+    if(doc)
+        sil_document_builder_term_position(doc, pos, term);
+    else
+        sil_search_builder_term_position(builder, pos, term);
+}
+
+static void term_value(sil_search_builder_t *builder, sil_document_builder_t *doc,
+                       uint32_t value, const char *term) {
+    if(doc)
+        sil_document_builder_term_value(doc, value, term);
+    else
+        sil_search_builder_term_value(builder, value, term);
+}
+
+static void add_document_terms(sil_search_builder_t *builder, sil_document_builder_t *doc,
+                               uint32_t id) {
+    uint64_t seed = id;
+    uint32_t pos = 1;
+    term_position(builder, doc, pos++, "all");
+    if((id & 1) == 0)
+        term_position(builder, doc, pos++, "even");
+    if(id % 7 == 0) {
+        for(uint32_t i=0; i<1+(id % 5); i++)
+            term_position(builder, doc, pos++, "seven");
+    }
+    if(next_rand(&seed) % 97 == 0)
+        term_value(builder, doc, next_rand(&seed), "rare");
+    term_position(builder, doc, pos+(next_rand(&seed) % 500), "filler");
+    if(id % 13 == 0) {
+        char bucket[32];
+        snprintf(bucket, sizeof(bucket), "bucket:%u", id % 211);
+        term_value(builder, doc, id % 1000, bucket);
+    }
+}
+
+static void add_document(sil_search_builder_t *builder, uint32_t id) {
+    char content[32];
+    snprintf(content, sizeof(content), "document %u", id);
+    sil_search_builder_global(builder, NULL, 0, content, strlen(content), &id, sizeof(id));
+    add_document_terms(builder, NULL, id);
+}
+
+// the blob sil_document_builder makes of the document id
+static void document_blob(sil_document_builder_t *doc, aml_buffer_t *bh, uint32_t id,
+                          sil_document_image_t *img) {
+    char content[32];
+    snprintf(content, sizeof(content), "document %u", id);
+    add_document_terms(NULL, doc, id);
+    sil_document_builder_global(doc, bh, NULL, 0, content, strlen(content), &id, sizeof(id));
+    sil_document_image_init(img, aml_buffer_data(bh) + sizeof(uint32_t),
+                            aml_buffer_length(bh) - sizeof(uint32_t));
+}
+
+// the documents with lo <= id < hi
+static void build_partition(const char *name, sil_search_builder_options_t *options,
+                            uint32_t lo, uint32_t hi) {
+    sil_search_builder_t *builder = sil_search_builder_ext_init(name, options);
+    uint64_t seed = 42;
+    for(uint32_t id=1; id<MAX_ID; id=next_id(id, &seed)) {
+        if(id >= lo && id < hi)
+            add_document(builder, id);
+    }
+    sil_search_builder_destroy(builder);
+}
+
+static void build_index(const char *name, sil_search_builder_options_t *options) {
+    build_partition(name, options, 0, MAX_ID);
+}
+
+static bool same_file(const char *base, const char *other_base, const char *suffix) {
+    char name[256], other_name[256];
+    snprintf(name, sizeof(name), "%s%s", base, suffix);
+    snprintf(other_name, sizeof(other_name), "%s%s", other_base, suffix);
+    FILE *a = fopen(name, "rb"), *b = fopen(other_name, "rb");
+    bool same = a && b;
+    while(same) {
+        int ca = fgetc(a), cb = fgetc(b);
+        same = ca == cb;
+        if(ca == EOF)
+            break;
+    }
+    if(a)
+        fclose(a);
+    if(b)
+        fclose(b);
+    return same;
+}
+
+static uint32_t *term_ids(aml_pool_t *pool, sil_search_image_t *img, const char *term, uint32_t *num) {
+    sil_term_t *t = sil_search_image_term(img, pool, term);
+    uint32_t *ids = (uint32_t *)aml_pool_alloc(pool, sizeof(uint32_t) * (t ? t->document_frequency : 1));
+    *num = 0;
+    while(t && t->c.advance((atl_cursor_t *)t))
+        ids[(*num)++] = t->c.id;
+    return ids;
+}
+
+static int test_iterate(aml_pool_t *pool, sil_search_image_t *img, const char *term) {
+    sil_term_t *t = sil_search_image_term(img, pool, term);
+    uint32_t num;
+    uint32_t *ids = term_ids(pool, img, term, &num);
+    if(num != t->document_frequency) {
+        fprintf(stderr, "%s: iterated %u ids, document_frequency is %u\n", term, num, t->document_frequency);
+        return 1;
+    }
+    for(uint32_t i=1; i<num; i++) {
+        if(ids[i] <= ids[i-1]) {
+            fprintf(stderr, "%s: ids out of order at %u\n", term, i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int test_advance_to(aml_pool_t *pool, sil_search_image_t *img, const char *term) {
+    uint32_t num;
+    uint32_t *ids = term_ids(pool, img, term, &num);
+    for(uint32_t step=1000; step<400000; step*=3) {
+        sil_term_t *t = sil_search_image_term(img, pool, term);
+        t->c.advance((atl_cursor_t *)t);
+        uint32_t i = 0;
+        for(uint32_t target=step; target<MAX_ID+step; target+=step) {
+            while(i < num && ids[i] < target)
+                i++;
+            bool found = t->c.advance_to((atl_cursor_t *)t, target);
+            if(found != (i < num) || (found && t->c.id != ids[i])) {
+                fprintf(stderr, "%s: advance_to(%u) returned %u, expected %u\n",
+                        term, target, found ? t->c.id : 0, i < num ? ids[i] : 0);
+                return 1;
+            }
+            if(!found)
+                break;
+        }
+    }
+    return 0;
+}
+
+static int compare_results(const char *name, sil_scored_id_t *res, size_t num_res,
+                           float *scores, uint32_t num_expected, size_t k) {
+    size_t expected = num_expected < k ? num_expected : k;
+    if(num_res != expected) {
+        fprintf(stderr, "%s returned %zu results, expected %zu\n", name, num_res, expected);
+        return 1;
+    }
+    for(size_t i=0; i<num_res; i++) {
+        float diff = res[i].score - scores[res[i].id];
+        if(diff > 0.0001f || diff < -0.0001f || (i && res[i].score > res[i-1].score)) {
+            fprintf(stderr, "%s result %zu (%u) has score %f, expected %f\n",
+                    name, i, res[i].id, res[i].score, scores[res[i].id]);
+            return 1;
+        }
+    }
+    // nothing outside of the results can score higher than the last result
+    for(uint32_t id=0; num_res && id<=MAX_ID; id++) {
+        if(scores[id] > res[num_res-1].score + 0.0001f) {
+            bool seen = false;
+            for(size_t i=0; i<num_res; i++)
+                seen = seen || res[i].id == id;
+            if(!seen) {
+                fprintf(stderr, "%s missed %u (%f)\n", name, id, scores[id]);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* score terms the slow way, only documents matching every required term are kept */
+static uint32_t brute_force(aml_pool_t *pool, sil_search_image_t *img, float *scores,
+                            const char **required, size_t num_required,
+                            const char **optional, size_t num_optional) {
+    sil_bm25_params_t params;
+    sil_bm25_params_init(&params);
+    uint8_t *matches = (uint8_t *)aml_zalloc(MAX_ID+1);
+    double total_documents = sil_search_image_total_documents(img);
+    double ave_d = sil_search_image_average_document_length(img);
+    memset(scores, 0, sizeof(float) * (MAX_ID+1));
+    for(size_t i=0; i<num_required + num_optional; i++) {
+        const char *term = i < num_required ? required[i] : optional[i-num_required];
+        sil_term_t *t = sil_search_image_term(img, pool, term);
+        if(!t)
+            continue;
+        double idf_qtf = sil_idf_qtf(total_documents, t->document_frequency, 1, params.k3);
+        while(t->c.advance((atl_cursor_t *)t)) {
+            uint32_t length;
+            const sil_global_header_t *gh = sil_search_image_global(&length, img, t->c.id);
+            scores[t->c.id] += (float)sil_term_bm25_plus(t, &params, idf_qtf, gh->document_length, ave_d);
+            if(i < num_required)
+                matches[t->c.id]++;
+            else if(!num_required)
+                matches[t->c.id] = 1;
+        }
+    }
+    uint32_t num_matches = 0;
+    for(uint32_t id=0; id<=MAX_ID; id++) {
+        if(num_required ? matches[id] != num_required : !matches[id])
+            scores[id] = 0.0f;
+        else
+            num_matches++;
+    }
+    aml_free(matches);
+    return num_matches;
+}
+
+static int test_accumulator(aml_pool_t *pool, sil_search_image_t *img) {
+    const char *terms[] = { "even", "seven", "rare", "missing" };
+    float *scores = (float *)aml_zalloc(sizeof(float) * (MAX_ID+1));
+    uint32_t num_expected = brute_force(pool, img, scores, NULL, 0, terms, 4);
+
+    sil_bm25_params_t params;
+    sil_bm25_params_init(&params);
+    int errors = 0;
+    for(uint32_t bits=10; bits<=18; bits+=4) {
+        sil_term_accumulator_t *acc = sil_term_accumulator_init(img, &params, bits);
+        for(size_t i=0; i<sizeof(terms)/sizeof(terms[0]); i++) {
+            sil_term_t *t = sil_search_image_term(img, pool, terms[i]);
+            if(t)
+                sil_term_accumulator_add(acc, t, 1);
+        }
+        sil_scored_id_t res[50];
+        size_t num_res = sil_term_accumulator_top_k(acc, res, 50);
+        errors += compare_results("accumulator", res, num_res, scores, num_expected, 50);
+        sil_term_accumulator_destroy(acc);
+    }
+    aml_free(scores);
+    return errors;
+}
+
+static int test_query_plan(aml_pool_t *pool, sil_search_image_t *img) {
+    const char *required[] = { "even", "seven" };
+    const char *optional[] = { "rare", "all" };
+    float *scores = (float *)aml_zalloc(sizeof(float) * (MAX_ID+1));
+    sil_scored_id_t res[40];
+    int errors = 0;
+
+    sil_query_planner_options_t options;
+    sil_query_planner_options_init(&options);
+    uint32_t num_expected = brute_force(pool, img, scores, required, 2, optional, 2);
+    sil_query_plan_t *plan = sil_query_plan_init(pool, img, &options);
+    sil_query_plan_required(plan, "even");
+    sil_query_plan_optional(plan, "rare");
+    sil_query_plan_required(plan, "seven");
+    sil_query_plan_optional(plan, "all");
+    sil_query_plan_build(plan, 40);
+    if(plan->strategy != SIL_PLAN_CONJUNCTION || strcmp(plan->terms[0].term, "seven") ||
+       plan->terms[1].mode != SIL_PLAN_TERM_BITMAP) {
+        sil_query_plan_dump(plan);
+        errors++;
+    }
+    errors += compare_results("conjunction", res, sil_query_plan_top_k(plan, res, 40),
+                              scores, num_expected, 40);
+
+    // a dense term probed through its bitmap is still scored with its term frequency
+    const char *dense_required[] = { "rare", "seven" };
+    num_expected = brute_force(pool, img, scores, dense_required, 2, optional + 1, 1);
+    plan = sil_query_plan_init(pool, img, &options);
+    sil_query_plan_required(plan, "seven");
+    sil_query_plan_required(plan, "rare");
+    sil_query_plan_optional(plan, "all");
+    sil_query_plan_build(plan, 40);
+    if(strcmp(plan->terms[0].term, "rare") || plan->terms[1].mode != SIL_PLAN_TERM_BITMAP) {
+        sil_query_plan_dump(plan);
+        errors++;
+    }
+    errors += compare_results("dense conjunction", res, sil_query_plan_top_k(plan, res, 40),
+                              scores, num_expected, 40);
+
+    num_expected = brute_force(pool, img, scores, NULL, 0, optional, 2);
+    for(uint32_t min_terms=2; min_terms<=3; min_terms++) {
+        options.term_at_a_time_min_terms = min_terms;
+        plan = sil_query_plan_init(pool, img, &options);
+        sil_query_plan_optional(plan, "all");
+        sil_query_plan_optional(plan, "rare");
+        sil_query_plan_optional(plan, "missing");
+        errors += compare_results(min_terms == 2 ? "term_at_a_time" : "disjunction",
+                                  res, sil_query_plan_top_k(plan, res, 40), scores, num_expected, 40);
+    }
+
+    plan = sil_query_plan_init(pool, img, &options);
+    sil_query_plan_required(plan, "seven");
+    sil_query_plan_required(plan, "missing");
+    if(sil_query_plan_top_k(plan, res, 40) != 0 || plan->strategy != SIL_PLAN_EMPTY)
+        errors++;
+
+    aml_free(scores);
+    return errors;
+}
+
+/* every value in range must be returned, in order, whether or not groups were skipped */
+static int test_value_range(aml_pool_t *pool, sil_search_image_t *img, const char *term,
+                            uint32_t lo, uint32_t hi) {
+    uint32_t num = 0, expected = 0;
+    uint32_t *ids = term_ids(pool, img, term, &num);
+    uint32_t *values = (uint32_t *)aml_pool_alloc(pool, sizeof(uint32_t) * (num ? num : 1));
+    sil_term_t *t = sil_search_image_term(img, pool, term);
+    for(uint32_t i=0; t && t->c.advance((atl_cursor_t *)t); i++) {
+        values[i] = t->value;
+        if(values[i] >= lo && values[i] <= hi)
+            ids[expected++] = ids[i];
+    }
+
+    uint32_t found = 0;
+    t = sil_term_value_range(sil_search_image_term(img, pool, term), lo, hi);
+    while(t && t->c.advance((atl_cursor_t *)t)) {
+        if(found >= expected || t->c.id != ids[found] || t->value < lo || t->value > hi) {
+            fprintf(stderr, "%s [%u, %u]: unexpected %u (value %u)\n", term, lo, hi, t->c.id, t->value);
+            return 1;
+        }
+        found++;
+    }
+    if(found != expected) {
+        fprintf(stderr, "%s [%u, %u]: found %u of %u ids\n", term, lo, hi, found, expected);
+        return 1;
+    }
+
+    // advance_to must land on the first id in range at or after the target
+    t = sil_term_value_range(sil_search_image_term(img, pool, term), lo, hi);
+    if(t && expected && t->c.advance((atl_cursor_t *)t)) {
+        uint32_t i = 0;
+        for(uint32_t target=5000; target<MAX_ID; target+=37011) {
+            while(i < expected && ids[i] < target)
+                i++;
+            bool ok = t->c.advance_to((atl_cursor_t *)t, target);
+            if(ok != (i < expected) || (ok && t->c.id != ids[i])) {
+                fprintf(stderr, "%s [%u, %u]: advance_to(%u) returned %u, expected %u\n",
+                        term, lo, hi, target, ok ? t->c.id : 0, i < expected ? ids[i] : 0);
+                return 1;
+            }
+            if(!ok)
+                break;
+        }
+    }
+    return 0;
+}
+
+static int compare_valued_ids(const void *a, const void *b) {
+    const sil_valued_id_t *x = (const sil_valued_id_t *)a, *y = (const sil_valued_id_t *)b;
+    if(x->value != y->value)
+        return x->value < y->value ? 1 : -1;
+    return x->id < y->id ? -1 : (x->id > y->id);
+}
+
+/* the top k by value of term, optionally limited to ids in filter (restricted to a value range) */
+static int test_value_top_k(aml_pool_t *pool, sil_search_image_t *img, const char *term,
+                            const char *filter, uint32_t lo, uint32_t hi, size_t k) {
+    uint8_t *matches = (uint8_t *)aml_zalloc(MAX_ID+1);
+    sil_term_t *t = filter ? sil_term_value_range(sil_search_image_term(img, pool, filter), lo, hi) : NULL;
+    while(t && t->c.advance((atl_cursor_t *)t))
+        matches[t->c.id] = 1;
+
+    t = sil_search_image_term(img, pool, term);
+    sil_valued_id_t *expected = (sil_valued_id_t *)aml_pool_alloc(pool, sizeof(sil_valued_id_t) * (t->document_frequency+1));
+    size_t num_expected = 0;
+    while(t->c.advance((atl_cursor_t *)t)) {
+        if(filter && !matches[t->c.id])
+            continue;
+        expected[num_expected].id = t->c.id;
+        expected[num_expected].value = t->value;
+        num_expected++;
+    }
+    aml_free(matches);
+    qsort(expected, num_expected, sizeof(sil_valued_id_t), compare_valued_ids);
+    if(num_expected > k)
+        num_expected = k;
+
+    sil_valued_id_t res[100];
+    size_t num_res;
+    t = sil_search_image_term(img, pool, term);
+    if(filter) {
+        sil_term_t *f = sil_term_value_range(sil_search_image_term(img, pool, filter), lo, hi);
+        num_res = sil_term_value_top_k_and(t, &f, 1, res, k);
+    }
+    else
+        num_res = sil_term_value_top_k(t, res, k);
+    if(num_res != num_expected) {
+        fprintf(stderr, "%s top %zu by value returned %zu, expected %zu\n", term, k, num_res, num_expected);
+        return 1;
+    }
+    for(size_t i=0; i<num_res; i++) {
+        if(res[i].id != expected[i].id || res[i].value != expected[i].value) {
+            fprintf(stderr, "%s top %zu by value: result %zu is %u (%u), expected %u (%u)\n", term, k,
+                    i, res[i].id, res[i].value, expected[i].id, expected[i].value);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    const char *term;
+    bool range;
+    uint32_t lo;
+    uint32_t hi;
+} count_term_t;
+
+static sil_term_t *count_term(aml_pool_t *pool, sil_search_image_t *img, count_term_t *ct) {
+    sil_term_t *t = sil_search_image_term(img, pool, ct->term);
+    return ct->range ? sil_term_value_range(t, ct->lo, ct->hi) : t;
+}
+
+/* counts must match iterating over every term */
+static int test_count(aml_pool_t *pool, sil_search_image_t *img, count_term_t *terms, size_t num_terms) {
+    uint8_t *matches = (uint8_t *)aml_zalloc(MAX_ID+1);
+    for(size_t i=0; i<num_terms; i++) {
+        sil_term_t *t = count_term(pool, img, terms + i);
+        while(t && t->c.advance((atl_cursor_t *)t))
+            matches[t->c.id]++;
+    }
+    uint32_t expected = 0;
+    for(uint32_t id=0; id<=MAX_ID; id++)
+        if(matches[id] == num_terms)
+            expected++;
+    aml_free(matches);
+
+    sil_term_t *t[4];
+    for(size_t i=0; i<num_terms; i++)
+        t[i] = count_term(pool, img, terms + i);
+    uint32_t count = num_terms == 1 ? sil_term_count(t[0]) : sil_term_count_and(img, t, num_terms);
+    if(count != expected) {
+        fprintf(stderr, "count of %s%s returned %u, expected %u\n", terms[0].term,
+                num_terms > 1 ? " and ..." : "", count, expected);
+        return 1;
+    }
+    return 0;
+}
+
+// the cursor over del must return the postings of img less the deleted documents
+static int compare_deleted_term(aml_pool_t *pool, sil_search_image_t *img, sil_search_image_t *del,
+                                const char *term) {
+    uint32_t num = 0, expected = 0;
+    uint32_t *ids = term_ids(pool, img, term, &num);
+    for(uint32_t i=0; i<num; i++)
+        if(!sil_search_image_is_deleted(del, ids[i]))
+            ids[expected++] = ids[i];
+    uint32_t found = 0;
+    sil_term_t *t = sil_search_image_term(del, pool, term);
+    while(t && t->c.advance((atl_cursor_t *)t)) {
+        if(found >= expected || t->c.id != ids[found]) {
+            fprintf(stderr, "%s: unexpected %u with deleted documents\n", term, t->c.id);
+            return 1;
+        }
+        found++;
+    }
+    if(found != expected) {
+        fprintf(stderr, "%s: found %u of %u ids with deleted documents\n", term, found, expected);
+        return 1;
+    }
+    for(uint32_t step=1000; step<400000; step*=7) {
+        t = sil_search_image_term(del, pool, term);
+        if(!t || !t->c.advance((atl_cursor_t *)t))
+            break;
+        uint32_t i = 0;
+        for(uint32_t target=step; target<MAX_ID; target+=step) {
+            while(i < expected && ids[i] < target)
+                i++;
+            bool ok = t->c.advance_to((atl_cursor_t *)t, target);
+            if(ok != (i < expected) || (ok && t->c.id != ids[i])) {
+                fprintf(stderr, "%s: advance_to(%u) returned %u with deleted documents, expected %u\n",
+                        term, target, ok ? t->c.id : 0, i < expected ? ids[i] : 0);
+                return 1;
+            }
+            if(!ok)
+                break;
+        }
+    }
+    return 0;
+}
+
+/* Every document in groups 100-109 of 1024 ids and every third one elsewhere is deleted.
+   Cursors, value ranges, counts and top k must skip them, the deletes must survive a
+   reopen and merging the image must drop them. */
+static int test_deleted(aml_pool_t *pool, sil_search_image_t *img) {
+    sil_search_builder_options_t options;
+    sil_search_builder_options_init(&options);
+    sil_search_builder_options_buffer_size(&options, 1024*1024);
+    sil_search_builder_options_value_summaries(&options);
+    sil_search_builder_options_group_counts(&options);
+    build_index(DELETED_INDEX_NAME, &options);
+    remove(DELETED_INDEX_NAME "_deleted");
+    sil_search_image_t *del = sil_search_image_init(DELETED_INDEX_NAME);
+
+    uint32_t num_ids;
+    const uint32_t *ids = sil_search_image_ids(del, &num_ids);
+    for(uint32_t i=0; i<num_ids; i++) {
+        if(((ids[i] >> 10) >= 100 && (ids[i] >> 10) < 110) || ids[i] % 3 == 0)
+            sil_search_image_delete(del, ids[i]);
+    }
+    uint32_t num_deleted = sil_search_image_deleted_documents(del);
+
+    int errors = 0;
+    const char *terms[] = { "all", "even", "seven", "rare", "filler" };
+    for(size_t i=0; i<sizeof(terms)/sizeof(terms[0]); i++)
+        errors += compare_deleted_term(pool, img, del, terms[i]);
+    errors += test_value_range(pool, del, "rare", 0, RAND_MAX / 2);
+    errors += test_value_top_k(pool, del, "rare", NULL, 0, 0, 20);
+    errors += test_value_top_k(pool, del, "rare", "even", 0, UINT32_MAX, 20);
+    count_term_t all = { "all", false, 0, 0 }, even = { "even", false, 0, 0 };
+    count_term_t rare = { "rare", true, 0, RAND_MAX / 2 };
+    count_term_t counts[][2] = { { all }, { rare }, { all, even }, { even, rare } };
+    size_t num_counts[] = { 1, 1, 2, 2 };
+    for(size_t i=0; i<sizeof(num_counts)/sizeof(num_counts[0]); i++)
+        errors += test_count(pool, del, counts[i], num_counts[i]);
+
+    sil_search_image_save_deleted(del);
+    sil_search_image_destroy(del);
+    del = sil_search_image_init(DELETED_INDEX_NAME);
+    if(sil_search_image_deleted_documents(del) != num_deleted) {
+        fprintf(stderr, "%u of %u deletes were saved\n", sil_search_image_deleted_documents(del), num_deleted);
+        errors++;
+    }
+
+    sil_search_builder_merge_stats_t stats;
+    sil_search_builder_merge(DELETED_INDEX_NAME "_merged", &del, NULL, 1, &options, &stats);
+    if(stats.documents != stats.input_documents - num_deleted || stats.output_bytes >= stats.input_bytes) {
+        fprintf(stderr, "merge kept %zu of %zu documents in %zu of %zu bytes\n", stats.documents,
+                stats.input_documents, stats.output_bytes, stats.input_bytes);
+        errors++;
+    }
+    sil_search_image_t *merged = sil_search_image_init(DELETED_INDEX_NAME "_merged");
+    for(size_t i=0; i<sizeof(terms)/sizeof(terms[0]); i++)
+        errors += compare_deleted_term(pool, del, merged, terms[i]);
+    sil_search_image_destroy(merged);
+    sil_search_image_destroy(del);
+    return errors;
+}
+
+static int test_value_summaries(aml_pool_t *pool) {
+    sil_search_builder_options_t options;
+    sil_search_builder_options_init(&options);
+    sil_search_builder_options_buffer_size(&options, 1024*1024);
+    sil_search_builder_options_value_summaries(&options);
+    sil_search_builder_options_group_counts(&options);
+    sil_search_builder_t *builder = sil_search_builder_ext_init(VALUE_INDEX_NAME, &options);
+    srand(7);
+    for(uint32_t id=1; id<MAX_ID; id+=1+(rand()%200)) {
+        sil_search_builder_global(builder, NULL, 0, NULL, 0, &id, sizeof(id));
+        // values follow the id so most groups fall outside of a narrow range
+        sil_search_builder_term_value(builder, id / 3000 + (rand() % 20), "price");
+        sil_search_builder_term_position(builder, 1, "price");
+        if(rand() % 3 == 0)
+            sil_search_builder_term_value(builder, rand() % 100, "mixed");
+        else
+            sil_search_builder_term_position(builder, 1 + (rand() % 10), "mixed");
+    }
+    sil_search_builder_destroy(builder);
+
+    sil_search_image_t *img = sil_search_image_init(VALUE_INDEX_NAME);
+    if(!img) {
+        fprintf(stderr, "Failed to open value search image.\n");
+        return 1;
+    }
+    int errors = 0;
+    errors += test_value_range(pool, img, "price", 100, 120);
+    errors += test_value_range(pool, img, "price", 0, 5);
+    errors += test_value_range(pool, img, "price", 490, UINT32_MAX);
+    errors += test_value_range(pool, img, "price", 1000, 2000);
+    errors += test_value_range(pool, img, "mixed", 10, 20);
+    errors += test_value_range(pool, img, "mixed", 0, 0);
+    errors += test_value_top_k(pool, img, "price", NULL, 0, 0, 100);
+    errors += test_value_top_k(pool, img, "price", NULL, 0, 0, 1);
+    errors += test_value_top_k(pool, img, "mixed", NULL, 0, 0, 50);
+    errors += test_value_top_k(pool, img, "price", "mixed", 10, 20, 100);
+    errors += test_value_top_k(pool, img, "mixed", "price", 0, 50, 30);
+
+    count_term_t price = { "price", false, 0, 0 }, mixed = { "mixed", false, 0, 0 };
+    count_term_t cheap = { "price", true, 0, 100 }, low = { "mixed", true, 0, 40 };
+    count_term_t counts[][3] = { { price }, { cheap }, { low }, { mixed, price }, { price, cheap },
+                                 { cheap, mixed }, { low, price }, { low, cheap, price } };
+    size_t num_counts[] = { 1, 1, 1, 2, 2, 2, 2, 3 };
+    for(size_t i=0; i<sizeof(num_counts)/sizeof(num_counts[0]); i++)
+        errors += test_count(pool, img, counts[i], num_counts[i]);
+    sil_search_image_destroy(img);
+    return errors;
+}
+
+// the values of term in img must be values (in the order of ids)
+static int compare_term_values(aml_pool_t *pool, sil_search_image_t *img, const char *term,
+                               const uint32_t *ids, const uint32_t *values, uint32_t num,
+                               const char *label) {
+    uint32_t i = 0;
+    sil_term_t *t = sil_search_image_term(img, pool, term);
+    for(; t && t->c.advance((atl_cursor_t *)t); i++) {
+        if(i >= num || t->c.id != ids[i] || t->value != values[i]) {
+            fprintf(stderr, "%s: %s %u has value %u, expected %u\n", label, term, t->c.id,
+                    t->value, i < num ? values[i] : 0);
+            return 1;
+        }
+    }
+    if(i != num) {
+        fprintf(stderr, "%s: %s has %u postings, expected %u\n", label, term, i, num);
+        return 1;
+    }
+    return 0;
+}
+
+static int test_value_updates(aml_pool_t *pool) {
+    remove(VALUE_INDEX_NAME "_updates");
+    sil_search_image_t *img = sil_search_image_init(VALUE_INDEX_NAME);
+    uint32_t num = 0;
+    uint32_t *ids = term_ids(pool, img, "price", &num);
+    uint32_t *values = (uint32_t *)aml_pool_alloc(pool, sizeof(uint32_t) * num);
+    uint32_t *updated = (uint32_t *)aml_pool_alloc(pool, sizeof(uint32_t) * num);
+    sil_term_t *t = sil_search_image_term(img, pool, "price");
+    for(uint32_t i=0; t->c.advance((atl_cursor_t *)t); i++)
+        values[i] = updated[i] = t->value;
+
+    int errors = 0;
+    if(sil_search_image_update_value(img, "missing", ids[0], 1) ||
+       sil_search_image_update_value(img, "price", ids[0]+1, 1) ||
+       sil_search_image_update_value(img, "price", MAX_ID*2, 1)) {
+        fprintf(stderr, "Updated a posting which does not exist\n");
+        errors++;
+    }
+    // values above every stored one, so value ranges and top k must see past the summaries
+    size_t num_updated = 0;
+    for(uint32_t i=0; i<num; i+=7) {
+        sil_search_image_update_value(img, "price", ids[i], 1);
+        updated[i] = 5000 + i;
+        sil_search_image_update_value(img, "price", ids[i], updated[i]);
+        num_updated++;
+    }
+    errors += compare_term_values(pool, img, "price", ids, values, num, "unpublished");
+    if(sil_search_image_publish_updates(img) != num_updated) {
+        fprintf(stderr, "Expected %zu updated postings\n", num_updated);
+        errors++;
+    }
+    errors += compare_term_values(pool, img, "price", ids, updated, num, "published");
+
+    // a second batch replaces some of the first, a cursor opened before it keeps the first
+    uint32_t *first = (uint32_t *)aml_pool_dup(pool, updated, sizeof(uint32_t) * num);
+    t = sil_search_image_term(img, pool, "price");
+    for(uint32_t i=0; i<num; i+=14)
+        sil_search_image_update_value(img, "price", ids[i], updated[i] = 9000 + i);
+    sil_search_image_publish_updates(img);
+    errors += compare_term_values(pool, img, "price", ids, updated, num, "republished");
+    for(uint32_t i=0; t->c.advance((atl_cursor_t *)t); i++) {
+        if(t->value != first[i]) {
+            fprintf(stderr, "An open cursor saw updates published after it\n");
+            errors++;
+            break;
+        }
+    }
+    sil_search_image_term_release(t);
+    errors += test_value_range(pool, img, "price", 5000, 8000);
+    errors += test_value_range(pool, img, "price", 100, 120);
+    errors += test_value_top_k(pool, img, "price", NULL, 0, 0, 20);
+    errors += test_value_top_k(pool, img, "price", "mixed", 10, 20, 20);
+
+    if(!sil_search_image_save_updates(img)) {
+        fprintf(stderr, "Failed to save updates\n");
+        errors++;
+    }
+    sil_search_image_destroy(img);
+    img = sil_search_image_init(VALUE_INDEX_NAME);
+    errors += compare_term_values(pool, img, "price", ids, updated, num, "reloaded");
+
+    // merging writes the updated values into the image
+    sil_search_builder_options_t options;
+    sil_search_builder_options_init(&options);
+    sil_search_builder_options_value_summaries(&options);
+    if(!sil_search_builder_merge(VALUE_INDEX_NAME "_merged", &img, NULL, 1, &options, NULL)) {
+        fprintf(stderr, "Failed to merge updated image\n");
+        errors++;
+    }
+    sil_search_image_destroy(img);
+    remove(VALUE_INDEX_NAME "_updates");
+    img = sil_search_image_init(VALUE_INDEX_NAME "_merged");
+    errors += compare_term_values(pool, img, "price", ids, updated, num, "merged");
+    sil_search_image_destroy(img);
+    return errors;
+}
+
+#define CHECKPOINT_DOCUMENTS 3000
+#define CHECKPOINT_EVERY 500
+
+/* Small globals and many postings, so _term_data is the largest file written by destroy.
+   Builders with checkpoints take one every CHECKPOINT_EVERY documents. */
+static void add_checkpoint_documents(sil_search_builder_t *builder, uint32_t first, uint32_t last) {
+    for(uint32_t i=first; i<last; i++) {
+        uint32_t id = i*3 + 1;
+        sil_search_builder_global(builder, NULL, 0, NULL, 0, &id, sizeof(id));
+        for(uint32_t j=0; j<40; j++)
+            sil_search_builder_termf_position(builder, j+1, "t%u", (i*7 + j*13) % 500);
+        if((i+1) % CHECKPOINT_EVERY == 0)
+            sil_search_builder_checkpoint(builder);
+    }
+}
+
+// the exit status of a child process running a build which is cut short
+static int wait_for_build(pid_t pid) {
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return status;
+}
+
+/* A build which crashes while documents are added resumes from the last checkpoint and one
+   which crashes while writing the terms resumes from the last term recorded.  Either way
+   the image is the same as one built in one go. */
+static int test_checkpoints() {
+    sil_search_builder_options_t options;
+    sil_search_builder_options_init(&options);
+    sil_search_builder_options_buffer_size(&options, 16*1024);
+    sil_search_builder_options_encoder_threads(&options, 2);
+    sil_search_builder_t *builder = sil_search_builder_ext_init(CHECKPOINT_INDEX_NAME "_expected", &options);
+    add_checkpoint_documents(builder, 0, CHECKPOINT_DOCUMENTS);
+    sil_search_builder_destroy(builder);
+
+    sil_search_builder_options_checkpoints(&options);
+    remove(CHECKPOINT_INDEX_NAME "_manifest");
+    pid_t pid = fork();
+    if(pid == 0) {
+        builder = sil_search_builder_ext_init(CHECKPOINT_INDEX_NAME, &options);
+        add_checkpoint_documents(builder, 0, CHECKPOINT_DOCUMENTS / 2 + 10);
+        _exit(0);
+    }
+    wait_for_build(pid);
+
+    int errors = 0;
+    size_t num_documents = 0;
+    pid = fork();
+    if(pid == 0) {
+        builder = sil_search_builder_resume(CHECKPOINT_INDEX_NAME, &options, &num_documents);
+        if(!builder || num_documents != CHECKPOINT_DOCUMENTS / 2)
+            _exit(1);
+        add_checkpoint_documents(builder, num_documents, CHECKPOINT_DOCUMENTS);
+        // _term_data outgrows the limit, which stops the process part way through the terms
+        struct rlimit limit = { 150*1024, 150*1024 };
+        setrlimit(RLIMIT_FSIZE, &limit);
+        sil_search_builder_destroy(builder);
+        _exit(0);
+    }
+    int status = wait_for_build(pid);
+    if(!WIFSIGNALED(status) || WTERMSIG(status) != SIGXFSZ) {
+        fprintf(stderr, "Resumed build was not stopped while writing terms (status %d)\n", status);
+        errors++;
+    }
+
+    sil_checkpoint_t checkpoint;
+    memset(&checkpoint, 0, sizeof(checkpoint));
+    FILE *in = fopen(CHECKPOINT_INDEX_NAME "_manifest", "rb");
+    if(in) {
+        if(fread(&checkpoint, sizeof(checkpoint), 1, in) != 1)
+            checkpoint.phase = SIL_CHECKPOINT_RUNS;
+        fclose(in);
+    }
+    if(checkpoint.phase != SIL_CHECKPOINT_TERMS || !checkpoint.terms_written) {
+        fprintf(stderr, "Expected the manifest to record terms written\n");
+        errors++;
+    }
+
+    // a resumed build which cannot record its progress stops and leaves the manifest alone
+    remove(CHECKPOINT_INDEX_NAME "_stats.txt");
+    mkdir(CHECKPOINT_INDEX_NAME "_manifest.tmp", 0755);
+    builder = sil_search_builder_resume(CHECKPOINT_INDEX_NAME, &options, &num_documents);
+    if(builder)
+        sil_search_builder_destroy(builder);
+    rmdir(CHECKPOINT_INDEX_NAME "_manifest.tmp");
+    sil_checkpoint_t unchanged;
+    memset(&unchanged, 0, sizeof(unchanged));
+    in = fopen(CHECKPOINT_INDEX_NAME "_manifest", "rb");
+    if(in) {
+        if(fread(&unchanged, sizeof(unchanged), 1, in) != 1)
+            unchanged.phase = SIL_CHECKPOINT_RUNS;
+        fclose(in);
+    }
+    in = fopen(CHECKPOINT_INDEX_NAME "_stats.txt", "rb");
+    if(in)
+        fclose(in);
+    if(unchanged.phase != checkpoint.phase || unchanged.terms_written != checkpoint.terms_written || in) {
+        fprintf(stderr, "A build which could not record its progress went on\n");
+        errors++;
+    }
+    builder = sil_search_builder_resume(CHECKPOINT_INDEX_NAME, &options, &num_documents);
+    if(!builder || num_documents != CHECKPOINT_DOCUMENTS) {
+        fprintf(stderr, "Failed to resume writing the terms\n");
+        return errors + 1;
+    }
+    sil_search_builder_destroy(builder);
+
+    const char *suffixes[] = { "_term_idx", "_term_data", "_gbl", "_stats.txt" };
+    for(size_t i=0; i<sizeof(suffixes)/sizeof(suffixes[0]); i++) {
+        if(!same_file(CHECKPOINT_INDEX_NAME "_expected", CHECKPOINT_INDEX_NAME, suffixes[i])) {
+            fprintf(stderr, "%s differs after resuming\n", suffixes[i]);
+            errors++;
+        }
+    }
+    in = fopen(CHECKPOINT_INDEX_NAME "_manifest", "rb");
+    if(in) {
+        fclose(in);
+        fprintf(stderr, "The manifest is left after the build\n");
+        errors++;
+    }
+    if(sil_search_builder_resume(CHECKPOINT_INDEX_NAME, &options, &num_documents)) {
+        fprintf(stderr, "Resumed a finished build\n");
+        errors++;
+    }
+
+    // a checkpoint is refused while a thread builder is open and includes it once destroyed
+    remove(CHECKPOINT_INDEX_NAME "_threads_manifest");
+    pid = fork();
+    if(pid == 0) {
+        builder = sil_search_builder_ext_init(CHECKPOINT_INDEX_NAME "_threads", &options);
+        sil_search_builder_t *thread_builder = sil_search_builder_thread_init(builder);
+        add_checkpoint_documents(thread_builder, 0, CHECKPOINT_DOCUMENTS / 2);
+        if(sil_search_builder_checkpoint(builder))
+            _exit(1);
+        sil_search_builder_destroy(thread_builder);
+        _exit(sil_search_builder_checkpoint(builder) ? 0 : 2);
+    }
+    status = wait_for_build(pid);
+    if(!WIFEXITED(status) || WEXITSTATUS(status)) {
+        fprintf(stderr, "Checkpoint with a thread builder failed (status %d)\n", status);
+        errors++;
+    }
+    builder = sil_search_builder_resume(CHECKPOINT_INDEX_NAME "_threads", &options, &num_documents);
+    if(!builder || num_documents != CHECKPOINT_DOCUMENTS / 2) {
+        fprintf(stderr, "The documents of a thread builder were not checkpointed\n");
+        return errors + 1;
+    }
+    add_checkpoint_documents(builder, num_documents, CHECKPOINT_DOCUMENTS);
+    sil_search_builder_destroy(builder);
+    for(size_t i=0; i<sizeof(suffixes)/sizeof(suffixes[0]); i++) {
+        if(!same_file(CHECKPOINT_INDEX_NAME "_expected", CHECKPOINT_INDEX_NAME "_threads", suffixes[i])) {
+            fprintf(stderr, "%s differs after resuming a build with a thread builder\n", suffixes[i]);
+            errors++;
+        }
+    }
+    return errors;
+}
+
+/* interning only changes how postings are spilled, the image must be identical */
+static int test_interned_terms() {
+    sil_search_builder_options_t options;
+    sil_search_builder_options_init(&options);
+    sil_search_builder_options_buffer_size(&options, 1024*1024);
+    sil_search_builder_options_intern_terms(&options, 64); // force several dictionary generations
+    int errors = 0;
+    for(int radix=0; radix<2; radix++) {
+        if(radix) {
+            // small runs so several are merged
+            sil_search_builder_options_buffer_size(&options, 64*1024);
+            sil_search_builder_options_radix_sort(&options);
+        }
+        build_index(INTERNED_INDEX_NAME, &options);
+
+        const char *suffixes[] = { "_term_idx", "_term_data", "_gbl", "_stats.txt" };
+        for(size_t i=0; i<sizeof(suffixes)/sizeof(suffixes[0]); i++) {
+            if(!same_file(INDEX_NAME, INTERNED_INDEX_NAME, suffixes[i])) {
+                fprintf(stderr, "%s differs when terms are interned%s\n", suffixes[i],
+                        radix ? " and radix sorted" : "");
+                errors++;
+            }
+        }
+    }
+    return errors;
+}
+
+/* adding the same documents as sil_document_builder blobs must build the same image */
+static int test_add_document() {
+    sil_search_builder_options_t options;
+    sil_search_builder_options_init(&options);
+    sil_search_builder_options_buffer_size(&options, 1024*1024);
+    sil_search_builder_t *builder = sil_search_builder_ext_init(BLOB_INDEX_NAME, &options);
+    sil_document_builder_t *doc = sil_document_builder_init();
+    aml_buffer_t *bh = aml_buffer_init(1024);
+    uint64_t seed = 42;
+    for(uint32_t id=1; id<MAX_ID; id=next_id(id, &seed)) {
+        sil_document_image_t img;
+        document_blob(doc, bh, id, &img);
+        sil_search_builder_add_document(builder, &img);
+    }
+    aml_buffer_destroy(bh);
+    sil_document_builder_destroy(doc);
+    sil_search_builder_destroy(builder);
+
+    int errors = 0;
+    const char *suffixes[] = { "_term_idx", "_term_data", "_gbl", "_content", "_stats.txt" };
+    for(size_t i=0; i<sizeof(suffixes)/sizeof(suffixes[0]); i++) {
+        if(!same_file(INDEX_NAME, BLOB_INDEX_NAME, suffixes[i])) {
+            fprintf(stderr, "%s differs when built from document blobs\n", suffixes[i]);
+            errors++;
+        }
+    }
+    return errors;
+}
+
+/* Partitions over disjoint ranges of ids concatenate to the image of a single build.  The
+   first boundary splits a top level group (262144 ids) between partitions. */
+static int test_concat() {
+    sil_search_builder_options_t options;
+    sil_search_builder_options_init(&options);
+    sil_search_builder_options_buffer_size(&options, 1024*1024);
+    const uint32_t bounds[] = { 0, 300*1024, 1024*1024, MAX_ID };
+    const char *parts[] = { CONCAT_INDEX_NAME "_2", CONCAT_INDEX_NAME "_0", CONCAT_INDEX_NAME "_1" };
+    for(uint32_t i=0; i<3; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "%s_%u", CONCAT_INDEX_NAME, i);
+        build_partition(name, &options, bounds[i], bounds[i+1]);
+    }
+    int errors = 0;
+    if(!sil_search_image_concat(CONCAT_INDEX_NAME, parts, 3)) {
+        fprintf(stderr, "concatenating disjoint images failed\n");
+        return 1;
+    }
+    const char *suffixes[] = { "_term_idx", "_term_data", "_gbl", "_content", "_stats.txt" };
+    for(size_t i=0; i<sizeof(suffixes)/sizeof(suffixes[0]); i++) {
+        if(!same_file(INDEX_NAME, CONCAT_INDEX_NAME, suffixes[i])) {
+            fprintf(stderr, "%s differs when partitions are concatenated\n", suffixes[i]);
+            errors++;
+        }
+    }
+
+    // a document deleted from a partition is still deleted once they are concatenated
+    sil_search_image_t *part = sil_search_image_init(CONCAT_INDEX_NAME "_0");
+    uint32_t num_ids;
+    uint32_t deleted_id = sil_search_image_ids(part, &num_ids)[num_ids/2];
+    sil_search_image_delete(part, deleted_id);
+    sil_search_image_save_deleted(part);
+    sil_search_image_destroy(part);
+    sil_search_image_t *img = NULL;
+    if(sil_search_image_concat(CONCAT_INDEX_NAME, parts, 3))
+        img = sil_search_image_init(CONCAT_INDEX_NAME);
+    if(!img || !sil_search_image_is_deleted(img, deleted_id) ||
+       sil_search_image_deleted_documents(img) != 1) {
+        fprintf(stderr, "document %u deleted before concatenating is not deleted\n", deleted_id);
+        errors++;
+    }
+    if(img)
+        sil_search_image_destroy(img);
+    remove(CONCAT_INDEX_NAME "_0_deleted");
+
+    // the original ids of a renumbered image cannot be carried over
+    FILE *id_map = fopen(CONCAT_INDEX_NAME "_2_id_map", "wb");
+    fclose(id_map);
+    if(sil_search_image_concat(CONCAT_INDEX_NAME, parts, 3)) {
+        fprintf(stderr, "an image with an id map was concatenated\n");
+        errors++;
+    }
+    remove(CONCAT_INDEX_NAME "_2_id_map");
+
+    // nor can value updates, which live outside of the postings
+    part = sil_search_image_init(CONCAT_INDEX_NAME "_1");
+    sil_search_image_update_value(part, "all", sil_search_image_ids(part, &num_ids)[0], 7);
+    sil_search_image_publish_updates(part);
+    sil_search_image_save_updates(part);
+    sil_search_image_destroy(part);
+    if(sil_search_image_concat(CONCAT_INDEX_NAME, parts, 3)) {
+        fprintf(stderr, "an image with value updates was concatenated\n");
+        errors++;
+    }
+    remove(CONCAT_INDEX_NAME "_1_updates");
+
+    // the partition ending at 300*1024 shares a group of 1024 ids with one starting at 300*1024-512
+    build_partition(CONCAT_INDEX_NAME "_1", &options, 300*1024-512, 1024*1024);
+    if(sil_search_image_concat(CONCAT_INDEX_NAME, parts, 3)) {
+        fprintf(stderr, "overlapping images were concatenated\n");
+        errors++;
+    }
+    return errors;
+}
+
+// the union cursor over the segments must return the postings of the single image
+static int compare_segments_term(aml_pool_t *pool, sil_search_image_t *img,
+                                 sil_segments_snapshot_t *snapshot, const char *term) {
+    sil_term_t *t = sil_search_image_term(img, pool, term);
+    sil_term_t *u = sil_segments_term(snapshot, pool, term);
+    while(t && t->c.advance((atl_cursor_t *)t)) {
+        if(!u || !u->c.advance((atl_cursor_t *)u) || u->c.id != t->c.id || u->value != t->value ||
+           sil_term_position_count(u) != sil_term_position_count(t)) {
+            fprintf(stderr, "%s: segments differ at id %u\n", term, t->c.id);
+            return 1;
+        }
+    }
+    if(u && u->c.advance((atl_cursor_t *)u)) {
+        fprintf(stderr, "%s: segments have an extra id %u\n", term, u->c.id);
+        return 1;
+    }
+    for(uint32_t step=1000; step<400000; step*=7) {
+        t = sil_search_image_term(img, pool, term);
+        u = sil_segments_term(snapshot, pool, term);
+        t->c.advance((atl_cursor_t *)t);
+        u->c.advance((atl_cursor_t *)u);
+        for(uint32_t target=step; target<MAX_ID; target+=step) {
+            bool found = t->c.advance_to((atl_cursor_t *)t, target);
+            if(found != u->c.advance_to((atl_cursor_t *)u, target) || (found && t->c.id != u->c.id)) {
+                fprintf(stderr, "%s: segments advance_to(%u) differs\n", term, target);
+                return 1;
+            }
+            if(!found)
+                break;
+        }
+    }
+    return 0;
+}
+
+static int compare_segments(aml_pool_t *pool, sil_search_image_t *img, sil_segments_t *segments) {
+    int errors = 0;
+    sil_segments_snapshot_t *snapshot = sil_segments_acquire(segments);
+    const char *terms[] = { "all", "even", "seven", "rare", "filler", "bucket:26" };
+    for(size_t i=0; i<sizeof(terms)/sizeof(terms[0]); i++)
+        errors += compare_segments_term(pool, img, snapshot, terms[i]);
+    if(sil_segments_total_documents(snapshot) != sil_search_image_total_documents(img) ||
+       fabs(sil_segments_average_document_length(snapshot) -
+            sil_search_image_average_document_length(img)) > 0.0001) {
+        fprintf(stderr, "segments have %u documents of average length %f, expected %u and %f\n",
+                sil_segments_total_documents(snapshot), sil_segments_average_document_length(snapshot),
+                sil_search_image_total_documents(img), sil_search_image_average_document_length(img));
+        errors++;
+    }
+    sil_segments_release(snapshot);
+    return errors;
+}
+
+/* Documents added in several segments, with a tenth of them added again in a later one,
+   are searched as if they were one image and compact to the image of a single build. */
+static int test_segments(aml_pool_t *pool, sil_search_image_t *img) {
+    remove(SEGMENTS_INDEX_NAME "_segments");
+    sil_segments_options_t options;
+    sil_segments_options_init(&options);
+    sil_search_builder_options_buffer_size(&options.builder_options, 256*1024);
+    sil_segments_t *segments = sil_segments_init(SEGMENTS_INDEX_NAME, &options);
+    for(uint32_t segment=0; segment<=NUM_SEGMENTS; segment++) {
+        sil_search_builder_t *builder = sil_segments_builder(segments);
+        uint64_t seed = 42;
+        uint32_t n = 0;
+        for(uint32_t id=1; id<MAX_ID; id=next_id(id, &seed), n++) {
+            if(segment < NUM_SEGMENTS ? n % NUM_SEGMENTS == segment : n % 10 == 0)
+                add_document(builder, id);
+        }
+        sil_segments_add(segments, builder);
+    }
+    int errors = compare_segments(pool, img, segments);
+
+    sil_segments_compact(segments);
+    sil_segments_snapshot_t *snapshot = sil_segments_acquire(segments);
+    if(sil_segments_num_segments(snapshot) != 1) {
+        fprintf(stderr, "compacted into %zu segments\n", sil_segments_num_segments(snapshot));
+        errors++;
+    }
+    sil_segments_release(snapshot);
+    errors += compare_segments(pool, img, segments);
+    sil_segments_destroy(segments);
+
+    // reopened from the list of segments
+    sil_segments_options_manual_compaction(&options);
+    segments = sil_segments_init(SEGMENTS_INDEX_NAME, &options);
+    errors += compare_segments(pool, img, segments);
+    sil_segments_destroy(segments);
+
+    uint32_t next_number = 0, number = 0;
+    FILE *in = fopen(SEGMENTS_INDEX_NAME "_segments", "rb");
+    if(!in || fscanf(in, "%u %u", &next_number, &number) != 2) {
+        fprintf(stderr, "the list of segments was not written\n");
+        errors++;
+    }
+    if(in)
+        fclose(in);
+    char name[64];
+    snprintf(name, sizeof(name), "%s_seg_%u", SEGMENTS_INDEX_NAME, number);
+    const char *suffixes[] = { "_term_idx", "_term_data", "_gbl", "_content", "_stats.txt" };
+    for(size_t i=0; i<sizeof(suffixes)/sizeof(suffixes[0]); i++) {
+        if(!same_file(INDEX_NAME, name, suffixes[i])) {
+            fprintf(stderr, "%s differs when segments are compacted\n", suffixes[i]);
+            errors++;
+        }
+    }
+
+    // deleted documents are skipped and dropped by the next merge
+    segments = sil_segments_init(SEGMENTS_INDEX_NAME, &options);
+    uint32_t num_ids, num_deleted = 0;
+    const uint32_t *ids = term_ids(pool, img, "all", &num_ids);
+    for(uint32_t i=0; i<num_ids; i+=5)
+        num_deleted += sil_segments_delete(segments, ids[i]) ? 1 : 0;
+    snapshot = sil_segments_acquire(segments);
+    sil_term_t *t = sil_segments_term(snapshot, pool, "all");
+    for(uint32_t i=0; i<num_ids; i++) {
+        if(i % 5 == 0)
+            continue;
+        if(!t->c.advance((atl_cursor_t *)t) || t->c.id != ids[i]) {
+            fprintf(stderr, "segments returned %u, expected %u after deletes\n", t->c.id, ids[i]);
+            errors++;
+            break;
+        }
+    }
+    sil_segments_release(snapshot);
+
+    // a merge whose list of segments cannot be written leaves the segments as they were
+    char tmp[64];
+    snprintf(tmp, sizeof(tmp), "%s_segments.%u.tmp", SEGMENTS_INDEX_NAME, next_number);
+    mkdir(tmp, 0755);
+    sil_segments_compact(segments);
+    rmdir(tmp);
+    uint32_t listed = 0;
+    in = fopen(SEGMENTS_INDEX_NAME "_segments", "rb");
+    if(!in || fscanf(in, "%*u %u", &listed) != 1 || listed != number ||
+       sil_segments_reclaimed_bytes(segments, NULL)) {
+        fprintf(stderr, "a merge replaced segment %u without writing the list of segments\n", number);
+        errors++;
+    }
+    if(in)
+        fclose(in);
+
+    sil_segments_compact(segments);
+    size_t dropped_documents = 0;
+    size_t reclaimed_bytes = sil_segments_reclaimed_bytes(segments, &dropped_documents);
+    if(dropped_documents != num_deleted || reclaimed_bytes == 0) {
+        fprintf(stderr, "compacting dropped %zu of %u deleted documents, reclaiming %zu bytes\n",
+                dropped_documents, num_deleted, reclaimed_bytes);
+        errors++;
+    }
+    sil_segments_destroy(segments);
+    return errors;
+}
+
+/* Documents in the memory index are searched along with the segments and replace the
+   versions in the segments.  The memory index is written out as a segment once it fills
+   and when the index is compacted or destroyed. */
+static int test_memory_index(aml_pool_t *pool, sil_search_image_t *img) {
+    remove(MEMORY_INDEX_NAME "_segments");
+    sil_segments_options_t options;
+    sil_segments_options_init(&options);
+    sil_segments_options_manual_compaction(&options);
+    sil_search_builder_options_buffer_size(&options.builder_options, 256*1024);
+    sil_segments_t *segments = sil_segments_init(MEMORY_INDEX_NAME, &options);
+    sil_document_builder_t *doc = sil_document_builder_init();
+    aml_buffer_t *bh = aml_buffer_init(1024);
+    sil_document_image_t blob;
+
+    // half of the documents go to a segment and the rest (and a tenth again) to memory
+    sil_search_builder_t *builder = sil_segments_builder(segments);
+    uint64_t seed = 42;
+    uint32_t n = 0;
+    for(uint32_t id=1; id<MAX_ID; id=next_id(id, &seed), n++) {
+        if(n % 2 == 0)
+            add_document(builder, id);
+        else {
+            document_blob(doc, bh, id, &blob);
+            sil_segments_add_document(segments, &blob);
+        }
+    }
+    sil_segments_add(segments, builder);
+    seed = 42;
+    n = 0;
+    for(uint32_t id=1; id<MAX_ID; id=next_id(id, &seed), n++) {
+        if(n % 10 == 0) {
+            document_blob(doc, bh, id, &blob);
+            sil_segments_add_document(segments, &blob);
+        }
+    }
+    int errors = compare_segments(pool, img, segments);
+
+    sil_segments_snapshot_t *snapshot = sil_segments_acquire(segments);
+    if(sil_segments_image(snapshot, 1) || !sil_segments_document(snapshot, 1, &blob) ||
+       blob.header.content_length != strlen("document 1") ||
+       memcmp(blob.content, "document 1", blob.header.content_length)) {
+        fprintf(stderr, "the current version of document 1 is not in memory\n");
+        errors++;
+    }
+    sil_segments_release(snapshot);
+
+    // the totals follow documents added to and deleted from memory between snapshots
+    snapshot = sil_segments_acquire(segments);
+    uint32_t total_documents = sil_segments_total_documents(snapshot);
+    sil_segments_release(snapshot);
+    document_blob(doc, bh, MAX_ID, &blob);
+    sil_segments_add_document(segments, &blob);
+    document_blob(doc, bh, 1, &blob);
+    sil_segments_add_document(segments, &blob);
+    snapshot = sil_segments_acquire(segments);
+    if(sil_segments_total_documents(snapshot) != total_documents+1) {
+        fprintf(stderr, "adding a document to memory did not add to the totals\n");
+        errors++;
+    }
+    sil_segments_release(snapshot);
+    sil_segments_delete(segments, MAX_ID);
+    snapshot = sil_segments_acquire(segments);
+    if(sil_segments_total_documents(snapshot) != total_documents || sil_segments_image(snapshot, MAX_ID)) {
+        fprintf(stderr, "deleting a document from memory did not subtract from the totals\n");
+        errors++;
+    }
+    sil_segments_release(snapshot);
+
+    sil_segments_compact(segments);
+    snapshot = sil_segments_acquire(segments);
+    if(sil_segments_num_segments(snapshot) != 1 || sil_segments_document(snapshot, 1, &blob)) {
+        fprintf(stderr, "the memory index was not written out by compact\n");
+        errors++;
+    }
+    sil_segments_release(snapshot);
+    errors += compare_segments(pool, img, segments);
+    sil_segments_destroy(segments);
+
+    // a small memory index is written out while documents are added
+    remove(MEMORY_INDEX_NAME "_segments");
+    sil_segments_options_memory_size(&options, 128*1024);
+    segments = sil_segments_init(MEMORY_INDEX_NAME, &options);
+    seed = 42;
+    for(uint32_t id=1; id<MAX_ID; id=next_id(id, &seed)) {
+        document_blob(doc, bh, id, &blob);
+        sil_segments_add_document(segments, &blob);
+    }
+    snapshot = sil_segments_acquire(segments);
+    if(sil_segments_num_segments(snapshot) < 2) {
+        fprintf(stderr, "the memory index was written out to %zu segments\n",
+                sil_segments_num_segments(snapshot));
+        errors++;
+    }
+    sil_segments_release(snapshot);
+    errors += compare_segments(pool, img, segments);
+    sil_segments_destroy(segments);
+
+    // destroy wrote out the rest
+    segments = sil_segments_init(MEMORY_INDEX_NAME, &options);
+    errors += compare_segments(pool, img, segments);
+    sil_segments_destroy(segments);
+    aml_buffer_destroy(bh);
+    sil_document_builder_destroy(doc);
+    return errors;
+}
+
+static long file_size(const char *base, const char *suffix) {
+    char name[256];
+    snprintf(name, sizeof(name), "%s%s", base, suffix);
+    FILE *in = fopen(name, "rb");
+    if(!in)
+        return -1;
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    fclose(in);
+    return size;
+}
+
+typedef struct {
+    uint32_t id;
+    uint32_t value;
+    uint32_t positions;
+} reordered_posting_t;
+
+static int compare_reordered_postings(const void *a, const void *b) {
+    uint32_t x = ((const reordered_posting_t *)a)->id, y = ((const reordered_posting_t *)b)->id;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// the postings of term in the reordered image, under their original ids, must match img
+static int compare_reordered_term(aml_pool_t *pool, sil_search_image_t *img,
+                                  sil_search_image_t *reordered, const char *term) {
+    sil_term_t *r = sil_search_image_term(reordered, pool, term);
+    sil_term_t *t = sil_search_image_term(img, pool, term);
+    if(!r || !t || r->document_frequency != t->document_frequency) {
+        fprintf(stderr, "%s: the reordered image has %u postings\n", term, r ? r->document_frequency : 0);
+        return 1;
+    }
+    reordered_posting_t *postings =
+        (reordered_posting_t *)aml_pool_alloc(pool, sizeof(reordered_posting_t) * r->document_frequency);
+    uint32_t n = 0, last_id = 0;
+    while(r->c.advance((atl_cursor_t *)r)) {
+        if(r->c.id <= last_id || n == t->document_frequency)
+            break;
+        last_id = r->c.id;
+        postings[n].id = sil_search_image_original_id(reordered, r->c.id);
+        postings[n].value = r->value;
+        postings[n].positions = sil_term_position_count(r);
+        n++;
+    }
+    qsort(postings, n, sizeof(reordered_posting_t), compare_reordered_postings);
+    for(uint32_t i=0; i<n; i++) {
+        if(!t->c.advance((atl_cursor_t *)t) || t->c.id != postings[i].id ||
+           t->value != postings[i].value || sil_term_position_count(t) != postings[i].positions) {
+            fprintf(stderr, "%s: the reordered image differs at original id %u\n", term, postings[i].id);
+            return 1;
+        }
+    }
+    return n == t->document_frequency ? 0 : 1;
+}
+
+/* Renumbering the documents by graph bisection keeps every posting (under the original
+   ids) and makes the postings smaller.  The builder option writes the same image. */
+static int test_reorder(aml_pool_t *pool, sil_search_image_t *img) {
+    int errors = 0;
+    if(!sil_search_builder_reorder(REORDERED_INDEX_NAME, img, NULL)) {
+        fprintf(stderr, "the image could not be reordered\n");
+        return 1;
+    }
+    sil_search_image_t *reordered = sil_search_image_init(REORDERED_INDEX_NAME);
+    const char *terms[] = { "all", "even", "seven", "rare", "filler", "bucket:26" };
+    for(size_t i=0; i<sizeof(terms)/sizeof(terms[0]); i++)
+        errors += compare_reordered_term(pool, img, reordered, terms[i]);
+
+    uint32_t num_ids;
+    const uint32_t *ids = sil_search_image_ids(img, &num_ids);
+    for(uint32_t i=0; i<num_ids; i+=97) {
+        uint32_t id, length;
+        char content[32];
+        snprintf(content, sizeof(content), "document %u", ids[i]);
+        const sil_global_header_t *gh;
+        if(!sil_search_image_reordered_id(reordered, ids[i], &id) ||
+           sil_search_image_original_id(reordered, id) != ids[i] ||
+           !(gh = sil_search_image_global(&length, reordered, id)) || *(uint32_t *)(gh+1) != id ||
+           memcmp(sil_search_image_content(reordered, gh) + sizeof(uint32_t), content, strlen(content))) {
+            fprintf(stderr, "document %u was not renumbered\n", ids[i]);
+            errors++;
+            break;
+        }
+    }
+    if(sil_search_image_total_documents(reordered) != num_ids ||
+       sil_search_image_max_id(reordered) != num_ids+1) {
+        fprintf(stderr, "the reordered image has %u documents\n", sil_search_image_total_documents(reordered));
+        errors++;
+    }
+    sil_search_image_destroy(reordered);
+
+    long before = file_size(INDEX_NAME, "_term_data"), after = file_size(REORDERED_INDEX_NAME, "_term_data");
+    if(after >= before) {
+        fprintf(stderr, "reordering grew the postings from %ld to %ld bytes\n", before, after);
+        errors++;
+    }
+
+    sil_search_builder_options_t options;
+    sil_search_builder_options_init(&options);
+    sil_search_builder_options_buffer_size(&options, 1024*1024);
+    sil_search_builder_options_reorder_ids(&options);
+    build_index(REORDERED_INDEX_NAME "_built", &options);
+    const char *suffixes[] = { "_term_idx", "_term_data", "_gbl", "_content", "_stats.txt", "_id_map" };
+    for(size_t i=0; i<sizeof(suffixes)/sizeof(suffixes[0]); i++) {
+        if(!same_file(REORDERED_INDEX_NAME, REORDERED_INDEX_NAME "_built", suffixes[i])) {
+            fprintf(stderr, "%s differs when the builder reorders ids\n", suffixes[i]);
+            errors++;
+        }
+    }
+    return errors;
+}
+
+// every eleventh document is left without a rank
+static uint32_t static_rank(uint32_t id) {
+    return id % 11 ? (id * 2654435761u) >> 22 : 0;
+}
+
+static size_t ranked_top_k(aml_pool_t *pool, sil_search_image_t *img, bool early_termination,
+                           double margin, sil_scored_id_t *res, size_t k, bool *terminated_early) {
+    sil_query_planner_options_t options;
+    sil_query_planner_options_init(&options);
+    options.early_termination = early_termination;
+    options.early_termination_margin = margin;
+    sil_query_plan_t *plan = sil_query_plan_init(pool, img, &options);
+    sil_query_plan_required(plan, "seven");
+    sil_query_plan_optional(plan, "even");
+    size_t num = sil_query_plan_top_k(plan, res, k);
+    *terminated_early = plan->terminated_early;
+    return num;
+}
+
+static int test_static_rank(aml_pool_t *pool) {
+    int errors = 0;
+    sil_search_builder_options_t options;
+    sil_search_builder_options_init(&options);
+    sil_search_builder_options_buffer_size(&options, 1024*1024);
+    sil_search_builder_options_static_rank_order(&options);
+    sil_search_builder_t *builder = sil_search_builder_ext_init(RANKED_INDEX_NAME, &options);
+    uint64_t seed = 42;
+    for(uint32_t id=1; id<MAX_ID; id=next_id(id, &seed)) {
+        add_document(builder, id);
+        if(static_rank(id))
+            sil_search_builder_static_rank(builder, static_rank(id));
+    }
+    sil_search_builder_destroy(builder);
+
+    sil_search_image_t *ranked = sil_search_image_init(RANKED_INDEX_NAME);
+    uint32_t num_ids;
+    const uint32_t *ids = sil_search_image_ids(ranked, &num_ids);
+    for(uint32_t i=1; i<num_ids; i++) {
+        uint32_t a = sil_search_image_original_id(ranked, ids[i-1]);
+        uint32_t b = sil_search_image_original_id(ranked, ids[i]);
+        if(ids[i] != i+1 || static_rank(a) < static_rank(b) ||
+           (static_rank(a) == static_rank(b) && a > b)) {
+            fprintf(stderr, "id %u (originally %u) is out of static rank order\n", ids[i], b);
+            errors++;
+            break;
+        }
+    }
+
+    // a margin of 1 takes the first k matches, which are the best by static rank
+    sil_scored_id_t res[20], exact[20];
+    bool terminated_early;
+    size_t num = ranked_top_k(pool, ranked, true, 1.0, res, 20, &terminated_early);
+    uint32_t num_first;
+    uint32_t *first = term_ids(pool, ranked, "seven", &num_first);
+    bool first_matches = terminated_early && num == 20 && num_first > 20;
+    for(size_t i=0; i<num; i++)
+        if(res[i].id > first[19])
+            first_matches = false;
+    if(!first_matches) {
+        fprintf(stderr, "early termination did not return the first matches\n");
+        errors++;
+    }
+
+    // the default margin stops a head query within the start of its postings, with every
+    // result near the best score found
+    sil_query_planner_options_t defaults;
+    sil_query_planner_options_init(&defaults);
+    num = ranked_top_k(pool, ranked, true, defaults.early_termination_margin, res, 20,
+                       &terminated_early);
+    bool head = terminated_early && num == 20;
+    for(size_t i=0; i<num; i++)
+        if(res[i].id > first[num_first / 10] ||
+           res[i].score < (1.0 - defaults.early_termination_margin) * res[0].score)
+            head = false;
+    if(!head) {
+        fprintf(stderr, "early termination with the default margin did not stop early\n");
+        errors++;
+    }
+
+    // a margin of 0 only stops when nothing can score higher, so the results are exact
+    size_t num_exact = ranked_top_k(pool, ranked, false, 0.0, exact, 20, &terminated_early);
+    num = ranked_top_k(pool, ranked, true, 0.0, res, 20, &terminated_early);
+    if(num != num_exact || memcmp(res, exact, sizeof(sil_scored_id_t) * num)) {
+        fprintf(stderr, "early termination with no margin changed the results\n");
+        errors++;
+    }
+    sil_search_image_destroy(ranked);
+    return errors;
+}
+
+// the content of every document of img must be read back from blocks the same
+static int compare_content(sil_search_image_t *img, sil_search_image_t *blocks, aml_buffer_t *bh) {
+    uint32_t num_ids;
+    const uint32_t *ids = sil_search_image_ids(img, &num_ids);
+    // a stride through the ids revisits blocks after they may have been evicted
+    for(uint32_t i=0; i<num_ids; i++) {
+        uint32_t id = ids[(i * 7919) % num_ids], length;
+        const sil_global_header_t *gh = sil_search_image_global(&length, img, id);
+        const sil_global_header_t *bgh = sil_search_image_global(&length, blocks, id);
+        const char *content = sil_search_image_content(img, gh);
+        const char *copy = bgh ? sil_search_image_content_copy(blocks, bgh, bh) : NULL;
+        if(!copy || memcmp(content, copy, sizeof(uint32_t) + *(uint32_t *)content)) {
+            fprintf(stderr, "the content of %u differs when it is compressed\n", id);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    sil_search_image_t *img;
+    sil_search_image_t *blocks;
+    int errors;
+} content_thread_t;
+
+static void *compare_content_thread(void *arg) {
+    content_thread_t *ct = (content_thread_t *)arg;
+    aml_buffer_t *bh = aml_buffer_init(64);
+    ct->errors = compare_content(ct->img, ct->blocks, bh);
+    aml_buffer_destroy(bh);
+    return NULL;
+}
+
+static int test_content_blocks(sil_search_image_t *img) {
+    int errors = 0;
+    sil_search_builder_options_t options;
+    sil_search_builder_options_init(&options);
+    sil_search_builder_options_buffer_size(&options, 1024*1024);
+    sil_search_builder_options_content_blocks(&options, 4096);
+    build_index(BLOCKS_INDEX_NAME, &options);
+
+    aml_buffer_t *bh = aml_buffer_init(64);
+    sil_search_image_t *blocks = sil_search_image_init(BLOCKS_INDEX_NAME);
+    uint32_t length;
+    const uint32_t *ids = sil_search_image_ids(img, &length);
+    if(sil_search_image_content(blocks, sil_search_image_global(&length, blocks, ids[0]))) {
+        fprintf(stderr, "compressed content was returned without a copy\n");
+        errors++;
+    }
+    errors += compare_content(img, blocks, bh);
+    sil_search_image_content_cache(blocks, 4);
+    errors += compare_content(img, blocks, bh);
+
+    // readers sharing the cache evict blocks the others are still copying from
+    pthread_t threads[NUM_THREADS];
+    content_thread_t args[NUM_THREADS];
+    for(uint32_t i=0; i<NUM_THREADS; i++) {
+        args[i].img = img;
+        args[i].blocks = blocks;
+        pthread_create(threads+i, NULL, compare_content_thread, args+i);
+    }
+    for(uint32_t i=0; i<NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        errors += args[i].errors;
+    }
+    long before = file_size(INDEX_NAME, "_content"), after = file_size(BLOCKS_INDEX_NAME, "_content");
+    if(after >= before) {
+        fprintf(stderr, "compressing the content grew it from %ld to %ld bytes\n", before, after);
+        errors++;
+    }
+
+    // merging with the default options writes the content as it was
+    sil_search_builder_options_t merge_options;
+    sil_search_builder_options_init(&merge_options);
+    if(!sil_search_builder_merge(BLOCKS_INDEX_NAME "_merged", &blocks, NULL, 1, &merge_options, NULL) ||
+       !same_file(INDEX_NAME, BLOCKS_INDEX_NAME "_merged", "_content") ||
+       !same_file(INDEX_NAME, BLOCKS_INDEX_NAME "_merged", "_gbl")) {
+        fprintf(stderr, "merging compressed content changed it\n");
+        errors++;
+    }
+    sil_search_image_destroy(blocks);
+
+    // partitions are joined a block at a time
+    const char *parts[] = { BLOCKS_INDEX_NAME "_0", BLOCKS_INDEX_NAME "_1" };
+    build_partition(parts[0], &options, 0, 700*1024);
+    build_partition(parts[1], &options, 700*1024, MAX_ID);
+    if(!sil_search_image_concat(BLOCKS_INDEX_NAME "_concat", parts, 2)) {
+        fprintf(stderr, "concatenating compressed content failed\n");
+        errors++;
+    }
+    else {
+        blocks = sil_search_image_init(BLOCKS_INDEX_NAME "_concat");
+        errors += compare_content(img, blocks, bh);
+        sil_search_image_destroy(blocks);
+    }
+    aml_buffer_destroy(bh);
+    return errors;
+}
+
+// a cold term must return the same postings as the image read normally
+static int compare_cold_term(aml_pool_t *pool, sil_search_image_t *img, sil_search_image_t *cold,
+                             const char *term) {
+    sil_term_t *a = sil_search_image_term(img, pool, term);
+    sil_term_t *b = sil_search_image_term(cold, pool, term);
+    if(!a || !b || a->document_frequency != b->document_frequency) {
+        fprintf(stderr, "%s is missing when its postings are cold\n", term);
+        return 1;
+    }
+    while(a->c.advance((atl_cursor_t *)a)) {
+        if(!b->c.advance((atl_cursor_t *)b) || a->c.id != b->c.id || a->value != b->value) {
+            fprintf(stderr, "%s differs when its postings are cold\n", term);
+            return 1;
+        }
+    }
+    if(b->c.advance((atl_cursor_t *)b)) {
+        fprintf(stderr, "%s has extra postings when they are cold\n", term);
+        return 1;
+    }
+    return 0;
+}
+
+static int test_cold_postings(aml_pool_t *pool, sil_search_image_t *img) {
+    int errors = 0;
+    sil_search_image_t *cold = sil_search_image_init(INDEX_NAME);
+    sil_cold_postings_options_t options;
+    sil_cold_postings_options_init(&options);
+    options.max_document_frequency = UINT32_MAX;
+    options.cache_size = 16*1024;
+    options.window = 8;
+    sil_search_image_cold_postings(cold, &options);
+    if(sil_search_image_cold_postings(cold, &options)) {
+        fprintf(stderr, "postings were made cold twice\n");
+        errors++;
+    }
+
+    // enough passes for terms to be promoted into the cache and evicted from it
+    const char *terms[] = { "all", "even", "seven", "rare", "filler", "bucket:26", "bucket:100" };
+    for(int pass=0; pass<3; pass++) {
+        for(size_t i=0; i<sizeof(terms)/sizeof(terms[0]); i++) {
+            aml_pool_clear(pool);
+            errors += compare_cold_term(pool, img, cold, terms[i]);
+        }
+    }
+    aml_pool_clear(pool);
+    errors += test_query_plan(pool, cold);
+
+    sil_cold_postings_stats_t stats;
+    sil_search_image_cold_stats(cold, &stats);
+    if(!stats.cold_terms || stats.compressed_bytes >= stats.cold_bytes || !stats.hits ||
+       !stats.misses || stats.cached_bytes > options.cache_size ||
+       sil_search_image_size(cold) >= sil_search_image_size(img)) {
+        fprintf(stderr, "cold postings: %zu terms, %zu bytes compressed to %zu, %zu hits, %zu misses\n",
+                stats.cold_terms, stats.cold_bytes, stats.compressed_bytes, stats.hits, stats.misses);
+        errors++;
+    }
+    sil_search_image_destroy(cold);
+
+    // an open more than a few windows ago no longer counts towards promotion
+    cold = sil_search_image_init(INDEX_NAME);
+    options.promote_after = 2;
+    options.min_bytes = 0;
+    sil_search_image_cold_postings(cold, &options);
+    aml_pool_clear(pool);
+    sil_search_image_term(cold, pool, "rare");
+    for(uint32_t bucket=0; bucket<5*options.window; bucket++)
+        sil_search_image_termf(cold, pool, "bucket:%u", bucket);
+    sil_search_image_term(cold, pool, "rare");
+    sil_search_image_term(cold, pool, "rare");
+    sil_search_image_cold_stats(cold, &stats);
+    if(stats.hits) {
+        fprintf(stderr, "a cold term was promoted by opens from earlier windows\n");
+        errors++;
+    }
+    sil_search_image_term(cold, pool, "rare");
+    sil_search_image_cold_stats(cold, &stats);
+    if(stats.hits != 1) {
+        fprintf(stderr, "a cold term opened twice in a window was not promoted\n");
+        errors++;
+    }
+    sil_search_image_destroy(cold);
+    return errors;
+}
+
+// ids on both sides of 2^26, where the top level group key no longer fits in a byte
+static uint32_t large_id(uint32_t i) {
+    return (1u << 26) - (1u << 20) + i * 97;
+}
+
+static int test_large_ids(aml_pool_t *pool) {
+    int errors = 0;
+    const uint32_t num_docs = 20000;
+    sil_search_builder_options_t options;
+    sil_search_builder_options_init(&options);
+    sil_search_builder_options_buffer_size(&options, 1024*1024);
+    sil_search_builder_t *builder = sil_search_builder_ext_init(LARGE_IDS_INDEX_NAME, &options);
+    for(uint32_t i=0; i<num_docs; i++)
+        add_document(builder, large_id(i));
+    sil_search_builder_destroy(builder);
+
+    sil_search_image_t *img = sil_search_image_init(LARGE_IDS_INDEX_NAME);
+    if(!img) {
+        fprintf(stderr, "the image with large ids did not open\n");
+        return 1;
+    }
+    uint32_t num;
+    uint32_t *ids = term_ids(pool, img, "even", &num);
+    uint32_t n = 0;
+    for(uint32_t i=0; i<num_docs && !errors; i++) {
+        uint32_t id = large_id(i), length;
+        char content[32];
+        snprintf(content, sizeof(content), "document %u", id);
+        const sil_global_header_t *gh = sil_search_image_global(&length, img, id);
+        if(!gh || *(uint32_t *)(gh+1) != id ||
+           memcmp(sil_search_image_content(img, gh) + sizeof(uint32_t), content, strlen(content))) {
+            fprintf(stderr, "the global of %u is missing\n", id);
+            errors++;
+        }
+        if(sil_search_image_global(&length, img, id+1) || sil_search_image_global(&length, img, id-1)) {
+            fprintf(stderr, "a global was found next to %u\n", id);
+            errors++;
+        }
+        if((id & 1) == 0 && (n >= num || ids[n++] != id)) {
+            fprintf(stderr, "even: expected %u\n", id);
+            errors++;
+        }
+    }
+    if(!errors && n != num) {
+        fprintf(stderr, "even: %u extra postings\n", num - n);
+        errors++;
+    }
+
+    sil_term_t *t = sil_search_image_term(img, pool, "all");
+    for(uint32_t i=0; i<num_docs && !errors; i+=37) {
+        uint32_t target = large_id(i) - 96;
+        if(!t->c.advance_to((atl_cursor_t *)t, target) || t->c.id != large_id(i)) {
+            fprintf(stderr, "all: advance_to(%u) returned %u, expected %u\n", target, t->c.id, large_id(i));
+            errors++;
+        }
+    }
+    sil_search_image_destroy(img);
+    return errors;
+}
+
+// an id in the last partition of the accumulator, where the partition end overflows 32 bits
+static int test_top_partition_ids(aml_pool_t *pool) {
+    const uint32_t ids[] = { 5, 0xFFFFFF00 };
+    sil_search_builder_t *builder = sil_search_builder_init(LARGE_IDS_INDEX_NAME "_top", 1024*1024);
+    for(size_t i=0; i<2; i++)
+        add_document(builder, ids[i]);
+    sil_search_builder_destroy(builder);
+
+    sil_search_image_t *img = sil_search_image_init(LARGE_IDS_INDEX_NAME "_top");
+    if(!img) {
+        fprintf(stderr, "the image with an id in the top partition did not open\n");
+        return 1;
+    }
+    sil_bm25_params_t params;
+    sil_bm25_params_init(&params);
+    sil_term_accumulator_t *acc = sil_term_accumulator_init(img, &params, 10);
+    sil_term_accumulator_add(acc, sil_search_image_term(img, pool, "all"), 1);
+    sil_scored_id_t res[4];
+    size_t num_res = sil_term_accumulator_top_k(acc, res, 4);
+    int errors = 0;
+    if(num_res != 2 || (res[0].id != ids[0] && res[1].id != ids[0]) ||
+       (res[0].id != ids[1] && res[1].id != ids[1])) {
+        fprintf(stderr, "top partition: expected ids %u and %u\n", ids[0], ids[1]);
+        errors++;
+    }
+    sil_term_accumulator_destroy(acc);
+
+    // deleting the top id only allocates its page, which is saved and loaded as a bitmap
+    if(!sil_search_image_delete(img, ids[1]) || sil_search_image_delete(img, ids[1]) ||
+       !sil_search_image_save_deleted(img))
+        errors++;
+    sil_search_image_destroy(img);
+    img = sil_search_image_init(LARGE_IDS_INDEX_NAME "_top");
+    if(sil_search_image_deleted_documents(img) != 1 || !sil_search_image_is_deleted(img, ids[1]) ||
+       sil_search_image_is_deleted(img, ids[0])) {
+        fprintf(stderr, "the deleted top id was not loaded back\n");
+        errors++;
+    }
+    sil_term_t *t = sil_search_image_term(img, pool, "all");
+    if(!t || !t->c.advance((atl_cursor_t *)t) || t->c.id != ids[0] || t->c.advance((atl_cursor_t *)t)) {
+        fprintf(stderr, "the deleted top id was returned\n");
+        errors++;
+    }
+    sil_search_image_destroy(img);
+    remove(LARGE_IDS_INDEX_NAME "_top_deleted");
+    return errors;
+}
+
+static char *read_file(const char *base, const char *suffix, size_t *len) {
+    char name[256];
+    snprintf(name, sizeof(name), "%s%s", base, suffix);
+    FILE *in = fopen(name, "rb");
+    if(!in)
+        return NULL;
+    fseek(in, 0, SEEK_END);
+    *len = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    char *data = (char *)malloc(*len + 1);
+    *len = fread(data, 1, *len, in);
+    data[*len] = 0;
+    fclose(in);
+    return data;
+}
+
+static void write_file(const char *base, const char *suffix, const char *data, size_t len) {
+    char name[256];
+    snprintf(name, sizeof(name), "%s%s", base, suffix);
+    FILE *out = fopen(name, "wb");
+    fwrite(data, len, 1, out);
+    fclose(out);
+}
+
+static void copy_image(const char *base, const char *dest) {
+    const char *suffixes[] = { "_stats.txt", "_gbl", "_content", "_embeddings", "_term_idx", "_term_data" };
+    for(size_t i=0; i<sizeof(suffixes)/sizeof(suffixes[0]); i++) {
+        size_t len;
+        char *data = read_file(base, suffixes[i], &len);
+        write_file(dest, suffixes[i], data, len);
+        free(data);
+    }
+}
+
+// replace the flags (the fifth field of the first line) of the image
+static void write_flags(const char *base, uint32_t flags) {
+    size_t len;
+    char *data = read_file(base, "_stats.txt", &len);
+    uint32_t num_terms, max_id, old_flags;
+    size_t total_documents, total_terms;
+    sscanf(data, "%u %zu %zu %u %u", &num_terms, &total_documents, &total_terms, &max_id, &old_flags);
+    char *rest = strchr(data, '\n');
+    char line[256];
+    int n = snprintf(line, sizeof(line), "%u %zu %zu %u %u", num_terms, total_documents, total_terms,
+                     max_id, flags);
+    write_file(base, "_stats.txt", line, n);
+    char name[256];
+    snprintf(name, sizeof(name), "%s_stats.txt", base);
+    FILE *out = fopen(name, "ab");
+    fwrite(rest, data + len - rest, 1, out);
+    fclose(out);
+    free(data);
+}
+
+/* Write base in the layout of images from before SIL_IMAGE_FORMAT_V2: narrower global
+   headers and one byte top level group keys. */
+static void write_v1_image(const char *base, const char *dest, uint32_t flags) {
+    copy_image(base, dest);
+    write_flags(dest, flags & ~SIL_IMAGE_FORMAT_V2);
+
+    size_t len;
+    char *data = read_file(base, "_gbl", &len);
+    char *out = (char *)malloc(len + 1);
+    char *wp = out;
+    for(char *p=data; p<data+len; ) {
+        uint32_t rlen;
+        memcpy(&rlen, p, sizeof(rlen));
+        sil_global_header_t gh;
+        memcpy(&gh, p + sizeof(rlen), sizeof(gh));
+        sil_global_header_v1_t v1;
+        v1.document_length = gh.document_length;
+        v1.num_embeddings = gh.num_embeddings;
+        v1.content_offset = gh.content_offset;
+        v1.embeddings_offset = gh.embeddings_offset;
+        uint32_t v1_len = rlen - sizeof(gh) + sizeof(v1);
+        memcpy(wp, &v1_len, sizeof(v1_len));
+        memcpy(wp + sizeof(v1_len), &v1, sizeof(v1));
+        memcpy(wp + sizeof(v1_len) + sizeof(v1), p + sizeof(rlen) + sizeof(gh), rlen - sizeof(gh));
+        wp += sizeof(v1_len) + v1_len;
+        p += sizeof(rlen) + rlen;
+    }
+    write_file(dest, "_gbl", out, wp - out);
+    free(out);
+    free(data);
+
+    // every top level group loses a byte, so the posting lists move
+    size_t idx_len, term_data_len;
+    char *idx = read_file(base, "_term_idx", &idx_len);
+    char *term_data = read_file(base, "_term_data", &term_data_len);
+    out = (char *)malloc(term_data_len + 1);
+    memcpy(out, term_data, sizeof(uint32_t));
+    size_t offs = sizeof(uint32_t);
+    for(char *p=idx; p<idx+idx_len; ) {
+        p += strlen(p) + 1;
+        size_t term_offs;
+        memcpy(&term_offs, p, sizeof(term_offs));
+        uint32_t tlen;
+        memcpy(&tlen, term_data + term_offs - sizeof(uint32_t), sizeof(tlen));
+        uint8_t *tp = (uint8_t *)term_data + term_offs;
+        uint8_t *etp = tp + tlen;
+        uint8_t *wtp = (uint8_t *)out + offs;
+        memcpy(wtp, tp, sizeof(sil_term_header_t));
+        wtp += sizeof(sil_term_header_t);
+        tp += sizeof(sil_term_header_t);
+        while(tp < etp) {
+            *wtp++ = tp[0];  // the key is below 256 in a v1 image
+            tp += sizeof(uint16_t);
+            uint32_t glen = tp[0];
+            uint32_t header = 1;
+            if(glen == GROUP_2BYTE_LENGTH) {
+                uint16_t v;
+                memcpy(&v, tp+1, sizeof(v));
+                glen = v;
+                header += sizeof(v);
+            }
+            else if(glen == GROUP_4BYTE_LENGTH) {
+                memcpy(&glen, tp+1, sizeof(glen));
+                header += sizeof(glen);
+            }
+            memcpy(wtp, tp, header + glen);
+            wtp += header + glen;
+            tp += header + glen;
+        }
+        uint32_t new_len = wtp - ((uint8_t *)out + offs);
+        memcpy(out + offs - sizeof(uint32_t), &new_len, sizeof(new_len));
+        memcpy(p, &offs, sizeof(offs));
+        offs += new_len + sizeof(uint32_t);
+        p += sizeof(size_t);
+    }
+    write_file(dest, "_term_idx", idx, idx_len);
+    write_file(dest, "_term_data", out, offs - sizeof(uint32_t));
+    free(out);
+    free(term_data);
+    free(idx);
+}
+
+static int test_format_versions(aml_pool_t *pool, sil_search_image_t *img) {
+    int errors = 0;
+    size_t len;
+    char *stats = read_file(INDEX_NAME, "_stats.txt", &len);
+    uint32_t num_terms, max_id, flags = 0;
+    size_t total_documents, total_terms;
+    sscanf(stats, "%u %zu %zu %u %u", &num_terms, &total_documents, &total_terms, &max_id, &flags);
+    free(stats);
+    if(!(flags & SIL_IMAGE_FORMAT_V2)) {
+        fprintf(stderr, "the image was not written in the current format\n");
+        errors++;
+    }
+
+    write_v1_image(INDEX_NAME, V1_INDEX_NAME, flags);
+    sil_search_image_t *v1 = sil_search_image_init(V1_INDEX_NAME);
+    if(!v1) {
+        fprintf(stderr, "the v1 image did not open\n");
+        return errors + 1;
+    }
+    const char *terms[] = { "all", "even", "seven", "rare", "filler", "bucket:26" };
+    for(size_t i=0; i<sizeof(terms)/sizeof(terms[0]); i++) {
+        aml_pool_clear(pool);
+        errors += compare_cold_term(pool, img, v1, terms[i]);
+    }
+    aml_buffer_t *bh = aml_buffer_init(256);
+    errors += compare_content(img, v1, bh);
+    aml_buffer_destroy(bh);
+    sil_search_image_destroy(v1);
+    const char *bases[] = { V1_INDEX_NAME };
+    if(sil_search_image_concat(CORRUPT_INDEX_NAME, bases, 1)) {
+        fprintf(stderr, "a v1 image was concatenated\n");
+        errors++;
+    }
+
+    // flags from a newer format
+    copy_image(INDEX_NAME, CORRUPT_INDEX_NAME);
+    write_flags(CORRUPT_INDEX_NAME, flags | 0x100);
+    if(sil_search_image_init(CORRUPT_INDEX_NAME)) {
+        fprintf(stderr, "an image with unknown flags opened\n");
+        errors++;
+    }
+
+    // a truncated posting list and then a global record with a bad length
+    copy_image(INDEX_NAME, CORRUPT_INDEX_NAME);
+    char *data = read_file(INDEX_NAME, "_term_data", &len);
+    write_file(CORRUPT_INDEX_NAME, "_term_data", data, len / 2);
+    free(data);
+    if(sil_search_image_init(CORRUPT_INDEX_NAME)) {
+        fprintf(stderr, "an image with truncated postings opened\n");
+        errors++;
+    }
+    copy_image(INDEX_NAME, CORRUPT_INDEX_NAME);
+    data = read_file(INDEX_NAME, "_gbl", &len);
+    uint32_t bad_len = 3;
+    memcpy(data, &bad_len, sizeof(bad_len));
+    write_file(CORRUPT_INDEX_NAME, "_gbl", data, len);
+    free(data);
+    if(sil_search_image_init(CORRUPT_INDEX_NAME)) {
+        fprintf(stderr, "an image with a corrupt global opened\n");
+        errors++;
+    }
+    return errors;
+}
+
+enum { RANK_COLUMN, SMALL_COLUMN, SCORE_COLUMN, BIG_COLUMN };
+
+static void build_columns(const char *name, uint32_t lo, uint32_t hi) {
+    sil_search_builder_options_t options;
+    sil_search_builder_options_init(&options);
+    sil_search_builder_options_buffer_size(&options, 1024*1024);
+    sil_search_builder_options_column(&options, "rank", SIL_COLUMN_U32);
+    sil_search_builder_options_column(&options, "small", SIL_COLUMN_U8);
+    sil_search_builder_options_column(&options, "score", SIL_COLUMN_FLOAT);
+    sil_search_builder_options_column(&options, "big", SIL_COLUMN_U64);
+    sil_search_builder_t *builder = sil_search_builder_ext_init(name, &options);
+    uint64_t seed = 42;
+    for(uint32_t id=1; id<MAX_ID; id=next_id(id, &seed)) {
+        if(id < lo || id >= hi)
+            continue;
+        add_document(builder, id);
+        sil_search_builder_column(builder, RANK_COLUMN, id * 3);
+        sil_search_builder_column(builder, SMALL_COLUMN, id);  // truncated to a byte
+        sil_search_builder_column_float(builder, SCORE_COLUMN, id / 8.0f);
+        if(id & 1)
+            sil_search_builder_column(builder, BIG_COLUMN, (uint64_t)id << 33);
+    }
+    sil_search_builder_destroy(builder);
+}
+
+// the columns of every document of img, whose ids may have been renumbered
+static int compare_columns(const char *name, sil_search_image_t *img) {
+    sil_column_type_t rank_type, small_type, score_type, big_type;
+    const void *rank = sil_search_image_column(img, "rank", &rank_type);
+    const void *small = sil_search_image_column(img, "small", &small_type);
+    const void *score = sil_search_image_column(img, "score", &score_type);
+    const void *big = sil_search_image_column(img, "big", &big_type);
+    if(!rank || !small || !score || !big || sil_search_image_column(img, "missing", NULL) ||
+       rank_type != SIL_COLUMN_U32 || small_type != SIL_COLUMN_U8 || score_type != SIL_COLUMN_FLOAT ||
+       big_type != SIL_COLUMN_U64 || ((uintptr_t)rank & 63) || ((uintptr_t)big & 63)) {
+        fprintf(stderr, "%s: the columns are missing\n", name);
+        return 1;
+    }
+    uint32_t num_ids;
+    const uint32_t *ids = sil_search_image_ids(img, &num_ids);
+    for(uint32_t i=0; i<num_ids; i++) {
+        uint32_t id = sil_search_image_original_id(img, ids[i]);
+        if(sil_search_image_document_index(img, ids[i]) != i ||
+           sil_column_value(rank, rank_type, i) != id * 3 ||
+           sil_column_value(small, small_type, i) != (id & 0xFF) ||
+           sil_column_double(score, score_type, i) != id / 8.0f ||
+           sil_column_value(big, big_type, i) != ((id & 1) ? (uint64_t)id << 33 : 0)) {
+            fprintf(stderr, "%s: the columns of %u differ\n", name, id);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int test_columns() {
+    int errors = 0;
+    build_columns(COLUMNS_INDEX_NAME, 0, MAX_ID);
+    sil_search_image_t *img = sil_search_image_init(COLUMNS_INDEX_NAME);
+    errors += compare_columns("built", img);
+
+    // columns without declared options are carried through merges and reorders
+    uint32_t num_ids;
+    sil_search_image_delete(img, sil_search_image_ids(img, &num_ids)[5]);
+    sil_search_builder_merge(COLUMNS_INDEX_NAME "_merged", &img, NULL, 1, NULL, NULL);
+    sil_search_builder_reorder(COLUMNS_INDEX_NAME "_reordered", img, NULL);
+    sil_search_image_destroy(img);
+    const char *names[] = { COLUMNS_INDEX_NAME "_merged", COLUMNS_INDEX_NAME "_reordered" };
+    for(size_t i=0; i<sizeof(names)/sizeof(names[0]); i++) {
+        img = sil_search_image_init(names[i]);
+        errors += compare_columns(names[i], img);
+        sil_search_image_destroy(img);
+    }
+
+    const char *parts[] = { COLUMNS_INDEX_NAME "_1", COLUMNS_INDEX_NAME "_0" };
+    build_columns(parts[1], 0, 600*1024);
+    build_columns(parts[0], 600*1024, MAX_ID);
+    if(!sil_search_image_concat(COLUMNS_INDEX_NAME "_concat", parts, 2) ||
+       !same_file(COLUMNS_INDEX_NAME, COLUMNS_INDEX_NAME "_concat", "_columns")) {
+        fprintf(stderr, "the columns differ when partitions are concatenated\n");
+        errors++;
+    }
+    return errors;
+}
+
+static int compare_expected_facets(const void *a, const void *b) {
+    const sil_facet_count_t *x = (const sil_facet_count_t *)a, *y = (const sil_facet_count_t *)b;
+    if(x->count != y->count)
+        return x->count > y->count ? -1 : 1;
+    if(x->value)
+        return strcmp(x->value, y->value);
+    return x->column_value < y->column_value ? -1 : x->column_value > y->column_value;
+}
+
+static int compare_facets(const char *name, sil_facet_count_t *res, size_t num,
+                          sil_facet_count_t *expected, size_t num_expected) {
+    qsort(expected, num_expected, sizeof(sil_facet_count_t), compare_expected_facets);
+    if(num_expected > 10)
+        num_expected = 10;
+    if(num != num_expected) {
+        fprintf(stderr, "%s: %zu facet values, expected %zu\n", name, num, num_expected);
+        return 1;
+    }
+    for(size_t i=0; i<num; i++) {
+        if(res[i].count != expected[i].count || res[i].column_value != expected[i].column_value ||
+           (res[i].value == NULL) != (expected[i].value == NULL) ||
+           (res[i].value && strcmp(res[i].value, expected[i].value))) {
+            fprintf(stderr, "%s: facet %zu is %s/%llu (%u), expected %s/%llu (%u)\n", name, i,
+                    res[i].value ? res[i].value : "", (unsigned long long)res[i].column_value, res[i].count,
+                    expected[i].value ? expected[i].value : "", (unsigned long long)expected[i].column_value,
+                    expected[i].count);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int test_facets(aml_pool_t *pool, sil_search_image_t *img) {
+    int errors = 0;
+    aml_pool_clear(pool);
+    uint32_t num_matches, num_even;
+    uint64_t *matches = sil_search_image_matches(img, pool,
+                                                 (atl_cursor_t *)sil_search_image_term(img, pool, "even"),
+                                                 &num_matches);
+    uint32_t *even = term_ids(pool, img, "even", &num_even);
+    if(num_matches != num_even) {
+        fprintf(stderr, "the matches have %u ids, expected %u\n", num_matches, num_even);
+        errors++;
+    }
+    // the bitmap has exactly the ids of the term
+    uint32_t num_bits = 0;
+    for(size_t i=0; i<sil_search_image_match_words(img); i++)
+        num_bits += __builtin_popcountll(matches[i]);
+    for(uint32_t i=0; i<num_even; i++) {
+        if(!((matches[even[i] >> 6] >> (even[i] & 63)) & 1)) {
+            fprintf(stderr, "%u is missing from the matches\n", even[i]);
+            errors++;
+            break;
+        }
+    }
+    if(num_bits != num_even) {
+        fprintf(stderr, "the matches bitmap has %u ids, expected %u\n", num_bits, num_even);
+        errors++;
+    }
+
+    // the buckets of the even documents, counted posting by posting
+    sil_facet_count_t expected[256], res[10];
+    char values[211][8];
+    size_t num_expected = 0;
+    for(uint32_t b=0; b<211; b++) {
+        char term[32];
+        snprintf(term, sizeof(term), "bucket:%u", b);
+        uint32_t num;
+        uint32_t *ids = term_ids(pool, img, term, &num);
+        uint32_t count = 0;
+        for(uint32_t i=0; i<num; i++)
+            if((matches[ids[i] >> 6] >> (ids[i] & 63)) & 1)
+                count++;
+        if(!count)
+            continue;
+        snprintf(values[num_expected], sizeof(values[0]), "%u", b);
+        expected[num_expected].value = values[num_expected];
+        expected[num_expected].column_value = 0;
+        expected[num_expected++].count = count;
+    }
+    bool sampled;
+    size_t num = sil_search_image_facet(img, matches, "bucket:", NULL, res, &sampled);
+    errors += compare_facets("bucket", res, num, expected, num_expected) + sampled;
+    // "all" covers every group, so it is counted from the matches alone
+    num = sil_search_image_facet(img, matches, "al", NULL, res, NULL);
+    if(num != 1 || strcmp(res[0].value, "l") || res[0].count != num_matches) {
+        fprintf(stderr, "the facet of a term in every document is wrong\n");
+        errors++;
+    }
+
+    sil_facet_options_t options;
+    sil_facet_options_init(&options);
+    options.sample_above = num_matches / 2;
+    options.sample_groups = 4;
+    num = sil_search_image_facet(img, matches, "bucket:", &options, res, &sampled);
+    for(size_t i=0; i<num; i++)
+        if(res[i].count % 4)
+            sampled = false;
+    if(!sampled || !num) {
+        fprintf(stderr, "the facets of many matches were not sampled\n");
+        errors++;
+    }
+
+    // a column of the image built with columns, over the documents with "seven"
+    sil_search_image_t *columns = sil_search_image_init(COLUMNS_INDEX_NAME);
+    matches = sil_search_image_matches(columns, pool,
+                                       (atl_cursor_t *)sil_search_image_term(columns, pool, "seven"), NULL);
+    uint32_t num_seven;
+    uint32_t *seven = term_ids(pool, columns, "seven", &num_seven);
+    uint32_t small[256] = { 0 };
+    for(uint32_t i=0; i<num_seven; i++)
+        small[seven[i] & 0xFF]++;
+    num_expected = 0;
+    for(uint32_t v=0; v<256; v++) {
+        if(!small[v])
+            continue;
+        expected[num_expected].value = NULL;
+        expected[num_expected].column_value = v;
+        expected[num_expected++].count = small[v];
+    }
+    num = sil_search_image_facet_column(columns, matches, "small", NULL, res, NULL);
+    errors += compare_facets("small", res, num, expected, num_expected);
+    sil_search_image_destroy(columns);
+    return errors;
+}
+
+typedef struct {
+    sil_search_builder_t *builder;
+    uint32_t thread;
+} ingest_thread_t;
+
+// each thread adds every NUM_THREADS'th document
+static void *ingest(void *arg) {
+    ingest_thread_t *it = (ingest_thread_t *)arg;
+    sil_search_builder_t *builder = sil_search_builder_thread_init(it->builder);
+    uint64_t seed = 42;
+    uint32_t n = 0;
+    for(uint32_t id=1; id<MAX_ID; id=next_id(id, &seed), n++) {
+        if(n % NUM_THREADS == it->thread)
+            add_document(builder, id);
+    }
+    sil_search_builder_destroy(builder);
+    return NULL;
+}
+
+/* documents added and encoded from several threads must build the same image as a single
+   builder */
+static int test_thread_builders() {
+    int errors = 0;
+    for(int interned=0; interned<2; interned++) {
+        sil_search_builder_options_t options;
+        sil_search_builder_options_init(&options);
+        sil_search_builder_options_buffer_size(&options, 256*1024);
+        if(interned)
+            sil_search_builder_options_radix_sort(&options);
+        sil_search_builder_options_encoder_threads(&options, 3);
+        sil_search_builder_t *builder = sil_search_builder_ext_init(THREADED_INDEX_NAME, &options);
+        pthread_t threads[NUM_THREADS];
+        ingest_thread_t args[NUM_THREADS];
+        for(uint32_t i=0; i<NUM_THREADS; i++) {
+            args[i].builder = builder;
+            args[i].thread = i;
+            pthread_create(threads+i, NULL, ingest, args+i);
+        }
+        for(uint32_t i=0; i<NUM_THREADS; i++)
+            pthread_join(threads[i], NULL);
+        sil_search_builder_destroy(builder);
+
+        const char *suffixes[] = { "_term_idx", "_term_data", "_gbl", "_content", "_stats.txt" };
+        for(size_t i=0; i<sizeof(suffixes)/sizeof(suffixes[0]); i++) {
+            if(!same_file(INDEX_NAME, THREADED_INDEX_NAME, suffixes[i])) {
+                fprintf(stderr, "%s differs when built from %d threads%s\n", suffixes[i],
+                        NUM_THREADS, interned ? " with interned terms" : "");
+                errors++;
+            }
+        }
+    }
+    return errors;
+}
+
+static uint64_t histogram_total(const uint64_t *counts, size_t num) {
+    uint64_t total = 0;
+    for(size_t i=0; i<num; i++)
+        total += counts[i];
+    return total;
+}
+
+/* The build stats describe the image written: a histogram entry for every term and
+   posting, the same ones no matter how many threads encode, and the bytes of its files. */
+static int test_build_stats() {
+    int errors = 0;
+    sil_search_builder_stats_t stats[2];
+    for(uint32_t threads=0; threads<2; threads++) {
+        sil_search_builder_options_t options;
+        sil_search_builder_options_init(&options);
+        sil_search_builder_options_buffer_size(&options, 256*1024);
+        sil_search_builder_options_encoder_threads(&options, threads * 3);
+        sil_search_builder_options_stats(&options, stats + threads, true);
+        build_index(STATS_INDEX_NAME, &options);
+    }
+    const sil_search_builder_histograms_t *hist = &stats[0].histograms;
+    if(memcmp(hist, &stats[1].histograms, sizeof(*hist))) {
+        fprintf(stderr, "histograms differ with encoder threads\n");
+        errors++;
+    }
+
+    size_t len = 0;
+    char *text = read_file(STATS_INDEX_NAME, "_stats.txt", &len);
+    uint32_t total_terms = text ? strtoul(text, NULL, 10) : 0;
+    free(text);
+    // _term_idx holds each term followed by the offset of its postings
+    uint64_t postings = 0;
+    sil_search_image_t *img = sil_search_image_init(STATS_INDEX_NAME);
+    aml_pool_t *pool = aml_pool_init(1024);
+    char *idx = read_file(STATS_INDEX_NAME, "_term_idx", &len);
+    for(char *p = idx; idx && p < idx + len; p += strlen(p) + 1 + sizeof(size_t)) {
+        aml_pool_clear(pool);
+        sil_term_t *t = sil_search_image_term(img, pool, p);
+        if(t)
+            postings += t->document_frequency;
+    }
+    free(idx);
+    aml_pool_destroy(pool);
+    sil_search_image_destroy(img);
+    if(histogram_total(hist->postings_per_term, SIL_HISTOGRAM_BUCKETS) != total_terms ||
+       histogram_total(hist->bytes_per_posting, SIL_HISTOGRAM_BUCKETS) != postings ||
+       !histogram_total(hist->position_delta_widths, 5)) {
+        fprintf(stderr, "histograms do not match the %u terms and %llu postings written\n",
+                total_terms, (unsigned long long)postings);
+        errors++;
+    }
+
+    const char *suffixes[] = { "_gbl", "_embeddings", "_content", "_term_idx", "_term_data",
+                               "_stats.txt" };
+    uint64_t bytes = 0;
+    for(size_t i=0; i<sizeof(suffixes)/sizeof(suffixes[0]); i++)
+        bytes += file_size(STATS_INDEX_NAME, suffixes[i]);
+    if(stats[1].bytes_written != bytes || !stats[1].runs_spilled ||
+       stats[1].spilled_bytes > stats[1].sorted_bytes || stats[1].ingest.wall_seconds <= 0 ||
+       stats[1].merge.wall_seconds + stats[1].global_write.wall_seconds +
+       stats[1].term_encode.wall_seconds <= 0) {
+        fprintf(stderr, "build stats are off: %llu bytes written of %llu, %llu runs spilled\n",
+                (unsigned long long)stats[1].bytes_written, (unsigned long long)bytes,
+                (unsigned long long)stats[1].runs_spilled);
+        errors++;
+    }
+    text = read_file(STATS_INDEX_NAME, "_stats.json", &len);
+    if(!text || !strstr(text, "\"term_encode\"") || !strstr(text, "\"postings_per_term\"")) {
+        fprintf(stderr, "%s_stats.json is missing the stats\n", STATS_INDEX_NAME);
+        errors++;
+    }
+    free(text);
+    return errors;
+}
+
+int main() {
+    sil_search_builder_options_t options;
+    sil_search_builder_options_init(&options);
+    sil_search_builder_options_buffer_size(&options, 1024*1024);
+    build_index(INDEX_NAME, &options);
+
+    sil_search_image_t *img = sil_search_image_init(INDEX_NAME);
+    if(!img) {
+        fprintf(stderr, "Failed to open search image.\n");
+        return EXIT_FAILURE;
+    }
+
+    aml_pool_t *pool = aml_pool_init(1024*64);
+    int errors = 0;
+    const char *terms[] = { "all", "even", "seven", "rare", "filler" };
+    for(size_t i=0; i<sizeof(terms)/sizeof(terms[0]); i++) {
+        errors += test_iterate(pool, img, terms[i]);
+        errors += test_advance_to(pool, img, terms[i]);
+    }
+    errors += test_accumulator(pool, img);
+    errors += test_query_plan(pool, img);
+    errors += test_value_range(pool, img, "rare", 0, RAND_MAX / 2);
+    errors += test_value_range(pool, img, "all", 0, 0);
+    errors += test_value_top_k(pool, img, "rare", NULL, 0, 0, 20);
+    errors += test_value_top_k(pool, img, "rare", "even", 0, UINT32_MAX, 20);
+
+    count_term_t all = { "all", false, 0, 0 }, even = { "even", false, 0, 0 };
+    count_term_t seven = { "seven", false, 0, 0 }, rare = { "rare", true, 0, RAND_MAX / 2 };
+    count_term_t counts[][3] = { { even }, { rare }, { even, seven }, { all, even },
+                                 { seven, rare, all } };
+    size_t num_counts[] = { 1, 1, 2, 2, 3 };
+    for(size_t i=0; i<sizeof(num_counts)/sizeof(num_counts[0]); i++)
+        errors += test_count(pool, img, counts[i], num_counts[i]);
+    errors += test_value_summaries(pool);
+    errors += test_interned_terms();
+    errors += test_thread_builders();
+    errors += test_add_document();
+    errors += test_concat();
+    errors += test_segments(pool, img);
+    errors += test_deleted(pool, img);
+    errors += test_memory_index(pool, img);
+    errors += test_reorder(pool, img);
+    errors += test_static_rank(pool);
+    errors += test_content_blocks(img);
+    errors += test_cold_postings(pool, img);
+    errors += test_large_ids(pool);
+    errors += test_top_partition_ids(pool);
+    errors += test_format_versions(pool, img);
+    errors += test_columns();
+    errors += test_facets(pool, img);
+    errors += test_value_updates(pool);
+    errors += test_checkpoints();
+    errors += test_build_stats();
+
+    aml_pool_destroy(pool);
+    sil_search_image_destroy(img);
+    if(errors) {
+        fprintf(stderr, "%d error(s)\n", errors);
+        return EXIT_FAILURE;
+    }
+    printf("search image tests passed\n");
+    return EXIT_SUCCESS;
+}